@@ -0,0 +1,349 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "rlite/rlite.h"
+#include "rlite/cache.h"
+#include "rlite/util.h"
+
+/* They use a single page cache, guarded by `mutex`, and take `lock` before
+ * the file lock so threads queue on each other in memory instead of in
+ * flock. */
+struct rl_shared_cache {
+	dev_t dev;
+	ino_t ino;
+	int refs;
+	rl_cache *cache;
+	pthread_mutex_t mutex;
+	pthread_rwlock_t lock;
+	struct rl_shared_cache *next;
+};
+
+static pthread_mutex_t shared_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static rl_shared_cache *shared_caches = NULL;
+
+static void page_destroy(rlite *db, rl_page *page)
+{
+	if (page->type && page->type->destroy && page->obj) {
+		page->type->destroy(db, page->obj);
+	}
+#ifdef RL_DEBUG
+	rl_free(page->serialized_data);
+#endif
+	rl_free(page);
+}
+
+static void lru_unlink(rl_cache *cache, rl_cache_entry *entry)
+{
+	if (entry->lru_prev) {
+		entry->lru_prev->lru_next = entry->lru_next;
+	}
+	else {
+		cache->lru_head = entry->lru_next;
+	}
+	if (entry->lru_next) {
+		entry->lru_next->lru_prev = entry->lru_prev;
+	}
+	else {
+		cache->lru_tail = entry->lru_prev;
+	}
+	entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_head(rl_cache *cache, rl_cache_entry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head) {
+		cache->lru_head->lru_prev = entry;
+	}
+	cache->lru_head = entry;
+	if (!cache->lru_tail) {
+		cache->lru_tail = entry;
+	}
+}
+
+static rl_cache_entry *remove_entry(rl_cache *cache, long page_number)
+{
+	rl_cache_entry **link = &cache->buckets[page_number & (cache->buckets_len - 1)];
+	rl_cache_entry *entry;
+	while ((entry = *link) != NULL) {
+		if (entry->page->page_number == page_number) {
+			*link = entry->next;
+			lru_unlink(cache, entry);
+			cache->len--;
+			return entry;
+		}
+		link = &entry->next;
+	}
+	return NULL;
+}
+
+int rl_cache_create(rl_cache **_cache, long size)
+{
+	int retval = RL_OK;
+	rl_cache *cache;
+	RL_MALLOC(cache, sizeof(*cache));
+	cache->size = size;
+	cache->len = 0;
+	cache->lru_head = cache->lru_tail = NULL;
+	cache->change_counter = 0;
+	cache->buckets_len = 16;
+	while (cache->buckets_len < size) {
+		cache->buckets_len *= 2;
+	}
+	cache->buckets = rl_malloc(sizeof(rl_cache_entry *) * cache->buckets_len);
+	if (!cache->buckets) {
+		rl_free(cache);
+		retval = RL_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+	memset(cache->buckets, 0, sizeof(rl_cache_entry *) * cache->buckets_len);
+	*_cache = cache;
+cleanup:
+	return retval;
+}
+
+int rl_cache_clear(rlite *db, rl_cache *cache)
+{
+	rl_cache_entry *entry, *next;
+	for (entry = cache->lru_head; entry; entry = next) {
+		next = entry->lru_next;
+		page_destroy(db, entry->page);
+		rl_free(entry);
+	}
+	memset(cache->buckets, 0, sizeof(rl_cache_entry *) * cache->buckets_len);
+	cache->lru_head = cache->lru_tail = NULL;
+	cache->len = 0;
+	return RL_OK;
+}
+
+int rl_cache_destroy(rlite *db, rl_cache *cache)
+{
+	if (!cache) {
+		return RL_OK;
+	}
+	rl_cache_clear(db, cache);
+	rl_free(cache->buckets);
+	rl_free(cache);
+	return RL_OK;
+}
+
+int rl_cache_take(rlite *db, rl_cache *cache, rl_data_type *type, long page_number, rl_page **page)
+{
+	rl_cache_entry *entry = remove_entry(cache, page_number);
+	if (!entry) {
+		return RL_NOT_FOUND;
+	}
+	if (entry->page->type != type) {
+		// the page was reused for something else, it needs to be read again
+		page_destroy(db, entry->page);
+		rl_free(entry);
+		return RL_NOT_FOUND;
+	}
+	*page = entry->page;
+	rl_free(entry);
+	return RL_FOUND;
+}
+
+/**
+ * Serializes a cached page into `data`, leaving it in the cache. Used by
+ * shared caches: every transaction gets its own copy to modify, while the
+ * cached one keeps serving the other handles.
+ */
+int rl_cache_copy(rlite *db, rl_cache *cache, rl_data_type *type, long page_number, unsigned char *data)
+{
+	rl_cache_entry *entry;
+	for (entry = cache->buckets[page_number & (cache->buckets_len - 1)]; entry; entry = entry->next) {
+		if (entry->page->page_number == page_number) {
+			break;
+		}
+	}
+	if (!entry) {
+		return RL_NOT_FOUND;
+	}
+	if (entry->page->type != type) {
+		entry = remove_entry(cache, page_number);
+		page_destroy(db, entry->page);
+		rl_free(entry);
+		return RL_NOT_FOUND;
+	}
+	memset(data, 0, db->page_size);
+	if (type->serialize(db, entry->page->obj, data) != RL_OK) {
+		return RL_NOT_FOUND;
+	}
+	lru_unlink(cache, entry);
+	lru_push_head(cache, entry);
+	return RL_FOUND;
+}
+
+static void evict(rlite *db, rl_cache *cache)
+{
+	rl_cache_entry *entry;
+	while (cache->len > cache->size) {
+		entry = remove_entry(cache, cache->lru_tail->page->page_number);
+		page_destroy(db, entry->page);
+		rl_free(entry);
+	}
+}
+
+int rl_cache_put(rlite *db, rl_cache *cache, rl_page *page)
+{
+	int retval = RL_OK;
+	rl_cache_entry *entry = remove_entry(cache, page->page_number);
+	if (entry) {
+		if (entry->page != page) {
+			page_destroy(db, entry->page);
+		}
+	}
+	else {
+		entry = rl_malloc(sizeof(*entry));
+		if (!entry) {
+			page_destroy(db, page);
+			retval = RL_OUT_OF_MEMORY;
+			goto cleanup;
+		}
+	}
+	entry->page = page;
+	long bucket = page->page_number & (cache->buckets_len - 1);
+	entry->next = cache->buckets[bucket];
+	cache->buckets[bucket] = entry;
+	lru_push_head(cache, entry);
+	cache->len++;
+
+	evict(db, cache);
+cleanup:
+	return retval;
+}
+
+int rl_cache_resize(rlite *db, rl_cache *cache, long size)
+{
+	cache->size = size;
+	evict(db, cache);
+	return RL_OK;
+}
+
+/**
+ * Joins the other RLITE_OPEN_SHARED handles on the same file, or starts the
+ * group with this handle's cache. The file must exist.
+ */
+int rl_shared_cache_acquire(rlite *db)
+{
+	int retval = RL_OK;
+	rl_shared_cache *shared;
+	struct stat st;
+	if (stat(((rl_file_driver *)db->driver)->filename, &st) != 0) {
+		return RL_UNEXPECTED;
+	}
+	pthread_mutex_lock(&shared_caches_lock);
+	for (shared = shared_caches; shared; shared = shared->next) {
+		if (shared->dev == st.st_dev && shared->ino == st.st_ino) {
+			break;
+		}
+	}
+	if (shared) {
+		rl_cache_destroy(db, db->page_cache);
+	}
+	else {
+		shared = rl_malloc(sizeof(*shared));
+		if (!shared) {
+			retval = RL_OUT_OF_MEMORY;
+			goto cleanup;
+		}
+		if (pthread_rwlock_init(&shared->lock, NULL) != 0) {
+			rl_free(shared);
+			retval = RL_UNEXPECTED;
+			goto cleanup;
+		}
+		pthread_mutex_init(&shared->mutex, NULL);
+		shared->dev = st.st_dev;
+		shared->ino = st.st_ino;
+		shared->refs = 0;
+		shared->cache = db->page_cache;
+		shared->next = shared_caches;
+		shared_caches = shared;
+	}
+	shared->refs++;
+	db->page_cache = shared->cache;
+	db->shared_cache = shared;
+cleanup:
+	pthread_mutex_unlock(&shared_caches_lock);
+	return retval;
+}
+
+int rl_shared_cache_release(rlite *db)
+{
+	rl_shared_cache *shared = db->shared_cache, **link;
+	if (!shared) {
+		return RL_OK;
+	}
+	pthread_mutex_lock(&shared_caches_lock);
+	if (--shared->refs == 0) {
+		for (link = &shared_caches; *link != shared; link = &(*link)->next);
+		*link = shared->next;
+		rl_cache_destroy(db, shared->cache);
+		pthread_rwlock_destroy(&shared->lock);
+		pthread_mutex_destroy(&shared->mutex);
+		rl_free(shared);
+	}
+	pthread_mutex_unlock(&shared_caches_lock);
+	db->shared_cache = NULL;
+	db->page_cache = NULL;
+	return RL_OK;
+}
+
+/**
+ * Takes the in-process side of a RLITE_FLOCK_SH or RLITE_FLOCK_EX lock,
+ * before the file lock itself. Like rl_flock, RLITE_FLOCK_NB makes it
+ * return RL_NOT_FOUND instead of waiting. A no-op for handles that are not
+ * shared.
+ */
+int rl_shared_cache_lock(rlite *db, int type)
+{
+	int nonblocking = type & RLITE_FLOCK_NB, retval;
+	rl_shared_cache *shared = db->shared_cache;
+	if (!shared) {
+		return RL_OK;
+	}
+	type &= ~RLITE_FLOCK_NB;
+	if (type == RLITE_FLOCK_SH) {
+		retval = nonblocking ? pthread_rwlock_tryrdlock(&shared->lock) : pthread_rwlock_rdlock(&shared->lock);
+	}
+	else if (type == RLITE_FLOCK_EX) {
+		retval = nonblocking ? pthread_rwlock_trywrlock(&shared->lock) : pthread_rwlock_wrlock(&shared->lock);
+	}
+	else {
+		return RL_UNEXPECTED;
+	}
+	if (retval == 0) {
+		return RL_OK;
+	}
+	return nonblocking && retval == EBUSY ? RL_NOT_FOUND : RL_UNEXPECTED;
+}
+
+void rl_shared_cache_unlock(rlite *db)
+{
+	if (db->shared_cache) {
+		pthread_rwlock_unlock(&db->shared_cache->lock);
+	}
+}
+
+/**
+ * Guards the page cache while it is used, readers of a shared cache hold
+ * the file lock at the same time.
+ */
+void rl_cache_enter(rlite *db)
+{
+	if (db->shared_cache) {
+		pthread_mutex_lock(&db->shared_cache->mutex);
+	}
+}
+
+void rl_cache_leave(rlite *db)
+{
+	if (db->shared_cache) {
+		pthread_mutex_unlock(&db->shared_cache->mutex);
+	}
+}
@@ -0,0 +1,103 @@
+/* CRC-32C (Castagnoli), as used by iSCSI and ext4.
+ *
+ * Name: crc-32c
+ * Width: 32 bits
+ * Poly: 0x1edc6f41 (reflected 0x82f63b78)
+ * Reflected In: True
+ * Xor_In: 0xffffffff
+ * Reflected_Out: True
+ * Xor_Out: 0xffffffff
+ * Check("123456789"): 0xe3069283
+ */
+#include <pthread.h>
+#include <string.h>
+#include "rlite/crc32c.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define RL_CRC32C_SSE42 1
+#include <nmmintrin.h>
+#endif
+
+#define POLY 0x82f63b78
+
+static uint32_t table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void table_init(void)
+{
+	uint32_t i, j, crc;
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++) {
+			crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+		}
+		table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		crc = table[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = table[0][crc & 0xff] ^ (crc >> 8);
+			table[j][i] = crc;
+		}
+	}
+}
+
+// slicing-by-8, one table lookup per byte but eight bytes per iteration
+uint32_t rl_crc32c_sw(uint32_t crc, const unsigned char *data, size_t len)
+{
+	uint32_t lo, hi;
+	pthread_once(&table_once, table_init);
+	crc = ~crc;
+	while (len >= 8) {
+		lo = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+		hi = (uint32_t)data[4] | (uint32_t)data[5] << 8 | (uint32_t)data[6] << 16 | (uint32_t)data[7] << 24;
+		crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+			table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+			table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+			table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+		data += 8;
+		len -= 8;
+	}
+	while (len--) {
+		crc = table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+#ifdef RL_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *data, size_t len)
+{
+	uint64_t crc64 = ~crc, word;
+	while (len >= 8) {
+		memcpy(&word, data, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+		data += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)crc64;
+	while (len--) {
+		crc = _mm_crc32_u8(crc, *data++);
+	}
+	return ~crc;
+}
+
+static int hw = 0;
+static pthread_once_t hw_once = PTHREAD_ONCE_INIT;
+
+static void hw_init(void)
+{
+	hw = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+}
+#endif
+
+uint32_t rl_crc32c(uint32_t crc, const unsigned char *data, size_t len)
+{
+#ifdef RL_CRC32C_SSE42
+	pthread_once(&hw_once, hw_init);
+	if (hw) {
+		return crc32c_hw(crc, data, len);
+	}
+#endif
+	return rl_crc32c_sw(crc, data, len);
+}
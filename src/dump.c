@@ -98,9 +98,8 @@ static int rl_dump_set(struct rlite *db, const unsigned char *key, long keylen,
 {
 	int retval;
 	long valuelen;
-	unsigned char *buf = NULL;
+	unsigned char *buf = NULL, *value = NULL;
 	long buflen;
-	long page;
 	uint32_t length;
 
 	rl_set_iterator *iterator = NULL;
@@ -124,13 +123,16 @@ static int rl_dump_set(struct rlite *db, const unsigned char *key, long keylen,
 	buflen = 6;
 
 	RL_CALL(rl_smembers, RL_OK, db, &iterator, key, keylen);
-	while ((retval = rl_set_iterator_next(iterator, &page, NULL, &valuelen)) == RL_OK) {
+	while ((retval = rl_set_iterator_next(iterator, NULL, &value, &valuelen)) == RL_OK) {
 		buf[buflen++] = (REDIS_RDB_32BITLEN << 6);
 		length = htonl(valuelen);
 		memcpy(&buf[buflen], &length, 4);
 		buflen += 4;
-		RL_CALL(rl_multi_string_cpy, RL_OK, db, page, &buf[buflen], NULL);
+		if (valuelen) {
+			memcpy(&buf[buflen], value, valuelen);
+		}
 		buflen += valuelen;
+		rl_free(value);
 	}
 	iterator = NULL;
 	if (retval != RL_END) {
@@ -154,8 +156,8 @@ static int rl_dump_zset(struct rlite *db, const unsigned char *key, long keylen,
 {
 	int retval;
 	long valuelen;
-	unsigned char *buf = NULL;
-	long buflen, page;
+	unsigned char *buf = NULL, *value = NULL;
+	long buflen;
 	uint32_t length;
 	double score;
 	char f[40];
@@ -181,13 +183,16 @@ static int rl_dump_zset(struct rlite *db, const unsigned char *key, long keylen,
 	buflen = 6;
 
 	RL_CALL(rl_zrange, RL_OK, db, key, keylen, 0, -1, &iterator);
-	while ((retval = rl_zset_iterator_next(iterator, &page, &score, NULL, &valuelen)) == RL_OK) {
+	while ((retval = rl_zset_iterator_next(iterator, NULL, &score, &value, &valuelen)) == RL_OK) {
 		buf[buflen++] = (REDIS_RDB_32BITLEN << 6);
 		length = htonl(valuelen);
 		memcpy(&buf[buflen], &length, 4);
 		buflen += 4;
-		RL_CALL(rl_multi_string_cpy, RL_OK, db, page, &buf[buflen], NULL);
+		if (valuelen) {
+			memcpy(&buf[buflen], value, valuelen);
+		}
 		buflen += valuelen;
+		rl_free(value);
 
 		valuelen = snprintf(f, 40, "%lf", score);
 		buf[buflen++] = valuelen;
@@ -219,7 +224,7 @@ static int rl_dump_hash(struct rlite *db, const unsigned char *key, long keylen,
 	unsigned char *buf = NULL;
 	long buflen;
 	uint32_t length;
-	long valuepage, value2page;
+	unsigned char *value = NULL, *value2 = NULL;
 
 	rl_hash_iterator *iterator = NULL;
 	RL_CALL(rl_hgetall, RL_OK, db, &iterator, key, keylen);
@@ -242,20 +247,26 @@ static int rl_dump_hash(struct rlite *db, const unsigned char *key, long keylen,
 	buflen = 6;
 
 	RL_CALL(rl_hgetall, RL_OK, db, &iterator, key, keylen);
-	while ((retval = rl_hash_iterator_next(iterator, &valuepage, NULL, &valuelen, &value2page, NULL, &value2len)) == RL_OK) {
+	while ((retval = rl_hash_iterator_next(iterator, NULL, &value, &valuelen, NULL, &value2, &value2len)) == RL_OK) {
 		buf[buflen++] = (REDIS_RDB_32BITLEN << 6);
 		length = htonl(valuelen);
 		memcpy(&buf[buflen], &length, 4);
 		buflen += 4;
-		RL_CALL(rl_multi_string_cpy, RL_OK, db, valuepage, &buf[buflen], NULL);
+		if (valuelen) {
+			memcpy(&buf[buflen], value, valuelen);
+		}
 		buflen += valuelen;
 
 		buf[buflen++] = (REDIS_RDB_32BITLEN << 6);
 		length = htonl(value2len);
 		memcpy(&buf[buflen], &length, 4);
 		buflen += 4;
-		RL_CALL(rl_multi_string_cpy, RL_OK, db, value2page, &buf[buflen], NULL);
+		if (value2len) {
+			memcpy(&buf[buflen], value2, value2len);
+		}
 		buflen += value2len;
+		rl_free(value);
+		rl_free(value2);
 	}
 	iterator = NULL;
 
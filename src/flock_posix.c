@@ -5,11 +5,17 @@
 #include <errno.h>
 
 #include "rlite/rlite.h"
+#include "rlite/flock.h"
 
 int rl_flock(FILE *fp, int type)
 {
-	int fd = fileno(fp);
-	int locktype;
+	return rl_flock_fd(fileno(fp), type);
+}
+
+int rl_flock_fd(int fd, int type)
+{
+	int locktype, nonblocking = type & RLITE_FLOCK_NB;
+	type &= ~RLITE_FLOCK_NB;
 	if (type == RLITE_FLOCK_SH) {
 		locktype = LOCK_SH;
 	} else if (type == RLITE_FLOCK_EX) {
@@ -19,11 +25,16 @@ int rl_flock(FILE *fp, int type)
 	} else {
 		return RL_UNEXPECTED;
 	}
+	if (nonblocking) {
+		locktype |= LOCK_NB;
+	}
 	// all documented error codes for flock do not apply
-	// EWOULDBLOCK because we are not using LOCK_NB
-	// ENOTSUP, EBADF and EINVAL because we received the fileno from a FILE*
+	// except EWOULDBLOCK when using LOCK_NB
+	// ENOTSUP, EBADF and EINVAL because we received an open file descriptor
 	if (flock(fd, locktype) == 0) {
 		return RL_OK;
+	} else if (nonblocking && errno == EWOULDBLOCK) {
+		return RL_NOT_FOUND;
 	} else {
 		return RL_UNEXPECTED;
 	}
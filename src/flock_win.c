@@ -4,3 +4,8 @@ int rl_flock(FILE *fp, int type) {
 	// TODO: implement flock
 	return RL_OK;
 }
+
+int rl_flock_fd(int fd, int type) {
+	// TODO: implement flock
+	return RL_OK;
+}
@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <ctype.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
@@ -65,6 +66,16 @@
 		goto cleanup;\
 	}
 
+// the lock was not taken within the busy timeout, the caller may retry
+#define CHECK_BUSY(c, retval)\
+	if (retval == RL_TIMEOUT) {\
+		retval = addReplyErrorFormat(c->context, RLITE_BUSYERR);\
+		goto cleanup;\
+	}\
+	if (retval != RL_OK) {\
+		goto cleanup;\
+	}
+
 #define RLITE_SERVER_OK(c, retval)\
 	RLITE_SERVER_ERR(c, retval, RL_OK);
 
@@ -87,8 +98,12 @@
 
 int strerror_r(int, char *, size_t);
 
-struct rliteCommand *rliteLookupCommand(const char *name, size_t UNUSED(len));
+struct rliteCommand *rliteLookupCommand(const char *name, size_t len);
 static void __rliteSetError(rliteContext *c, int type, const char *str);
+static void recordCommandLatency(rliteClient *c, struct rliteCommand *command, unsigned long long total, unsigned long long exec, rl_page_stats *before);
+static void freeLatency(rliteContext *c);
+static void slowlogCommand(rliteClient *c);
+static void latencyCommand(rliteClient *c);
 
 static int catvprintf(char** s, size_t *slen, const char *fmt, va_list ap) {
 	va_list cpy;
@@ -189,17 +204,45 @@ rliteReply *createStatusObject(const char *str) {
 	return createStringTypeObject(RLITE_REPLY_STATUS, str, strlen(str));
 }
 
-rliteReply *createDoubleObject(double d) {
-	char dbuf[128];
-	int dlen;
+static int formatDouble(char *dbuf, size_t size, double d) {
 	if (isinf(d)) {
 		/* Libc in odd systems (Hi Solaris!) will format infinite in a
 		 * different way, so better to handle it in an explicit way. */
-		return createCStringObject(d > 0 ? "inf" : "-inf");
-	} else {
-		dlen = snprintf(dbuf,sizeof(dbuf),"%.17g",d);
-		return createStringObject(dbuf, dlen);
+		return snprintf(dbuf, size, "%s", d > 0 ? "inf" : "-inf");
+	}
+	return snprintf(dbuf, size, "%.17g", d);
+}
+
+rliteReply *createDoubleObject(double d) {
+	char dbuf[128];
+	int dlen = formatDouble(dbuf, sizeof(dbuf), d);
+	return createStringObject(dbuf, dlen);
+}
+
+/* Hands a string element to the client's stream callback, `str` is still
+ * owned by the caller afterwards. */
+static void streamString(rliteClient *c, char *str, long len) {
+	rliteReply element;
+	memset(&element, 0, sizeof(element));
+	element.type = RLITE_REPLY_STRING;
+	element.str = str;
+	element.len = len;
+	c->stream(c->streamPrivdata, &element);
+}
+
+static void streamDouble(rliteClient *c, double d) {
+	char dbuf[128];
+	int dlen = formatDouble(dbuf, sizeof(dbuf), d);
+	streamString(c, dbuf, dlen);
+}
+
+/* What a streamed command replies with once its elements are out. */
+static rliteReply *createStreamedArrayObject(size_t elements) {
+	rliteReply *reply = createReplyObject(RLITE_REPLY_ARRAY);
+	if (reply) {
+		reply->elements = elements;
 	}
+	return reply;
 }
 
 rliteReply *createLongLongObject(long long value) {
@@ -220,6 +263,21 @@ static void addZsetIteratorReply(rliteClient *c, int retval, rl_zset_iterator *i
 		return;
 	}
 	c->reply->elements = withscores ? (iterator->size * 2) : iterator->size;
+	if (c->stream) {
+		while ((retval = rl_zset_iterator_next(iterator, NULL, withscores ? &score : NULL, &vstr, &vlen)) == RL_OK) {
+			streamString(c, (char *)vstr, vlen);
+			rl_free(vstr);
+			if (withscores) {
+				streamDouble(c, score);
+			}
+		}
+		if (retval != RL_END) {
+			rliteFreeReplyObject(c->reply);
+			c->reply = NULL;
+			__rliteSetError(c->context, RLITE_ERR, "Unexpected early end");
+		}
+		return;
+	}
 	MALLOC(c->reply->element, sizeof(rliteReply*) * c->reply->elements);
 	i = 0;
 	while ((retval = rl_zset_iterator_next(iterator, NULL, withscores ? &score : NULL, &vstr, &vlen)) == RL_OK) {
@@ -675,17 +733,66 @@ int rliteFormatCommandArgv(rliteClient *client, int argc, char **argv, size_t *a
 }
 
 static int refresh_rlite_fp(rliteContext* context) {
+	if (context->inBatch) {
+		// the batch holds the lock until it is done
+		return RL_OK;
+	}
 	return rl_refresh(context->db);
 }
 
+static int commit_rlite(rliteContext* context) {
+	if (context->inBatch) {
+		return RL_OK;
+	}
+	return rl_commit(context->db);
+}
+
+/* There is no connection to time out, the timeouts are how long to wait
+ * for another process holding the database lock. */
+static long timevalToMs(const struct timeval tv) {
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
 #define DEFAULT_REPLIES_SIZE 16
-static rliteContext *_rliteConnect(const char *path) {
+struct rliteCommandLock {
+	pthread_mutex_t mutex;
+};
+
+static struct rliteCommandLock *createCommandLock(void) {
+	struct rliteCommandLock *lock = rl_malloc(sizeof(*lock));
+	if (lock && pthread_mutex_init(&lock->mutex, NULL) != 0) {
+		rl_free(lock);
+		lock = NULL;
+	}
+	return lock;
+}
+
+static void freeCommandLock(struct rliteCommandLock *lock) {
+	pthread_mutex_destroy(&lock->mutex);
+	rl_free(lock);
+}
+
+static void lockContext(rliteContext *c) {
+	pthread_mutex_lock(&c->commandLock->mutex);
+}
+
+static void unlockContext(rliteContext *c) {
+	pthread_mutex_unlock(&c->commandLock->mutex);
+}
+
+static rliteContext *_rliteConnect(const char *path, int flags, long busyTimeout) {
 	rliteContext *context = rl_malloc(sizeof(*context));
 	if (!context) {
 		return NULL;
 	}
+	context->commandLock = createCommandLock();
+	if (!context->commandLock) {
+		rl_free(context);
+		return NULL;
+	}
 	context->replies = rl_malloc(sizeof(rliteReply*) * DEFAULT_REPLIES_SIZE);
 	if (!context->replies) {
+		freeCommandLock(context->commandLock);
 		rl_free(context);
 		context = NULL;
 		goto cleanup;
@@ -694,6 +801,7 @@ static rliteContext *_rliteConnect(const char *path) {
 	context->path = rl_malloc(sizeof(char) * pathlen);
 	if (!context->path) {
 		rl_free(context->replies);
+		freeCommandLock(context->commandLock);
 		rl_free(context);
 		context = NULL;
 		goto cleanup;
@@ -710,16 +818,24 @@ static rliteContext *_rliteConnect(const char *path) {
 	context->hashtableLimitValue = 0;
 	context->inLuaScript = 0;
 	context->inTransaction = 0;
+	context->inBatch = 0;
 	context->transactionFailed = 0;
 	context->watchedKeysLength = context->enqueuedCommandsLength = 0;
 	context->watchedKeysAlloc = context->enqueuedCommandsAlloc = 0;
 	context->watchedKeys = NULL;
 	context->enqueuedCommands = NULL;
+	context->slowlogLogSlowerThan = RLITE_SLOWLOG_LOG_SLOWER_THAN;
+	context->slowlogMaxLen = RLITE_SLOWLOG_MAX_LEN;
+	context->slowlogLength = 0;
+	context->slowlogNextId = 0;
+	context->slowlog = NULL;
+	context->latency = NULL;
 	context->db = NULL;
-	int retval = rl_open(context->path, &context->db, RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE);;
+	int retval = rl_open_busy_timeout(context->path, &context->db, RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE | RLITE_OPEN_KEEP_FD | flags, busyTimeout);
 	if (retval != RL_OK) {
 		rl_free(context->path);
 		rl_free(context->replies);
+		freeCommandLock(context->commandLock);
 		rl_free(context);
 		context = NULL;
 		goto cleanup;
@@ -730,6 +846,7 @@ static rliteContext *_rliteConnect(const char *path) {
 		rl_close(context->db);
 		rl_free(context->path);
 		rl_free(context->replies);
+		freeCommandLock(context->commandLock);
 		rl_free(context);
 		context = NULL;
 		goto cleanup;
@@ -739,38 +856,46 @@ cleanup:
 }
 
 rliteContext *rliteConnect(const char *ip, int UNUSED(port)) {
-	return _rliteConnect(ip);
+	return _rliteConnect(ip, 0, 0);
 }
 
-rliteContext *rliteConnectWithTimeout(const char *ip, int UNUSED(port), const struct timeval UNUSED(tv)) {
-	return _rliteConnect(ip);
+rliteContext *rliteConnectWithTimeout(const char *ip, int UNUSED(port), const struct timeval tv) {
+	return _rliteConnect(ip, 0, timevalToMs(tv));
 }
 
 rliteContext *rliteConnectNonBlock(const char *ip, int UNUSED(port)) {
-	return _rliteConnect(ip);
+	return _rliteConnect(ip, 0, 0);
 }
 
 rliteContext *rliteConnectBindNonBlock(const char *ip, int UNUSED(port), const char *UNUSED(source_addr)) {
-	return _rliteConnect(ip);
+	return _rliteConnect(ip, 0, 0);
 }
 
 rliteContext *rliteConnectUnix(const char *path) {
-	return _rliteConnect(path);
+	return _rliteConnect(path, 0, 0);
 }
 
-rliteContext *rliteConnectUnixWithTimeout(const char *path, const struct timeval UNUSED(tv)) {
-	return _rliteConnect(path);
+rliteContext *rliteConnectUnixWithTimeout(const char *path, const struct timeval tv) {
+	return _rliteConnect(path, 0, timevalToMs(tv));
 }
 
 rliteContext *rliteConnectUnixNonBlock(const char *path) {
-	return _rliteConnect(path);
+	return _rliteConnect(path, 0, 0);
+}
+
+/* Like rliteConnectUnix, but every context connected this way to the same
+ * file shares one page cache, and threads using them wait for each other on
+ * an in-process lock before the file lock. A thread per context lets reads
+ * run in parallel; threads sharing one context run its commands in turn. */
+rliteContext *rliteConnectShared(const char *path) {
+	return _rliteConnect(path, RLITE_OPEN_SHARED, 0);
 }
 
 rliteContext *rliteConnectFd(int UNUSED(fd)) {
 	return NULL;
 }
-int rliteSetTimeout(rliteContext *UNUSED(c), const struct timeval UNUSED(tv)) {
-	return 0;
+int rliteSetTimeout(rliteContext *c, const struct timeval tv) {
+	return rl_set_busy_timeout(c->db, timevalToMs(tv)) == RL_OK ? RLITE_OK : RLITE_ERR;
 }
 
 int rliteEnableKeepAlive(rliteContext *UNUSED(c)) {
@@ -816,6 +941,8 @@ void rliteFree(rliteContext *c) {
 	rl_free(c->replies);
 	freeWatchedKeys(c);
 	freeEnqueuedCommands(c);
+	freeLatency(c);
+	freeCommandLock(c->commandLock);
 	rl_free(c->path);
 	rl_free(c);
 }
@@ -931,7 +1058,7 @@ static void execCommand(rliteClient *c) {
 		c->context->writeCommand(rl_get_selected_db(c->context->db), 1, argv, argvlen);
 	}
 
-	retval = rl_commit(c->context->db);
+	retval = commit_rlite(c->context);
 	RLITE_SERVER_OK(c, retval);
 cleanup:
 	rl_free(oldhash);
@@ -1019,16 +1146,29 @@ static void *_popReply(rliteContext *c) {
 }
 
 int rliteGetReply(rliteContext *c, void **reply) {
+	lockContext(c);
 	*reply = _popReply(c);
+	unlockContext(c);
 	return RLITE_OK;
 }
 
+void *rlitePopReply(rliteContext *c) {
+	return _popReply(c);
+}
+
 static void flagTransactions(rliteClient *c) {
 	if (c->context->inTransaction) {
 		c->context->transactionFailed = 1;
 	}
 }
 
+/* Commands flagged 'r' run under a shared lock and skip the commit.
+ * Pubsub commands wait for and write subscriber state, they take the
+ * regular path. */
+static int isReadOnlyCommand(struct rliteCommand *command) {
+	return strchr(command->sflags, 'r') != NULL && strchr(command->sflags, 'p') == NULL;
+}
+
 int rliteAppendCommandClient(rliteClient *c) {
 	if (c->argc == 0) {
 		return RLITE_ERR;
@@ -1039,7 +1179,9 @@ int rliteAppendCommandClient(rliteClient *c) {
 	void *tmp;
 	size_t newAlloc;
 	struct rliteCommand *command = rliteLookupCommand(c->argv[0], c->argvlen[0]);
-	int i, retval = RLITE_OK;
+	int i, readOnly, measured = 0, retval = RLITE_OK;
+	unsigned long long start = 0, execStart, exec = 0;
+	rl_page_stats before;
 	if (!command) {
 		cmd = rl_malloc(sizeof(char) * (c->argvlen[0] + 1));
 		memcpy(cmd, c->argv[0], c->argvlen[0] * sizeof(char));
@@ -1055,8 +1197,27 @@ int rliteAppendCommandClient(rliteClient *c) {
 		(c->argc < -command->arity)) {
 		retval = addReplyErrorFormat(c->context, "wrong number of arguments for '%s' command", command->name);
 		flagTransactions(c);
+	} else if (c->context->inBatch && strchr(command->sflags, 'p') != NULL) {
+		// pubsub commands commit and wait on their own
+		retval = addReplyErrorFormat(c->context, "'%s' is not allowed in a batch", command->name);
+		flagTransactions(c);
 	} else {
-		RL_CALL(refresh_rlite_fp, RL_OK, c->context);
+		start = rl_ustime();
+		before = c->context->db->stats;
+		readOnly = !c->context->inTransaction && !c->context->inBatch && isReadOnlyCommand(command);
+		if (readOnly) {
+			retval = rl_begin_read(c->context->db);
+			if (retval != RL_OK && retval != RL_TIMEOUT) {
+				// a crashed commit needs to be recovered first
+				readOnly = 0;
+				retval = RL_OK;
+			}
+			CHECK_BUSY(c, retval);
+		}
+		if (!readOnly) {
+			retval = refresh_rlite_fp(c->context);
+			CHECK_BUSY(c, retval);
+		}
 
 		if (c->context->inTransaction && (command->proc != execCommand && command->proc != discardCommand &&
 					command->proc != multiCommand && command->proc != watchCommand)) {
@@ -1072,6 +1233,7 @@ int rliteAppendCommandClient(rliteClient *c) {
 
 			MALLOC(c->context->enqueuedCommands[c->context->enqueuedCommandsLength], sizeof(rliteClient));
 			c->context->enqueuedCommands[c->context->enqueuedCommandsLength]->flags = 0;
+			c->context->enqueuedCommands[c->context->enqueuedCommandsLength]->stream = NULL;
 #define COMMAND c->context->enqueuedCommands[c->context->enqueuedCommandsLength]
 			COMMAND->argc = c->argc;
 			MALLOC(COMMAND->argvlen, sizeof(size_t) * c->argc);
@@ -1091,12 +1253,35 @@ int rliteAppendCommandClient(rliteClient *c) {
 			retval = addReply(c->context, c->reply);
 		} else {
 			c->reply = NULL;
+			measured = 1;
+
+			if (readOnly) {
+				execStart = rl_ustime();
+				command->proc(c);
+				exec += rl_ustime() - execStart;
+				if (rl_end_read(c->context->db) == RL_OK) {
+					if (c->reply) {
+						retval = addReply(c->context, c->reply);
+					}
+					goto cleanup;
+				}
+				// it wrote something, like deleting an expired key, do it
+				// again holding the exclusive lock
+				if (c->reply) {
+					rliteFreeReplyObject(c->reply);
+					c->reply = NULL;
+				}
+				retval = refresh_rlite_fp(c->context);
+				CHECK_BUSY(c, retval);
+			}
 
 			if (c->context->writeCommand) {
 				RL_CALL(rl_dirty_hash, RL_OK, c->context->db, &oldhash);
 			}
 
+			execStart = rl_ustime();
 			command->proc(c);
+			exec += rl_ustime() - execStart;
 			if (c->reply) {
 				retval = addReply(c->context, c->reply);
 			}
@@ -1107,10 +1292,23 @@ int rliteAppendCommandClient(rliteClient *c) {
 					c->context->writeCommand(rl_get_selected_db(c->context->db), c->argc, c->argv, c->argvlen);
 				}
 			}
-			RL_CALL(rl_commit, RL_OK, c->context->db);
+			retval = commit_rlite(c->context);
+			if (retval == RL_TIMEOUT) {
+				// readers kept the commit out, nothing was written
+				rl_discard(c->context->db);
+				if (c->reply) {
+					c->context->replyLength--;
+					rliteFreeReplyObject(c->reply);
+					c->reply = NULL;
+				}
+			}
+			CHECK_BUSY(c, retval);
 		}
 	}
 cleanup:
+	if (measured) {
+		recordCommandLatency(c, command, rl_ustime() - start, exec, &before);
+	}
 	rl_free(oldhash);
 	rl_free(newhash);
 	return retval;
@@ -1122,9 +1320,11 @@ int rliteAppendFormattedCommand(rliteContext *UNUSED(c), const char *UNUSED(cmd)
 	return RLITE_ERR;
 }
 
-int rlitevAppendCommand(rliteContext *c, const char *format, va_list ap) {
+// callers hold the context lock
+static int appendFormattedCommand(rliteContext *c, const char *format, va_list ap) {
 	rliteClient client;
 	client.context = c;
+	client.stream = NULL;
 	if (rlitevFormatCommand(&client, format, ap) != RLITE_OK) {
 		return RLITE_ERR;
 	}
@@ -1140,6 +1340,13 @@ int rlitevAppendCommand(rliteContext *c, const char *format, va_list ap) {
 	return retval;
 }
 
+int rlitevAppendCommand(rliteContext *c, const char *format, va_list ap) {
+	lockContext(c);
+	int retval = appendFormattedCommand(c, format, ap);
+	unlockContext(c);
+	return retval;
+}
+
 int rliteAppendCommand(rliteContext *c, const char *format, ...) {
 	va_list ap;
 	int retval;
@@ -1149,9 +1356,11 @@ int rliteAppendCommand(rliteContext *c, const char *format, ...) {
 	return retval;
 }
 
-int rliteAppendCommandArgv(rliteContext *c, int argc, char **argv, size_t *argvlen) {
+// callers hold the context lock
+static int appendCommandArgv(rliteContext *c, int argc, char **argv, size_t *argvlen) {
 	rliteClient client;
 	client.context = c;
+	client.stream = NULL;
 	client.argc = argc;
 	client.argv = argv;
 	client.argvlen = argvlen;
@@ -1159,10 +1368,67 @@ int rliteAppendCommandArgv(rliteContext *c, int argc, char **argv, size_t *argvl
 	return rliteAppendCommandClient(&client);
 }
 
+int rliteAppendCommandArgv(rliteContext *c, int argc, char **argv, size_t *argvlen) {
+	lockContext(c);
+	int retval = appendCommandArgv(c, argc, argv, argvlen);
+	unlockContext(c);
+	return retval;
+}
+
+int rliteAppendCommandArgvBatch(rliteContext *c, int commands, int *argc, char ***argv, size_t **argvlen) {
+	rliteClient client;
+	int i, retval, replyLength = c->replyLength;
+	unsigned long discards;
+	client.context = c;
+	client.stream = NULL;
+
+	lockContext(c);
+	if (rl_refresh(c->db) != RL_OK) {
+		unlockContext(c);
+		return RLITE_ERR;
+	}
+	discards = c->db->discards;
+	c->inBatch = 1;
+	for (i = 0; i < commands; i++) {
+		client.argc = argc[i];
+		client.argv = argv[i];
+		client.argvlen = argvlen[i];
+		if (rliteAppendCommandClient(&client) != RLITE_OK) {
+			break;
+		}
+		if (c->db->discards != discards) {
+			// an internal failure dropped the writes of earlier commands
+			break;
+		}
+	}
+	c->inBatch = 0;
+
+	if (i == commands && rl_commit(c->db) == RL_OK) {
+		retval = RLITE_OK;
+	} else {
+		rl_discard(c->db);
+		if (c->replyLength > replyLength) {
+			for (i = replyLength; i < c->replyLength; i++) {
+				rliteFreeReplyObject(c->replies[i]);
+			}
+			c->replyLength = replyLength;
+		}
+		if (c->replyPosition >= c->replyLength) {
+			c->replyPosition = c->replyLength = 0;
+		}
+		retval = RLITE_ERR;
+	}
+	unlockContext(c);
+	return retval;
+}
+
 void *rlitevCommand(rliteContext *c, const char *format, va_list ap) {
-	if (rlitevAppendCommand(c,format,ap) != RLITE_OK)
-		return NULL;
-	return _popReply(c);
+	void *reply = NULL;
+	lockContext(c);
+	if (appendFormattedCommand(c,format,ap) == RLITE_OK)
+		reply = _popReply(c);
+	unlockContext(c);
+	return reply;
 }
 
 void *rliteCommand(rliteContext *c, const char *format, ...) {
@@ -1175,9 +1441,42 @@ void *rliteCommand(rliteContext *c, const char *format, ...) {
 }
 
 void *rliteCommandArgv(rliteContext *c, int argc, char **argv, size_t *argvlen) {
-	if (rliteAppendCommandArgv(c,argc,argv,argvlen) != RLITE_OK)
+	void *reply = NULL;
+	lockContext(c);
+	if (appendCommandArgv(c,argc,argv,argvlen) == RLITE_OK)
+		reply = _popReply(c);
+	unlockContext(c);
+	return reply;
+}
+
+void *rliteCommandArgvStream(rliteContext *c, int argc, char **argv, size_t *argvlen, rliteStreamCallback *stream, void *privdata) {
+	rliteClient client;
+	rliteReply *reply;
+	size_t i;
+	client.context = c;
+	client.argc = argc;
+	client.argv = argv;
+	client.argvlen = argvlen;
+	client.stream = stream;
+	client.streamPrivdata = privdata;
+
+	lockContext(c);
+	if (rliteAppendCommandClient(&client) != RLITE_OK) {
+		unlockContext(c);
 		return NULL;
-	return _popReply(c);
+	}
+	reply = _popReply(c);
+	unlockContext(c);
+	if (reply && reply->type == RLITE_REPLY_ARRAY && reply->element) {
+		// built by a command that does not stream, hand it out anyway
+		for (i = 0; i < reply->elements; i++) {
+			stream(privdata, reply->element[i]);
+			rliteFreeReplyObject(reply->element[i]);
+		}
+		rl_free(reply->element);
+		reply->element = NULL;
+	}
+	return reply;
 }
 
 static void echoCommand(rliteClient *c)
@@ -1395,7 +1694,7 @@ cleanup:
 
 static void zunionInterGenericCommand(rliteClient *c, int op) {
 	int i, j;
-	long setnum;
+	long setnum, card;
 	int aggregate = RL_ZSET_AGGREGATE_SUM;
 	double *weights = NULL;
 	unsigned char **keys = NULL;
@@ -1462,7 +1761,10 @@ static void zunionInterGenericCommand(rliteClient *c, int op) {
 	}
 	retval = (op == RLITE_OP_UNION ? rl_zunionstore : rl_zinterstore)(c->context->db, setnum + 1, keys, keys_len, weights, aggregate);
 	RLITE_SERVER_OK(c, retval);
-	zcardCommand(c);
+	// an empty result leaves no destination key
+	retval = rl_zcard(c->context->db, keys[0], keys_len[0], &card);
+	RLITE_SERVER_ERR2(c, retval, RL_OK, RL_NOT_FOUND);
+	c->reply = createLongLongObject(retval == RL_OK ? card : 0);
 cleanup:
 	rl_free(keys);
 	rl_free(keys_len);
@@ -1940,6 +2242,27 @@ static void addHashIteratorReply(rliteClient *c, int retval, rl_hash_iterator *i
 		return;
 	}
 	c->reply->elements = iterator->size * (fields + values);
+	if (c->stream) {
+		while ((retval = rl_hash_iterator_next(iterator,
+						NULL, fields ? &field : NULL, fields ? &fieldlen : NULL,
+						NULL, values ? &value : NULL, values ? &valuelen : NULL
+						)) == RL_OK) {
+			if (fields) {
+				streamString(c, (char *)field, fieldlen);
+				rl_free(field);
+			}
+			if (values) {
+				streamString(c, (char *)value, valuelen);
+				rl_free(value);
+			}
+		}
+		if (retval != RL_END) {
+			rliteFreeReplyObject(c->reply);
+			c->reply = NULL;
+			__rliteSetError(c->context, RLITE_ERR, "Unexpected early end");
+		}
+		return;
+	}
 	MALLOC(c->reply->element, sizeof(rliteReply*) * c->reply->elements);
 	while ((retval = rl_hash_iterator_next(iterator,
 					NULL, fields ? &field : NULL, fields ? &fieldlen : NULL,
@@ -2375,6 +2698,40 @@ cleanup:
 	return;
 }
 
+static void lrangeStream(rliteClient *c, unsigned char *key, size_t keylen, long start, long stop) {
+	rl_list_iterator *iterator = NULL;
+	unsigned char *value;
+	long size = 0, valuelen, i = 0;
+	void *tmp;
+
+	int retval = rl_lrange_iterator(c->context->db, key, keylen, start, stop, &size, &iterator);
+	RLITE_SERVER_ERR2(c, retval, RL_OK, RL_NOT_FOUND);
+	if (retval == RL_NOT_FOUND || size == 0) {
+		iterator = NULL;
+		size = 0;
+	}
+	while (i < size && (retval = rl_list_iterator_next(iterator, &tmp)) == RL_OK) {
+		retval = rl_multi_string_get(c->context->db, *(long *)tmp, &value, &valuelen);
+		rl_free(tmp);
+		RLITE_SERVER_OK(c, retval);
+		streamString(c, (char *)value, valuelen);
+		rl_free(value);
+		i++;
+	}
+	if (i < size) {
+		if (retval == RL_END) {
+			// the iterator is gone already
+			iterator = NULL;
+		}
+		RLITE_SERVER_OK(c, retval);
+	}
+	CHECK_OOM(c->reply = createStreamedArrayObject(size));
+cleanup:
+	if (iterator) {
+		rl_list_iterator_destroy(c->context->db, iterator);
+	}
+}
+
 static void lrangeCommand(rliteClient *c) {
 	unsigned char *key = UNSIGN(c->argv[1]);
 	size_t keylen = c->argvlen[1];
@@ -2387,6 +2744,11 @@ static void lrangeCommand(rliteClient *c) {
 	if ((getLongFromObjectOrReply(c, c->argv[2], c->argvlen[2], &start, NULL) != RLITE_OK) ||
 		(getLongFromObjectOrReply(c, c->argv[3], c->argvlen[3], &stop, NULL) != RLITE_OK)) return;
 
+	if (c->stream) {
+		lrangeStream(c, key, keylen, start, stop);
+		return;
+	}
+
 	int retval = rl_lrange(c->context->db, key, keylen, start, stop, &size, &values, &valueslen);
 	RLITE_SERVER_ERR2(c, retval, RL_OK, RL_NOT_FOUND);
 	CHECK_OOM(c->reply = createReplyObject(RLITE_REPLY_ARRAY));
@@ -3940,7 +4302,7 @@ static struct rliteCommand rliteCommandTable[] = {
 	// {"client",clientCommand,-2,"ars",0,NULL,0,0,0,0,0},
 	{"eval",evalCommand,-3,"s",0,0,0,0,0,0},
 	{"evalsha",evalShaCommand,-3,"s",0,0,0,0,0,0},
-	// {"slowlog",slowlogCommand,-2,"r",0,NULL,0,0,0,0,0},
+	{"slowlog",slowlogCommand,-2,"r",0,0,0,0,0,0},
 	{"script",scriptCommand,-2,"ras",0,0,0,0,0,0},
 	// {"time",timeCommand,1,"rRF",0,NULL,0,0,0,0,0},
 	{"bitop",bitopCommand,-4,"wm",0,2,-1,1,0,0},
@@ -3953,7 +4315,7 @@ static struct rliteCommand rliteCommandTable[] = {
 	{"pfcount",pfcountCommand,-2,"w",0,1,1,1,0,0},
 	{"pfmerge",pfmergeCommand,-2,"wm",0,1,-1,1,0,0},
 	{"pfdebug",pfdebugCommand,-3,"w",0,0,0,0,0,0},
-	// {"latency",latencyCommand,-2,"arslt",0,NULL,0,0,0,0,0}
+	{"latency",latencyCommand,-2,"arslt",0,0,0,0,0,0}
 };
 
 int rliteCommandHasFlag(struct rliteCommand *c, int flags) {
@@ -3980,22 +4342,437 @@ int rliteCommandHasFlag(struct rliteCommand *c, int flags) {
 	return flags == 0;
 }
 
-struct rliteCommand *rliteLookupCommand(const char *name, size_t len) {
-	char _name[100];
-	if (len >= 100) {
-		return NULL;
+/* Open addressing table over rliteCommandTable, keyed on the lower cased
+ * name. It is filled once and only read afterwards. */
+#define RLITE_COMMAND_BUCKETS 512
+static struct rliteCommand *commandBuckets[RLITE_COMMAND_BUCKETS];
+static pthread_once_t commandBucketsOnce = PTHREAD_ONCE_INIT;
+
+static unsigned int commandHash(const char *name, size_t len) {
+	unsigned int hash = 5381;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		hash = hash * 33 + (unsigned char)tolower((unsigned char)name[i]);
 	}
-	memcpy(_name, name, len);
-	_name[len] = '\0';
+	return hash;
+}
+
+static void populateCommandBuckets(void) {
 	int j;
 	int numcommands = sizeof(rliteCommandTable)/sizeof(struct rliteCommand);
+	unsigned int bucket;
 
 	for (j = 0; j < numcommands; j++) {
 		struct rliteCommand *c = rliteCommandTable+j;
-		if (strcasecmp(c->name, _name) == 0) {
+		bucket = commandHash(c->name, strlen(c->name)) & (RLITE_COMMAND_BUCKETS - 1);
+		while (commandBuckets[bucket]) {
+			bucket = (bucket + 1) & (RLITE_COMMAND_BUCKETS - 1);
+		}
+		commandBuckets[bucket] = c;
+	}
+}
+
+struct rliteCommand *rliteLookupCommand(const char *name, size_t len) {
+	struct rliteCommand *c;
+	unsigned int bucket;
+
+	pthread_once(&commandBucketsOnce, populateCommandBuckets);
+	bucket = commandHash(name, len) & (RLITE_COMMAND_BUCKETS - 1);
+	while ((c = commandBuckets[bucket]) != NULL) {
+		if (strlen(c->name) == len && strncasecmp(c->name, name, len) == 0) {
 			return c;
 		}
+		bucket = (bucket + 1) & (RLITE_COMMAND_BUCKETS - 1);
 	}
 
 	return NULL;
 }
+
+/* Latency histograms and the slowlog, filled by rliteAppendCommandClient
+ * with the time every command took, split into waiting for the database
+ * lock, running the command, and writing and applying the wal. */
+#define NUMCOMMANDS (sizeof(rliteCommandTable)/sizeof(struct rliteCommand))
+#define LATENCY_BUCKETS 40
+#define SLOWLOG_ENTRY_MAX_ARGC 32
+#define SLOWLOG_ENTRY_MAX_STRING 128
+
+enum {
+	LATENCY_TOTAL,
+	LATENCY_LOCK,
+	LATENCY_EXEC,
+	LATENCY_WAL_WRITE,
+	LATENCY_WAL_APPLY,
+	LATENCY_PHASES
+};
+
+static const char *latencyPhaseNames[LATENCY_PHASES] = {
+	"histogram_usec", "lock_usec", "exec_usec", "wal_write_usec", "wal_apply_usec"
+};
+
+/* Bucket i counts the calls that took more than 2^(i-1) and up to 2^i
+ * microseconds. */
+struct rliteCommandLatency {
+	unsigned long long calls;
+	unsigned long long buckets[LATENCY_PHASES][LATENCY_BUCKETS];
+};
+
+struct rliteSlowlogEntry {
+	long long id;
+	long long time; /* unix time in seconds */
+	unsigned long long duration[LATENCY_PHASES];
+	int argc;
+	char **argv;
+	size_t *argvlen;
+};
+
+/* An array reply whose elements can be filled one at a time, freeing it
+ * halfway through only frees the ones already there. */
+static rliteReply *createEmptyArrayObject(size_t size) {
+	rliteReply *reply = createArrayObject(size);
+	if (reply) {
+		memset(reply->element, 0, sizeof(rliteReply *) * size);
+	}
+	return reply;
+}
+
+static int latencyBucket(unsigned long long usec) {
+	int i = 0;
+	while (i < LATENCY_BUCKETS - 1 && (1ULL << i) < usec) {
+		i++;
+	}
+	return i;
+}
+
+static void freeSlowlogEntry(struct rliteSlowlogEntry *entry) {
+	int i;
+	for (i = 0; i < entry->argc; i++) {
+		rl_free(entry->argv[i]);
+	}
+	rl_free(entry->argv);
+	rl_free(entry->argvlen);
+	rl_free(entry);
+}
+
+static void slowlogReset(rliteContext *c) {
+	long i;
+	for (i = 0; i < c->slowlogLength; i++) {
+		freeSlowlogEntry(c->slowlog[i]);
+	}
+	c->slowlogLength = 0;
+}
+
+static void freeLatency(rliteContext *c) {
+	size_t i;
+	slowlogReset(c);
+	rl_free(c->slowlog);
+	c->slowlog = NULL;
+	if (c->latency) {
+		for (i = 0; i < NUMCOMMANDS; i++) {
+			rl_free(c->latency[i]);
+		}
+		rl_free(c->latency);
+		c->latency = NULL;
+	}
+}
+
+/* Copies the arguments like redis does, at most SLOWLOG_ENTRY_MAX_ARGC of
+ * them and SLOWLOG_ENTRY_MAX_STRING bytes of each one. */
+static struct rliteSlowlogEntry *createSlowlogEntry(rliteClient *c, unsigned long long *duration) {
+	struct rliteSlowlogEntry *entry = rl_malloc(sizeof(*entry));
+	int i, argc = c->argc > SLOWLOG_ENTRY_MAX_ARGC ? SLOWLOG_ENTRY_MAX_ARGC : c->argc;
+	char buffer[64];
+	size_t len;
+
+	if (!entry) {
+		return NULL;
+	}
+	entry->argc = 0;
+	entry->argv = rl_malloc(sizeof(char *) * argc);
+	entry->argvlen = rl_malloc(sizeof(size_t) * argc);
+	if (!entry->argv || !entry->argvlen) {
+		goto fail;
+	}
+	for (i = 0; i < argc; i++) {
+		if (i == argc - 1 && argc != c->argc) {
+			len = snprintf(buffer, sizeof(buffer), "... (%d more arguments)", c->argc - argc + 1);
+			entry->argv[i] = rl_malloc(len + 1);
+			if (!entry->argv[i]) {
+				goto fail;
+			}
+			memcpy(entry->argv[i], buffer, len + 1);
+		} else if (c->argvlen[i] > SLOWLOG_ENTRY_MAX_STRING) {
+			len = snprintf(buffer, sizeof(buffer), "... (%lu more bytes)", (unsigned long)(c->argvlen[i] - SLOWLOG_ENTRY_MAX_STRING));
+			entry->argv[i] = rl_malloc(SLOWLOG_ENTRY_MAX_STRING + len + 1);
+			if (!entry->argv[i]) {
+				goto fail;
+			}
+			memcpy(entry->argv[i], c->argv[i], SLOWLOG_ENTRY_MAX_STRING);
+			memcpy(&entry->argv[i][SLOWLOG_ENTRY_MAX_STRING], buffer, len + 1);
+			len += SLOWLOG_ENTRY_MAX_STRING;
+		} else {
+			len = c->argvlen[i];
+			entry->argv[i] = rl_malloc(len + 1);
+			if (!entry->argv[i]) {
+				goto fail;
+			}
+			memcpy(entry->argv[i], c->argv[i], len);
+			entry->argv[i][len] = '\0';
+		}
+		entry->argvlen[i] = len;
+		entry->argc++;
+	}
+	entry->id = c->context->slowlogNextId++;
+	entry->time = time(NULL);
+	memcpy(entry->duration, duration, sizeof(entry->duration));
+	return entry;
+fail:
+	freeSlowlogEntry(entry);
+	return NULL;
+}
+
+static void slowlogPush(rliteClient *c, unsigned long long *duration) {
+	rliteContext *context = c->context;
+	struct rliteSlowlogEntry *entry;
+
+	if (context->slowlogMaxLen <= 0) {
+		return;
+	}
+	if (!context->slowlog) {
+		context->slowlog = rl_malloc(sizeof(struct rliteSlowlogEntry *) * context->slowlogMaxLen);
+		if (!context->slowlog) {
+			return;
+		}
+	}
+	entry = createSlowlogEntry(c, duration);
+	if (!entry) {
+		return;
+	}
+	if (context->slowlogLength == context->slowlogMaxLen) {
+		freeSlowlogEntry(context->slowlog[--context->slowlogLength]);
+	}
+	memmove(&context->slowlog[1], context->slowlog, sizeof(struct rliteSlowlogEntry *) * context->slowlogLength);
+	context->slowlog[0] = entry;
+	context->slowlogLength++;
+}
+
+/* Running out of memory here loses a sample, the command already ran. */
+static void recordCommandLatency(rliteClient *c, struct rliteCommand *command, unsigned long long total, unsigned long long exec, rl_page_stats *before) {
+	rliteContext *context = c->context;
+	rl_page_stats *after = &context->db->stats;
+	struct rliteCommandLatency *latency;
+	unsigned long long duration[LATENCY_PHASES];
+	size_t index = command - rliteCommandTable;
+	int i;
+
+	duration[LATENCY_TOTAL] = total;
+	duration[LATENCY_LOCK] = after->lock_wait_us - before->lock_wait_us;
+	duration[LATENCY_EXEC] = exec;
+	duration[LATENCY_WAL_WRITE] = after->wal_write_us - before->wal_write_us;
+	duration[LATENCY_WAL_APPLY] = after->wal_apply_us - before->wal_apply_us;
+
+	if (!context->latency) {
+		context->latency = rl_malloc(sizeof(struct rliteCommandLatency *) * NUMCOMMANDS);
+		if (!context->latency) {
+			return;
+		}
+		memset(context->latency, 0, sizeof(struct rliteCommandLatency *) * NUMCOMMANDS);
+	}
+	latency = context->latency[index];
+	if (!latency) {
+		latency = context->latency[index] = rl_malloc(sizeof(struct rliteCommandLatency));
+		if (!latency) {
+			return;
+		}
+		memset(latency, 0, sizeof(*latency));
+	}
+	latency->calls++;
+	for (i = 0; i < LATENCY_PHASES; i++) {
+		latency->buckets[i][latencyBucket(duration[i])]++;
+	}
+
+	if (context->slowlogLogSlowerThan >= 0 && total >= (unsigned long long)context->slowlogLogSlowerThan) {
+		slowlogPush(c, duration);
+	}
+}
+
+static rliteReply *createSlowlogEntryReply(struct rliteSlowlogEntry *entry) {
+	rliteReply *reply, *args, *phases;
+	int i;
+
+	if (!(reply = createEmptyArrayObject(5))) {
+		return NULL;
+	}
+	reply->element[0] = createLongLongObject(entry->id);
+	reply->element[1] = createLongLongObject(entry->time);
+	reply->element[2] = createLongLongObject(entry->duration[LATENCY_TOTAL]);
+	args = reply->element[3] = createEmptyArrayObject(entry->argc);
+	phases = reply->element[4] = createEmptyArrayObject((LATENCY_PHASES - 1) * 2);
+	if (!reply->element[0] || !reply->element[1] || !reply->element[2] || !args || !phases) {
+		goto fail;
+	}
+	for (i = 0; i < entry->argc; i++) {
+		if (!(args->element[i] = createStringObject(entry->argv[i], entry->argvlen[i]))) {
+			goto fail;
+		}
+	}
+	for (i = 1; i < LATENCY_PHASES; i++) {
+		phases->element[(i - 1) * 2] = createCStringObject(latencyPhaseNames[i]);
+		phases->element[(i - 1) * 2 + 1] = createLongLongObject(entry->duration[i]);
+		if (!phases->element[(i - 1) * 2] || !phases->element[(i - 1) * 2 + 1]) {
+			goto fail;
+		}
+	}
+	return reply;
+fail:
+	rliteFreeReplyObject(reply);
+	return NULL;
+}
+
+/* SLOWLOG GET [count] | LEN | RESET
+ * Every entry is the id, unix time, duration and arguments, like in redis,
+ * followed by how long the command waited for the lock, ran, and wrote and
+ * applied the wal. */
+static void slowlogCommand(rliteClient *c) {
+	rliteContext *context = c->context;
+	long long count;
+	long i;
+	int retval = RL_OK;
+
+	if (c->argc == 2 && ARGVCASEEQ(c, 1, "reset")) {
+		slowlogReset(context);
+		c->reply = createStatusObject(RLITE_STR_OK);
+	} else if (c->argc == 2 && ARGVCASEEQ(c, 1, "len")) {
+		c->reply = createLongLongObject(context->slowlogLength);
+	} else if ((c->argc == 2 || c->argc == 3) && ARGVCASEEQ(c, 1, "get")) {
+		count = 10;
+		if (c->argc == 3 && getLongLongFromObjectOrReply(c, c->argv[2], c->argvlen[2], &count, NULL) != RLITE_OK) {
+			return;
+		}
+		if (count < 0 || count > context->slowlogLength) {
+			count = context->slowlogLength;
+		}
+		CHECK_OOM(c->reply = createEmptyArrayObject(count));
+		for (i = 0; i < count; i++) {
+			CHECK_OOM(c->reply->element[i] = createSlowlogEntryReply(context->slowlog[i]));
+		}
+	} else {
+		c->reply = createErrorObject("ERR Unknown SLOWLOG subcommand or wrong number of arguments.");
+	}
+cleanup:
+	if (retval != RL_OK && c->reply) {
+		rliteFreeReplyObject(c->reply);
+		c->reply = NULL;
+	}
+}
+
+/* The upper bound of every bucket from the first to the last one used,
+ * with the number of calls up to it. */
+static rliteReply *createHistogramReply(unsigned long long *buckets) {
+	rliteReply *reply;
+	unsigned long long calls = 0;
+	int i, first = -1, last = -1;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		if (buckets[i]) {
+			if (first == -1) {
+				first = i;
+			}
+			last = i;
+		}
+	}
+	if (first == -1) {
+		return createArrayObject(0);
+	}
+	if (!(reply = createEmptyArrayObject((last - first + 1) * 2))) {
+		return NULL;
+	}
+	for (i = first; i <= last; i++) {
+		calls += buckets[i];
+		reply->element[(i - first) * 2] = createLongLongObject(1LL << i);
+		reply->element[(i - first) * 2 + 1] = createLongLongObject(calls);
+		if (!reply->element[(i - first) * 2] || !reply->element[(i - first) * 2 + 1]) {
+			rliteFreeReplyObject(reply);
+			return NULL;
+		}
+	}
+	return reply;
+}
+
+static rliteReply *createCommandLatencyReply(struct rliteCommandLatency *latency) {
+	rliteReply *reply;
+	int i;
+
+	if (!(reply = createEmptyArrayObject(2 + LATENCY_PHASES * 2))) {
+		return NULL;
+	}
+	reply->element[0] = createCStringObject("calls");
+	reply->element[1] = createLongLongObject(latency->calls);
+	if (!reply->element[0] || !reply->element[1]) {
+		goto fail;
+	}
+	for (i = 0; i < LATENCY_PHASES; i++) {
+		reply->element[2 + i * 2] = createCStringObject(latencyPhaseNames[i]);
+		reply->element[3 + i * 2] = createHistogramReply(latency->buckets[i]);
+		if (!reply->element[2 + i * 2] || !reply->element[3 + i * 2]) {
+			goto fail;
+		}
+	}
+	return reply;
+fail:
+	rliteFreeReplyObject(reply);
+	return NULL;
+}
+
+/* LATENCY HISTOGRAM [command ...] | RESET
+ * HISTOGRAM replies with the name and the histograms of every command that
+ * ran, or of the ones asked for. RESET clears them. */
+static void latencyCommand(rliteClient *c) {
+	rliteContext *context = c->context;
+	struct rliteCommand *command;
+	struct rliteCommandLatency *latency;
+	size_t i, j, commandc = 0;
+	int retval = RL_OK;
+
+	if (c->argc == 2 && ARGVCASEEQ(c, 1, "reset")) {
+		if (context->latency) {
+			for (i = 0; i < NUMCOMMANDS; i++) {
+				if (context->latency[i]) {
+					commandc++;
+					rl_free(context->latency[i]);
+					context->latency[i] = NULL;
+				}
+			}
+		}
+		c->reply = createLongLongObject(commandc);
+	} else if (ARGVCASEEQ(c, 1, "histogram")) {
+		CHECK_OOM(c->reply = createEmptyArrayObject(context->latency ? NUMCOMMANDS * 2 : 0));
+		for (i = 0; context->latency && i < NUMCOMMANDS; i++) {
+			latency = context->latency[i];
+			command = &rliteCommandTable[i];
+			if (!latency) {
+				continue;
+			}
+			if (c->argc > 2) {
+				for (j = 2; j < (size_t)c->argc; j++) {
+					if (rliteLookupCommand(c->argv[j], c->argvlen[j]) == command) {
+						break;
+					}
+				}
+				if (j == (size_t)c->argc) {
+					continue;
+				}
+			}
+			CHECK_OOM(c->reply->element[commandc * 2] = createCStringObject(command->name));
+			CHECK_OOM(c->reply->element[commandc * 2 + 1] = createCommandLatencyReply(latency));
+			commandc++;
+		}
+		c->reply->elements = commandc * 2;
+	} else {
+		c->reply = createErrorObject("ERR Unknown LATENCY subcommand or wrong number of arguments.");
+	}
+cleanup:
+	if (retval != RL_OK && c->reply) {
+		rliteFreeReplyObject(c->reply);
+		c->reply = NULL;
+	}
+}
@@ -575,6 +575,7 @@ int rl_btree_remove_element(struct rlite *db, rl_btree *btree, long btree_page,
 				btree->height--;
 				if (node->children) {
 					btree->root = node->children[0];
+					RL_CALL(rl_delete, RL_OK, db, node_page);
 				}
 				else {
 					RL_CALL(rl_delete, RL_OK, db, btree->root);
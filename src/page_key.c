@@ -72,8 +72,13 @@ int rl_key_set(rlite *db, const unsigned char *key, long keylen, unsigned char t
 	}
 	key_obj->version = version;
 
-	RL_CALL(rl_btree_add_element, RL_OK, db, btree, db->databases[rl_get_selected_db(db)], digest, key_obj);
-	retval = RL_OK;
+	retval = rl_btree_add_element(db, btree, db->databases[rl_get_selected_db(db)], digest, key_obj);
+	// the btree frees them if it fails
+	digest = NULL;
+	key_obj = NULL;
+	if (retval != RL_OK) {
+		goto cleanup;
+	}
 cleanup:
 	if (retval != RL_OK) {
 		rl_free(digest);
@@ -135,17 +140,44 @@ cleanup:
 	return retval;
 }
 
-static int rl_key_sha_check_version(struct rlite *db, struct watched_key* key) {
+static int watched_key_cmp(const void *a, const void *b)
+{
+	const struct watched_key *ka = *(const struct watched_key **)a;
+	const struct watched_key *kb = *(const struct watched_key **)b;
+	if (ka->database != kb->database) {
+		return ka->database < kb->database ? -1 : 1;
+	}
+	return memcmp(ka->digest, kb->digest, 20);
+}
+
+static int get_database_btree(struct rlite *db, int database, rl_btree **btree)
+{
+	int retval;
+	void *tmp;
+	if (!db->databases[database]) {
+		return RL_NOT_FOUND;
+	}
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_btree_hash_sha1_key, db->databases[database], &rl_btree_type_hash_sha1_key, &tmp, 1);
+	*btree = tmp;
+	retval = RL_OK;
+cleanup:
+	return retval;
+}
+
+static int rl_key_sha_check_version(struct rlite *db, rl_btree *btree, struct watched_key* key) {
 	int retval;
-	long version;
+	long version = 0;
+	void *tmp;
 	// if the key has expired, the version is still valid, according to
 	// https://code.google.com/p/redis/issues/detail?id=270
 	// it seems to be relevant to redis being stateful and single process
 	// I don't think it is possible to replicate exactly the behavior, but
 	// this is pretty close.
-	RL_CALL2(rl_key_get_hash_ignore_expire, RL_FOUND, RL_NOT_FOUND, db, key->digest, NULL, NULL, NULL, NULL, &version, 1);
-	if (retval == RL_NOT_FOUND) {
-		version = 0;
+	if (btree) {
+		RL_CALL2(rl_btree_find_score, RL_FOUND, RL_NOT_FOUND, db, btree, key->digest, &tmp, NULL, NULL);
+		if (retval == RL_FOUND) {
+			version = ((rl_key *)tmp)->version;
+		}
 	}
 	if (version != key->version) {
 		retval = RL_OUTDATED;
@@ -156,13 +188,35 @@ cleanup:
 	return retval;
 }
 
+/**
+ * Skips the lookups altogether if nothing was committed since the keys were
+ * watched. Otherwise `keys` is sorted by database so every key btree is read
+ * once.
+ */
 int rl_check_watched_keys(struct rlite *db, int watched_count, struct watched_key** keys)
 {
-	int i, retval = RL_OK;
+	int i, database = -1, retval = RL_OK;
+	unsigned long long change_counter;
+	rl_btree *btree = NULL;
 
+	if (db->write_pages_len == 0 && rl_get_change_counter(db, &change_counter) == RL_OK) {
+		for (i = 0; i < watched_count && keys[i]->change_counter == change_counter; i++);
+		if (i == watched_count) {
+			db->stats.watch_skipped++;
+			return RL_OK;
+		}
+	}
+
+	qsort(keys, watched_count, sizeof(struct watched_key *), watched_key_cmp);
 	for (i = 0; i < watched_count; i++) {
-		RL_CALL(rl_key_sha_check_version, RL_OK, db, keys[i]);
+		if (keys[i]->database != database) {
+			database = keys[i]->database;
+			btree = NULL;
+			RL_CALL2(get_database_btree, RL_OK, RL_NOT_FOUND, db, database, &btree);
+		}
+		RL_CALL(rl_key_sha_check_version, RL_OK, db, btree, keys[i]);
 	}
+	retval = RL_OK;
 cleanup:
 	return retval;
 }
@@ -172,6 +226,8 @@ int rl_watch(struct rlite *db, struct watched_key** _watched_key, const unsigned
 	struct watched_key* wkey = NULL;
 	RL_MALLOC(wkey, sizeof(struct watched_key));
 	wkey->database = rl_get_selected_db(db);
+	// pending writes are not counted yet, force a lookup on check
+	wkey->change_counter = db->write_pages_len == 0 ? db->initial_change_counter : (unsigned long long)-1;
 
 	RL_CALL(sha1, RL_OK, key, keylen, wkey->digest);
 	RL_CALL2(rl_key_get_hash_ignore_expire, RL_FOUND, RL_NOT_FOUND, db, wkey->digest, NULL, NULL, NULL, NULL, &wkey->version, 1);
@@ -23,6 +23,17 @@ rl_list_type rl_list_type_long = {
 #endif
 };
 
+// the levels page of a sorted set, which may hold a packed sorted set instead
+rl_list_type rl_list_type_zset = {
+	&rl_data_type_zset,
+	&rl_data_type_list_node_long,
+	sizeof(long),
+	long_cmp,
+#ifdef RL_DEBUG
+	long_formatter,
+#endif
+};
+
 int rl_list_serialize(rlite *UNUSED(db), void *obj, unsigned char *data)
 {
 	rl_list *list = obj;
@@ -30,6 +41,8 @@ int rl_list_serialize(rlite *UNUSED(db), void *obj, unsigned char *data)
 	put_4bytes(&data[4], list->right);
 	put_4bytes(&data[8], list->max_node_size);
 	put_4bytes(&data[12], list->size);
+	put_4bytes(&data[16], list->index);
+	put_4bytes(&data[20], list->index_height);
 	return RL_OK;
 }
 
@@ -43,6 +56,8 @@ int rl_list_deserialize(rlite *UNUSED(db), void **obj, void *context, unsigned c
 	list->right = get_4bytes(&data[4]);
 	list->max_node_size = get_4bytes(&data[8]);
 	list->size = get_4bytes(&data[12]);
+	list->index = get_4bytes(&data[16]);
+	list->index_height = get_4bytes(&data[20]);
 	*obj = list;
 cleanup:
 	return retval;
@@ -135,6 +150,8 @@ int rl_list_create(rlite *db, rl_list **_list, rl_list_type *type)
 	node->left = 0;
 	node->right = 0;
 	list->size = 0;
+	list->index = 0;
+	list->index_height = 0;
 	list->left = db->next_empty_page;
 	RL_CALL(rl_write, RL_OK, db, list->type->list_node_type, db->next_empty_page, node);
 	list->right = list->left;
@@ -153,6 +170,423 @@ int rl_list_destroy(rlite *UNUSED(db), void *list)
 	return RL_OK;
 }
 
+// entries per index page; nodes get room for one more to be split afterwards
+#define INDEX_NODE_MAX_SIZE(db) (((db)->page_size - 4) / 8)
+
+typedef struct {
+	long page;
+	long slot;
+	rl_list_index_node *node;
+} rl_list_index_step;
+
+static int index_node_create(rlite *db, rl_list_index_node **_node)
+{
+	int retval = RL_OK;
+	rl_list_index_node *node;
+	RL_MALLOC(node, sizeof(*node));
+	node->size = 0;
+	node->children = rl_malloc(sizeof(long) * (INDEX_NODE_MAX_SIZE(db) + 1));
+	node->counts = rl_malloc(sizeof(long) * (INDEX_NODE_MAX_SIZE(db) + 1));
+	if (!node->children || !node->counts) {
+		rl_list_index_node_destroy(db, node);
+		retval = RL_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+	*_node = node;
+cleanup:
+	return retval;
+}
+
+int rl_list_index_node_destroy(rlite *UNUSED(db), void *obj)
+{
+	rl_list_index_node *node = obj;
+	rl_free(node->children);
+	rl_free(node->counts);
+	rl_free(node);
+	return RL_OK;
+}
+
+int rl_list_index_node_serialize(rlite *UNUSED(db), void *obj, unsigned char *data)
+{
+	rl_list_index_node *node = obj;
+	long i, pos = 4;
+	put_4bytes(data, node->size);
+	for (i = 0; i < node->size; i++) {
+		put_4bytes(&data[pos], node->children[i]);
+		put_4bytes(&data[pos + 4], node->counts[i]);
+		pos += 8;
+	}
+	return RL_OK;
+}
+
+int rl_list_index_node_deserialize(rlite *db, void **obj, void *UNUSED(context), unsigned char *data)
+{
+	rl_list_index_node *node;
+	long i, pos = 4;
+	int retval;
+	RL_CALL(index_node_create, RL_OK, db, &node);
+	node->size = get_4bytes(data);
+	for (i = 0; i < node->size; i++) {
+		node->children[i] = get_4bytes(&data[pos]);
+		node->counts[i] = get_4bytes(&data[pos + 4]);
+		pos += 8;
+	}
+	*obj = node;
+cleanup:
+	return retval;
+}
+
+static void index_node_insert(rl_list_index_node *node, long slot, long child, long count)
+{
+	memmove(&node->children[slot + 1], &node->children[slot], sizeof(long) * (node->size - slot));
+	memmove(&node->counts[slot + 1], &node->counts[slot], sizeof(long) * (node->size - slot));
+	node->children[slot] = child;
+	node->counts[slot] = count;
+	node->size++;
+}
+
+static void index_node_remove(rl_list_index_node *node, long slot)
+{
+	memmove(&node->children[slot], &node->children[slot + 1], sizeof(long) * (node->size - slot - 1));
+	memmove(&node->counts[slot], &node->counts[slot + 1], sizeof(long) * (node->size - slot - 1));
+	node->size--;
+}
+
+/**
+ * Finds the list node holding `position`, or the last one when the position
+ * is past the end. `steps`, if provided, gets the index page and entry used
+ * on every level.
+ */
+static int index_find(rlite *db, rl_list *list, long position, rl_list_index_step *steps, long *_number, long *_pos)
+{
+	rl_list_index_node *node;
+	void *_node;
+	long level, i, pos = 0, number = list->index;
+	int retval = RL_OK;
+	for (level = 0; level < list->index_height; level++) {
+		RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_index, number, NULL, &_node, 1);
+		node = _node;
+		for (i = 0; i < node->size - 1; i++) {
+			if (position < pos + node->counts[i]) {
+				break;
+			}
+			pos += node->counts[i];
+		}
+		if (steps) {
+			steps[level].page = number;
+			steps[level].slot = i;
+			steps[level].node = node;
+		}
+		number = node->children[i];
+	}
+	*_number = number;
+	if (_pos) {
+		*_pos = pos;
+	}
+	retval = RL_OK;
+cleanup:
+	return retval;
+}
+
+/**
+ * Updates the element count of the list node holding `position`.
+ */
+static int index_add(rlite *db, rl_list *list, long position, long delta)
+{
+	rl_list_index_step *steps = NULL;
+	long level, number;
+	int retval = RL_OK;
+	if (!list->index) {
+		goto cleanup;
+	}
+	RL_MALLOC(steps, sizeof(*steps) * list->index_height);
+	RL_CALL(index_find, RL_OK, db, list, position, steps, &number, NULL);
+	for (level = 0; level < list->index_height; level++) {
+		steps[level].node->counts[steps[level].slot] += delta;
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_list_index, steps[level].page, steps[level].node);
+	}
+cleanup:
+	rl_free(steps);
+	return retval;
+}
+
+/**
+ * Adds the list node `child` with `count` elements right after the list node
+ * holding `position`, splitting index pages that overflow.
+ */
+static int index_insert(rlite *db, rl_list *list, long position, long child, long count)
+{
+	rl_list_index_step *steps = NULL;
+	rl_list_index_node *node, *new_node, *parent;
+	long level, i, number, new_page, new_count, max_size = INDEX_NODE_MAX_SIZE(db);
+	int retval = RL_OK;
+	RL_MALLOC(steps, sizeof(*steps) * list->index_height);
+	RL_CALL(index_find, RL_OK, db, list, position, steps, &number, NULL);
+	for (level = 0; level < list->index_height - 1; level++) {
+		steps[level].node->counts[steps[level].slot] += count;
+	}
+	index_node_insert(steps[level].node, steps[level].slot + 1, child, count);
+	for (; level >= 0; level--) {
+		node = steps[level].node;
+		if (node->size > max_size) {
+			RL_CALL(index_node_create, RL_OK, db, &new_node);
+			new_node->size = node->size / 2;
+			node->size -= new_node->size;
+			memcpy(new_node->children, &node->children[node->size], sizeof(long) * new_node->size);
+			memcpy(new_node->counts, &node->counts[node->size], sizeof(long) * new_node->size);
+			new_count = 0;
+			for (i = 0; i < new_node->size; i++) {
+				new_count += new_node->counts[i];
+			}
+			new_page = db->next_empty_page;
+			RL_CALL(rl_write, RL_OK, db, &rl_data_type_list_index, new_page, new_node);
+			if (level > 0) {
+				parent = steps[level - 1].node;
+				parent->counts[steps[level - 1].slot] -= new_count;
+				index_node_insert(parent, steps[level - 1].slot + 1, new_page, new_count);
+			}
+			else {
+				// the root was split, the index grows one level
+				RL_CALL(index_node_create, RL_OK, db, &new_node);
+				new_node->size = 2;
+				new_node->children[0] = steps[0].page;
+				new_node->children[1] = new_page;
+				new_node->counts[0] = 0;
+				for (i = 0; i < node->size; i++) {
+					new_node->counts[0] += node->counts[i];
+				}
+				new_node->counts[1] = new_count;
+				list->index = db->next_empty_page;
+				list->index_height++;
+				RL_CALL(rl_write, RL_OK, db, &rl_data_type_list_index, list->index, new_node);
+			}
+		}
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_list_index, steps[level].page, node);
+	}
+cleanup:
+	rl_free(steps);
+	return retval;
+}
+
+/**
+ * Drops the list node holding `position` from the index, merging index pages
+ * that fit together and removing levels (or the whole index) that are no
+ * longer needed.
+ */
+static int index_remove(rlite *db, rl_list *list, long position)
+{
+	rl_list_index_step *steps = NULL;
+	rl_list_index_node *node, *sibling, *parent;
+	void *_node;
+	long level, slot, count, number, max_size = INDEX_NODE_MAX_SIZE(db);
+	int retval = RL_OK;
+	if (!list->index) {
+		goto cleanup;
+	}
+	RL_MALLOC(steps, sizeof(*steps) * list->index_height);
+	RL_CALL(index_find, RL_OK, db, list, position, steps, &number, NULL);
+	level = list->index_height - 1;
+	count = steps[level].node->counts[steps[level].slot];
+	for (slot = 0; slot < level; slot++) {
+		steps[slot].node->counts[steps[slot].slot] -= count;
+	}
+	index_node_remove(steps[level].node, steps[level].slot);
+	for (; level > 0; level--) {
+		node = steps[level].node;
+		parent = steps[level - 1].node;
+		slot = steps[level - 1].slot;
+		if (node->size == 0) {
+			index_node_remove(parent, slot);
+			RL_CALL(rl_delete, RL_OK, db, steps[level].page);
+			continue;
+		}
+		if (slot > 0) {
+			RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_index, parent->children[slot - 1], NULL, &_node, 1);
+			sibling = _node;
+			if (sibling->size + node->size <= max_size) {
+				memcpy(&sibling->children[sibling->size], node->children, sizeof(long) * node->size);
+				memcpy(&sibling->counts[sibling->size], node->counts, sizeof(long) * node->size);
+				sibling->size += node->size;
+				parent->counts[slot - 1] += parent->counts[slot];
+				index_node_remove(parent, slot);
+				RL_CALL(rl_write, RL_OK, db, &rl_data_type_list_index, parent->children[slot - 1], sibling);
+				RL_CALL(rl_delete, RL_OK, db, steps[level].page);
+				continue;
+			}
+		}
+		if (slot < parent->size - 1) {
+			number = parent->children[slot + 1];
+			RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_index, number, NULL, &_node, 1);
+			sibling = _node;
+			if (sibling->size + node->size <= max_size) {
+				memcpy(&node->children[node->size], sibling->children, sizeof(long) * sibling->size);
+				memcpy(&node->counts[node->size], sibling->counts, sizeof(long) * sibling->size);
+				node->size += sibling->size;
+				parent->counts[slot] += parent->counts[slot + 1];
+				index_node_remove(parent, slot + 1);
+				RL_CALL(rl_delete, RL_OK, db, number);
+			}
+		}
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_list_index, steps[level].page, node);
+	}
+
+	node = steps[0].node;
+	while (list->index_height > 1 && node->size == 1) {
+		number = node->children[0];
+		RL_CALL(rl_delete, RL_OK, db, list->index);
+		list->index = number;
+		list->index_height--;
+		RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_index, list->index, NULL, &_node, 1);
+		node = _node;
+	}
+	if (node->size == 1) {
+		// a single list node does not need an index
+		RL_CALL(rl_delete, RL_OK, db, list->index);
+		list->index = 0;
+		list->index_height = 0;
+	}
+	else {
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_list_index, list->index, node);
+	}
+cleanup:
+	rl_free(steps);
+	return retval;
+}
+
+/**
+ * Builds the index of a list with more than one node, one level at a time.
+ * Lists written before the index existed get one the first time they change.
+ */
+static int index_build(rlite *db, rl_list *list)
+{
+	rl_list_node *list_node;
+	rl_list_index_node *node;
+	void *_node, *tmp;
+	long *children = NULL, *counts = NULL;
+	long i, j, len = 0, alloc = 16, number = list->left, max_size = INDEX_NODE_MAX_SIZE(db);
+	int retval = RL_OK;
+	RL_MALLOC(children, sizeof(long) * alloc);
+	RL_MALLOC(counts, sizeof(long) * alloc);
+	while (number != 0) {
+		RL_CALL(rl_read, RL_FOUND, db, list->type->list_node_type, number, list, &_node, 1);
+		list_node = _node;
+		if (len == alloc) {
+			alloc *= 2;
+			RL_REALLOC(children, sizeof(long) * alloc);
+			RL_REALLOC(counts, sizeof(long) * alloc);
+		}
+		children[len] = number;
+		counts[len] = list_node->size;
+		len++;
+		number = list_node->right;
+	}
+
+	list->index_height = 0;
+	do {
+		// group the entries of this level into pages, which become the entries of the next one
+		for (i = 0, j = 0; i < len; j++) {
+			RL_CALL(index_node_create, RL_OK, db, &node);
+			for (; i < len && node->size < max_size; i++) {
+				node->children[node->size] = children[i];
+				node->counts[node->size] = counts[i];
+				node->size++;
+			}
+			children[j] = db->next_empty_page;
+			for (counts[j] = 0, number = 0; number < node->size; number++) {
+				counts[j] += node->counts[number];
+			}
+			RL_CALL(rl_write, RL_OK, db, &rl_data_type_list_index, children[j], node);
+		}
+		len = j;
+		list->index_height++;
+	} while (len > 1);
+	list->index = children[0];
+	retval = RL_OK;
+cleanup:
+	rl_free(children);
+	rl_free(counts);
+	return retval;
+}
+
+static int index_delete(rlite *db, long page, long height)
+{
+	rl_list_index_node *node;
+	void *_node;
+	long i;
+	int retval;
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_index, page, NULL, &_node, 1);
+	node = _node;
+	if (height > 1) {
+		for (i = 0; i < node->size; i++) {
+			RL_CALL(index_delete, RL_OK, db, node->children[i], height - 1);
+		}
+	}
+	RL_CALL(rl_delete, RL_OK, db, page);
+cleanup:
+	return retval;
+}
+
+static int index_pages(rlite *db, long page, long height, short *pages)
+{
+	rl_list_index_node *node;
+	void *_node;
+	long i;
+	int retval;
+	pages[page] = 1;
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_index, page, NULL, &_node, 1);
+	node = _node;
+	if (height > 1) {
+		for (i = 0; i < node->size; i++) {
+			RL_CALL(index_pages, RL_OK, db, node->children[i], height - 1, pages);
+		}
+	}
+	retval = RL_OK;
+cleanup:
+	return retval;
+}
+
+/**
+ * Checks that the index lists the nodes in `numbers` in order, with their
+ * sizes, and that every entry counts the elements below it.
+ */
+static int index_is_balanced(rlite *db, long page, long height, long *numbers, long *sizes, long len, long *position, long *count)
+{
+	rl_list_index_node *node;
+	void *_node;
+	long i, child_count;
+	int retval;
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_index, page, NULL, &_node, 1);
+	node = _node;
+	if (node->size == 0 || node->size > INDEX_NODE_MAX_SIZE(db)) {
+		fprintf(stderr, "Index page %ld has %ld entries\n", page, node->size);
+		retval = RL_INVALID_STATE;
+		goto cleanup;
+	}
+	*count = 0;
+	for (i = 0; i < node->size; i++) {
+		if (height > 1) {
+			RL_CALL(index_is_balanced, RL_OK, db, node->children[i], height - 1, numbers, sizes, len, position, &child_count);
+		}
+		else {
+			if (*position >= len || numbers[*position] != node->children[i]) {
+				fprintf(stderr, "Index points to node %ld at position %ld\n", node->children[i], *position);
+				retval = RL_INVALID_STATE;
+				goto cleanup;
+			}
+			child_count = sizes[(*position)++];
+		}
+		if (child_count != node->counts[i]) {
+			fprintf(stderr, "Index expected %ld elements in page %ld, got %ld\n", node->counts[i], node->children[i], child_count);
+			retval = RL_INVALID_STATE;
+			goto cleanup;
+		}
+		*count += child_count;
+	}
+	retval = RL_OK;
+cleanup:
+	return retval;
+}
+
 int rl_list_find_element(rlite *db, rl_list *list, void *element, void **found_element, long *position, rl_list_node **found_node, long *found_node_page)
 {
 	if (!list->type->cmp) {
@@ -201,7 +635,16 @@ static int rl_find_element_by_position(rlite *db, rl_list *list, long *position,
 		return RL_INVALID_PARAMETERS;
 	}
 	int retval = RL_OK;
-	if (*position >= 0) {
+	// both ends are one read away without the index
+	if (list->index && *position != 0 && *position != -1) {
+		if (*position < 0) {
+			*position = list->size + *position + add;
+		}
+		RL_CALL(index_find, RL_OK, db, list, *position, NULL, &number, &pos);
+		RL_CALL(rl_read, RL_FOUND, db, list->type->list_node_type, number, list, &tmp_node, 1);
+		node = tmp_node;
+	}
+	else if (*position >= 0) {
 		number = list->left;
 		while (1) {
 			RL_CALL(rl_read, RL_FOUND, db, list->type->list_node_type, number, list, &tmp_node, 1);
@@ -257,6 +700,58 @@ cleanup:
 	return retval;
 }
 
+/**
+ * Points `elements` to the `count` elements starting at `position`, reading
+ * each node once.
+ */
+int rl_list_get_elements(struct rlite *db, rl_list *list, void **elements, long position, long count)
+{
+	long pos, i = 0;
+	rl_list_node *node;
+	void *_node;
+	int retval;
+	RL_CALL(rl_find_element_by_position, RL_FOUND, db, list, &position, &pos, &node, NULL, 0);
+	if (count <= 0 || position + count > list->size) {
+		retval = RL_INVALID_PARAMETERS;
+		goto cleanup;
+	}
+	position -= pos;
+	while (1) {
+		for (; position < node->size && i < count; position++) {
+			elements[i++] = node->elements[position];
+		}
+		if (i == count) {
+			break;
+		}
+		RL_CALL(rl_read, RL_FOUND, db, list->type->list_node_type, node->right, list, &_node, 1);
+		node = _node;
+		position = 0;
+	}
+	retval = RL_FOUND;
+cleanup:
+	return retval;
+}
+
+/**
+ * Replaces the element at `position` in place, the list keeps its shape.
+ */
+int rl_list_set_element(struct rlite *db, rl_list *list, void *element, long position)
+{
+	long pos, number;
+	rl_list_node *node;
+	int retval;
+	RL_CALL(rl_find_element_by_position, RL_FOUND, db, list, &position, &pos, &node, &number, 0);
+	rl_free(node->elements[position - pos]);
+	node->elements[position - pos] = element;
+	element = NULL;
+	RL_CALL(rl_write, RL_OK, db, list->type->list_node_type, number, node);
+cleanup:
+	if (retval != RL_OK) {
+		rl_free(element);
+	}
+	return retval;
+}
+
 int rl_list_add_element(rlite *db, rl_list *list, long list_page, void *element, long position)
 {
 	rl_list_node *node, *sibling_node, *new_node, *old_node;
@@ -264,6 +759,9 @@ int rl_list_add_element(rlite *db, rl_list *list, long list_page, void *element,
 	long number, sibling_number;
 	void *_node;
 	int retval;
+	if (!list->index && list->left != list->right) {
+		RL_CALL(index_build, RL_OK, db, list);
+	}
 	RL_CALL(rl_find_element_by_position, RL_FOUND, db, list, &position, &pos, &node, &number, 1);
 
 	if (node->size != list->max_node_size) {
@@ -275,6 +773,7 @@ int rl_list_add_element(rlite *db, rl_list *list, long list_page, void *element,
 		node->size++;
 
 		RL_CALL(rl_write, RL_OK, db, list->type->list_node_type, number, node);
+		RL_CALL(index_add, RL_OK, db, list, pos, 1);
 	}
 	else {
 		if (node->left) {
@@ -294,6 +793,7 @@ int rl_list_add_element(rlite *db, rl_list *list, long list_page, void *element,
 				sibling_node->size++;
 				RL_CALL(rl_write, RL_OK, db, list->type->list_node_type, number, node);
 				RL_CALL(rl_write, RL_OK, db, list->type->list_node_type, sibling_number, sibling_node);
+				RL_CALL(index_add, RL_OK, db, list, pos - 1, 1);
 				goto succeeded;
 			}
 		}
@@ -315,6 +815,7 @@ int rl_list_add_element(rlite *db, rl_list *list, long list_page, void *element,
 				sibling_node->size++;
 				RL_CALL(rl_write, RL_OK, db, list->type->list_node_type, number, node);
 				RL_CALL(rl_write, RL_OK, db, list->type->list_node_type, sibling_number, sibling_node);
+				RL_CALL(index_add, RL_OK, db, list, pos + node->size, 1);
 				goto succeeded;
 			}
 		}
@@ -343,6 +844,12 @@ int rl_list_add_element(rlite *db, rl_list *list, long list_page, void *element,
 		else {
 			list->right = node->right;
 		}
+		if (list->index) {
+			RL_CALL(index_insert, RL_OK, db, list, pos, node->right, 1);
+		}
+		else {
+			RL_CALL(index_build, RL_OK, db, list);
+		}
 	}
 
 succeeded:
@@ -361,6 +868,9 @@ int rl_list_remove_element(rlite *db, rl_list *list, long list_page, long positi
 	long pos, number;
 	void *_node;
 	int retval;
+	if (!list->index && list->left != list->right) {
+		RL_CALL(index_build, RL_OK, db, list);
+	}
 	RL_CALL(rl_find_element_by_position, RL_FOUND, db, list, &position, &pos, &node, &number, 0);
 
 	if (node->size - (position - pos + 1) > 0) {
@@ -390,6 +900,7 @@ int rl_list_remove_element(rlite *db, rl_list *list, long list_page, long positi
 			RL_CALL(rl_write, RL_OK, db, list->type->list_node_type, node->right, sibling_node);
 		}
 		RL_CALL(rl_delete, RL_OK, db, number);
+		RL_CALL(index_remove, RL_OK, db, list, pos);
 	}
 	else {
 		if (node->left) {
@@ -409,6 +920,8 @@ int rl_list_remove_element(rlite *db, rl_list *list, long list_page, long positi
 				else {
 					list->right = node->left;
 				}
+				RL_CALL(index_add, RL_OK, db, list, pos - 1, node->size);
+				RL_CALL(index_remove, RL_OK, db, list, pos + node->size);
 				// don't rl_free each element
 				rl_free(node->elements);
 				node->elements = NULL;
@@ -435,6 +948,8 @@ int rl_list_remove_element(rlite *db, rl_list *list, long list_page, long positi
 				else {
 					list->left = node->right;
 				}
+				RL_CALL(index_add, RL_OK, db, list, pos + node->size + 1, node->size);
+				RL_CALL(index_remove, RL_OK, db, list, pos);
 				// don't rl_free each element
 				rl_free(node->elements);
 				node->elements = NULL;
@@ -444,6 +959,7 @@ int rl_list_remove_element(rlite *db, rl_list *list, long list_page, long positi
 			}
 		}
 		RL_CALL(rl_write, RL_OK, db, list->type->list_node_type, number, node);
+		RL_CALL(index_add, RL_OK, db, list, pos, -1);
 	}
 succeeded:
 	retval = RL_OK;
@@ -468,8 +984,13 @@ int rl_list_is_balanced(rlite *db, rl_list *list)
 	int retval = RL_OK;
 	long *left = NULL;
 	long *right = NULL;
+	long *numbers = NULL;
+	long *sizes = NULL;
+	long index_position = 0, index_count;
 	RL_MALLOC(right, sizeof(long) * max_node);
 	RL_MALLOC(left, sizeof(long) * max_node);
+	RL_MALLOC(numbers, sizeof(long) * max_node);
+	RL_MALLOC(sizes, sizeof(long) * max_node);
 	rl_list_node *node;
 	void *_node;
 	while (number != 0) {
@@ -478,6 +999,8 @@ int rl_list_is_balanced(rlite *db, rl_list *list)
 		size += node->size;
 		left[i] = node->left;
 		right[i] = node->right;
+		numbers[i] = number;
+		sizes[i] = node->size;
 		if (i != 0) {
 			if (node->size + prev_size < list->max_node_size) {
 				fprintf(stderr, "Two continous node could be merged\n");
@@ -506,6 +1029,20 @@ int rl_list_is_balanced(rlite *db, rl_list *list)
 		goto cleanup;
 	}
 
+	if (list->index) {
+		RL_CALL(index_is_balanced, RL_OK, db, list->index, list->index_height, numbers, sizes, i, &index_position, &index_count);
+		if (index_position != i || index_count != list->size) {
+			fprintf(stderr, "Index covers %ld nodes and %ld elements, expected %ld and %ld\n", index_position, index_count, i, list->size);
+			retval = RL_INVALID_STATE;
+			goto cleanup;
+		}
+	}
+	else if (i > 1) {
+		fprintf(stderr, "List with %ld nodes has no index\n", i);
+		retval = RL_INVALID_STATE;
+		goto cleanup;
+	}
+
 	i = 0;
 	retval = rl_list_iterator_create(db, &iterator, list, 1);
 	while ((retval = rl_list_iterator_next(iterator, NULL)) == RL_OK) {
@@ -538,6 +1075,8 @@ int rl_list_is_balanced(rlite *db, rl_list *list)
 cleanup:
 	rl_free(right);
 	rl_free(left);
+	rl_free(numbers);
+	rl_free(sizes);
 	return retval;
 }
 
@@ -671,6 +1210,9 @@ int rl_list_pages(struct rlite *db, rl_list *list, short *pages)
 	void *_node;
 	long number = list->left;
 	int retval = RL_OK;
+	if (list->index) {
+		RL_CALL(index_pages, RL_OK, db, list->index, list->index_height, pages);
+	}
 	pages[number] = 1;
 	while (number != 0) {
 		RL_CALL(rl_read, RL_FOUND, db, list->type->list_node_type, number, list, &_node, 1);
@@ -691,6 +1233,9 @@ int rl_list_delete(struct rlite *db, rl_list *list)
 	void *_node;
 	long number = list->left, new_number;
 	int retval = RL_OK;
+	if (list->index) {
+		RL_CALL(index_delete, RL_OK, db, list->index, list->index_height);
+	}
 	while (number != 0) {
 		RL_CALL(rl_read, RL_FOUND, db, list->type->list_node_type, number, list, &_node, 1);
 		node = _node;
@@ -7,6 +7,97 @@
 #include "rlite/page_multi_string.h"
 #include "rlite/util.h"
 
+#define INLINE_HEADER_SIZE 8
+#define INLINE_MAX_SIZE(db) ((db)->page_size - INLINE_HEADER_SIZE)
+// no list has its first node in page 0
+#define IS_INLINE(list) ((list)->left == 0)
+
+/**
+ * A string short enough to live in the multi string page itself, instead of
+ * a list with its length and the pages holding its data.
+ */
+typedef struct {
+	rl_list list;
+	long size;
+	unsigned char *data;
+} rl_multi_string_inline;
+
+rl_list_type rl_list_type_multi_string = {
+	&rl_data_type_multi_string,
+	&rl_data_type_list_node_long,
+	sizeof(long),
+	long_cmp,
+#ifdef RL_DEBUG
+	long_formatter,
+#endif
+};
+
+int rl_multi_string_serialize(struct rlite *db, void *obj, unsigned char *data)
+{
+	rl_multi_string_inline *str = obj;
+	if (!IS_INLINE(&str->list)) {
+		return rl_list_serialize(db, obj, data);
+	}
+	put_4bytes(data, 0);
+	put_4bytes(&data[4], str->size);
+	memcpy(&data[INLINE_HEADER_SIZE], str->data, sizeof(unsigned char) * str->size);
+	return RL_OK;
+}
+
+static int inline_create(const unsigned char *data, long size, rl_multi_string_inline **_str)
+{
+	int retval = RL_OK;
+	rl_multi_string_inline *str;
+	RL_MALLOC(str, sizeof(*str));
+	str->list.max_node_size = 0;
+	str->list.size = 0;
+	str->list.type = &rl_list_type_multi_string;
+	str->list.left = str->list.right = 0;
+	str->list.index = str->list.index_height = 0;
+	str->size = size;
+	str->data = rl_malloc(sizeof(unsigned char) * (size + 1));
+	if (!str->data) {
+		rl_free(str);
+		retval = RL_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+	if (size > 0) {
+		memcpy(str->data, data, sizeof(unsigned char) * size);
+	}
+	*_str = str;
+cleanup:
+	return retval;
+}
+
+int rl_multi_string_deserialize(struct rlite *db, void **obj, void *UNUSED(context), unsigned char *data)
+{
+	if (get_4bytes(data) != 0) {
+		return rl_list_deserialize(db, obj, &rl_list_type_multi_string, data);
+	}
+	return inline_create(&data[INLINE_HEADER_SIZE], get_4bytes(&data[4]), (rl_multi_string_inline **)obj);
+}
+
+int rl_multi_string_destroy(struct rlite *UNUSED(db), void *obj)
+{
+	rl_multi_string_inline *str = obj;
+	if (IS_INLINE(&str->list)) {
+		rl_free(str->data);
+	}
+	rl_free(str);
+	return RL_OK;
+}
+
+static int read_head(struct rlite *db, long number, rl_list **list, int cache)
+{
+	void *tmp;
+	int retval;
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_multi_string, number, &rl_list_type_multi_string, &tmp, cache);
+	*list = tmp;
+	retval = RL_OK;
+cleanup:
+	return retval;
+}
+
 int rl_normalize_string_range(long totalsize, long *start, long *stop)
 {
 	if (*start < 0) {
@@ -34,14 +125,24 @@ int rl_multi_string_cmp(struct rlite *db, long p1, long p2, int *cmp)
 {
 	rl_list *list1 = NULL, *list2 = NULL;
 	rl_list_node *node1 = NULL, *node2 = NULL;
-	void *_list, *_node;
+	void *_node;
 	unsigned char *str1, *str2;
+	rl_multi_string_inline *str;
 
 	int retval;
-	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, p1, &rl_list_type_long, &_list, 0);
-	list1 = _list;
-	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, p2, &rl_list_type_long, &_list, 0);
-	list2 = _list;
+	RL_CALL(read_head, RL_OK, db, p1, &list1, 0);
+	RL_CALL(read_head, RL_OK, db, p2, &list2, 0);
+	if (IS_INLINE(list1)) {
+		str = (rl_multi_string_inline *)list1;
+		RL_CALL(rl_multi_string_cmp_str, RL_OK, db, p2, str->data, str->size, cmp);
+		*cmp = -*cmp;
+		goto cleanup;
+	}
+	if (IS_INLINE(list2)) {
+		str = (rl_multi_string_inline *)list2;
+		RL_CALL(rl_multi_string_cmp_str, RL_OK, db, p1, str->data, str->size, cmp);
+		goto cleanup;
+	}
 
 	long node_number1 = list1->left, node_number2 = list2->left, i;
 	int first = 1;
@@ -97,8 +198,12 @@ int rl_multi_string_cmp(struct rlite *db, long p1, long p2, int *cmp)
 		node1 = node2 = NULL;
 	}
 cleanup:
-	rl_list_nocache_destroy(db, list1);
-	rl_list_nocache_destroy(db, list2);
+	if (list1) {
+		rl_multi_string_destroy(db, list1);
+	}
+	if (list2) {
+		rl_multi_string_destroy(db, list2);
+	}
 	if (node1) {
 		rl_list_node_nocache_destroy(db, node1);
 	}
@@ -112,18 +217,31 @@ int rl_multi_string_cmp_str(struct rlite *db, long p1, unsigned char *str, long
 {
 	rl_list *list1 = NULL;
 	rl_list_node *node1 = NULL;
-	void *_list, *_node;
+	void *_node;
 	unsigned char *str1;
+	rl_multi_string_inline *str_inline;
 
 	int retval;
-	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, p1, &rl_list_type_long, &_list, 0);
-	list1 = _list;
+	RL_CALL(read_head, RL_OK, db, p1, &list1, 0);
 
 	long node_number1 = list1->left, i, pos = 0;
 	int first = 1;
 	long cmplen;
 	long stored_length = 0;
 	*cmp = 0;
+	if (IS_INLINE(list1)) {
+		str_inline = (rl_multi_string_inline *)list1;
+		cmplen = str_inline->size < len ? str_inline->size : len;
+		*cmp = cmplen > 0 ? memcmp(str_inline->data, str, cmplen) : 0;
+		if (*cmp == 0) {
+			*cmp = str_inline->size == len ? 0 : (str_inline->size > len ? 1 : -1);
+		}
+		else {
+			*cmp = *cmp < 0 ? -1 : 1;
+		}
+		retval = RL_OK;
+		goto cleanup;
+	}
 	do {
 		if (node_number1 == 0) {
 			*cmp = len == 0 ? 0 : -1;
@@ -168,7 +286,9 @@ int rl_multi_string_cmp_str(struct rlite *db, long p1, unsigned char *str, long
 	while (len > pos);
 	retval = RL_OK;
 cleanup:
-	rl_list_nocache_destroy(db, list1);
+	if (list1) {
+		rl_multi_string_destroy(db, list1);
+	}
 	if (node1) {
 		rl_list_node_nocache_destroy(db, node1);
 	}
@@ -200,6 +320,53 @@ cleanup:
 	return retval;
 }
 
+/**
+ * Stores `data` in `*number` as a list of its length followed by its pages.
+ * A `*number` of 0 gets a new page.
+ */
+static int list_set(struct rlite *db, long *number, const unsigned char *data, long size)
+{
+	int retval;
+	long *page = NULL;
+	rl_list *list = NULL;
+	RL_CALL(rl_list_create, RL_OK, db, &list, &rl_list_type_multi_string);
+	if (*number == 0) {
+		*number = db->next_empty_page;
+	}
+	RL_CALL(rl_write, RL_OK, db, &rl_data_type_multi_string, *number, list);
+	RL_MALLOC(page, sizeof(*page));
+	*page = size;
+	RL_CALL(rl_list_add_element, RL_OK, db, list, *number, page, -1);
+	page = NULL;
+	RL_CALL(append, RL_OK, db, list, *number, data, size);
+cleanup:
+	rl_free(page);
+	return retval;
+}
+
+/**
+ * Replaces the contents of an inline string, moving it to a list if they do
+ * not fit in the page anymore.
+ */
+static int inline_update(struct rlite *db, long number, rl_multi_string_inline *str, unsigned char *data, long size)
+{
+	int retval;
+	if (size <= INLINE_MAX_SIZE(db)) {
+		rl_free(str->data);
+		str->data = data;
+		str->size = size;
+		data = NULL;
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_multi_string, number, str);
+	}
+	else {
+		RL_CALL(list_set, RL_OK, db, &number, data, size);
+	}
+	retval = RL_OK;
+cleanup:
+	rl_free(data);
+	return retval;
+}
+
 int rl_multi_string_append(struct rlite *db, long number, const unsigned char *data, long datasize, long *newlength)
 {
 	rl_list *list = NULL;
@@ -208,16 +375,26 @@ int rl_multi_string_append(struct rlite *db, long number, const unsigned char *d
 	int retval;
 	long size, cpsize;
 	long string_page_number;
-
-	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, number, &rl_list_type_long, &tmp, 0);
-	list = tmp;
+	rl_multi_string_inline *str;
+
+	RL_CALL(read_head, RL_OK, db, number, &list, 1);
+	if (IS_INLINE(list)) {
+		str = (rl_multi_string_inline *)list;
+		RL_MALLOC(tmp_data, sizeof(unsigned char) * (str->size + datasize + 1));
+		memcpy(tmp_data, str->data, sizeof(unsigned char) * str->size);
+		memcpy(&tmp_data[str->size], data, sizeof(unsigned char) * datasize);
+		if (newlength) {
+			*newlength = str->size + datasize;
+		}
+		RL_CALL(inline_update, RL_OK, db, number, str, tmp_data, str->size + datasize);
+		goto cleanup;
+	}
 
 	RL_CALL(rl_list_get_element, RL_FOUND, db, list, &tmp, 0);
 	size = *(long *)tmp;
 	RL_MALLOC(tmp, sizeof(long));
 	*(long *)tmp = size + datasize;
-	RL_CALL(rl_list_add_element, RL_OK, db, list, number, tmp, 0);
-	RL_CALL(rl_list_remove_element, RL_OK, db, list, number, 1);
+	RL_CALL(rl_list_set_element, RL_OK, db, list, tmp, 0);
 	if (newlength) {
 		*newlength = size + datasize;
 	}
@@ -247,21 +424,54 @@ cleanup:
 	return retval;
 }
 
+/**
+ * Copies `size` bytes from `start` out of a string stored as a list. Every
+ * page but the last one is full, so the pages holding the range follow from
+ * the offsets and are fetched in a single pass over the list.
+ */
+static int list_copy(struct rlite *db, rl_list *list, unsigned char *data, long start, long size)
+{
+	void **pages = NULL;
+	unsigned char *page_data;
+	long i, count, first = start / db->page_size, pos = 0, pagesize, pagestart = start % db->page_size;
+	int retval;
+	count = (start + size - 1) / db->page_size - first + 1;
+	RL_MALLOC(pages, sizeof(void *) * count);
+	// the first element in the list is the length of the string, its pages follow
+	RL_CALL(rl_list_get_elements, RL_FOUND, db, list, pages, first + 1, count);
+	for (i = 0; i < count; i++) {
+		RL_CALL(rl_string_get, RL_OK, db, &page_data, *(long *)pages[i]);
+		pagesize = db->page_size - pagestart;
+		if (pos + pagesize > size) {
+			pagesize = size - pos;
+		}
+		memcpy(&data[pos], &page_data[pagestart], sizeof(unsigned char) * pagesize);
+		pos += pagesize;
+		pagestart = 0;
+	}
+	retval = RL_OK;
+cleanup:
+	rl_free(pages);
+	return retval;
+}
+
 int rl_multi_string_cpyrange(struct rlite *db, long number, unsigned char *data, long *_size, long start, long stop)
 {
 	long totalsize;
 	rl_list *list = NULL;
 	rl_list_node *node = NULL;
-	void *_list, *tmp;
+	void *tmp;
 	int retval;
-	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, number, &rl_list_type_long, &_list, 0);
-	list = _list;
-	unsigned char *tmp_data;
-	long i, pos = 0, pagesize, pagestart;
+	RL_CALL(read_head, RL_OK, db, number, &list, 0);
 	long size;
 
-	RL_CALL(rl_list_get_element, RL_FOUND, db, list, &tmp, 0);
-	totalsize = *(long *)tmp;
+	if (IS_INLINE(list)) {
+		totalsize = ((rl_multi_string_inline *)list)->size;
+	}
+	else {
+		RL_CALL(rl_list_get_element, RL_FOUND, db, list, &tmp, 0);
+		totalsize = *(long *)tmp;
+	}
 	if (totalsize == 0) {
 		if (_size) {
 			*_size = 0;
@@ -281,26 +491,16 @@ int rl_multi_string_cpyrange(struct rlite *db, long number, unsigned char *data,
 	if (_size) {
 		*_size = size;
 	}
-
-	i = start / db->page_size;
-	pagestart = start % db->page_size;
-	// pos = i * db->page_size + pagestart;
-	// the first element in the list is the length of the array, skip to the second
-	for (i++; i < list->size; i++) {
-		RL_CALL(rl_list_get_element, RL_FOUND, db, list, &tmp, i);
-		RL_CALL(rl_string_get, RL_OK, db, &tmp_data, *(long *)tmp);
-		pagesize = db->page_size - pagestart;
-		if (pos + pagesize > size) {
-			pagesize = size - pos;
-		}
-		memcpy(&data[pos], &tmp_data[pagestart], sizeof(unsigned char) * pagesize);
-		pos += pagesize;
-		pagestart = 0;
+	if (IS_INLINE(list)) {
+		memcpy(data, &((rl_multi_string_inline *)list)->data[start], sizeof(unsigned char) * size);
+		retval = RL_OK;
+		goto cleanup;
 	}
-	retval = RL_OK;
+
+	RL_CALL(list_copy, RL_OK, db, list, data, start, size);
 cleanup:
 	if (list) {
-		rl_list_nocache_destroy(db, list);
+		rl_multi_string_destroy(db, list);
 	}
 	if (node) {
 		rl_list_node_nocache_destroy(db, node);
@@ -313,16 +513,18 @@ int rl_multi_string_getrange(struct rlite *db, long number, unsigned char **_dat
 	long totalsize;
 	rl_list *list = NULL;
 	rl_list_node *node = NULL;
-	void *_list, *tmp;
+	void *tmp;
 	unsigned char *data = NULL;
 	int retval;
-	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, number, &rl_list_type_long, &_list, 0);
-	list = _list;
-	unsigned char *tmp_data;
-	long i, pos = 0, pagesize, pagestart;
+	RL_CALL(read_head, RL_OK, db, number, &list, 0);
 
-	RL_CALL(rl_list_get_element, RL_FOUND, db, list, &tmp, 0);
-	totalsize = *(long *)tmp;
+	if (IS_INLINE(list)) {
+		totalsize = ((rl_multi_string_inline *)list)->size;
+	}
+	else {
+		RL_CALL(rl_list_get_element, RL_FOUND, db, list, &tmp, 0);
+		totalsize = *(long *)tmp;
+	}
 	if (totalsize == 0) {
 		*size = 0;
 		if (_data) {
@@ -347,22 +549,15 @@ int rl_multi_string_getrange(struct rlite *db, long number, unsigned char **_dat
 	}
 
 	RL_MALLOC(data, sizeof(unsigned char) * (*size + 1));
-
-	i = start / db->page_size;
-	pagestart = start % db->page_size;
-	// pos = i * db->page_size + pagestart;
-	// the first element in the list is the length of the array, skip to the second
-	for (i++; i < list->size; i++) {
-		RL_CALL(rl_list_get_element, RL_FOUND, db, list, &tmp, i);
-		RL_CALL(rl_string_get, RL_OK, db, &tmp_data, *(long *)tmp);
-		pagesize = db->page_size - pagestart;
-		if (pos + pagesize > *size) {
-			pagesize = *size - pos;
-		}
-		memcpy(&data[pos], &tmp_data[pagestart], sizeof(unsigned char) * pagesize);
-		pos += pagesize;
-		pagestart = 0;
+	if (IS_INLINE(list)) {
+		memcpy(data, &((rl_multi_string_inline *)list)->data[start], sizeof(unsigned char) * *size);
+		data[*size] = 0;
+		*_data = data;
+		retval = RL_OK;
+		goto cleanup;
 	}
+
+	RL_CALL(list_copy, RL_OK, db, list, data, start, *size);
 	data[*size] = 0;
 	*_data = data;
 	retval = RL_OK;
@@ -371,7 +566,7 @@ cleanup:
 		rl_free(data);
 	}
 	if (list) {
-		rl_list_nocache_destroy(db, list);
+		rl_multi_string_destroy(db, list);
 	}
 	if (node) {
 		rl_list_node_nocache_destroy(db, node);
@@ -392,16 +587,16 @@ int rl_multi_string_cpy(struct rlite *db, long number, unsigned char *data, long
 int rl_multi_string_set(struct rlite *db, long *number, const unsigned char *data, long size)
 {
 	int retval;
-	long *page = NULL;
-	rl_list *list = NULL;
-	RL_CALL(rl_list_create, RL_OK, db, &list, &rl_list_type_long);
-	*number = db->next_empty_page;
-	RL_CALL(rl_write, RL_OK, db, &rl_data_type_list_long, *number, list);
-	RL_MALLOC(page, sizeof(*page));
-	*page = size;
-	RL_CALL(rl_list_add_element, RL_OK, db, list, *number, page, -1);
-	page = NULL;
-	RL_CALL(append, RL_OK, db, list, *number, data, size);
+	rl_multi_string_inline *str;
+	if (size <= INLINE_MAX_SIZE(db)) {
+		RL_CALL(inline_create, RL_OK, data, size, &str);
+		*number = db->next_empty_page;
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_multi_string, *number, str);
+	}
+	else {
+		*number = 0;
+		RL_CALL(list_set, RL_OK, db, number, data, size);
+	}
 cleanup:
 	return retval;
 }
@@ -409,16 +604,31 @@ int rl_multi_string_setrange(struct rlite *db, long number, const unsigned char
 {
 	long oldsize, newsize;
 	rl_list *list = NULL;
-	void *_list, *tmp;
+	void *tmp, **pages = NULL;
 	int retval;
-	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, number, &rl_list_type_long, &_list, 1);
-	list = _list;
+	RL_CALL(read_head, RL_OK, db, number, &list, 1);
 	unsigned char *tmp_data;
-	long i, pagesize, pagestart, page;
+	long i, count, pagesize, pagestart, page;
+	rl_multi_string_inline *str;
 	if (offset < 0) {
 		retval = RL_INVALID_PARAMETERS;
 		goto cleanup;
 	}
+	if (IS_INLINE(list)) {
+		str = (rl_multi_string_inline *)list;
+		newsize = offset + size > str->size ? offset + size : str->size;
+		RL_MALLOC(tmp_data, sizeof(unsigned char) * (newsize + 1));
+		memcpy(tmp_data, str->data, sizeof(unsigned char) * str->size);
+		if (offset > str->size) {
+			memset(&tmp_data[str->size], 0, offset - str->size);
+		}
+		memcpy(&tmp_data[offset], data, sizeof(unsigned char) * size);
+		if (newlength) {
+			*newlength = newsize;
+		}
+		RL_CALL(inline_update, RL_OK, db, number, str, tmp_data, newsize);
+		goto cleanup;
+	}
 
 	RL_CALL(rl_list_get_element, RL_FOUND, db, list, &tmp, 0);
 	oldsize = *(long *)tmp;
@@ -431,15 +641,22 @@ int rl_multi_string_setrange(struct rlite *db, long number, const unsigned char
 			newsize = (list->size - 1) * db->page_size;
 		}
 		if (newsize > oldsize) {
-			RL_CALL(rl_list_remove_element, RL_OK, db, list, number, 0);
 			RL_MALLOC(tmp, sizeof(long));
 			*(long *)tmp = newsize;
-			RL_CALL(rl_list_add_element, RL_OK, db, list, number, tmp, 0);
+			RL_CALL(rl_list_set_element, RL_OK, db, list, tmp, 0);
 		}
 
-		for (i++; size > 0 && i < list->size; i++) {
-			RL_CALL(rl_list_get_element, RL_FOUND, db, list, &tmp, i);
-			page = *(long *)tmp;
+		// pages from the one holding the offset to the last one written or the end of the string
+		count = size > 0 ? (offset + size - 1) / db->page_size - i + 1 : 0;
+		if (count > list->size - 1 - i) {
+			count = list->size - 1 - i;
+		}
+		if (count > 0) {
+			RL_MALLOC(pages, sizeof(void *) * count);
+			RL_CALL(rl_list_get_elements, RL_FOUND, db, list, pages, i + 1, count);
+		}
+		for (i = 0; i < count; i++) {
+			page = *(long *)pages[i];
 			RL_CALL(rl_string_get, RL_OK, db, &tmp_data, page);
 			pagesize = db->page_size - pagestart;
 			if (pagesize > size) {
@@ -474,6 +691,7 @@ int rl_multi_string_setrange(struct rlite *db, long number, const unsigned char
 	}
 	retval = RL_OK;
 cleanup:
+	rl_free(pages);
 	return retval;
 }
 
@@ -486,11 +704,17 @@ int rl_multi_string_sha1(struct rlite *db, unsigned char digest[20], long number
 	SHA1Init(&sha);
 
 	void *tmp;
-	rl_list *list;
+	rl_list *list = NULL;
 	rl_list_iterator *iterator = NULL;
 	int retval;
-	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, number, &rl_list_type_long, &tmp, 0);
-	list = tmp;
+	RL_CALL(read_head, RL_OK, db, number, &list, 0);
+	if (IS_INLINE(list)) {
+		SHA1Update(&sha, ((rl_multi_string_inline *)list)->data, ((rl_multi_string_inline *)list)->size);
+		rl_multi_string_destroy(db, list);
+		SHA1Final(digest, &sha);
+		retval = RL_OK;
+		goto cleanup;
+	}
 
 	RL_CALL(rl_list_iterator_create, RL_OK, db, &iterator, list, 1);
 
@@ -527,11 +751,15 @@ cleanup:
 int rl_multi_string_pages(struct rlite *db, long page, short *pages)
 {
 	void *tmp;
-	rl_list *list;
+	rl_list *list = NULL;
 	rl_list_iterator *iterator = NULL;
 	int retval;
-	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, page, &rl_list_type_long, &tmp, 0);
-	list = tmp;
+	RL_CALL(read_head, RL_OK, db, page, &list, 0);
+	if (IS_INLINE(list)) {
+		rl_multi_string_destroy(db, list);
+		retval = RL_OK;
+		goto cleanup;
+	}
 
 	RL_CALL(rl_list_pages, RL_OK, db, list, pages);
 	RL_CALL(rl_list_iterator_create, RL_OK, db, &iterator, list, 1);
@@ -565,11 +793,14 @@ cleanup:
 int rl_multi_string_delete(struct rlite *db, long page)
 {
 	void *tmp;
-	rl_list *list;
+	rl_list *list = NULL;
 	rl_list_iterator *iterator = NULL;
 	int retval;
-	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, page, &rl_list_type_long, &tmp, 1);
-	list = tmp;
+	RL_CALL(read_head, RL_OK, db, page, &list, 1);
+	if (IS_INLINE(list)) {
+		RL_CALL(rl_delete, RL_OK, db, page);
+		goto cleanup;
+	}
 
 	RL_CALL(rl_list_iterator_create, RL_OK, db, &iterator, list, 1);
 
@@ -4,6 +4,9 @@
 #include "rlite/page_multi_string.h"
 #include "rlite/util.h"
 
+// bytes used by a node in its page, including its slot's level count
+#define NODE_SIZE(levels) (17 + 8 * (levels))
+
 static int rl_skiplist_random_level()
 {
 	int level = 1;
@@ -13,6 +16,117 @@ static int rl_skiplist_random_level()
 	return (level < RL_SKIPLIST_MAXLEVEL) ? level : RL_SKIPLIST_MAXLEVEL;
 }
 
+static int node_page_bytes(rl_skiplist_node_page *page)
+{
+	int i, bytes = RL_SKIPLIST_NODES_PER_PAGE;
+	for (i = 0; i < RL_SKIPLIST_NODES_PER_PAGE; i++) {
+		if (page->nodes[i]) {
+			bytes += NODE_SIZE(page->nodes[i]->num_levels);
+		}
+	}
+	return bytes;
+}
+
+static long node_page_number(rl_skiplist *skiplist, long node)
+{
+	return skiplist->packed ? RL_SKIPLIST_NODE_PAGE(node) : node;
+}
+
+static int read_node(rlite *db, rl_skiplist *skiplist, long node, void **obj)
+{
+	void *tmp;
+	rl_skiplist_node_page *page;
+	int retval;
+	if (!skiplist->packed) {
+		return rl_read(db, &rl_data_type_skiplist_single_node, node, skiplist, obj, 1);
+	}
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_skiplist_node, RL_SKIPLIST_NODE_PAGE(node), skiplist, &tmp, 1);
+	page = tmp;
+	*obj = page->nodes[RL_SKIPLIST_NODE_SLOT(node)];
+	if (!*obj) {
+		fprintf(stderr, "Skiplist node %ld not found\n", node);
+		retval = RL_UNEXPECTED;
+		goto cleanup;
+	}
+	retval = RL_FOUND;
+cleanup:
+	return retval;
+}
+
+static int write_node(rlite *db, rl_skiplist *skiplist, long node)
+{
+	void *tmp;
+	rl_data_type *type = skiplist->packed ? &rl_data_type_skiplist_node : &rl_data_type_skiplist_single_node;
+	int retval;
+	RL_CALL(rl_read, RL_FOUND, db, type, node_page_number(skiplist, node), skiplist, &tmp, 1);
+	RL_CALL(rl_write, RL_OK, db, type, node_page_number(skiplist, node), tmp);
+cleanup:
+	return retval;
+}
+
+/**
+ * Stores a new node in the same page as `near` if it has room for it,
+ * otherwise in a new page. Keeping neighbours together lets range scans
+ * read each page once for many nodes.
+ */
+static int add_node(rlite *db, rl_skiplist *skiplist, long near, rl_skiplist_node *node, long *_node_ref)
+{
+	void *tmp;
+	rl_skiplist_node_page *page = NULL;
+	long page_number, slot;
+	int retval;
+	if (!skiplist->packed) {
+		*_node_ref = db->next_empty_page;
+		return rl_write(db, &rl_data_type_skiplist_single_node, *_node_ref, node);
+	}
+	if (near) {
+		page_number = RL_SKIPLIST_NODE_PAGE(near);
+		RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_skiplist_node, page_number, skiplist, &tmp, 1);
+		page = tmp;
+		if (page->size < RL_SKIPLIST_NODES_PER_PAGE && node_page_bytes(page) + NODE_SIZE(node->num_levels) <= db->page_size) {
+			for (slot = 0; page->nodes[slot]; slot++);
+			page->nodes[slot] = node;
+			page->size++;
+			RL_CALL(rl_write, RL_OK, db, &rl_data_type_skiplist_node, page_number, page);
+			*_node_ref = RL_SKIPLIST_NODE(page_number, slot);
+			retval = RL_OK;
+			goto cleanup;
+		}
+	}
+	RL_CALL(rl_skiplist_node_page_create, RL_OK, db, &page);
+	page->nodes[0] = node;
+	page->size = 1;
+	page_number = db->next_empty_page;
+	RL_CALL(rl_write, RL_OK, db, &rl_data_type_skiplist_node, page_number, page);
+	*_node_ref = RL_SKIPLIST_NODE(page_number, 0);
+	retval = RL_OK;
+cleanup:
+	return retval;
+}
+
+static int remove_node(rlite *db, rl_skiplist *skiplist, long node)
+{
+	void *tmp;
+	rl_skiplist_node_page *page;
+	long page_number = RL_SKIPLIST_NODE_PAGE(node);
+	int retval;
+	if (!skiplist->packed) {
+		return rl_delete(db, node);
+	}
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_skiplist_node, page_number, skiplist, &tmp, 1);
+	page = tmp;
+	rl_skiplist_node_destroy(db, page->nodes[RL_SKIPLIST_NODE_SLOT(node)]);
+	page->nodes[RL_SKIPLIST_NODE_SLOT(node)] = NULL;
+	if (--page->size == 0) {
+		RL_CALL(rl_delete, RL_OK, db, page_number);
+	}
+	else {
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_skiplist_node, page_number, page);
+	}
+cleanup:
+	return retval;
+}
+
 int rl_skiplist_malloc(rlite *db, rl_skiplist **_skiplist)
 {
 	int retval = RL_OK;
@@ -21,6 +135,7 @@ int rl_skiplist_malloc(rlite *db, rl_skiplist **_skiplist)
 	skiplist->right = 0;
 	skiplist->size = 0;
 	skiplist->level = 1;
+	skiplist->packed = 1;
 
 	*_skiplist = skiplist;
 cleanup:
@@ -34,7 +149,6 @@ int rl_skiplist_create(rlite *db, rl_skiplist **_skiplist)
 {
 	int retval;
 	RL_CALL(rl_skiplist_malloc, RL_OK, db, _skiplist);
-	(*_skiplist)->left = db->next_empty_page;
 	rl_skiplist_node *node;
 	RL_CALL(rl_skiplist_node_create, RL_OK, db, &node, RL_SKIPLIST_MAXLEVEL, 0.0, 0);
 
@@ -44,7 +158,7 @@ int rl_skiplist_create(rlite *db, rl_skiplist **_skiplist)
 		node->level[j].span = 0;
 	}
 
-	RL_CALL(rl_write, RL_OK, db, &rl_data_type_skiplist_node, db->next_empty_page, node);
+	RL_CALL(add_node, RL_OK, db, *_skiplist, 0, node, &(*_skiplist)->left);
 cleanup:
 	return retval;
 }
@@ -135,7 +249,7 @@ int rl_skiplist_iterator_next(rl_skiplist_iterator *iterator, rl_skiplist_node *
 	}
 	void *_node;
 	rl_skiplist_node *node;
-	RL_CALL(rl_read, RL_FOUND, iterator->db, &rl_data_type_skiplist_node, iterator->node_page, iterator->skiplist, &_node, 1);
+	RL_CALL(read_node, RL_FOUND, iterator->db, iterator->skiplist, iterator->node_page, &_node);
 	node = _node;
 	if (iterator->direction == 1) {
 		iterator->node_page = node->level[0].right;
@@ -167,7 +281,7 @@ static int rl_skiplist_get_update(rlite *db, rl_skiplist *skiplist, double score
 	}
 
 	int cmp, retval;
-	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_skiplist_node, skiplist->left, skiplist, &_node, 1);
+	RL_CALL(read_node, RL_FOUND, db, skiplist, skiplist->left, &_node);
 	if (update_node_page) {
 		update_node_page[0] = skiplist->left;
 	}
@@ -183,7 +297,7 @@ static int rl_skiplist_get_update(rlite *db, rl_skiplist *skiplist, double score
 			if (tmp == 0) {
 				break;
 			}
-			RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_skiplist_node, tmp, skiplist, &_node, 1);
+			RL_CALL(read_node, RL_FOUND, db, skiplist, tmp, &_node);
 			next_node = _node;
 			if (next_node->score > score) {
 				break;
@@ -221,7 +335,7 @@ int rl_skiplist_add(rlite *db, rl_skiplist *skiplist, long skiplist_page, double
 {
 	void *_node;
 	rl_skiplist_node *node;
-	long node_page, tmp;
+	long node_page = 0, tmp;
 	long rank[RL_SKIPLIST_MAXLEVEL];
 	rl_skiplist_node *update_node[RL_SKIPLIST_MAXLEVEL];
 	long update_node_page[RL_SKIPLIST_MAXLEVEL];
@@ -234,7 +348,7 @@ int rl_skiplist_add(rlite *db, rl_skiplist *skiplist, long skiplist_page, double
 	if (level > skiplist->level) {
 		for (i = skiplist->level; i < level; i++) {
 			rank[i] = 0;
-			RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_skiplist_node, skiplist->left, skiplist, &_node, 1);
+			RL_CALL(read_node, RL_FOUND, db, skiplist, skiplist->left, &_node);
 			update_node[i] = _node;
 			update_node[i]->level[i].span = skiplist->size;
 			update_node_page[i] = skiplist->left;
@@ -242,8 +356,7 @@ int rl_skiplist_add(rlite *db, rl_skiplist *skiplist, long skiplist_page, double
 		skiplist->level = level;
 	}
 	RL_CALL(rl_skiplist_node_create, RL_OK, db, &node, level, score, value_page);
-	node_page = db->next_empty_page;
-	RL_CALL(rl_write, RL_OK, db, &rl_data_type_skiplist_node, db->next_empty_page, node);
+	RL_CALL(add_node, RL_OK, db, skiplist, update_node_page[0], node, &node_page);
 	for (i = 0; i < level || i < skiplist->level; i++) {
 		if (i < level) {
 			node->level[i].right = update_node[i]->level[i].right;
@@ -252,7 +365,7 @@ int rl_skiplist_add(rlite *db, rl_skiplist *skiplist, long skiplist_page, double
 			node->level[i].span = update_node[i]->level[i].span - (rank[0] - rank[i]);
 			update_node[i]->level[i].span = (rank[0] - rank[i]) + 1;
 		}
-		RL_CALL(rl_write, RL_OK, db, &rl_data_type_skiplist_node, update_node_page[i], update_node[i]);
+		RL_CALL(write_node, RL_OK, db, skiplist, update_node_page[i]);
 	}
 
 	for (i = level; i < skiplist->level; i++) {
@@ -263,10 +376,10 @@ int rl_skiplist_add(rlite *db, rl_skiplist *skiplist, long skiplist_page, double
 	if (node->level[0].right) {
 		tmp = node_page;
 		node_page = node->level[0].right;
-		RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_skiplist_node, node_page, skiplist, &_node, 1);
+		RL_CALL(read_node, RL_FOUND, db, skiplist, node_page, &_node);
 		node = _node;
 		node->left = tmp;
-		RL_CALL(rl_write, RL_OK, db, &rl_data_type_skiplist_node, node_page, node);
+		RL_CALL(write_node, RL_OK, db, skiplist, node_page);
 	}
 	else {
 		skiplist->right = node_page;
@@ -309,7 +422,7 @@ int rl_skiplist_first_node(rlite *db, rl_skiplist *skiplist, double score, int r
 	}
 
 	if (range_mode == RL_SKIPLIST_UPTO_SCORE && update_node[0]->level[0].right) {
-		RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_skiplist_node, update_node[0]->level[0].right, skiplist, (void **)&update_node[1], 1);
+		RL_CALL(read_node, RL_FOUND, db, skiplist, update_node[0]->level[0].right, (void **)&update_node[1]);
 		if (update_node[1]->score == score) {
 			if (!value) {
 				cmp = 0;
@@ -337,7 +450,7 @@ int rl_skiplist_first_node(rlite *db, rl_skiplist *skiplist, double score, int r
 	}
 	else if (update_node[0]->level[0].right) {
 		if (retnode) {
-			RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_skiplist_node, update_node[0]->level[0].right, skiplist, (void **)retnode, 1);
+			RL_CALL(read_node, RL_FOUND, db, skiplist, update_node[0]->level[0].right, (void **)retnode);
 		}
 		retval = RL_FOUND;
 
@@ -360,7 +473,7 @@ int rl_skiplist_delete(rlite *db, rl_skiplist *skiplist, long skiplist_page, dou
 	void *_node;
 	rl_skiplist_node *node, *next_node;
 	long node_page = update_node[0]->level[0].right;
-	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_skiplist_node, node_page, skiplist, &_node, 1);
+	RL_CALL(read_node, RL_FOUND, db, skiplist, node_page, &_node);
 	node = _node;
 
 	int cmp;
@@ -380,24 +493,24 @@ int rl_skiplist_delete(rlite *db, rl_skiplist *skiplist, long skiplist_page, dou
 		else {
 			update_node[i]->level[i].span--;
 		}
-		RL_CALL(rl_write, RL_OK, db, &rl_data_type_skiplist_node, update_node_page[i], update_node[i]);
+		RL_CALL(write_node, RL_OK, db, skiplist, update_node_page[i]);
 	}
 
 	long next_node_page = node->level[0].right;
 	if (next_node_page) {
-		RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_skiplist_node, next_node_page, skiplist, &_node, 1);
+		RL_CALL(read_node, RL_FOUND, db, skiplist, next_node_page, &_node);
 		next_node = _node;
 		next_node->left = node->left;
-		RL_CALL(rl_write, RL_OK, db, &rl_data_type_skiplist_node, next_node_page, next_node);
+		RL_CALL(write_node, RL_OK, db, skiplist, next_node_page);
 	}
 	else {
 		skiplist->right = node->left;
 	}
 
 	RL_CALL(rl_multi_string_delete, RL_OK, db, node->value);
-	RL_CALL(rl_delete, RL_OK, db, node_page);
+	RL_CALL(remove_node, RL_OK, db, skiplist, node_page);
 	node_page = skiplist->left;
-	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_skiplist_node, skiplist->left, skiplist, &_node, 1);
+	RL_CALL(read_node, RL_FOUND, db, skiplist, skiplist->left, &_node);
 	node = _node;
 	while (skiplist->level > 0 && node->level[skiplist->level - 1].right == 0) {
 		skiplist->level--;
@@ -407,7 +520,7 @@ int rl_skiplist_delete(rlite *db, rl_skiplist *skiplist, long skiplist_page, dou
 		retval = RL_OK;
 	}
 	else {
-		RL_CALL(rl_delete, RL_OK, db, node_page);
+		RL_CALL(remove_node, RL_OK, db, skiplist, node_page);
 		RL_CALL(rl_delete, RL_OK, db, skiplist_page);
 		retval = RL_DELETED;
 	}
@@ -422,13 +535,13 @@ int rl_skiplist_delete_all(rlite *db, rl_skiplist *skiplist)
 	void *_node;
 	rl_skiplist_node *node;
 	while (page != 0) {
-		RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_skiplist_node, page, skiplist, &_node, 1);
+		RL_CALL(read_node, RL_FOUND, db, skiplist, page, &_node);
 		node = _node;
 		next_page = node->level[0].right;
 		if (node->value) {
 			RL_CALL(rl_multi_string_delete, RL_OK, db, node->value);
 		}
-		RL_CALL(rl_delete, RL_OK, db, page);
+		RL_CALL(remove_node, RL_OK, db, skiplist, page);
 		page = next_page;
 	}
 	retval = RL_OK;
@@ -452,7 +565,7 @@ int rl_skiplist_print(rlite *db, rl_skiplist *skiplist)
 			fprintf(stderr, "Too many nodes, expected %ld\n", skiplist->size);
 			return RL_UNEXPECTED;
 		}
-		RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_skiplist_node, page, skiplist, &_node, 1);
+		RL_CALL(read_node, RL_FOUND, db, skiplist, page, &_node);
 		node = _node;
 		printf("page: %ld, value: %ld, score: %lf, left: %ld", page, node->value, node->score, node->left);
 		for (i = 0; i < node->num_levels; i++) {
@@ -488,7 +601,7 @@ int rl_skiplist_is_balanced(rlite *db, rl_skiplist *skiplist)
 			goto cleanup;
 		}
 		nodes_page[i] = page;
-		RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_skiplist_node, page, skiplist, &_node, 1);
+		RL_CALL(read_node, RL_FOUND, db, skiplist, page, &_node);
 		node = _node;
 		nodes[i++] = node;
 		page = node->level[0].right;
@@ -563,6 +676,7 @@ int rl_skiplist_serialize(struct rlite *UNUSED(db), void *obj, unsigned char *da
 	put_4bytes(&data[4], skiplist->right);
 	put_4bytes(&data[8], skiplist->size);
 	put_4bytes(&data[12], skiplist->level);
+	put_4bytes(&data[16], skiplist->packed);
 	return RL_OK;
 }
 int rl_skiplist_deserialize(struct rlite *db, void **obj, void *UNUSED(context), unsigned char *data)
@@ -574,6 +688,8 @@ int rl_skiplist_deserialize(struct rlite *db, void **obj, void *UNUSED(context),
 	skiplist->right = get_4bytes(&data[4]);
 	skiplist->size = get_4bytes(&data[8]);
 	skiplist->level = get_4bytes(&data[12]);
+	// skiplists written with one node per page have no flag, pages are zero padded
+	skiplist->packed = get_4bytes(&data[16]);
 	*obj = skiplist;
 	retval = RL_OK;
 cleanup:
@@ -602,7 +718,7 @@ int rl_skiplist_node_deserialize(struct rlite *db, void **obj, void *UNUSED(cont
 	long value = get_4bytes(data);
 	double score = get_double(&data[4]);
 	long left = get_4bytes(&data[12]);
-	long level = get_4bytes(&data[16]);;
+	long level = get_4bytes(&data[16]);
 	int retval;
 	RL_CALL(rl_skiplist_node_create, RL_OK, db, &node, level, score, value);
 	node->left = left;
@@ -617,6 +733,88 @@ cleanup:
 	return retval;
 }
 
+int rl_skiplist_node_page_create(rlite *UNUSED(db), rl_skiplist_node_page **_page)
+{
+	int retval = RL_OK;
+	rl_skiplist_node_page *page;
+	RL_MALLOC(page, sizeof(*page));
+	page->size = 0;
+	memset(page->nodes, 0, sizeof(page->nodes));
+	*_page = page;
+cleanup:
+	return retval;
+}
+
+int rl_skiplist_node_page_destroy(rlite *db, void *obj)
+{
+	rl_skiplist_node_page *page = obj;
+	long i;
+	for (i = 0; i < RL_SKIPLIST_NODES_PER_PAGE; i++) {
+		if (page->nodes[i]) {
+			rl_skiplist_node_destroy(db, page->nodes[i]);
+		}
+	}
+	rl_free(page);
+	return RL_OK;
+}
+
+int rl_skiplist_node_page_serialize(struct rlite *UNUSED(db), void *obj, unsigned char *data)
+{
+	rl_skiplist_node_page *page = obj;
+	rl_skiplist_node *node;
+	long i, j, pos = 0;
+	for (i = 0; i < RL_SKIPLIST_NODES_PER_PAGE; i++) {
+		node = page->nodes[i];
+		if (!node) {
+			data[pos++] = 0;
+			continue;
+		}
+		data[pos++] = node->num_levels;
+		put_4bytes(&data[pos], node->value);
+		put_double(&data[pos + 4], node->score);
+		put_4bytes(&data[pos + 12], node->left);
+		pos += 16;
+		for (j = 0; j < node->num_levels; j++) {
+			put_4bytes(&data[pos], node->level[j].right);
+			put_4bytes(&data[pos + 4], node->level[j].span);
+			pos += 8;
+		}
+	}
+	return RL_OK;
+}
+
+int rl_skiplist_node_page_deserialize(struct rlite *db, void **obj, void *UNUSED(context), unsigned char *data)
+{
+	rl_skiplist_node_page *page = NULL;
+	rl_skiplist_node *node;
+	long i, j, level, pos = 0;
+	int retval;
+	RL_CALL(rl_skiplist_node_page_create, RL_OK, db, &page);
+	for (i = 0; i < RL_SKIPLIST_NODES_PER_PAGE; i++) {
+		level = data[pos++];
+		if (level == 0) {
+			continue;
+		}
+		RL_CALL(rl_skiplist_node_create, RL_OK, db, &node, level, get_double(&data[pos + 4]), get_4bytes(&data[pos]));
+		node->left = get_4bytes(&data[pos + 12]);
+		pos += 16;
+		for (j = 0; j < level; j++) {
+			node->level[j].right = get_4bytes(&data[pos]);
+			node->level[j].span = get_4bytes(&data[pos + 4]);
+			pos += 8;
+		}
+		page->nodes[i] = node;
+		page->size++;
+	}
+	*obj = page;
+	retval = RL_OK;
+cleanup:
+	if (retval != RL_OK && page) {
+		rl_skiplist_node_page_destroy(db, page);
+	}
+	return retval;
+}
+
 int rl_skiplist_node_by_rank(rlite *db, rl_skiplist *skiplist, long rank, rl_skiplist_node **retnode, long *retnode_page)
 {
 	void *_node;
@@ -628,7 +826,7 @@ int rl_skiplist_node_by_rank(rlite *db, rl_skiplist *skiplist, long rank, rl_ski
 	rank++;
 
 	int retval;
-	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_skiplist_node, skiplist->left, skiplist, &_node, 1);
+	RL_CALL(read_node, RL_FOUND, db, skiplist, skiplist->left, &_node);
 	node = _node;
 
 	for (i = skiplist->level - 1; i >= 0; i--) {
@@ -641,7 +839,7 @@ int rl_skiplist_node_by_rank(rlite *db, rl_skiplist *skiplist, long rank, rl_ski
 			}
 			pos += node->level[i].span;
 			node_page = node->level[i].right;
-			RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_skiplist_node, node_page, skiplist, &_node, 1);
+			RL_CALL(read_node, RL_FOUND, db, skiplist, node_page, &_node);
 			node = _node;
 		}
 	}
@@ -666,11 +864,11 @@ int rl_skiplist_pages(struct rlite *db, rl_skiplist *skiplist, short *pages)
 	int retval;
 	rl_skiplist_iterator *iterator = NULL;
 	RL_CALL(rl_skiplist_iterator_create, RL_OK, db, &iterator, skiplist, 0, 1, 0);
-	pages[skiplist->right] = 1;
-	pages[skiplist->left] = 1;
+	pages[node_page_number(skiplist, skiplist->right)] = 1;
+	pages[node_page_number(skiplist, skiplist->left)] = 1;
 	do {
 		if (iterator->node_page) {
-			pages[iterator->node_page] = 1;
+			pages[node_page_number(skiplist, iterator->node_page)] = 1;
 		}
 	}
 	while ((retval = rl_skiplist_iterator_next(iterator, NULL)) == RL_OK);
@@ -17,7 +17,7 @@ static void generate_subscriber_id(rlite *db);
 static char *get_lock_filename(rlite *db, char *subscriber_id)
 {
 	char suffix[46];
-	if (db->driver_type != RL_FILE_DRIVER) {
+	if (!RL_IS_FILE_DRIVER(db)) {
 		return NULL;
 	}
 	rl_file_driver *driver = db->driver;
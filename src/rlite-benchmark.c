@@ -0,0 +1,513 @@
+/* rlite-benchmark, modeled on redis-benchmark.
+ *
+ * Each test splits its requests among a number of processes, every one of
+ * them with its own context on the same database, and reports the throughput
+ * and the latency percentiles of all of them together.
+ */
+#define _XOPEN_SOURCE 600
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "rlite/hirlite.h"
+
+#define MAX_ARGC 6
+#define ARG_SIZE 32
+#define LRANGE_SIZE 100
+
+static struct config {
+	const char *path;
+	long requests;
+	int clients;
+	long keyspace;
+	long datasize;
+	int pipeline;
+	int quiet;
+	const char *tests;
+	char *value;
+} config;
+
+typedef struct command {
+	int argc;
+	char *argv[MAX_ARGC];
+	size_t argvlen[MAX_ARGC];
+	char key[ARG_SIZE];
+	char score[ARG_SIZE];
+} command;
+
+typedef struct benchmark {
+	const char *name;
+	const char *title;
+	void (*build)(command *cmd);
+	void (*prepare)(rliteContext *context);
+} benchmark;
+
+/* What every process sends back once it is done. */
+typedef struct result {
+	long requests;
+	long long start;
+	long long end;
+} result;
+
+static long long ustime(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return ((long long)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static void setArg(command *cmd, int i, char *arg, size_t len) {
+	cmd->argv[i] = arg;
+	cmd->argvlen[i] = len;
+	if (i >= cmd->argc) {
+		cmd->argc = i + 1;
+	}
+}
+
+static void setStr(command *cmd, int i, char *arg) {
+	setArg(cmd, i, arg, strlen(arg));
+}
+
+/* Fills cmd->key with `prefix` followed by a random number in the key space,
+ * or always the same one without -r. */
+static void randomKey(command *cmd, const char *prefix) {
+	long n = config.keyspace ? random() % config.keyspace : 0;
+	snprintf(cmd->key, ARG_SIZE, "%s%012ld", prefix, n);
+}
+
+static void buildSet(command *cmd) {
+	randomKey(cmd, "key:");
+	setStr(cmd, 0, "SET");
+	setStr(cmd, 1, cmd->key);
+	setArg(cmd, 2, config.value, config.datasize);
+}
+
+static void buildGet(command *cmd) {
+	randomKey(cmd, "key:");
+	setStr(cmd, 0, "GET");
+	setStr(cmd, 1, cmd->key);
+}
+
+static void buildIncr(command *cmd) {
+	randomKey(cmd, "counter:");
+	setStr(cmd, 0, "INCR");
+	setStr(cmd, 1, cmd->key);
+}
+
+static void buildLpush(command *cmd) {
+	setStr(cmd, 0, "LPUSH");
+	setStr(cmd, 1, "mylist");
+	setArg(cmd, 2, config.value, config.datasize);
+}
+
+static void buildLrange(command *cmd) {
+	setStr(cmd, 0, "LRANGE");
+	setStr(cmd, 1, "mylist");
+	setStr(cmd, 2, "0");
+	snprintf(cmd->score, ARG_SIZE, "%d", LRANGE_SIZE - 1);
+	setStr(cmd, 3, cmd->score);
+}
+
+static void prepareLrange(rliteContext *context) {
+	char *argv[] = {"LPUSH", "mylist", config.value};
+	size_t argvlen[] = {5, 6, config.datasize};
+	char *llen[] = {"LLEN", "mylist"};
+	size_t llenlen[] = {4, 6};
+	rliteReply *reply = rliteCommandArgv(context, 2, llen, llenlen);
+	long long i = reply && reply->type == RLITE_REPLY_INTEGER ? reply->integer : 0;
+	rliteFreeReplyObject(reply);
+	for (; i < LRANGE_SIZE; i++) {
+		rliteFreeReplyObject(rliteCommandArgv(context, 3, argv, argvlen));
+	}
+}
+
+static void buildZadd(command *cmd) {
+	randomKey(cmd, "element:");
+	snprintf(cmd->score, ARG_SIZE, "%ld", random() % 1000000);
+	setStr(cmd, 0, "ZADD");
+	setStr(cmd, 1, "myzset");
+	setStr(cmd, 2, cmd->score);
+	setStr(cmd, 3, cmd->key);
+}
+
+static void buildHset(command *cmd) {
+	randomKey(cmd, "element:");
+	setStr(cmd, 0, "HSET");
+	setStr(cmd, 1, "myhash");
+	setStr(cmd, 2, cmd->key);
+	setArg(cmd, 3, config.value, config.datasize);
+}
+
+static void buildSadd(command *cmd) {
+	randomKey(cmd, "element:");
+	setStr(cmd, 0, "SADD");
+	setStr(cmd, 1, "myset");
+	setStr(cmd, 2, cmd->key);
+}
+
+static void buildEval(command *cmd) {
+	randomKey(cmd, "key:");
+	setStr(cmd, 0, "EVAL");
+	setStr(cmd, 1, "return redis.call('set',KEYS[1],ARGV[1])");
+	setStr(cmd, 2, "1");
+	setStr(cmd, 3, cmd->key);
+	setArg(cmd, 4, config.value, config.datasize);
+}
+
+static benchmark benchmarks[] = {
+	{"set", "SET", buildSet, NULL},
+	{"get", "GET", buildGet, NULL},
+	{"incr", "INCR", buildIncr, NULL},
+	{"lpush", "LPUSH", buildLpush, NULL},
+	{"lrange", "LRANGE (first 100 elements)", buildLrange, prepareLrange},
+	{"zadd", "ZADD", buildZadd, NULL},
+	{"hset", "HSET", buildHset, NULL},
+	{"sadd", "SADD", buildSadd, NULL},
+	{"eval", "EVAL", buildEval, NULL},
+};
+
+static void checkReply(const benchmark *b, rliteReply *reply) {
+	if (reply == NULL) {
+		fprintf(stderr, "%s: no reply\n", b->title);
+		exit(1);
+	}
+	if (reply->type == RLITE_REPLY_ERROR) {
+		fprintf(stderr, "%s: %.*s\n", b->title, reply->len, reply->str);
+		exit(1);
+	}
+	rliteFreeReplyObject(reply);
+}
+
+static int writeAll(int fd, const void *data, size_t len) {
+	const char *p = data;
+	ssize_t written;
+	while (len > 0) {
+		written = write(fd, p, len);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += written;
+		len -= written;
+	}
+	return 0;
+}
+
+static int readAll(int fd, void *data, size_t len) {
+	char *p = data;
+	ssize_t got;
+	while (len > 0) {
+		got = read(fd, p, len);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			return -1;
+		}
+		p += got;
+		len -= got;
+	}
+	return 0;
+}
+
+/* Runs in a child process, sending a result and then one latency per
+ * request through `fd`. */
+static int runClient(const benchmark *b, long requests, int fd) {
+	rliteContext *context = rliteConnect(config.path, 0);
+	command *cmds = calloc(config.pipeline, sizeof(command));
+	char ***argvs = malloc(sizeof(char **) * config.pipeline);
+	size_t **argvlens = malloc(sizeof(size_t *) * config.pipeline);
+	int *argcs = malloc(sizeof(int) * config.pipeline);
+	long long *latencies = malloc(sizeof(long long) * (requests > 0 ? requests : 1));
+	long long t;
+	long i, batch;
+	result res;
+	void *reply;
+
+	if (!context || !cmds || !argvs || !argvlens || !argcs || !latencies) {
+		fprintf(stderr, "Unable to start client for %s\n", config.path);
+		return 1;
+	}
+	srandom(getpid() ^ (unsigned int)ustime());
+	if (b->prepare) {
+		b->prepare(context);
+	}
+
+	res.requests = 0;
+	res.start = ustime();
+	while (res.requests < requests) {
+		batch = requests - res.requests;
+		if (batch > config.pipeline) {
+			batch = config.pipeline;
+		}
+		for (i = 0; i < batch; i++) {
+			cmds[i].argc = 0;
+			b->build(&cmds[i]);
+			argcs[i] = cmds[i].argc;
+			argvs[i] = cmds[i].argv;
+			argvlens[i] = cmds[i].argvlen;
+		}
+		t = ustime();
+		if (config.pipeline == 1) {
+			checkReply(b, rliteCommandArgv(context, argcs[0], argvs[0], argvlens[0]));
+		} else {
+			if (rliteAppendCommandArgvBatch(context, batch, argcs, argvs, argvlens) != RLITE_OK) {
+				fprintf(stderr, "%s: batch failed\n", b->title);
+				return 1;
+			}
+			for (i = 0; i < batch; i++) {
+				rliteGetReply(context, &reply);
+				checkReply(b, reply);
+			}
+		}
+		// every request in a batch waits for all of it
+		t = ustime() - t;
+		for (i = 0; i < batch; i++) {
+			latencies[res.requests++] = t;
+		}
+	}
+	res.end = ustime();
+
+	rliteFree(context);
+	if (writeAll(fd, &res, sizeof(res)) != 0 ||
+			writeAll(fd, latencies, sizeof(long long) * res.requests) != 0) {
+		return 1;
+	}
+	free(latencies);
+	free(argcs);
+	free(argvlens);
+	free(argvs);
+	free(cmds);
+	return 0;
+}
+
+static int compareLatency(const void *a, const void *b) {
+	long long la = *(const long long *)a, lb = *(const long long *)b;
+	return la < lb ? -1 : la > lb;
+}
+
+static long long percentile(long long *latencies, long count, double p) {
+	return latencies[(long)((count - 1) * p / 100)];
+}
+
+static void showReport(const benchmark *b, long long *latencies, long count, long long elapsed) {
+	double seconds = elapsed / 1e6;
+	double rps = seconds > 0 ? count / seconds : 0;
+
+	qsort(latencies, count, sizeof(long long), compareLatency);
+	if (config.quiet) {
+		printf("%s: %.2f requests per second, p50=%lld p99=%lld usec\n", b->title, rps,
+				percentile(latencies, count, 50), percentile(latencies, count, 99));
+		return;
+	}
+	printf("====== %s ======\n", b->title);
+	printf("  %ld requests completed in %.2f seconds\n", count, seconds);
+	printf("  %d parallel processes\n", config.clients);
+	printf("  %ld bytes payload\n", config.datasize);
+	printf("  %d commands per batch\n", config.pipeline);
+	printf("  database %s\n\n", config.path);
+	printf("latency (usec): p50 %lld, p90 %lld, p99 %lld, p99.9 %lld, max %lld\n",
+			percentile(latencies, count, 50), percentile(latencies, count, 90),
+			percentile(latencies, count, 99), percentile(latencies, count, 99.9),
+			latencies[count - 1]);
+	printf("%.2f requests per second\n\n", rps);
+}
+
+static int runBenchmark(const benchmark *b) {
+	pid_t *pids = malloc(sizeof(pid_t) * config.clients);
+	int *fds = malloc(sizeof(int) * config.clients);
+	long long *latencies = malloc(sizeof(long long) * config.requests);
+	long long start = 0, end = 0;
+	long count = 0, requests;
+	int i, status, failed = 0, fd[2];
+	result res;
+
+	if (!pids || !fds || !latencies) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	fflush(stdout);
+	for (i = 0; i < config.clients; i++) {
+		requests = config.requests / config.clients;
+		if (i < config.requests % config.clients) {
+			requests++;
+		}
+		if (pipe(fd) != 0) {
+			perror("pipe");
+			exit(1);
+		}
+		pids[i] = fork();
+		if (pids[i] == -1) {
+			perror("fork");
+			exit(1);
+		}
+		if (pids[i] == 0) {
+			close(fd[0]);
+			_exit(runClient(b, requests, fd[1]));
+		}
+		close(fd[1]);
+		fds[i] = fd[0];
+	}
+
+	for (i = 0; i < config.clients; i++) {
+		if (readAll(fds[i], &res, sizeof(res)) != 0 ||
+				readAll(fds[i], &latencies[count], sizeof(long long) * res.requests) != 0) {
+			failed = 1;
+		} else {
+			count += res.requests;
+			if (start == 0 || res.start < start) {
+				start = res.start;
+			}
+			if (res.end > end) {
+				end = res.end;
+			}
+		}
+		close(fds[i]);
+	}
+	for (i = 0; i < config.clients; i++) {
+		if (waitpid(pids[i], &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			failed = 1;
+		}
+	}
+
+	if (!failed && count > 0) {
+		showReport(b, latencies, count, end - start);
+	}
+	free(latencies);
+	free(fds);
+	free(pids);
+	return failed;
+}
+
+static int testSelected(const char *name) {
+	const char *p = config.tests;
+	size_t len = strlen(name);
+
+	if (p == NULL) {
+		return 1;
+	}
+	while (*p) {
+		if (strncasecmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0')) {
+			return 1;
+		}
+		p = strchr(p, ',');
+		if (p == NULL) {
+			break;
+		}
+		p++;
+	}
+	return 0;
+}
+
+static void usage(void) {
+	printf(
+"Usage: rlite-benchmark [-f <path>] [-c <processes>] [-n <requests>] [-d <size>]\n"
+"                       [-r <keyspacelen>] [-P <numreq>] [-t <tests>] [-q]\n\n"
+" -f <path>          Database file, or :memory: (default :memory:)\n"
+"                    The benchmark writes its keys into it.\n"
+" -c <processes>     Number of processes running at once (default 1)\n"
+"                    With :memory: each of them has its own database.\n"
+" -n <requests>      Total number of requests (default 100000)\n"
+" -d <size>          Data size of SET/LPUSH/HSET/EVAL values in bytes (default 3)\n"
+" -r <keyspacelen>   Use random keys for SET/GET/INCR, random elements for\n"
+"                    ZADD/HSET/SADD, picked from 0 to keyspacelen-1\n"
+" -P <numreq>        Run <numreq> requests per batch, holding the lock and\n"
+"                    committing once for all of them (default 1, no batches)\n"
+" -t <tests>         Only run the comma separated list of tests\n"
+" -q                 Quiet. Just show ops/sec and p50/p99 latency\n"
+" -h                 Show this help\n\n"
+"Tests: set, get, incr, lpush, lrange, zadd, hset, sadd, eval\n\n"
+"Examples:\n\n"
+" Run the benchmark on a file with 4 processes and batches of 16 commands:\n"
+"   $ rlite-benchmark -f bench.rld -c 4 -P 16\n\n"
+" Use 1M random keys and 100 byte values for SET and GET only:\n"
+"   $ rlite-benchmark -t set,get -r 1000000 -d 100 -q\n\n"
+	);
+}
+
+static long parseLong(const char *arg, const char *option, long min) {
+	char *end;
+	long value = strtol(arg, &end, 10);
+	if (*arg == '\0' || *end != '\0' || value < min) {
+		fprintf(stderr, "Invalid value for %s: %s\n", option, arg);
+		exit(1);
+	}
+	return value;
+}
+
+static void parseOptions(int argc, char **argv) {
+	int i, lastarg;
+
+	for (i = 1; i < argc; i++) {
+		lastarg = (i == (argc - 1));
+
+		if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			usage();
+			exit(0);
+		} else if (!strcmp(argv[i], "-q")) {
+			config.quiet = 1;
+		} else if (lastarg) {
+			goto invalid;
+		} else if (!strcmp(argv[i], "-f")) {
+			config.path = argv[++i];
+		} else if (!strcmp(argv[i], "-c")) {
+			config.clients = parseLong(argv[++i], "-c", 1);
+		} else if (!strcmp(argv[i], "-n")) {
+			config.requests = parseLong(argv[++i], "-n", 1);
+		} else if (!strcmp(argv[i], "-d")) {
+			config.datasize = parseLong(argv[++i], "-d", 1);
+		} else if (!strcmp(argv[i], "-r")) {
+			config.keyspace = parseLong(argv[++i], "-r", 1);
+		} else if (!strcmp(argv[i], "-P")) {
+			config.pipeline = parseLong(argv[++i], "-P", 1);
+		} else if (!strcmp(argv[i], "-t")) {
+			config.tests = argv[++i];
+		} else {
+			goto invalid;
+		}
+	}
+	return;
+
+invalid:
+	fprintf(stderr, "Invalid option \"%s\" or option argument missing\n\n", argv[i]);
+	usage();
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	size_t i;
+	int failed = 0;
+
+	config.path = ":memory:";
+	config.requests = 100000;
+	config.clients = 1;
+	config.keyspace = 0;
+	config.datasize = 3;
+	config.pipeline = 1;
+	config.quiet = 0;
+	config.tests = NULL;
+	parseOptions(argc, argv);
+
+	config.value = malloc(config.datasize + 1);
+	if (!config.value) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	memset(config.value, 'x', config.datasize);
+	config.value[config.datasize] = '\0';
+
+	for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+		if (testSelected(benchmarks[i].name)) {
+			failed |= runBenchmark(&benchmarks[i]);
+		}
+	}
+	free(config.value);
+	return failed;
+}
@@ -0,0 +1,322 @@
+/* rlite-page-benchmark, micro-benchmarks for the page layer.
+ *
+ * Drives the btree, skiplist, list and multi_string structures directly,
+ * without going through hirlite, and reports for every operation how long it
+ * took and how many pages and bytes it moved through rl_read and rl_commit.
+ */
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rlite/rlite.h"
+#include "rlite/page_btree.h"
+#include "rlite/page_list.h"
+#include "rlite/page_multi_string.h"
+#include "rlite/page_skiplist.h"
+#include "rlite/status.h"
+
+static struct config {
+	const char *path;
+	long operations;
+	long batch;
+	long datasize;
+	const char *tests;
+} config;
+
+typedef struct benchmark {
+	const char *name;
+	// creates the structure and writes its root page, if it has one
+	int (*setup)(rlite *db, long *page);
+	// the i-th insertion, and the i-th lookup once all of them are done
+	int (*add)(rlite *db, long page, long i);
+	int (*lookup)(rlite *db, long page, long i);
+} benchmark;
+
+static unsigned char *value;
+static long *strings;
+
+static long long nstime(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/* Maps 0..operations-1 into distinct numbers in no particular order, so
+ * inserts do not always land on the rightmost node. */
+static long scramble(long i) {
+	return (i * 1103515245L + 12345L) & 0x7fffffffL;
+}
+
+static int btreeSetup(rlite *db, long *page) {
+	int retval;
+	rl_btree *btree;
+	RL_CALL(rl_btree_create, RL_OK, db, &btree, &rl_btree_type_hash_long_long);
+	RL_CALL(rl_alloc_page_number, RL_OK, db, page);
+	RL_CALL(rl_write, RL_OK, db, btree->type->btree_type, *page, btree);
+cleanup:
+	return retval;
+}
+
+static int btreeAdd(rlite *db, long page, long i) {
+	int retval;
+	rl_btree *btree;
+	long *score = NULL, *val = NULL;
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_btree_hash_long_long, page, &rl_btree_type_hash_long_long, (void **)&btree, 1);
+	RL_MALLOC(score, sizeof(long));
+	RL_MALLOC(val, sizeof(long));
+	*score = scramble(i);
+	*val = i;
+	RL_CALL(rl_btree_add_element, RL_OK, db, btree, page, score, val);
+	score = val = NULL;
+cleanup:
+	rl_free(score);
+	rl_free(val);
+	return retval;
+}
+
+static int btreeLookup(rlite *db, long page, long i) {
+	int retval;
+	rl_btree *btree;
+	long score = scramble(i);
+	void *val;
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_btree_hash_long_long, page, &rl_btree_type_hash_long_long, (void **)&btree, 1);
+	RL_CALL(rl_btree_find_score, RL_FOUND, db, btree, &score, &val, NULL, NULL);
+	retval = RL_OK;
+cleanup:
+	return retval;
+}
+
+static int skiplistSetup(rlite *db, long *page) {
+	int retval;
+	rl_skiplist *skiplist;
+	RL_CALL(rl_skiplist_create, RL_OK, db, &skiplist);
+	RL_CALL(rl_alloc_page_number, RL_OK, db, page);
+	RL_CALL(rl_write, RL_OK, db, &rl_data_type_skiplist, *page, skiplist);
+cleanup:
+	return retval;
+}
+
+static int skiplistAdd(rlite *db, long page, long i) {
+	int retval;
+	rl_skiplist *skiplist;
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_skiplist, page, NULL, (void **)&skiplist, 1);
+	RL_CALL(rl_skiplist_add, RL_OK, db, skiplist, page, scramble(i), value, config.datasize);
+cleanup:
+	return retval;
+}
+
+static int skiplistLookup(rlite *db, long page, long i) {
+	int retval;
+	rl_skiplist *skiplist;
+	rl_skiplist_node *node;
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_skiplist, page, NULL, (void **)&skiplist, 1);
+	RL_CALL(rl_skiplist_first_node, RL_FOUND, db, skiplist, scramble(i), RL_SKIPLIST_INCLUDE_SCORE, NULL, 0, &node, NULL);
+	retval = RL_OK;
+cleanup:
+	return retval;
+}
+
+static int listSetup(rlite *db, long *page) {
+	int retval;
+	rl_list *list;
+	RL_CALL(rl_list_create, RL_OK, db, &list, &rl_list_type_long);
+	RL_CALL(rl_alloc_page_number, RL_OK, db, page);
+	RL_CALL(rl_write, RL_OK, db, list->type->list_type, *page, list);
+cleanup:
+	return retval;
+}
+
+static int listAdd(rlite *db, long page, long i) {
+	int retval;
+	rl_list *list;
+	long *element = NULL;
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, page, &rl_list_type_long, (void **)&list, 1);
+	RL_MALLOC(element, sizeof(long));
+	*element = i;
+	RL_CALL(rl_list_add_element, RL_OK, db, list, page, element, -1);
+	element = NULL;
+cleanup:
+	rl_free(element);
+	return retval;
+}
+
+static int listLookup(rlite *db, long page, long i) {
+	int retval;
+	rl_list *list;
+	void *element;
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, page, &rl_list_type_long, (void **)&list, 1);
+	RL_CALL(rl_list_get_element, RL_FOUND, db, list, &element, scramble(i) % config.operations);
+	retval = RL_OK;
+cleanup:
+	return retval;
+}
+
+static int multiStringSetup(rlite *db, long *page) {
+	(void)db;
+	*page = 0;
+	return RL_OK;
+}
+
+static int multiStringAdd(rlite *db, long page, long i) {
+	(void)page;
+	return rl_multi_string_set(db, &strings[i], value, config.datasize);
+}
+
+static int multiStringLookup(rlite *db, long page, long i) {
+	int retval;
+	unsigned char *data = NULL;
+	long size, start = config.datasize / 2;
+	(void)page;
+	RL_CALL(rl_multi_string_getrange, RL_OK, db, strings[scramble(i) % config.operations], &data, &size, start, start + 99);
+cleanup:
+	rl_free(data);
+	return retval;
+}
+
+static const benchmark benchmarks[] = {
+	{"btree", btreeSetup, btreeAdd, btreeLookup},
+	{"skiplist", skiplistSetup, skiplistAdd, skiplistLookup},
+	{"list", listSetup, listAdd, listLookup},
+	{"multi_string", multiStringSetup, multiStringAdd, multiStringLookup},
+};
+
+static void showReport(const char *name, const char *operation, long long elapsed, rl_page_stats *before, rl_page_stats *after) {
+	double n = config.operations;
+	printf("%s %s: %.0f ns/op, %.2f pages read/op, %.2f pages written/op, "
+			"%.0f bytes deserialized/op, %.0f bytes serialized/op\n",
+			name, operation, elapsed / n,
+			(after->pages_read - before->pages_read) / n,
+			(after->pages_written - before->pages_written) / n,
+			(after->bytes_deserialized - before->bytes_deserialized) / n,
+			(after->bytes_serialized - before->bytes_serialized) / n);
+}
+
+/* Runs `config.operations` calls to `op`, `config.batch` of them per
+ * transaction. Reads are discarded instead of committed. */
+static int runPhase(rlite *db, const benchmark *b, const char *operation, int (*op)(rlite *, long, long), long page, int write) {
+	int retval = RL_OK;
+	rl_page_stats before = db->stats;
+	long long start = nstime();
+	long i;
+
+	for (i = 0; i < config.operations; i++) {
+		if (i % config.batch == 0) {
+			RL_CALL(rl_refresh, RL_OK, db);
+		}
+		RL_CALL(op, RL_OK, db, page, i);
+		if ((i + 1) % config.batch == 0 || i + 1 == config.operations) {
+			if (write) {
+				RL_CALL(rl_commit, RL_OK, db);
+			} else {
+				RL_CALL(rl_discard, RL_OK, db);
+			}
+		}
+	}
+	showReport(b->name, operation, nstime() - start, &before, &db->stats);
+cleanup:
+	if (retval != RL_OK) {
+		fprintf(stderr, "%s %s failed on operation %ld with %d\n", b->name, operation, i, retval);
+	}
+	return retval;
+}
+
+static int runBenchmark(rlite *db, const benchmark *b) {
+	int retval;
+	long page;
+	RL_CALL(rl_refresh, RL_OK, db);
+	RL_CALL(b->setup, RL_OK, db, &page);
+	RL_CALL(rl_commit, RL_OK, db);
+	RL_CALL(runPhase, RL_OK, db, b, "add", b->add, page, 1);
+	RL_CALL(runPhase, RL_OK, db, b, "lookup", b->lookup, page, 0);
+cleanup:
+	return retval;
+}
+
+static int testSelected(const char *name) {
+	const char *p = config.tests;
+	size_t len = strlen(name);
+
+	if (p == NULL) {
+		return 1;
+	}
+	while (*p) {
+		if (strncasecmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0')) {
+			return 1;
+		}
+		p = strchr(p, ',');
+		if (p == NULL) {
+			break;
+		}
+		p++;
+	}
+	return 0;
+}
+
+static void usage(void) {
+	printf(
+"Usage: rlite-page-benchmark [-f <path>] [-n <operations>] [-b <batch>]\n"
+"                            [-d <size>] [-t <tests>]\n\n"
+" -f <path>          Database file, or :memory: (default :memory:)\n"
+" -n <operations>    Insertions and lookups per structure (default 10000)\n"
+" -b <batch>         Operations per transaction (default 1)\n"
+" -d <size>          Bytes in every skiplist value and multi_string (default 3)\n"
+" -t <tests>         Comma separated list of structures to run, out of\n"
+"                    btree, skiplist, list and multi_string (default all)\n"
+" -h                 Show this help\n");
+}
+
+int main(int argc, char **argv) {
+	rlite *db = NULL;
+	size_t i;
+	int opt, failed = 0;
+
+	config.path = ":memory:";
+	config.operations = 10000;
+	config.batch = 1;
+	config.datasize = 3;
+	config.tests = NULL;
+
+	while ((opt = getopt(argc, argv, "f:n:b:d:t:h")) != -1) {
+		switch (opt) {
+			case 'f': config.path = optarg; break;
+			case 'n': config.operations = atol(optarg); break;
+			case 'b': config.batch = atol(optarg); break;
+			case 'd': config.datasize = atol(optarg); break;
+			case 't': config.tests = optarg; break;
+			case 'h': usage(); return 0;
+			default: usage(); return 1;
+		}
+	}
+	if (config.operations <= 0 || config.batch <= 0 || config.datasize <= 0) {
+		usage();
+		return 1;
+	}
+
+	value = malloc(config.datasize);
+	strings = malloc(sizeof(long) * config.operations);
+	if (!value || !strings) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	memset(value, 'x', config.datasize);
+	if (rl_open(config.path, &db, RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE) != RL_OK) {
+		fprintf(stderr, "Unable to open %s\n", config.path);
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+		if (testSelected(benchmarks[i].name) && runBenchmark(db, &benchmarks[i]) != RL_OK) {
+			failed = 1;
+			break;
+		}
+	}
+
+	rl_close(db);
+	free(strings);
+	free(value);
+	return failed;
+}
@@ -1,7 +1,12 @@
+#define _XOPEN_SOURCE 500
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 #include "rlite/page_btree.h"
@@ -13,12 +18,15 @@
 #include "rlite/type_string.h"
 #include "rlite/type_zset.h"
 #include "rlite/type_hash.h"
+#include "rlite/type_set.h"
 #include "rlite/rlite.h"
 #include "rlite/util.h"
 #include "rlite/sha1.h"
 #include "rlite/flock.h"
 #include "rlite/pubsub.h"
 #include "rlite/wal.h"
+#include "rlite/cache.h"
+#include "rlite/crc32c.h"
 #ifdef RL_DEBUG
 #include <valgrind/valgrind.h>
 #endif
@@ -33,9 +41,9 @@ int rl_has_flag(rlite *db, int flag);
 
 rl_data_type rl_data_type_btree_hash_sha1_long = {
 	"rl_data_type_btree_hash_sha1_long",
-	rl_btree_serialize,
-	rl_btree_deserialize,
-	rl_btree_destroy,
+	rl_set_serialize,
+	rl_set_deserialize,
+	rl_set_destroy,
 };
 rl_data_type rl_data_type_btree_node_hash_sha1_long = {
 	"rl_data_type_btree_node_hash_sha1_long",
@@ -69,9 +77,9 @@ rl_data_type rl_data_type_btree_node_hash_sha1_key = {
 };
 rl_data_type rl_data_type_btree_hash_sha1_hashkey = {
 	"rl_data_type_btree_hash_sha1_hashkey",
-	rl_btree_serialize,
-	rl_btree_deserialize,
-	rl_btree_destroy,
+	rl_hash_serialize,
+	rl_hash_deserialize,
+	rl_hash_destroy,
 };
 rl_data_type rl_data_type_btree_node_hash_sha1_hashkey = {
 	"rl_data_type_btree_node_hash_sha1_hashkey",
@@ -109,12 +117,30 @@ rl_data_type rl_data_type_list_long = {
 	rl_list_deserialize,
 	rl_list_destroy,
 };
+rl_data_type rl_data_type_zset = {
+	"rl_data_type_zset",
+	rl_zset_serialize,
+	rl_zset_deserialize,
+	rl_zset_destroy,
+};
 rl_data_type rl_data_type_list_node_long = {
 	"rl_data_type_list_node_long",
 	rl_list_node_serialize_long,
 	rl_list_node_deserialize_long,
 	rl_list_node_destroy,
 };
+rl_data_type rl_data_type_list_index = {
+	"rl_data_type_list_index",
+	rl_list_index_node_serialize,
+	rl_list_index_node_deserialize,
+	rl_list_index_node_destroy,
+};
+rl_data_type rl_data_type_multi_string = {
+	"rl_data_type_multi_string",
+	rl_multi_string_serialize,
+	rl_multi_string_deserialize,
+	rl_multi_string_destroy,
+};
 rl_data_type rl_data_type_string = {
 	"rl_data_type_string",
 	rl_string_serialize,
@@ -131,6 +157,12 @@ rl_data_type rl_data_type_skiplist = {
 
 rl_data_type rl_data_type_skiplist_node = {
 	"rl_data_type_skiplist_node",
+	rl_skiplist_node_page_serialize,
+	rl_skiplist_node_page_deserialize,
+	rl_skiplist_node_page_destroy,
+};
+rl_data_type rl_data_type_skiplist_single_node = {
+	"rl_data_type_skiplist_single_node",
 	rl_skiplist_node_serialize,
 	rl_skiplist_node_deserialize,
 	rl_skiplist_node_destroy,
@@ -146,41 +178,366 @@ rl_data_type rl_data_type_skiplist_node;
 
 static const unsigned char *identifier = (unsigned char *)"rlite0.0";
 
-static int file_driver_fp(rlite *db)
+static long change_counter_position(rlite *db);
+
+/**
+ * Reads up to `len` bytes at `offset`, returns how many were read.
+ */
+static size_t file_driver_read(rlite *db, long offset, unsigned char *data, size_t len)
 {
+	rl_file_driver *driver = db->driver;
+	if (db->driver_type != RL_FILE_DRIVER) {
+		size_t total = 0;
+		ssize_t read;
+		while (total < len) {
+			read = pread(driver->fd, &data[total], len - total, offset + total);
+			if (read == -1 && errno == EINTR) {
+				continue;
+			}
+			if (read <= 0) {
+				break;
+			}
+			total += read;
+		}
+		return total;
+	}
+	if (fseek(driver->fp, offset, SEEK_SET) != 0) {
+		return 0;
+	}
+	return fread(data, sizeof(unsigned char), len, driver->fp);
+}
+
+static int file_driver_is_open(rlite *db)
+{
+	rl_file_driver *driver = db->driver;
+	if (db->driver_type != RL_FILE_DRIVER) {
+		return driver->fd != -1;
+	}
+	return driver->fp != NULL;
+}
+
+static void file_driver_close(rlite *db)
+{
+	rl_file_driver *driver = db->driver;
+	if (driver->fp) {
+		fclose(driver->fp);
+		driver->fp = NULL;
+	}
+	if (driver->map) {
+		munmap(driver->map, driver->maplen);
+		driver->map = NULL;
+		driver->maplen = 0;
+	}
+	if (driver->fd != -1) {
+		close(driver->fd);
+		driver->fd = -1;
+	}
+}
+
+/**
+ * Points `data` to the page inside the read-only mapping of the file.
+ * The mapping grows along with the file, a page past its end remaps it.
+ */
+static int file_driver_map_page(rlite *db, long page, unsigned char **data)
+{
+	rl_file_driver *driver = db->driver;
+	size_t end = (size_t)(page + 1) * db->page_size;
+	struct stat st;
+	if (end > driver->maplen) {
+		if (fstat(driver->fd, &st) != 0) {
+			return RL_UNEXPECTED;
+		}
+		if ((size_t)st.st_size < end) {
+			return RL_NOT_FOUND;
+		}
+		if (driver->map) {
+			munmap(driver->map, driver->maplen);
+			driver->map = NULL;
+			driver->maplen = 0;
+		}
+		driver->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, driver->fd, 0);
+		if (driver->map == MAP_FAILED) {
+			driver->map = NULL;
+			return RL_UNEXPECTED;
+		}
+		driver->maplen = st.st_size;
+	}
+	*data = &driver->map[end - db->page_size];
+	return RL_OK;
+}
+
+static int file_driver_flock(rlite *db, int type)
+{
+	rl_file_driver *driver = db->driver;
 	int retval = RL_OK;
+	if (type != RLITE_FLOCK_UN) {
+		retval = rl_shared_cache_lock(db, type);
+	}
+	if (retval == RL_OK) {
+		if (db->driver_type != RL_FILE_DRIVER) {
+			retval = rl_flock_fd(driver->fd, type);
+		} else {
+			retval = rl_flock(driver->fp, type);
+		}
+		if (type == RLITE_FLOCK_UN || retval != RL_OK) {
+			rl_shared_cache_unlock(db);
+		}
+	}
+	return retval;
+}
+
+/**
+ * Writers take an exclusive lock on a file next to the database for their
+ * whole transaction, so only one of them runs at a time while readers keep
+ * using the database. The database itself is only locked once the writer
+ * is about to change it, see rl_lock_exclusive.
+ */
+static int file_driver_reserve(rlite *db, int type)
+{
 	rl_file_driver *driver = db->driver;
-	if (driver->fp == NULL) {
-		char *mode;
-		if (access(driver->filename, F_OK) == 0) {
-			mode = "r+";
+	char *writer_path;
+	if (driver->writer_fd == -1) {
+		writer_path = rl_get_filename_with_suffix(driver->filename, ".writer");
+		if (!writer_path) {
+			return RL_OUT_OF_MEMORY;
 		}
-		else {
-			if ((driver->mode & RLITE_OPEN_READWRITE) == 0) {
+		driver->writer_fd = open(writer_path, O_RDWR | O_CREAT, 0666);
+		rl_free(writer_path);
+		if (driver->writer_fd == -1) {
+			return RL_UNEXPECTED;
+		}
+	}
+	return rl_flock_fd(driver->writer_fd, type);
+}
+
+/**
+ * Takes a lock with `lock`. Without a busy handler it waits as long as it
+ * takes; with one, every time the lock is taken by someone else the handler
+ * decides whether to try again, and RL_TIMEOUT is returned once it gives up.
+ */
+static int file_driver_lock(rlite *db, int (*lock)(rlite *db, int type), int type)
+{
+	unsigned long long start = rl_ustime();
+	int retval, count = 0;
+	if (!db->busy_handler) {
+		retval = lock(db, type);
+		goto cleanup;
+	}
+	while ((retval = lock(db, type | RLITE_FLOCK_NB)) == RL_NOT_FOUND) {
+		if (!db->busy_handler(db->busy_arg, count++)) {
+			db->stats.lock_timeouts++;
+			retval = RL_TIMEOUT;
+			break;
+		}
+	}
+cleanup:
+	db->stats.lock_wait_us += rl_ustime() - start;
+	return retval;
+}
+
+/**
+ * Sleeps a little longer every time, until `busy_timeout` milliseconds
+ * have been spent waiting for the same lock.
+ */
+static int busy_timeout_handler(void *arg, int count)
+{
+	static const long delays[] = {1, 2, 5, 10, 15, 20, 25, 25, 25, 50, 50, 100};
+	static const int ndelays = sizeof(delays) / sizeof(delays[0]);
+	rlite *db = arg;
+	long delay, slept = 0;
+	struct timespec ts;
+	int i;
+	for (i = 0; i < count && i < ndelays; i++) {
+		slept += delays[i];
+	}
+	if (count > ndelays) {
+		slept += (count - ndelays) * delays[ndelays - 1];
+	}
+	delay = delays[count < ndelays ? count : ndelays - 1];
+	if (slept + delay > db->busy_timeout) {
+		delay = db->busy_timeout - slept;
+	}
+	if (delay <= 0) {
+		return 0;
+	}
+	ts.tv_sec = delay / 1000;
+	ts.tv_nsec = (delay % 1000) * 1000000;
+	nanosleep(&ts, NULL);
+	return 1;
+}
+
+static int file_driver_unlock(rlite *db)
+{
+	int retval = RL_OK;
+	rl_file_driver *driver = db->driver;
+	if (driver->locked) {
+		RL_CALL(file_driver_flock, RL_OK, db, RLITE_FLOCK_UN);
+		driver->locked = 0;
+	}
+	if (driver->reserved) {
+		RL_CALL(rl_flock_fd, RL_OK, driver->writer_fd, RLITE_FLOCK_UN);
+		driver->reserved = 0;
+	}
+cleanup:
+	return retval;
+}
+
+static int file_driver_open(rlite *db)
+{
+	int retval = RL_OK;
+	rl_file_driver *driver = db->driver;
+	if (db->driver_type != RL_FILE_DRIVER) {
+		int flags = (driver->mode & RLITE_OPEN_READWRITE) ? O_RDWR | O_CREAT : O_RDONLY;
+		driver->fd = open(driver->filename, flags, 0666);
+		if (driver->fd == -1) {
+			if (errno == ENOENT) {
 				fprintf(stderr, "Opening unexisting file in readonly mode\n");
 				retval = RL_INVALID_PARAMETERS;
 				goto cleanup;
 			}
-			mode = "w+";
-		}
-		driver->fp = fopen(driver->filename, mode);
-		if (driver->fp == NULL) {
-			fprintf(stderr, "Cannot open file %s, errno %d, mode %s\n", driver->filename, errno, mode);
+			fprintf(stderr, "Cannot open file %s, errno %d\n", driver->filename, errno);
 			perror(NULL);
 			retval = RL_UNEXPECTED;
+		}
+		goto cleanup;
+	}
+
+	char *mode;
+	if (access(driver->filename, F_OK) == 0) {
+		mode = "r+";
+	}
+	else {
+		if ((driver->mode & RLITE_OPEN_READWRITE) == 0) {
+			fprintf(stderr, "Opening unexisting file in readonly mode\n");
+			retval = RL_INVALID_PARAMETERS;
 			goto cleanup;
 		}
-		retval = rl_flock(driver->fp, (driver->mode & RLITE_OPEN_READWRITE) ? RLITE_FLOCK_EX : RLITE_FLOCK_SH);
+		mode = "w+";
+	}
+	driver->fp = fopen(driver->filename, mode);
+	if (driver->fp == NULL) {
+		fprintf(stderr, "Cannot open file %s, errno %d, mode %s\n", driver->filename, errno, mode);
+		perror(NULL);
+		retval = RL_UNEXPECTED;
+		goto cleanup;
+	}
+	if (driver->mode & RLITE_OPEN_KEEP_FD) {
+		// other processes write to the file while we are not holding
+		// the lock, anything buffered by stdio could be stale
+		setvbuf(driver->fp, NULL, _IONBF, 0);
+	}
+cleanup:
+	return retval;
+}
+
+/**
+ * Reads the newest version of a page, which might only exist in the wal log.
+ */
+static size_t file_driver_read_page(rlite *db, long page, unsigned char *data, size_t len)
+{
+	int retval = rl_wal_log_read(db, page, data, len);
+	if (retval == RL_FOUND) {
+		return len;
+	}
+	if (retval != RL_NOT_FOUND) {
+		return 0;
+	}
+	return file_driver_read(db, page * db->page_size, data, len);
+}
+
+/**
+ * Drops the page cache if another process committed since it was filled.
+ * Called right after acquiring the lock, before any cached page is used.
+ */
+static int validate_page_cache(rlite *db)
+{
+	unsigned char data[HEADER_SIZE];
+	unsigned long long change_counter;
+	long pos = change_counter_position(db);
+	int empty;
+	rl_cache_enter(db);
+	empty = db->page_cache->len == 0;
+	rl_cache_leave(db);
+	if (empty) {
+		return RL_OK;
+	}
+	if (pos == -1 || file_driver_read_page(db, 0, data, pos + 8) != (size_t)pos + 8) {
+		rl_cache_enter(db);
+		rl_cache_clear(db, db->page_cache);
+		rl_cache_leave(db);
+		return RL_OK;
+	}
+	change_counter = get_8bytes(&data[pos]);
+	rl_cache_enter(db);
+	if (change_counter != db->page_cache->change_counter) {
+		rl_cache_clear(db, db->page_cache);
+		db->page_cache->change_counter = change_counter;
+	}
+	rl_cache_leave(db);
+	// make sure our next commit is seen as a change by everyone else
+	db->initial_change_counter =
+	db->change_counter = change_counter;
+	return RL_OK;
+}
+
+static int file_driver_fp(rlite *db)
+{
+	int retval = RL_OK;
+	rl_file_driver *driver = db->driver;
+	if (!file_driver_is_open(db)) {
+		RL_CALL(file_driver_open, RL_OK, db);
+	}
+	if (!driver->locked && !driver->reserved && !db->snapshot) {
+		if ((driver->mode & RLITE_OPEN_READWRITE) && !db->read_transaction) {
+			retval = file_driver_lock(db, file_driver_reserve, RLITE_FLOCK_EX);
+			driver->reserved = retval == RL_OK;
+		}
+		else {
+			retval = file_driver_lock(db, file_driver_flock, RLITE_FLOCK_SH);
+			driver->locked = retval == RL_OK;
+		}
 		if (retval != RL_OK) {
-			fclose(driver->fp);
-			driver->fp = NULL;
+			if ((driver->mode & RLITE_OPEN_KEEP_FD) == 0) {
+				file_driver_close(db);
+			}
 			goto cleanup;
 		}
+		RL_CALL(rl_wal_log_refresh, RL_OK, db);
+		if (db->page_cache) {
+			RL_CALL(validate_page_cache, RL_OK, db);
+		}
 	}
 cleanup:
 	return retval;
 }
 
+/**
+ * The change counter is stored right after the database list, in what used to
+ * be padding. Files written by older versions have zeros there.
+ * Returns -1 if it does not fit in the part of the header read on open.
+ */
+static long change_counter_position(rlite *db)
+{
+	long pos = strlen((char *)identifier) + 16 + 4 * (db->number_of_databases + RLITE_INTERNAL_DB_COUNT);
+	if (pos + 8 > HEADER_SIZE) {
+		return -1;
+	}
+	return pos;
+}
+
+/**
+ * The number of commits since the database was created, as of the start of
+ * the current transaction. RL_NOT_FOUND if the header has no room for it.
+ */
+int rl_get_change_counter(struct rlite *db, unsigned long long *change_counter)
+{
+	if (change_counter_position(db) == -1) {
+		return RL_NOT_FOUND;
+	}
+	*change_counter = db->initial_change_counter;
+	return RL_OK;
+}
+
 int rl_header_serialize(struct rlite *db, void *UNUSED(obj), unsigned char *data)
 {
 	int identifier_len = strlen((char *)identifier);
@@ -196,6 +553,10 @@ int rl_header_serialize(struct rlite *db, void *UNUSED(obj), unsigned char *data
 		}
 		pos += 4;
 	}
+	pos = change_counter_position(db);
+	if (pos != -1) {
+		put_8bytes(&data[pos], db->change_counter);
+	}
 	return RL_OK;
 }
 
@@ -216,6 +577,7 @@ int rl_header_deserialize(struct rlite *db, void **UNUSED(obj), void *UNUSED(con
 	db->number_of_databases = get_4bytes(&data[identifier_len + 12]);
 	rl_free(db->databases);
 	rl_free(db->initial_databases);
+	db->databases = db->initial_databases = NULL;
 	RL_MALLOC(db->databases, sizeof(long) * (db->number_of_databases + RLITE_INTERNAL_DB_COUNT));
 	RL_MALLOC(db->initial_databases, sizeof(long) * (db->number_of_databases + RLITE_INTERNAL_DB_COUNT));
 
@@ -225,29 +587,181 @@ int rl_header_deserialize(struct rlite *db, void **UNUSED(obj), void *UNUSED(con
 		db->databases[i] = get_4bytes(&data[pos]);
 		pos += 4;
 	}
+	pos = change_counter_position(db);
+	db->initial_change_counter =
+	db->change_counter = pos == -1 ? 0 : get_8bytes(&data[pos]);
+	if (db->page_cache && !db->snapshot) {
+		rl_cache_enter(db);
+		if (pos == -1 || db->page_cache->change_counter != db->change_counter) {
+			// someone else committed since we last looked; nothing we kept is reliable
+			rl_cache_clear(db, db->page_cache);
+			db->page_cache->change_counter = db->change_counter;
+		}
+		rl_cache_leave(db);
+	}
 cleanup:
 	return retval;
 }
 
-int rl_ensure_pages(rlite *db)
+#define PAGE_INDEX_EMPTY -1
+
+static long page_index_home(rl_page_index *index, long page_number)
+{
+	return (long)(((unsigned long)page_number * 2654435761UL) & (index->alloc - 1));
+}
+
+/**
+ * Slot of `page_number` in the index, or of the empty slot where it would go.
+ */
+static long page_index_slot(rl_page_index *index, rl_page **pages, long page_number)
+{
+	long slot = page_index_home(index, page_number);
+	while (index->slots[slot] != PAGE_INDEX_EMPTY && pages[index->slots[slot]]->page_number != page_number) {
+		slot = (slot + 1) & (index->alloc - 1);
+	}
+	return slot;
+}
+
+static long page_index_find(rl_page_index *index, rl_page **pages, long page_number)
+{
+	if (index->alloc == 0) {
+		return -1;
+	}
+	return index->slots[page_index_slot(index, pages, page_number)];
+}
+
+static void page_index_add(rl_page_index *index, rl_page **pages, long position)
+{
+	index->slots[page_index_slot(index, pages, pages[position]->page_number)] = position;
+}
+
+/**
+ * Removes a page from the index, moving back the entries that probed past it
+ * so that lookups never stop early.
+ */
+static void page_index_delete(rl_page_index *index, rl_page **pages, long page_number)
+{
+	long mask = index->alloc - 1;
+	long hole = page_index_slot(index, pages, page_number), slot = hole, home;
+	index->slots[hole] = PAGE_INDEX_EMPTY;
+	while (1) {
+		slot = (slot + 1) & mask;
+		if (index->slots[slot] == PAGE_INDEX_EMPTY) {
+			break;
+		}
+		home = page_index_home(index, pages[index->slots[slot]]->page_number);
+		if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+			index->slots[hole] = index->slots[slot];
+			index->slots[slot] = PAGE_INDEX_EMPTY;
+			hole = slot;
+		}
+	}
+}
+
+static int page_index_build(rl_page_index *index, rl_page **pages, long len, long alloc)
 {
 	int retval = RL_OK;
 	void *tmp;
+	long i;
+	if (index->alloc != alloc) {
+		RL_REALLOC(index->slots, sizeof(long) * alloc);
+		index->alloc = alloc;
+	}
+	for (i = 0; i < alloc; i++) {
+		index->slots[i] = PAGE_INDEX_EMPTY;
+	}
+	for (i = 0; i < len; i++) {
+		page_index_add(index, pages, i);
+	}
+cleanup:
+	return retval;
+}
+
+/**
+ * Takes the page in `position` out of the array and its index, filling the
+ * gap with the last page.
+ */
+static void remove_page(rl_page **pages, long *pages_len, rl_page_index *index, long position)
+{
+	long last = *pages_len - 1;
+	page_index_delete(index, pages, pages[position]->page_number);
+	if (position != last) {
+		index->slots[page_index_slot(index, pages, pages[last]->page_number)] = position;
+		pages[position] = pages[last];
+	}
+	*pages_len = last;
+}
+
+static int grow_pages(rl_page ***pages, long *pages_alloc, rl_page_index *index, long pages_len, long default_alloc)
+{
+	int retval = RL_OK;
+	void *tmp;
+	long alloc = *pages_alloc ? *pages_alloc * 2 : default_alloc;
+	RL_REALLOC(*pages, sizeof(rl_page *) * alloc);
+	*pages_alloc = alloc;
+	RL_CALL(page_index_build, RL_OK, index, *pages, pages_len, alloc * 2);
+cleanup:
+	return retval;
+}
+
+int rl_ensure_pages(rlite *db)
+{
+	int retval = RL_OK;
 	if (rl_has_flag(db, RLITE_OPEN_READWRITE)) {
 		if (db->write_pages_len == db->write_pages_alloc) {
-			RL_REALLOC(db->write_pages, sizeof(rl_page *) * db->write_pages_alloc * 2)
-			db->write_pages_alloc *= 2;
+			RL_CALL(grow_pages, RL_OK, &db->write_pages, &db->write_pages_alloc, &db->write_pages_index, db->write_pages_len, DEFAULT_WRITE_PAGES_LEN);
 		}
 	}
 	if (db->read_pages_len == db->read_pages_alloc) {
-		RL_REALLOC(db->read_pages, sizeof(rl_page *) * db->read_pages_alloc * 2)
-		db->read_pages_alloc *= 2;
+		RL_CALL(grow_pages, RL_OK, &db->read_pages, &db->read_pages_alloc, &db->read_pages_index, db->read_pages_len, DEFAULT_READ_PAGES_LEN);
+	}
+cleanup:
+	return retval;
+}
+
+int rl_add_read_page(rlite *db, rl_page *page)
+{
+	int retval;
+	if (db->read_pages_len == db->read_pages_alloc) {
+		RL_CALL(grow_pages, RL_OK, &db->read_pages, &db->read_pages_alloc, &db->read_pages_index, db->read_pages_len, DEFAULT_READ_PAGES_LEN);
 	}
+	db->read_pages[db->read_pages_len] = page;
+	page_index_add(&db->read_pages_index, db->read_pages, db->read_pages_len);
+	db->read_pages_len++;
+	retval = RL_OK;
 cleanup:
 	return retval;
 }
 
+static int page_number_cmp(const void *a, const void *b)
+{
+	long pa = (*(rl_page **)a)->page_number, pb = (*(rl_page **)b)->page_number;
+	return pa < pb ? -1 : (pa > pb ? 1 : 0);
+}
+
+/**
+ * The wal wants the dirty pages in page order; it is cheaper to sort them
+ * once when the transaction is written than to keep them sorted.
+ */
+int rl_sort_write_pages(rlite *db)
+{
+	if (db->write_pages_len < 2) {
+		return RL_OK;
+	}
+	qsort(db->write_pages, db->write_pages_len, sizeof(rl_page *), page_number_cmp);
+	return page_index_build(&db->write_pages_index, db->write_pages, db->write_pages_len, db->write_pages_index.alloc);
+}
+
 int rl_open(const char *filename, rlite **_db, int flags)
+{
+	return rl_open_busy_timeout(filename, _db, flags, 0);
+}
+
+/**
+ * Like rl_open, with the busy timeout already set for the locks taken
+ * while opening. See rl_set_busy_timeout.
+ */
+int rl_open_busy_timeout(const char *filename, rlite **_db, int flags, long busy_timeout)
 {
 	int retval = RL_OK;
 	rlite *db;
@@ -262,22 +776,34 @@ int rl_open(const char *filename, rlite **_db, int flags)
 	db->page_size = DEFAULT_PAGE_SIZE;
 	db->read_pages = db->write_pages = NULL;
 	db->read_pages_alloc = db->read_pages_len = db->write_pages_len = db->write_pages_alloc = 0;
+	db->read_pages_index.alloc = db->write_pages_index.alloc = 0;
+	db->read_pages_index.slots = db->write_pages_index.slots = NULL;
 	db->initial_number_of_pages = db->number_of_pages = 0;
 	db->initial_number_of_databases =
 	db->number_of_databases = 0;
 	db->driver = NULL;
 	db->driver_type = -1;
-
-	RL_MALLOC(db->read_pages, sizeof(rl_page *) * DEFAULT_READ_PAGES_LEN)
-	db->read_pages_len = 0;
-	db->read_pages_alloc = DEFAULT_READ_PAGES_LEN;
-	db->write_pages_len = 0;
+	db->initial_change_counter = db->change_counter = 0;
+	db->page_cache = NULL;
+	db->shared_cache = NULL;
+	db->read_transaction = 0;
+	memset(&db->stats, 0, sizeof(db->stats));
+	db->sync_mode = RLITE_SYNC_NONE;
+	db->sync_group_ms = 0;
+	db->sync_group_commits = 0;
+	db->sync_group = NULL;
+	db->wal_log = NULL;
+	db->wal_checkpoint_pages = RL_DEFAULT_WAL_CHECKPOINT_PAGES;
+	db->snapshot_fd = -1;
+	db->snapshot = 0;
+	db->discards = 0;
+	rl_set_busy_timeout(db, busy_timeout);
+	db->wal_checksum = RL_CHECKSUM_CRC32C;
+
+	RL_CALL(rl_cache_create, RL_OK, &db->page_cache, RL_DEFAULT_PAGE_CACHE_SIZE);
+	RL_CALL(grow_pages, RL_OK, &db->read_pages, &db->read_pages_alloc, &db->read_pages_index, 0, DEFAULT_READ_PAGES_LEN);
 	if ((flags & RLITE_OPEN_READWRITE) > 0) {
-		db->write_pages_alloc = DEFAULT_WRITE_PAGES_LEN;
-		RL_MALLOC(db->write_pages, sizeof(rl_page *) * DEFAULT_WRITE_PAGES_LEN);
-	}
-	else {
-		db->write_pages_alloc = 0;
+		RL_CALL(grow_pages, RL_OK, &db->write_pages, &db->write_pages_alloc, &db->write_pages_index, 0, DEFAULT_WRITE_PAGES_LEN);
 	}
 
 	if (strcmp(filename, ":memory:") == 0) {
@@ -306,6 +832,12 @@ int rl_open(const char *filename, rlite **_db, int flags)
 		rl_file_driver *driver;
 		RL_MALLOC(driver, sizeof(*driver));
 		driver->fp = NULL;
+		driver->fd = -1;
+		driver->map = NULL;
+		driver->maplen = 0;
+		driver->locked = 0;
+		driver->reserved = 0;
+		driver->writer_fd = -1;
 		driver->filename = rl_malloc(sizeof(char) * (strlen(filename) + 1));
 		if (!driver->filename) {
 			rl_free(driver);
@@ -315,7 +847,20 @@ int rl_open(const char *filename, rlite **_db, int flags)
 		strcpy(driver->filename, filename);
 		driver->mode = flags;
 		db->driver = driver;
-		db->driver_type = RL_FILE_DRIVER;
+		if (flags & RLITE_OPEN_MMAP) {
+			db->driver_type = RL_MMAP_DRIVER;
+		}
+		else if (flags & RLITE_OPEN_PFILE) {
+			db->driver_type = RL_PFILE_DRIVER;
+		}
+		else {
+			db->driver_type = RL_FILE_DRIVER;
+		}
+		if (flags & RLITE_OPEN_SHARED) {
+			// the group is found by the file's inode, it has to exist
+			RL_CALL(file_driver_open, RL_OK, db);
+			RL_CALL(rl_shared_cache_acquire, RL_OK, db);
+		}
 	}
 
 	RL_CALL(rl_read_header, RL_OK, db);
@@ -331,7 +876,7 @@ cleanup:
 int rl_refresh(rlite *db)
 {
 	int retval = RL_OK;
-	if (db->driver_type == RL_FILE_DRIVER) {
+	if (RL_IS_FILE_DRIVER(db)) {
 		RL_CALL(rl_discard, RL_OK, db);
 		RL_CALL(rl_read_header, RL_OK, db);
 	}
@@ -345,13 +890,24 @@ int rl_close(rlite *db)
 		return RL_OK;
 	}
 
-	if (db->driver_type == RL_FILE_DRIVER) {
+	if (RL_IS_FILE_DRIVER(db)) {
 		rl_unsubscribe_all(db);
 	}
 	// discard before removing the driver, since we need to release locks
 	rl_discard(db);
-	if (db->driver_type == RL_FILE_DRIVER) {
+	if (RL_IS_FILE_DRIVER(db)) {
 		rl_file_driver *driver = db->driver;
+		// flushes the log, which may outlive this handle
+		rl_close_sync(db);
+		if (db->wal_log && file_driver_fp(db) == RL_OK) {
+			rl_close_wal_log(db, 1);
+			file_driver_unlock(db);
+		}
+		rl_close_wal_log(db, 0);
+		file_driver_close(db);
+		if (driver->writer_fd != -1) {
+			close(driver->writer_fd);
+		}
 		rl_free(driver->filename);
 	}
 	else if (db->driver_type == RL_MEMORY_DRIVER) {
@@ -362,10 +918,18 @@ int rl_close(rlite *db)
 		remove(db->subscriber_lock_filename);
 		rl_free(db->subscriber_lock_filename);
 	}
+	if (db->shared_cache) {
+		rl_shared_cache_release(db);
+	}
+	else {
+		rl_cache_destroy(db, db->page_cache);
+	}
 	rl_free(db->driver);
 	rl_free(db->subscriber_id);
 	rl_free(db->read_pages);
 	rl_free(db->write_pages);
+	rl_free(db->read_pages_index.slots);
+	rl_free(db->write_pages_index.slots);
 	rl_free(db->databases);
 	rl_free(db->initial_databases);
 	rl_free(db);
@@ -374,7 +938,7 @@ int rl_close(rlite *db)
 
 int rl_has_flag(rlite *db, int flag)
 {
-	if (db->driver_type == RL_FILE_DRIVER) {
+	if (RL_IS_FILE_DRIVER(db)) {
 		return (((rl_file_driver *)db->driver)->mode & flag) > 0;
 	}
 	else if (db->driver_type == RL_MEMORY_DRIVER) {
@@ -443,7 +1007,7 @@ int rl_read_header(rlite *db)
 		db->page_size = DEFAULT_PAGE_SIZE;
 		RL_CALL(rl_create_db, RL_OK, db);
 	}
-	else if (db->driver_type == RL_FILE_DRIVER) {
+	else if (RL_IS_FILE_DRIVER(db)) {
 		RL_CALL(file_driver_fp, RL_OK, db);
 		RL_CALL(rl_apply_wal, RL_OK, db);
 		retval = rl_read(db, &rl_data_type_header, 0, NULL, NULL, 1);
@@ -485,103 +1049,108 @@ void print_cache(rlite *db)
 #endif
 
 #ifdef RL_DEBUG
-int rl_search_cache(rlite *db, rl_data_type *type, long page_number, void **obj, long *position, void *context, rl_page **pages, long page_len)
+int rl_search_cache(rlite *db, rl_data_type *type, long page_number, void **obj, long *position, void *context, rl_page **pages, rl_page_index *index)
 #else
-static int rl_search_cache(rlite *db, rl_data_type *type, long page_number, void **obj, long *position, void *context, rl_page **pages, long page_len)
+static int rl_search_cache(rlite *db, rl_data_type *type, long page_number, void **obj, long *position, void *context, rl_page **pages, rl_page_index *index)
 #endif
 {
-	long pos, min = 0, max = page_len - 1;
 	rl_page *page;
-	if (max >= 0) {
-		do {
-			pos = min + (max - min) / 2;
-			page = pages[pos];
-			if (page->page_number == page_number) {
-				if (obj) {
-					if (page->type == NULL) {
-						// This happens when we are in read-only mode, and have a wal file
-						unsigned char *serialize_data = page->obj;
-						int retval = type->deserialize(db, &page->obj, context, serialize_data);
-						if (retval != RL_OK) {
-							return retval;
-						}
-						page->type = type;
-						rl_free(serialize_data);
-					}
-					*obj = page->obj;
-#ifdef RL_DEBUG
-				if (page->type != &rl_data_type_long && type != &rl_data_type_long && type != NULL && page->type != type) {
-					fprintf(stderr, "Type of page in cache (%s) doesn't match the asked one (%s)\n", page->type->name, type->name);
-					return RL_UNEXPECTED;
-				}
-#endif
-				}
-				if (position) {
-					*position = pos;
-				}
-				return RL_FOUND;
-			}
-			else if (page->page_number > page_number) {
-				max = pos - 1;
-			}
-			else {
-				min = pos + 1;
+	long pos = page_index_find(index, pages, page_number);
+	if (pos == -1) {
+		return RL_NOT_FOUND;
+	}
+	page = pages[pos];
+	if (obj) {
+		if (page->type == NULL) {
+			// This happens when we are in read-only mode, and have a wal file
+			unsigned char *serialize_data = page->obj;
+			int retval = type->deserialize(db, &page->obj, context, serialize_data);
+			if (retval != RL_OK) {
+				return retval;
 			}
+			db->stats.bytes_deserialized += db->page_size;
+			page->type = type;
+			rl_free(serialize_data);
 		}
-		while (max >= min);
-		if (position) {
-			if (pages[pos]->page_number > page_number && pos > 0) {
-				pos--;
-			}
-			if (pages[pos]->page_number < page_number && pos < page_len) {
-				pos++;
-			}
+		*obj = page->obj;
 #ifdef RL_DEBUG
-			long i, prev;
-			rl_page *p;
-			for (i = 0; i < db->read_pages_len; i++) {
-				p = db->read_pages[i];
-				if (i > 0) {
-					if (prev >= p->page_number) {
-						fprintf(stderr, "Reading cache is broken\n");
-						print_cache(db);
-						return RL_UNEXPECTED;
-					}
-				}
-				prev = p->page_number;
-			}
-			for (i = 0; i < db->write_pages_len; i++) {
-				p = db->write_pages[i];
-				if (i > 0) {
-					if (prev >= p->page_number) {
-						fprintf(stderr, "Writing cache is broken\n");
-						print_cache(db);
-						return RL_UNEXPECTED;
-					}
-				}
-				prev = p->page_number;
-			}
-#endif
-			*position = pos;
+		if (page->type != &rl_data_type_long && type != &rl_data_type_long && type != NULL && page->type != type) {
+			fprintf(stderr, "Type of page in cache (%s) doesn't match the asked one (%s)\n", page->type->name, type->name);
+			return RL_UNEXPECTED;
 		}
+#endif
 	}
-	else {
-		if (position) {
-			*position = 0;
-		}
+	if (position) {
+		*position = pos;
 	}
-	return RL_NOT_FOUND;
+	return RL_FOUND;
 }
 
 int rl_read_from_cache(rlite *db, rl_data_type *type, long page_number, void *context, void **obj)
 {
-	int retval = rl_search_cache(db, type, page_number, obj, NULL, context, db->write_pages, db->write_pages_len);
-	if (retval == RL_NOT_FOUND) {
-		retval = rl_search_cache(db, type, page_number, obj, NULL, context, db->read_pages, db->read_pages_len);
+	long pos = 0;
+	int retval = rl_search_cache(db, type, page_number, obj, &pos, context, db->write_pages, &db->write_pages_index);
+	if (retval == RL_FOUND) {
+		// the caller may modify a dirty page without writing it again
+		db->write_pages[pos]->dirty_checksum_valid = 0;
+	}
+	else if (retval == RL_NOT_FOUND) {
+		retval = rl_search_cache(db, type, page_number, obj, NULL, context, db->read_pages, &db->read_pages_index);
+	}
+	return retval;
+}
+
+/**
+ * Copies a page kept by a shared page cache into `data`, see rl_cache_copy.
+ */
+static int copy_cached_page(rlite *db, rl_data_type *type, long page_number, unsigned char *data)
+{
+	int retval;
+	rl_cache_enter(db);
+	if (db->snapshot && db->page_cache->change_counter != db->change_counter) {
+		// the cache holds a different version than the one this snapshot sees
+		retval = RL_NOT_FOUND;
+	}
+	else {
+		retval = rl_cache_copy(db, db->page_cache, type, page_number, data);
+	}
+	rl_cache_leave(db);
+	if (retval == RL_FOUND) {
+		db->stats.cache_hits++;
 	}
 	return retval;
 }
 
+/**
+ * Moves a page kept by the page cache into this transaction's read pages.
+ */
+static int take_cached_page(rlite *db, rl_data_type *type, long page_number)
+{
+	rl_page *page;
+	int retval;
+	rl_cache_enter(db);
+	if (db->snapshot && db->page_cache->change_counter != db->change_counter) {
+		// the cache holds a different version than the one this snapshot sees
+		retval = RL_NOT_FOUND;
+	}
+	else {
+		retval = rl_cache_take(db, db->page_cache, type, page_number, &page);
+	}
+	rl_cache_leave(db);
+	if (retval != RL_FOUND) {
+		return retval;
+	}
+	retval = rl_add_read_page(db, page);
+	if (retval != RL_OK) {
+		rl_cache_enter(db);
+		rl_cache_put(db, db->page_cache, page);
+		rl_cache_leave(db);
+		return retval;
+	}
+	db->stats.cache_hits++;
+	return RL_FOUND;
+}
+
 int rl_read(rlite *db, rl_data_type *type, long page, void *context, void **obj, int cache)
 {
 	// fprintf(stderr, "r %ld %s\n", page, type->name);
@@ -594,9 +1163,18 @@ int rl_read(rlite *db, rl_data_type *type, long page, void *context, void **obj,
 	}
 #endif
 	unsigned char *data = NULL;
-	int retval;
+	int retval, mapped = 0, copied = 0;
 	unsigned char *serialize_data;
 	retval = rl_read_from_cache(db, type, page, context, obj);
+	if (retval == RL_NOT_FOUND && page != 0 && db->page_cache && !db->shared_cache) {
+		if (RL_IS_FILE_DRIVER(db)) {
+			RL_CALL(file_driver_fp, RL_OK, db);
+		}
+		retval = take_cached_page(db, type, page);
+		if (retval == RL_FOUND) {
+			retval = rl_read_from_cache(db, type, page, context, obj);
+		}
+	}
 	if (retval != RL_NOT_FOUND) {
 		if (!cache) {
 			RL_MALLOC(serialize_data, db->page_size * sizeof(unsigned char));
@@ -610,17 +1188,45 @@ int rl_read(rlite *db, rl_data_type *type, long page, void *context, void **obj,
 			if (retval != RL_OK) {
 				return retval;
 			}
+			db->stats.bytes_serialized += db->page_size;
+			db->stats.bytes_deserialized += db->page_size;
 			retval = RL_FOUND;
 		}
 		return retval;
 	}
-	RL_MALLOC(data, db->page_size * sizeof(unsigned char));
-	if (db->driver_type == RL_FILE_DRIVER) {
-		rl_file_driver *driver = db->driver;
+	if (RL_IS_FILE_DRIVER(db)) {
 		RL_CALL(file_driver_fp, RL_OK, db);
-		fseek(driver->fp, page * db->page_size, SEEK_SET);
-		size_t read = fread(data, sizeof(unsigned char), db->page_size, driver->fp);
-		if (read != (size_t)db->page_size) {
+	}
+	if (page != 0 && db->shared_cache) {
+		RL_MALLOC(data, db->page_size * sizeof(unsigned char));
+		copied = copy_cached_page(db, type, page, data) == RL_FOUND;
+		if (!copied) {
+			rl_free(data);
+			data = NULL;
+		}
+	}
+#ifndef RL_DEBUG
+	// debug builds keep the serialized data around, they need their own copy
+	// pages in the wal log are not in the mapping yet
+	mapped = !copied && db->driver_type == RL_MMAP_DRIVER && rl_wal_log_read(db, page, NULL, 0) == RL_NOT_FOUND;
+#endif
+	if (!mapped && !copied) {
+		RL_MALLOC(data, db->page_size * sizeof(unsigned char));
+	}
+	if (copied) {
+		// the shared page cache filled `data` already
+	}
+	else if (mapped) {
+		retval = file_driver_map_page(db, page, &data);
+		if (retval != RL_OK) {
+			if (retval == RL_NOT_FOUND && page > 0) {
+				fprintf(stderr, "Unable to read page %ld on line %d\n", page, __LINE__);
+			}
+			goto cleanup;
+		}
+	}
+	else if (RL_IS_FILE_DRIVER(db)) {
+		if (file_driver_read_page(db, page, data, db->page_size) != (size_t)db->page_size) {
 			if (page > 0) {
 #ifdef RL_DEBUG
 				print_cache(db);
@@ -647,8 +1253,7 @@ int rl_read(rlite *db, rl_data_type *type, long page, void *context, void **obj,
 		goto cleanup;
 	}
 
-	long pos;
-	retval = rl_search_cache(db, type, page, NULL, &pos, context, db->read_pages, db->read_pages_len);
+	retval = rl_search_cache(db, type, page, NULL, NULL, context, db->read_pages, &db->read_pages_index);
 	if (retval != RL_NOT_FOUND) {
 		fprintf(stderr, "Unexpectedly found page in cache\n");
 		retval = RL_UNEXPECTED;
@@ -659,9 +1264,12 @@ int rl_read(rlite *db, rl_data_type *type, long page, void *context, void **obj,
 	if (retval != RL_OK) {
 		goto cleanup;
 	}
+	if (!copied) {
+		db->stats.pages_read++;
+	}
+	db->stats.bytes_deserialized += db->page_size;
 
 	if (cache) {
-		rl_ensure_pages(db);
 		rl_page *page_obj;
 		page_obj = rl_malloc(sizeof(*page_obj));
 		if (!page_obj) {
@@ -677,6 +1285,7 @@ int rl_read(rlite *db, rl_data_type *type, long page, void *context, void **obj,
 		page_obj->page_number = page;
 		page_obj->type = type;
 		page_obj->obj = obj ? *obj : NULL;
+		page_obj->dirty_checksum_valid = 0;
 #ifdef RL_DEBUG
 		keep = 1;
 		if (initial_page_size != db->page_size) {
@@ -715,11 +1324,18 @@ int rl_read(rlite *db, rl_data_type *type, long page, void *context, void **obj,
 		}
 		rl_free(serialize_data);
 #endif
-		if (pos < db->read_pages_len) {
-			memmove(&db->read_pages[pos + 1], &db->read_pages[pos], sizeof(rl_page *) * (db->read_pages_len - pos));
+		retval = rl_add_read_page(db, page_obj);
+		if (retval != RL_OK) {
+			if (obj && type->destroy && *obj) {
+				type->destroy(db, *obj);
+				*obj = NULL;
+			}
+#ifdef RL_DEBUG
+			keep = 0;
+#endif
+			rl_free(page_obj);
+			goto cleanup;
 		}
-		db->read_pages[pos] = page_obj;
-		db->read_pages_len++;
 	}
 	if (retval == RL_OK) {
 		retval = RL_FOUND;
@@ -731,7 +1347,9 @@ cleanup:
 	}
 #endif
 #ifndef RL_DEBUG
-	rl_free(data);
+	if (!mapped) {
+		rl_free(data);
+	}
 #endif
 	return retval;
 }
@@ -769,8 +1387,9 @@ int rl_write(struct rlite *db, rl_data_type *type, long page_number, void *obj)
 		}
 	}
 
-	retval = rl_search_cache(db, type, page_number, NULL, &pos, NULL, db->write_pages, db->write_pages_len);
+	retval = rl_search_cache(db, type, page_number, NULL, &pos, NULL, db->write_pages, &db->write_pages_index);
 	if (retval == RL_FOUND) {
+		db->write_pages[pos]->dirty_checksum_valid = 0;
 		if (obj != db->write_pages[pos]->obj) {
 			if (db->write_pages[pos]->obj) {
 				db->write_pages[pos]->type->destroy(db, db->write_pages[pos]->obj);
@@ -781,7 +1400,7 @@ int rl_write(struct rlite *db, rl_data_type *type, long page_number, void *obj)
 		retval = RL_OK;
 	}
 	else if (retval == RL_NOT_FOUND) {
-		if (db->driver_type == RL_FILE_DRIVER) {
+		if (RL_IS_FILE_DRIVER(db)) {
 			RL_CALL(file_driver_fp, RL_OK, db);
 		}
 		rl_ensure_pages(db);
@@ -792,13 +1411,12 @@ int rl_write(struct rlite *db, rl_data_type *type, long page_number, void *obj)
 		page->page_number = page_number;
 		page->type = type;
 		page->obj = obj;
-		if (pos < db->write_pages_len) {
-			memmove(&db->write_pages[pos + 1], &db->write_pages[pos], sizeof(rl_page *) * (db->write_pages_len - pos));
-		}
-		db->write_pages[pos] = page;
+		page->dirty_checksum_valid = 0;
+		db->write_pages[db->write_pages_len] = page;
+		page_index_add(&db->write_pages_index, db->write_pages, db->write_pages_len);
 		db->write_pages_len++;
 
-		retval = rl_search_cache(db, type, page_number, NULL, &pos, NULL, db->read_pages, db->read_pages_len);
+		retval = rl_search_cache(db, type, page_number, NULL, &pos, NULL, db->read_pages, &db->read_pages_index);
 		if (retval == RL_FOUND) {
 #ifdef RL_DEBUG
 			rl_free(db->read_pages[pos]->serialized_data);
@@ -806,9 +1424,9 @@ int rl_write(struct rlite *db, rl_data_type *type, long page_number, void *obj)
 			if (db->read_pages[pos]->obj != obj) {
 				db->read_pages[pos]->type->destroy(db, db->read_pages[pos]->obj);
 			}
-			rl_free(db->read_pages[pos]);
-			memmove(&db->read_pages[pos], &db->read_pages[pos + 1], sizeof(rl_page *) * (db->read_pages_len - pos));
-			db->read_pages_len--;
+			page = db->read_pages[pos];
+			remove_page(db->read_pages, &db->read_pages_len, &db->read_pages_index, pos);
+			rl_free(page);
 			retval = RL_OK;
 		}
 		else if (retval != RL_NOT_FOUND) {
@@ -834,14 +1452,15 @@ int rl_purge_cache(struct rlite *db, long page_number)
 {
 	long pos;
 	int retval;
-	retval = rl_search_cache(db, NULL, page_number, NULL, &pos, NULL, db->write_pages, db->write_pages_len);
+	retval = rl_search_cache(db, NULL, page_number, NULL, &pos, NULL, db->write_pages, &db->write_pages_index);
 	if (retval == RL_FOUND) {
 		db->write_pages[pos]->obj = NULL;
+		db->write_pages[pos]->dirty_checksum_valid = 0;
 	}
 	else if (retval != RL_NOT_FOUND) {
 		goto cleanup;
 	}
-	retval = rl_search_cache(db, NULL, page_number, NULL, &pos, NULL, db->read_pages, db->read_pages_len);
+	retval = rl_search_cache(db, NULL, page_number, NULL, &pos, NULL, db->read_pages, &db->read_pages_index);
 	if (retval == RL_FOUND) {
 		db->read_pages[pos]->obj = NULL;
 	}
@@ -868,29 +1487,43 @@ cleanup:
 	return retval;
 }
 
+/**
+ * Digest of every dirty page, to find out whether a command changed anything.
+ * Each page's crc32c is kept until the page might have been modified, so
+ * pages untouched since the last call are not serialized again.
+ */
 int rl_dirty_hash(struct rlite *db, unsigned char **hash)
 {
 	long i;
 	int retval = RL_OK;
 	rl_page *page;
 	SHA1_CTX sha;
-	unsigned char *data = NULL;
+	unsigned char *data = NULL, entry[8];
 
 	if (db->write_pages_len == 0) {
 		*hash = NULL;
 		goto cleanup;
 	}
 
-	RL_MALLOC(data, db->page_size * sizeof(unsigned char));
 	RL_MALLOC(*hash, sizeof(unsigned char) * 20);
 	SHA1Init(&sha);
 	for (i = 0; i < db->write_pages_len; i++) {
 		page = db->write_pages[i];
-		memset(data, 0, db->page_size);
-		if (page->type) {
-			retval = page->type->serialize(db, page->obj, data);
+		if (!page->dirty_checksum_valid) {
+			if (!data) {
+				RL_MALLOC(data, db->page_size * sizeof(unsigned char));
+			}
+			memset(data, 0, db->page_size);
+			if (page->type) {
+				retval = page->type->serialize(db, page->obj, data);
+			}
+			page->dirty_checksum = rl_crc32c(0, data, db->page_size);
+			// the header is built from rlite's fields, not from page->obj
+			page->dirty_checksum_valid = page->page_number != 0;
 		}
-		SHA1Update(&sha, data, db->page_size);
+		put_4bytes(entry, page->page_number);
+		memcpy(&entry[4], &page->dirty_checksum, 4);
+		SHA1Update(&sha, entry, 8);
 	}
 	SHA1Final(*hash, &sha);
 cleanup:
@@ -902,21 +1535,196 @@ cleanup:
 	return retval;
 }
 
+/**
+ * Hands every page of a committed transaction to the page cache, leaving in
+ * the transaction only those that cannot outlive it.
+ */
+static void cache_pages(rlite *db, rl_page **pages, long *pages_len)
+{
+	long i, len = 0;
+	rl_page *page;
+	for (i = 0; i < *pages_len; i++) {
+		page = pages[i];
+		// the header is always read again to find out if the cache is stale
+		if (page->page_number == 0 || page->type == NULL || page->obj == NULL) {
+			pages[len++] = page;
+			continue;
+		}
+#ifdef RL_DEBUG
+		if (!page->serialized_data) {
+			page->serialized_data = calloc(db->page_size, sizeof(unsigned char));
+			if (!page->serialized_data) {
+				pages[len++] = page;
+				continue;
+			}
+			page->type->serialize(db, page->obj, page->serialized_data);
+		}
+#endif
+		// on failure the page is released, which is all we can do
+		rl_cache_put(db, db->page_cache, page);
+	}
+	*pages_len = len;
+}
+
 int rl_commit(struct rlite *db)
 {
 	int retval;
+	if (db->write_pages_len > 0) {
+		db->change_counter++;
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_header, 0, NULL);
+		RL_CALL(rl_lock_exclusive, RL_OK, db);
+	}
+	RL_CALL(rl_sort_write_pages, RL_OK, db);
 	RL_CALL(rl_write_apply_wal, RL_OK, db);
+	db->initial_change_counter = db->change_counter;
 	db->initial_next_empty_page = db->next_empty_page;
 	db->initial_number_of_pages = db->number_of_pages;
 	db->initial_number_of_databases = db->number_of_databases;
 	rl_free(db->initial_databases);
 	RL_MALLOC(db->initial_databases, sizeof(long) * (db->number_of_databases + RLITE_INTERNAL_DB_COUNT));
 	memcpy(db->initial_databases, db->databases, sizeof(long) * (db->number_of_databases + RLITE_INTERNAL_DB_COUNT));
+	if (db->page_cache) {
+		rl_cache_enter(db);
+		db->page_cache->change_counter = db->change_counter;
+		cache_pages(db, db->read_pages, &db->read_pages_len);
+		cache_pages(db, db->write_pages, &db->write_pages_len);
+		rl_cache_leave(db);
+	}
 	rl_discard(db);
 cleanup:
 	return retval;
 }
 
+/**
+ * Waits for the readers of the file to finish and keeps new ones out, for a
+ * writer that is about to change the database. Held until the transaction
+ * ends.
+ */
+int rl_lock_exclusive(struct rlite *db)
+{
+	int retval = RL_OK;
+	rl_file_driver *driver;
+	if (!RL_IS_FILE_DRIVER(db)) {
+		goto cleanup;
+	}
+	driver = db->driver;
+	RL_CALL(file_driver_fp, RL_OK, db);
+	if (driver->reserved && !driver->locked) {
+		RL_CALL(file_driver_lock, RL_OK, db, file_driver_flock, RLITE_FLOCK_EX);
+		driver->locked = 1;
+	}
+cleanup:
+	return retval;
+}
+
+/**
+ * Starts a transaction that only reads, holding a shared lock so other
+ * readers can run alongside it. It must end with rl_end_read instead of
+ * rl_commit. Fails with RL_INVALID_STATE if a crashed commit has to be
+ * recovered first, which needs a regular transaction.
+ * When the file has a wal log, the transaction reads a snapshot of it
+ * instead and does not wait for writers at all, see rl_wal_log_snapshot.
+ */
+int rl_begin_read(struct rlite *db)
+{
+	int retval;
+	RL_CALL(rl_discard, RL_OK, db);
+	db->read_transaction = 1;
+	if (RL_IS_FILE_DRIVER(db)) {
+		retval = rl_wal_log_snapshot(db);
+		if (retval == RL_OK || retval == RL_NOT_FOUND) {
+			retval = rl_read_header(db);
+		}
+		if (retval != RL_OK) {
+			rl_discard(db);
+			goto cleanup;
+		}
+	}
+	retval = RL_OK;
+cleanup:
+	return retval;
+}
+
+/**
+ * Ends a transaction started by rl_begin_read, keeping what it read in the
+ * page cache. There is no wal to write.
+ * If anything was written, like an expired key being deleted, the changes
+ * are dropped and RL_INVALID_STATE is returned; the caller has to do the
+ * work again in a regular transaction.
+ */
+int rl_end_read(struct rlite *db)
+{
+	int retval = RL_OK;
+	if (db->write_pages_len > 0) {
+		rl_discard(db);
+		retval = RL_INVALID_STATE;
+		goto cleanup;
+	}
+	if (db->page_cache) {
+		rl_cache_enter(db);
+		if (!db->snapshot) {
+			db->page_cache->change_counter = db->change_counter;
+		}
+		// a snapshot older than the cache keeps its pages to itself
+		if (db->page_cache->change_counter == db->change_counter) {
+			cache_pages(db, db->read_pages, &db->read_pages_len);
+		}
+		rl_cache_leave(db);
+	}
+	RL_CALL(rl_discard, RL_OK, db);
+cleanup:
+	return retval;
+}
+
+/**
+ * Makes lock acquisition give up with RL_TIMEOUT after waiting `ms`
+ * milliseconds, backing off between attempts. Zero or less waits forever.
+ */
+int rl_set_busy_timeout(struct rlite *db, long ms)
+{
+	if (ms <= 0) {
+		return rl_set_busy_handler(db, NULL, NULL);
+	}
+	db->busy_timeout = ms;
+	return rl_set_busy_handler(db, busy_timeout_handler, db);
+}
+
+/**
+ * Called with `arg` and the number of previous calls for the same lock
+ * every time a lock is taken by someone else. Returning 0 gives up, and
+ * the operation fails with RL_TIMEOUT; anything else tries again. NULL
+ * waits for the lock forever.
+ */
+int rl_set_busy_handler(struct rlite *db, int (*handler)(void *arg, int count), void *arg)
+{
+	db->busy_handler = handler;
+	db->busy_arg = arg;
+	if (handler != busy_timeout_handler) {
+		db->busy_timeout = 0;
+	}
+	return RL_OK;
+}
+
+int rl_set_page_cache_size(struct rlite *db, long size)
+{
+	int retval = RL_OK;
+	if (db->shared_cache) {
+		// the other handles keep using it, only its size changes
+		rl_cache_enter(db);
+		rl_cache_resize(db, db->page_cache, size);
+		rl_cache_leave(db);
+		return RL_OK;
+	}
+	rl_cache_destroy(db, db->page_cache);
+	db->page_cache = NULL;
+	if (size > 0) {
+		RL_CALL(rl_cache_create, RL_OK, &db->page_cache, size);
+		db->page_cache->change_counter = db->initial_change_counter;
+	}
+cleanup:
+	return retval;
+}
+
 int rl_discard(struct rlite *db)
 {
 	long i;
@@ -925,12 +1733,14 @@ int rl_discard(struct rlite *db)
 
 	rl_page *page;
 
-	if (db->driver_type == RL_FILE_DRIVER) {
+	db->discards++;
+	db->read_transaction = 0;
+	if (RL_IS_FILE_DRIVER(db)) {
 		rl_file_driver *driver = db->driver;
-		if (driver->fp) {
-			RL_CALL(rl_flock, RL_OK, driver->fp, RLITE_FLOCK_UN);
-			fclose(driver->fp);
-			driver->fp = NULL;
+		RL_CALL(file_driver_unlock, RL_OK, db);
+		RL_CALL(rl_wal_log_release_snapshot, RL_OK, db);
+		if ((driver->mode & RLITE_OPEN_KEEP_FD) == 0) {
+			file_driver_close(db);
 		}
 	}
 
@@ -960,6 +1770,7 @@ int rl_discard(struct rlite *db)
 	db->read_pages_len = 0;
 	db->write_pages_len = 0;
 
+	db->change_counter = db->initial_change_counter;
 	db->next_empty_page = db->initial_next_empty_page;
 	db->number_of_pages = db->initial_number_of_pages;
 	db->number_of_databases = db->initial_number_of_databases;
@@ -978,6 +1789,7 @@ int rl_discard(struct rlite *db)
 		db->read_pages = tmp;
 		db->read_pages_alloc = DEFAULT_READ_PAGES_LEN;
 	}
+	RL_CALL(page_index_build, RL_OK, &db->read_pages_index, db->read_pages, 0, DEFAULT_READ_PAGES_LEN * 2);
 	if (db->write_pages_alloc > 0) {
 		if (db->write_pages_alloc != DEFAULT_WRITE_PAGES_LEN) {
 			db->write_pages_alloc = DEFAULT_WRITE_PAGES_LEN;
@@ -988,6 +1800,7 @@ int rl_discard(struct rlite *db)
 			}
 			db->write_pages = tmp;
 		}
+		RL_CALL(page_index_build, RL_OK, &db->write_pages_index, db->write_pages, 0, DEFAULT_WRITE_PAGES_LEN * 2);
 	}
 cleanup:
 	return retval;
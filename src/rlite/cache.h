@@ -0,0 +1,55 @@
+#ifndef _RL_CACHE_H
+#define _RL_CACHE_H
+
+#include "rlite.h"
+
+#define RL_DEFAULT_PAGE_CACHE_SIZE 1024
+
+typedef struct rl_cache_entry {
+	rl_page *page;
+	struct rl_cache_entry *next;
+	struct rl_cache_entry *lru_prev;
+	struct rl_cache_entry *lru_next;
+} rl_cache_entry;
+
+/**
+ * Pages that survive a commit. Once a transaction finishes, its clean pages
+ * are handed to the cache, and the next transaction takes them back when it
+ * needs them instead of reading and deserializing them again. A shared
+ * cache is read by many handles at once; they get copies instead, see
+ * rl_cache_copy.
+ * The cache is only valid while the header's change counter matches
+ * `change_counter`; any other process committing will bump it.
+ */
+typedef struct rl_cache {
+	long size;
+	long len;
+	long buckets_len;
+	rl_cache_entry **buckets;
+	rl_cache_entry *lru_head;
+	rl_cache_entry *lru_tail;
+	unsigned long long change_counter;
+} rl_cache;
+
+/**
+ * Shared by all handles in a process opened with RLITE_OPEN_SHARED on the
+ * same file; defined in cache.c.
+ */
+typedef struct rl_shared_cache rl_shared_cache;
+
+int rl_cache_create(rl_cache **cache, long size);
+int rl_cache_destroy(struct rlite *db, rl_cache *cache);
+int rl_cache_clear(struct rlite *db, rl_cache *cache);
+int rl_cache_take(struct rlite *db, rl_cache *cache, rl_data_type *type, long page_number, rl_page **page);
+int rl_cache_copy(struct rlite *db, rl_cache *cache, rl_data_type *type, long page_number, unsigned char *data);
+int rl_cache_put(struct rlite *db, rl_cache *cache, rl_page *page);
+int rl_cache_resize(struct rlite *db, rl_cache *cache, long size);
+
+int rl_shared_cache_acquire(struct rlite *db);
+int rl_shared_cache_release(struct rlite *db);
+int rl_shared_cache_lock(struct rlite *db, int type);
+void rl_shared_cache_unlock(struct rlite *db);
+void rl_cache_enter(struct rlite *db);
+void rl_cache_leave(struct rlite *db);
+
+#endif
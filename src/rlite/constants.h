@@ -13,3 +13,4 @@
 #define RLITE_OUTOFRANGEERR "ERR index out of range"
 #define RLITE_INVALIDMINMAXERR "ERR min or max not valid string range item"
 #define RLITE_NOSCRIPTERR "NOSCRIPT No matching script. Please use EVAL."
+#define RLITE_BUSYERR "BUSY the database is locked, try again later"
@@ -0,0 +1,14 @@
+#ifndef _RL_CRC32C_H
+#define _RL_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * CRC-32C (Castagnoli). Pass 0 to start, or a previous result to continue.
+ * Uses the SSE 4.2 crc32 instruction when the cpu has it.
+ */
+uint32_t rl_crc32c(uint32_t crc, const unsigned char *data, size_t len);
+uint32_t rl_crc32c_sw(uint32_t crc, const unsigned char *data, size_t len);
+
+#endif
@@ -3,6 +3,7 @@
 #include <stdio.h>
 
 int rl_flock(FILE *fp, int type);
+int rl_flock_fd(int fd, int type);
 int rl_is_flocked(const char *path, int type);
 
 #endif
@@ -62,6 +62,9 @@
 
 #define RLITE_KEEPALIVE_INTERVAL 15 /* seconds */
 
+#define RLITE_SLOWLOG_LOG_SLOWER_THAN 10000 /* microseconds */
+#define RLITE_SLOWLOG_MAX_LEN 128
+
 #define RLITE_CMD_WRITE 1                   /* "w" flag */
 #define RLITE_CMD_READONLY 2                /* "r" flag */
 #define RLITE_CMD_DENYOOM 4                 /* "m" flag */
@@ -93,6 +96,11 @@ typedef struct rliteReply {
 	struct rliteReply **element; /* elements vector for RLITE_REPLY_ARRAY */
 } rliteReply;
 
+/* Receives the elements of an array reply one at a time, see
+ * rliteCommandArgvStream. The element and its string are only valid during
+ * the call. */
+typedef void rliteStreamCallback(void *privdata, const rliteReply *element);
+
 /* Function to free the reply objects hirlite returns by default. */
 void rliteFreeReplyObject(void *reply);
 
@@ -122,12 +130,26 @@ typedef struct rliteContext {
 
 	short inTransaction;
 	short transactionFailed;
+	short inBatch;
 	size_t watchedKeysAlloc;
 	size_t watchedKeysLength;
 	struct watched_key **watchedKeys;
 	size_t enqueuedCommandsAlloc;
 	size_t enqueuedCommandsLength;
 	struct rliteClient **enqueuedCommands;
+
+	/* Commands that take at least slowlogLogSlowerThan microseconds are kept,
+	 * newest first, up to slowlogMaxLen of them. A negative value disables
+	 * the slowlog. */
+	long long slowlogLogSlowerThan;
+	long slowlogMaxLen;
+	long slowlogLength;
+	long long slowlogNextId;
+	struct rliteSlowlogEntry **slowlog;
+	/* Latency histograms, indexed like the command table. */
+	struct rliteCommandLatency **latency;
+	/* Held while a thread runs a command on this context. */
+	struct rliteCommandLock *commandLock;
 } rliteContext;
 
 rliteContext *rliteConnect(const char *ip, int port);
@@ -137,6 +159,7 @@ rliteContext *rliteConnectBindNonBlock(const char *ip, int port, const char *sou
 rliteContext *rliteConnectUnix(const char *path);
 rliteContext *rliteConnectUnixWithTimeout(const char *path, const struct timeval tv);
 rliteContext *rliteConnectUnixNonBlock(const char *path);
+rliteContext *rliteConnectShared(const char *path);
 rliteContext *rliteConnectFd(int fd);
 int rliteSetTimeout(rliteContext *c, const struct timeval tv);
 int rliteEnableKeepAlive(rliteContext *c);
@@ -161,7 +184,14 @@ int rliteAppendFormattedCommand(rliteContext *c, const char *cmd, size_t len);
 int rlitevAppendCommand(rliteContext *c, const char *format, va_list ap);
 int rliteAppendCommand(rliteContext *c, const char *format, ...);
 int rliteAppendCommandArgv(rliteContext *c, int argc, char **argv, size_t *argvlen);
+/* Run `commands` commands holding the lock once and committing once, their
+ * replies are read with rliteGetReply as usual. If any of them cannot be
+ * run nothing is written, no reply is added and RLITE_ERR is returned. */
+int rliteAppendCommandArgvBatch(rliteContext *c, int commands, int *argc, char ***argv, size_t **argvlen);
 int rliteAppendCommandClient(struct rliteClient *client);
+/* rliteGetReply for code already running a command on the context, such as
+ * a script, which holds its lock. */
+void *rlitePopReply(rliteContext *c);
 
 /* Issue a command to Redis. In a blocking context, it is identical to calling
  * rliteAppendCommand, followed by rliteGetReply. The function will return
@@ -172,6 +202,12 @@ int rliteAppendCommandClient(struct rliteClient *client);
 void *rlitevCommand(rliteContext *c, const char *format, va_list ap);
 void *rliteCommand(rliteContext *c, const char *format, ...);
 void *rliteCommandArgv(rliteContext *c, int argc, char **argv, size_t *argvlen);
+/* Like rliteCommandArgv, but the elements of an array reply are handed to
+ * `stream` as they are produced instead of being collected. The reply
+ * returned is the array with its number of elements and no element vector.
+ * LRANGE, HGETALL, HKEYS, HVALS and the ZRANGE family hold a single element
+ * in memory at a time. */
+void *rliteCommandArgvStream(rliteContext *c, int argc, char **argv, size_t *argvlen, rliteStreamCallback *stream, void *privdata);
 
 struct rliteCommand *rliteLookupCommand(const char *name, size_t len);
 int rliteCommandHasFlag(struct rliteCommand *cmd, int flag);
@@ -194,6 +230,8 @@ typedef struct rliteClient {
 	rliteReply *reply;
 	rliteContext *context;
 	int flags;
+	rliteStreamCallback *stream;
+	void *streamPrivdata;
 } rliteClient;
 
 typedef void rliteCommandProc(rliteClient *c);
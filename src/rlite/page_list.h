@@ -19,6 +19,7 @@ typedef struct {
 } rl_list_type;
 
 extern rl_list_type rl_list_type_long;
+extern rl_list_type rl_list_type_zset;
 
 typedef struct rl_list_node {
 	long size;
@@ -27,12 +28,26 @@ typedef struct rl_list_node {
 	void **elements;
 } rl_list_node;
 
+/**
+ * Interior page of a list's positional index. Each entry points to a page
+ * one level below (a list node on the lowest level) and keeps how many list
+ * elements live under it, so a position can be found without walking the
+ * nodes one by one.
+ */
+typedef struct rl_list_index_node {
+	long size;
+	long *children;
+	long *counts;
+} rl_list_index_node;
+
 typedef struct rl_list {
 	long max_node_size; // maximum number of elements in a node
 	long size;
 	rl_list_type *type;
 	long left;
 	long right;
+	long index; // root page of the positional index, 0 while the list has a single node
+	long index_height;
 } rl_list;
 
 typedef struct rl_list_iterator {
@@ -47,6 +62,8 @@ int rl_list_create(struct rlite *db, rl_list **_list, rl_list_type *type);
 int rl_list_destroy(struct rlite *db, void *list);
 int rl_list_node_destroy(struct rlite *db, void *node);
 int rl_list_get_element(struct rlite *db, rl_list *list, void **element, long position);
+int rl_list_get_elements(struct rlite *db, rl_list *list, void **elements, long position, long count);
+int rl_list_set_element(struct rlite *db, rl_list *list, void *element, long position);
 int rl_list_add_element(struct rlite *db, rl_list *list, long list_page, void *element, long position);
 int rl_list_remove_element(struct rlite *db, rl_list *list, long list_page, long position);
 int rl_list_find_element(struct rlite *db, rl_list *list, void *element, void **found_element, long *position, rl_list_node **found_node, long *found_node_page);
@@ -63,6 +80,10 @@ int rl_list_deserialize(struct rlite *db, void **obj, void *context, unsigned ch
 int rl_list_node_serialize_long(struct rlite *db, void *obj, unsigned char *data);
 int rl_list_node_deserialize_long(struct rlite *db, void **obj, void *context, unsigned char *data);
 
+int rl_list_index_node_serialize(struct rlite *db, void *obj, unsigned char *data);
+int rl_list_index_node_deserialize(struct rlite *db, void **obj, void *context, unsigned char *data);
+int rl_list_index_node_destroy(struct rlite *db, void *obj);
+
 int rl_list_pages(struct rlite *db, rl_list *list, short *pages);
 int rl_list_delete(struct rlite *db, rl_list *list);
 
@@ -17,4 +17,8 @@ int rl_multi_string_delete(struct rlite *db, long page);
 int rl_multi_string_cpyrange(struct rlite *db, long number, unsigned char *data, long *size, long start, long stop);
 int rl_multi_string_cpy(struct rlite *db, long number, unsigned char *data, long *size);
 
+int rl_multi_string_serialize(struct rlite *db, void *obj, unsigned char *data);
+int rl_multi_string_deserialize(struct rlite *db, void **obj, void *context, unsigned char *data);
+int rl_multi_string_destroy(struct rlite *db, void *obj);
+
 #endif
@@ -24,11 +24,30 @@ typedef struct {
 	} level[];
 } rl_skiplist_node;
 
+/**
+ * Nodes are packed several per page. Nodes reference each other, and the
+ * skiplist and its iterators reference them, by a number combining the
+ * node's page and its slot in the page.
+ * Skiplists written before nodes were packed have one node per page and
+ * reference nodes by page number; they keep that layout.
+ */
+#define RL_SKIPLIST_NODE_SLOT_BITS 5
+#define RL_SKIPLIST_NODES_PER_PAGE (1 << RL_SKIPLIST_NODE_SLOT_BITS)
+#define RL_SKIPLIST_NODE(page, slot) (((page) << RL_SKIPLIST_NODE_SLOT_BITS) | (slot))
+#define RL_SKIPLIST_NODE_PAGE(node) ((node) >> RL_SKIPLIST_NODE_SLOT_BITS)
+#define RL_SKIPLIST_NODE_SLOT(node) ((node) & (RL_SKIPLIST_NODES_PER_PAGE - 1))
+
+typedef struct {
+	long size;
+	rl_skiplist_node *nodes[RL_SKIPLIST_NODES_PER_PAGE];
+} rl_skiplist_node_page;
+
 typedef struct {
 	long left;
 	long right;
 	long size;
 	long level;
+	long packed; // 0 for skiplists with one node per page
 } rl_skiplist;
 
 typedef struct rl_skiplist_iterator {
@@ -64,6 +83,11 @@ int rl_skiplist_deserialize(struct rlite *db, void **obj, void *context, unsigne
 int rl_skiplist_node_serialize(struct rlite *db, void *obj, unsigned char *data);
 int rl_skiplist_node_deserialize(struct rlite *db, void **obj, void *context, unsigned char *data);
 
+int rl_skiplist_node_page_create(struct rlite *db, rl_skiplist_node_page **page);
+int rl_skiplist_node_page_destroy(struct rlite *db, void *page);
+int rl_skiplist_node_page_serialize(struct rlite *db, void *obj, unsigned char *data);
+int rl_skiplist_node_page_deserialize(struct rlite *db, void **obj, void *context, unsigned char *data);
+
 int rl_skiplist_pages(struct rlite *db, rl_skiplist *skiplist, short *pages);
 
 
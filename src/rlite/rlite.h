@@ -2,6 +2,7 @@
 #define _RLITE_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include "status.h"
 #include "page_btree.h"
 #include "page_key.h"
@@ -45,14 +46,44 @@
 
 #define RL_MEMORY_DRIVER 0
 #define RL_FILE_DRIVER 1
+// same file format, but using pread/pwrite on a raw file descriptor
+#define RL_PFILE_DRIVER 2
+// like RL_PFILE_DRIVER, but pages are deserialized out of a read-only mapping
+#define RL_MMAP_DRIVER 3
+#define RL_IS_FILE_DRIVER(db) ((db)->driver_type == RL_FILE_DRIVER || (db)->driver_type == RL_PFILE_DRIVER || (db)->driver_type == RL_MMAP_DRIVER)
 
 #define RLITE_OPEN_READONLY  0x00000001
 #define RLITE_OPEN_READWRITE 0x00000002
 #define RLITE_OPEN_CREATE    0x00000004
+// keep the file open between transactions, only the lock is released
+#define RLITE_OPEN_KEEP_FD   0x00000008
+// use RL_PFILE_DRIVER instead of RL_FILE_DRIVER
+#define RLITE_OPEN_PFILE     0x00000010
+// use RL_MMAP_DRIVER instead of RL_FILE_DRIVER
+#define RLITE_OPEN_MMAP      0x00000020
+// commits are appended to a persistent log, see doc/wal-format.md
+#define RLITE_OPEN_WAL_LOG   0x00000040
+// share the page cache with the other handles on the file in this process,
+// see rl_shared_cache
+#define RLITE_OPEN_SHARED    0x00000080
+
+// durability of commits, see rl_set_sync_mode
+// none: leave it to the operating system
+// full: sync the wal and the database on every commit
+// group: append to the wal log and sync it every N commits or N milliseconds
+#define RLITE_SYNC_NONE 0
+#define RLITE_SYNC_FULL 1
+#define RLITE_SYNC_GROUP 2
+
+// digest used to validate wal files and records
+#define RL_CHECKSUM_SHA1 0
+#define RL_CHECKSUM_CRC32C 1
 
 #define RLITE_FLOCK_SH 1
 #define RLITE_FLOCK_EX 2
 #define RLITE_FLOCK_UN 3
+// combined with RLITE_FLOCK_SH or RLITE_FLOCK_EX, fail instead of waiting
+#define RLITE_FLOCK_NB 4
 
 #define RLITE_INTERNAL_DB_COUNT 6
 #define RLITE_INTERNAL_DB_NO 0
@@ -80,8 +111,18 @@ typedef struct rl_data_type {
 
 typedef struct {
 	FILE *fp;
+	// only used by RL_PFILE_DRIVER and RL_MMAP_DRIVER, -1 when closed
+	int fd;
+	// only used by RL_MMAP_DRIVER
+	unsigned char *map;
+	size_t maplen;
 	char *filename;
 	int mode;
+	// holding a lock on the file itself, shared or exclusive
+	int locked;
+	// holding the writer lock on `writer_fd`, see rl_lock_exclusive
+	int reserved;
+	int writer_fd;
 } rl_file_driver;
 
 typedef struct {
@@ -93,19 +134,58 @@ typedef struct {
 	long page_number;
 	rl_data_type *type;
 	void *obj;
+	// crc32c of the serialized page, see rl_dirty_hash
+	uint32_t dirty_checksum;
+	int dirty_checksum_valid;
 #ifdef RL_DEBUG
 	unsigned char *serialized_data;
 #endif
 } rl_page;
 
+/**
+ * Open addressing index from page number to position in a pages array.
+ * `alloc` is a power of two, at least twice the array's capacity.
+ */
+typedef struct {
+	long alloc;
+	long *slots;
+} rl_page_index;
+
+/**
+ * Page traffic and I/O time counters, they only ever grow. Take a copy
+ * before the work being measured and subtract it afterwards.
+ */
+typedef struct {
+	// pages read from the driver and pages written by a commit
+	unsigned long long pages_read;
+	// pages found in the page cache instead
+	unsigned long long cache_hits;
+	unsigned long long pages_written;
+	unsigned long long bytes_serialized;
+	unsigned long long bytes_deserialized;
+	// microseconds waiting for the database lock, writing the wal and
+	// applying it to the database
+	unsigned long long lock_wait_us;
+	unsigned long long wal_write_us;
+	unsigned long long wal_apply_us;
+	// locks the busy handler gave up on
+	unsigned long long lock_timeouts;
+	// watched key checks answered by the change counter alone
+	unsigned long long watch_skipped;
+} rl_page_stats;
+
 typedef struct rlite {
-	// these four properties can change during a transaction
+	// these properties can change during a transaction
 	// we need to record their original values to use when
 	// checking watched keys
 	long initial_next_empty_page;
 	long initial_number_of_pages;
 	int initial_number_of_databases;
 	long *initial_databases;
+	unsigned long long initial_change_counter;
+
+	// incremented on every commit that writes pages
+	unsigned long long change_counter;
 
 	long number_of_pages;
 	long next_empty_page;
@@ -116,12 +196,40 @@ typedef struct rlite {
 	int selected_database;
 	int number_of_databases;
 	long *databases;
+	// pages used by the current transaction, in no particular order until
+	// rl_sort_write_pages orders the written ones for the wal
 	long read_pages_alloc;
 	long read_pages_len;
 	rl_page **read_pages;
+	rl_page_index read_pages_index;
 	long write_pages_alloc;
 	long write_pages_len;
 	rl_page **write_pages;
+	rl_page_index write_pages_index;
+	struct rl_cache *page_cache;
+	// set with RLITE_OPEN_SHARED, page_cache then belongs to it
+	struct rl_shared_cache *shared_cache;
+	// set by rl_begin_read, the transaction holds a shared lock and cannot commit
+	int read_transaction;
+	// incremented by rl_discard, tells callers their transaction was dropped
+	unsigned long discards;
+	rl_page_stats stats;
+
+	int sync_mode;
+	long sync_group_ms;
+	long sync_group_commits;
+	struct rl_sync_group *sync_group;
+	struct rl_wal_log *wal_log;
+	long wal_checkpoint_pages;
+	// lock file of the readers pinning the wal log, see rl_wal_log_snapshot
+	int snapshot_fd;
+	// set by rl_begin_read when it pinned the wal log instead of locking
+	int snapshot;
+	// see rl_set_busy_handler and rl_set_busy_timeout
+	int (*busy_handler)(void *arg, int count);
+	void *busy_arg;
+	long busy_timeout;
+	int wal_checksum;
 
 	char *subscriber_id;
 	char *subscriber_lock_filename;
@@ -132,14 +240,20 @@ typedef struct watched_key {
 	unsigned char digest[20];
 	long version;
 	int database;
+	// if nobody committed since, the version cannot have changed
+	unsigned long long change_counter;
 } watched_key;
 
 int rl_open(const char *filename, rlite **db, int flags);
+int rl_open_busy_timeout(const char *filename, rlite **db, int flags, long busy_timeout);
 int rl_refresh(rlite *db);
 int rl_close(rlite *db);
 
 int rl_ensure_pages(rlite *db);
+int rl_add_read_page(rlite *db, rl_page *page);
+int rl_sort_write_pages(rlite *db);
 int rl_read_header(rlite *db);
+int rl_get_change_counter(struct rlite *db, unsigned long long *change_counter);
 int rl_header_deserialize(struct rlite *db, void **obj, void *context, unsigned char *data);
 int rl_read(struct rlite *db, rl_data_type *type, long page, void *context, void **obj, int cache);
 int rl_get_key_btree(rlite *db, struct rl_btree **btree, int create);
@@ -150,6 +264,13 @@ int rl_delete(struct rlite *db, long page);
 int rl_dirty_hash(struct rlite *db, unsigned char **hash);
 int rl_commit(struct rlite *db);
 int rl_discard(struct rlite *db);
+int rl_begin_read(struct rlite *db);
+int rl_lock_exclusive(struct rlite *db);
+int rl_end_read(struct rlite *db);
+int rl_set_page_cache_size(struct rlite *db, long size);
+int rl_set_busy_timeout(struct rlite *db, long ms);
+int rl_set_busy_handler(struct rlite *db, int (*handler)(void *arg, int count), void *arg);
+int rl_set_sync_mode(struct rlite *db, int mode, long group_ms, long group_commits);
 int rl_is_balanced(struct rlite *db);
 int rl_get_selected_db(struct rlite *db);
 int rl_select(struct rlite *db, int selected_database);
@@ -178,11 +299,15 @@ extern rl_data_type rl_data_type_btree_node_hash_sha1_double;
 extern rl_data_type rl_data_type_btree_hash_sha1_long;
 extern rl_data_type rl_data_type_btree_node_hash_sha1_long;
 extern rl_data_type rl_data_type_list_long;
+extern rl_data_type rl_data_type_zset;
 extern rl_data_type rl_data_type_list_node_long;
+extern rl_data_type rl_data_type_list_index;
 extern rl_data_type rl_data_type_list_node_key;
+extern rl_data_type rl_data_type_multi_string;
 extern rl_data_type rl_data_type_string;
 extern rl_data_type rl_data_type_long;
 extern rl_data_type rl_data_type_skiplist;
 extern rl_data_type rl_data_type_skiplist_node;
+extern rl_data_type rl_data_type_skiplist_single_node;
 
 #endif
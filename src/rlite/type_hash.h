@@ -7,7 +7,29 @@
 
 struct rlite;
 
-typedef rl_btree_iterator rl_hash_iterator;
+/**
+ * Hashes with up to this many entries are stored packed in a single page,
+ * as long as they fit in it.
+ */
+#define RL_HASH_PACKED_MAX_ENTRIES 128
+
+/**
+ * Iterates a btree hash through `btree_iterator`, or a copy of a packed
+ * hash's entries through `data`. Packed entries have no pages of their own,
+ * so `rl_hash_iterator_next` reports 0 as their field and member pages.
+ */
+typedef struct {
+	struct rlite *db;
+	long size;
+	rl_btree_iterator *btree_iterator;
+	unsigned char *data;
+	long datalen;
+	long position;
+} rl_hash_iterator;
+
+int rl_hash_serialize(struct rlite *db, void *obj, unsigned char *data);
+int rl_hash_deserialize(struct rlite *db, void **obj, void *context, unsigned char *data);
+int rl_hash_destroy(struct rlite *db, void *obj);
 
 int rl_hash_iterator_next(rl_hash_iterator *iterator, long *fieldpage, unsigned char **field, long *fieldlen, long *memberpage, unsigned char **member, long *memberlen);
 int rl_hash_iterator_destroy(rl_hash_iterator *iterator);
@@ -7,11 +7,34 @@
 
 struct rlite;
 
-typedef rl_btree_iterator rl_set_iterator;
+/**
+ * Sets with up to this many members are stored packed in a single page,
+ * as long as they fit in it.
+ */
+#define RL_SET_PACKED_MAX_ENTRIES 128
+
+/**
+ * Iterates a btree set through `btree_iterator`, or a copy of a packed
+ * set's members through `data`. Packed members have no pages of their own,
+ * so `rl_set_iterator_next` reports 0 as their page.
+ */
+typedef struct {
+	struct rlite *db;
+	long size;
+	rl_btree_iterator *btree_iterator;
+	unsigned char *data;
+	long datalen;
+	long position;
+} rl_set_iterator;
+
+int rl_set_serialize(struct rlite *db, void *obj, unsigned char *data);
+int rl_set_deserialize(struct rlite *db, void **obj, void *context, unsigned char *data);
+int rl_set_destroy(struct rlite *db, void *obj);
 
 int rl_set_get_objects(struct rlite *db, const unsigned char *key, long keylen, long *_set_page_number, rl_btree **btree, int update_version, int create);
 int rl_set_iterator_next(rl_set_iterator *iterator, long *page, unsigned char **member, long *memberlen);
 int rl_set_iterator_destroy(rl_set_iterator *iterator);
+int rl_set_ismember(struct rlite *db, rl_btree *set, unsigned char *member, long memberlen);
 
 int rl_sadd(struct rlite *db, const unsigned char *key, long keylen, int memberc, unsigned char **members, long *memberslen, long *added);
 int rl_sismember(struct rlite *db, const unsigned char *key, long keylen, unsigned char *data, long datalen);
@@ -18,7 +18,31 @@ typedef struct {
 	int maxex;
 } rl_zrangespec;
 
-typedef struct rl_skiplist_iterator rl_zset_iterator;
+/**
+ * Sorted sets with up to this many members are stored packed in a single
+ * page, as long as they fit in it.
+ */
+#define RL_ZSET_PACKED_MAX_ENTRIES 128
+
+/**
+ * Iterates a skiplist through `skiplist_iterator`, or a copy of the packed
+ * entries in range through `data`. It stops after `size` members, callers
+ * may lower it to limit the range. Packed members have no pages of their
+ * own, so `rl_zset_iterator_next` reports 0 as their page.
+ */
+typedef struct {
+	struct rlite *db;
+	long size;
+	long position;
+	struct rl_skiplist_iterator *skiplist_iterator;
+	unsigned char *data;
+	long datalen;
+	long offset;
+} rl_zset_iterator;
+
+int rl_zset_serialize(struct rlite *db, void *obj, unsigned char *data);
+int rl_zset_deserialize(struct rlite *db, void **obj, void *context, unsigned char *data);
+int rl_zset_destroy(struct rlite *db, void *obj);
 
 int rl_zset_iterator_next(rl_zset_iterator *iterator, long *page, double *score, unsigned char **data, long *datalen);
 int rl_zset_iterator_destroy(rl_zset_iterator *iterator);
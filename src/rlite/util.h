@@ -69,6 +69,7 @@ double get_double(const unsigned char *p);
 void put_double(unsigned char *p, double v);
 int sha1(const unsigned char *data, long datalen, unsigned char digest[20]);
 unsigned long long rl_mstime();
+unsigned long long rl_ustime();
 double rl_strtod(unsigned char *str, long strlen, unsigned char **eptr);
 char *rl_get_filename_with_suffix(const char *filename, char *suffix);
 
@@ -1,8 +1,56 @@
 #ifndef _RL_WAL_H
 #define _RL_WAL_H
 
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+/**
+ * Shared by all handles in a process using RLITE_SYNC_GROUP on the same file.
+ */
+typedef struct rl_sync_group {
+	dev_t dev;
+	ino_t ino;
+	int refs;
+	// guards `pending` and `last_sync`, and is held while syncing
+	pthread_mutex_t lock;
+	// commits appended since the log was last synced
+	long pending;
+	struct timeval last_sync;
+	struct rl_sync_group *next;
+} rl_sync_group;
+
+#define RL_DEFAULT_WAL_CHECKPOINT_PAGES 1000
+
+/**
+ * In memory state of the append-only log (RLITE_OPEN_WAL_LOG).
+ */
+typedef struct rl_wal_log {
+	int fd;
+	unsigned long long generation;
+	long page_size;
+	int checksum;
+	// end of the last valid record, and size of the file
+	off_t end;
+	off_t size;
+	// pages appended since the last checkpoint
+	long frames;
+	// page number -> offset of its newest version, open addressing
+	long index_alloc;
+	long index_len;
+	long *index_pages;
+	off_t *index_offsets;
+} rl_wal_log;
+
 int rl_write_apply_wal(rlite *db);
 int rl_write_wal(const char *wal_path, rlite *db, unsigned char **_data, size_t *_datalen);
 int rl_apply_wal(rlite *db);
+int rl_close_sync(rlite *db);
+int rl_wal_log_refresh(rlite *db);
+int rl_wal_log_read(rlite *db, long page_number, unsigned char *data, size_t len);
+int rl_wal_checkpoint(rlite *db);
+int rl_close_wal_log(rlite *db, int checkpoint);
+int rl_wal_log_snapshot(rlite *db);
+int rl_wal_log_release_snapshot(rlite *db);
 
 #endif
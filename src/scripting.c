@@ -39,6 +39,7 @@
 #include <lualib.h>
 #include <ctype.h>
 #include <math.h>
+#include <pthread.h>
 
 #define RLITE_DEBUG 0
 #define RLITE_VERBOSE 1
@@ -212,6 +213,8 @@ void luaSortArray(lua_State *lua) {
 	lua_pop(lua,1);			 /* Stack: array (sorted) */
 }
 
+/* The interpreter is shared by every context, scripts run one at a time. */
+static pthread_mutex_t lua_mutex = PTHREAD_MUTEX_INITIALIZER;
 static lua_State *lua = NULL;
 static rliteClient *lua_caller = NULL;
 static rliteClient *lua_client = NULL;
@@ -341,7 +344,7 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
 
 	/* Run the command */
 	rliteAppendCommandClient(c);
-	rliteGetReply(c->context, (void **)&reply);
+	reply = rlitePopReply(c->context);
 
 	if (raise_error && reply->type != RLITE_REPLY_ERROR) raise_error = 0;
 	rliteToLuaType(lua,reply);
@@ -680,6 +683,7 @@ void scriptingInit(void) {
 		lua_client = rl_malloc(sizeof(*lua_client));
 
 		lua_client->flags = RLITE_LUA_CLIENT;
+		lua_client->stream = NULL;
 	}
 
 	/* Lua beginners often don't use "local", this is likely to introduce
@@ -1049,7 +1053,9 @@ void evalGenericCommand(rliteClient *c, int evalsha) {
 }
 
 void evalCommand(rliteClient *c) {
+	pthread_mutex_lock(&lua_mutex);
 	evalGenericCommand(c,0);
+	pthread_mutex_unlock(&lua_mutex);
 }
 
 void evalShaCommand(rliteClient *c) {
@@ -1061,7 +1067,9 @@ void evalShaCommand(rliteClient *c) {
 		c->reply = createErrorObject(RLITE_NOSCRIPTERR);
 		return;
 	}
+	pthread_mutex_lock(&lua_mutex);
 	evalGenericCommand(c,1);
+	pthread_mutex_unlock(&lua_mutex);
 }
 
 /* We replace math.random() with our implementation that is not affected
@@ -1109,7 +1117,9 @@ int rlite_math_randomseed (lua_State *L) {
 
 void scriptCommand(rliteClient *c) {
 	if (c->argc == 2 && !strcasecmp(c->argv[1],"flush")) {
+		pthread_mutex_lock(&lua_mutex);
 		scriptingReset();
+		pthread_mutex_unlock(&lua_mutex);
 		c->reply = createStatusObject(RLITE_STR_OK);
 	} else if (c->argc >= 2 && !strcasecmp(c->argv[1],"exists")) {
 		int j;
@@ -3,22 +3,239 @@
 #include <errno.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include "rlite/rlite.h"
 #include "rlite/page_multi_string.h"
 #include "rlite/type_hash.h"
 #include "rlite/page_btree.h"
 #include "rlite/util.h"
 
+/**
+ * Small hashes are stored "packed" in their own page instead of in a btree.
+ * The page starts like a btree header with a zero root (a real btree root is
+ * never page 0), followed by the number of entries, the length of the
+ * entries and the entries themselves: a 4-byte field length, the field,
+ * a 4-byte value length and the value.
+ * Once a write does not fit in the page, or the hash grows past
+ * RL_HASH_PACKED_MAX_ENTRIES, it is converted to a btree.
+ */
+#define PACKED_HEADER_SIZE 12
+#define PACKED_ENTRY_SIZE(fieldlen, valuelen) (8 + (fieldlen) + (valuelen))
+// a btree resets its root to 0 when its last element is removed, so loaded
+// packed hashes are told apart by their max_node_size instead
+#define IS_PACKED(hash) ((hash)->max_node_size == 0)
+
+typedef struct {
+	rl_btree btree;
+	long datalen;
+	unsigned char *data;
+} rl_hash_packed;
+
+int rl_hash_serialize(struct rlite *db, void *obj, unsigned char *data)
+{
+	rl_hash_packed *packed = obj;
+	if (!IS_PACKED(&packed->btree)) {
+		return rl_btree_serialize(db, obj, data);
+	}
+	put_4bytes(data, 0);
+	put_4bytes(&data[4], packed->btree.number_of_elements);
+	put_4bytes(&data[8], packed->datalen);
+	if (packed->datalen) {
+		memcpy(&data[PACKED_HEADER_SIZE], packed->data, packed->datalen);
+	}
+	return RL_OK;
+}
+
+int rl_hash_deserialize(struct rlite *db, void **obj, void *context, unsigned char *data)
+{
+	rl_hash_packed *packed;
+	int retval = RL_OK;
+	if (get_4bytes(data) != 0) {
+		return rl_btree_deserialize(db, obj, context, data);
+	}
+	RL_MALLOC(packed, sizeof(*packed));
+	packed->btree.db = db;
+	packed->btree.type = context;
+	packed->btree.root = 0;
+	packed->btree.height = 0;
+	packed->btree.max_node_size = 0;
+	packed->btree.number_of_elements = get_4bytes(&data[4]);
+	packed->datalen = get_4bytes(&data[8]);
+	packed->data = NULL;
+	if (packed->datalen) {
+		packed->data = rl_malloc(sizeof(unsigned char) * packed->datalen);
+		if (!packed->data) {
+			rl_free(packed);
+			retval = RL_OUT_OF_MEMORY;
+			goto cleanup;
+		}
+		memcpy(packed->data, &data[PACKED_HEADER_SIZE], packed->datalen);
+	}
+	*obj = packed;
+cleanup:
+	return retval;
+}
+
+int rl_hash_destroy(struct rlite *db, void *obj)
+{
+	rl_hash_packed *packed = obj;
+	if (IS_PACKED(&packed->btree)) {
+		rl_free(packed->data);
+	}
+	return rl_btree_destroy(db, obj);
+}
+
+static int packed_find(rl_hash_packed *packed, unsigned char *field, long fieldlen, long *_offset, unsigned char **value, long *valuelen)
+{
+	long offset = 0, flen, vlen;
+	while (offset < packed->datalen) {
+		flen = get_4bytes(&packed->data[offset]);
+		vlen = get_4bytes(&packed->data[offset + 4 + flen]);
+		if (flen == fieldlen && memcmp(&packed->data[offset + 4], field, fieldlen) == 0) {
+			if (_offset) {
+				*_offset = offset;
+			}
+			if (value) {
+				*value = &packed->data[offset + 8 + flen];
+			}
+			if (valuelen) {
+				*valuelen = vlen;
+			}
+			return RL_FOUND;
+		}
+		offset += PACKED_ENTRY_SIZE(flen, vlen);
+	}
+	return RL_NOT_FOUND;
+}
+
+static void packed_remove(rl_hash_packed *packed, long offset)
+{
+	long flen = get_4bytes(&packed->data[offset]);
+	long entrylen = PACKED_ENTRY_SIZE(flen, get_4bytes(&packed->data[offset + 4 + flen]));
+	memmove(&packed->data[offset], &packed->data[offset + entrylen], packed->datalen - offset - entrylen);
+	packed->datalen -= entrylen;
+	packed->btree.number_of_elements--;
+}
+
+static int packed_append(rl_hash_packed *packed, unsigned char *field, long fieldlen, unsigned char *value, long valuelen)
+{
+	int retval = RL_OK;
+	void *tmp;
+	long offset = packed->datalen;
+	RL_REALLOC(packed->data, sizeof(unsigned char) * (packed->datalen + PACKED_ENTRY_SIZE(fieldlen, valuelen)));
+	put_4bytes(&packed->data[offset], fieldlen);
+	memcpy(&packed->data[offset + 4], field, fieldlen);
+	put_4bytes(&packed->data[offset + 4 + fieldlen], valuelen);
+	memcpy(&packed->data[offset + 8 + fieldlen], value, valuelen);
+	packed->datalen += PACKED_ENTRY_SIZE(fieldlen, valuelen);
+	packed->btree.number_of_elements++;
+cleanup:
+	return retval;
+}
+
+struct packed_entry {
+	unsigned char digest[20];
+	long offset;
+};
+
+static int packed_entry_cmp(const void *a, const void *b)
+{
+	return sha1_cmp(((struct packed_entry *)a)->digest, ((struct packed_entry *)b)->digest);
+}
+
+/**
+ * Copies the entries ordered by their field's sha1, the order a btree hash
+ * iterates in, so converting a hash does not change HGETALL's output.
+ */
+static int packed_sorted_copy(rl_hash_packed *packed, unsigned char **_data)
+{
+	struct packed_entry *entries = NULL;
+	unsigned char *data = NULL;
+	long i, offset, fieldlen, entrylen, datalen = 0;
+	int retval;
+
+	RL_MALLOC(entries, sizeof(*entries) * packed->btree.number_of_elements);
+	RL_MALLOC(data, sizeof(unsigned char) * packed->datalen);
+	for (i = 0, offset = 0; offset < packed->datalen; i++) {
+		fieldlen = get_4bytes(&packed->data[offset]);
+		RL_CALL(sha1, RL_OK, &packed->data[offset + 4], fieldlen, entries[i].digest);
+		entries[i].offset = offset;
+		offset += PACKED_ENTRY_SIZE(fieldlen, get_4bytes(&packed->data[offset + 4 + fieldlen]));
+	}
+	qsort(entries, packed->btree.number_of_elements, sizeof(*entries), packed_entry_cmp);
+	for (i = 0; i < packed->btree.number_of_elements; i++) {
+		offset = entries[i].offset;
+		fieldlen = get_4bytes(&packed->data[offset]);
+		entrylen = PACKED_ENTRY_SIZE(fieldlen, get_4bytes(&packed->data[offset + 4 + fieldlen]));
+		memcpy(&data[datalen], &packed->data[offset], entrylen);
+		datalen += entrylen;
+	}
+	*_data = data;
+	data = NULL;
+	retval = RL_OK;
+cleanup:
+	rl_free(entries);
+	rl_free(data);
+	return retval;
+}
+
+/**
+ * Replaces the packed hash in `hash_page_number` with a btree holding the
+ * same entries.
+ */
+static int rl_hash_unpack(rlite *db, long hash_page_number, rl_btree **hash)
+{
+	rl_hash_packed *packed = (rl_hash_packed *)*hash;
+	unsigned char *data = packed->data, *digest = NULL;
+	long datalen = packed->datalen, offset, fieldlen, valuelen;
+	rl_btree *btree;
+	rl_hashkey *hashkey = NULL;
+	int retval;
+
+	RL_CALL(rl_btree_create, RL_OK, db, &btree, &rl_btree_type_hash_sha1_hashkey);
+	// writing the btree destroys the packed object, its entries are still needed
+	packed->data = NULL;
+	RL_CALL(rl_write, RL_OK, db, &rl_data_type_btree_hash_sha1_hashkey, hash_page_number, btree);
+	*hash = btree;
+
+	for (offset = 0; offset < datalen; offset += PACKED_ENTRY_SIZE(fieldlen, valuelen)) {
+		fieldlen = get_4bytes(&data[offset]);
+		valuelen = get_4bytes(&data[offset + 4 + fieldlen]);
+		RL_MALLOC(digest, sizeof(unsigned char) * 20);
+		RL_CALL(sha1, RL_OK, &data[offset + 4], fieldlen, digest);
+		RL_MALLOC(hashkey, sizeof(*hashkey));
+		RL_CALL(rl_multi_string_set, RL_OK, db, &hashkey->string_page, &data[offset + 4], fieldlen);
+		RL_CALL(rl_multi_string_set, RL_OK, db, &hashkey->value_page, &data[offset + 8 + fieldlen], valuelen);
+		RL_CALL(rl_btree_add_element, RL_OK, db, btree, hash_page_number, digest, hashkey);
+		digest = NULL;
+		hashkey = NULL;
+	}
+	retval = RL_OK;
+cleanup:
+	rl_free(data);
+	rl_free(digest);
+	rl_free(hashkey);
+	return retval;
+}
+
 static int rl_hash_create(rlite *db, long btree_page, rl_btree **btree)
 {
-	rl_btree *hash = NULL;
+	rl_hash_packed *packed = NULL;
 
 	int retval;
-	RL_CALL(rl_btree_create, RL_OK, db, &hash, &rl_btree_type_hash_sha1_hashkey);
-	RL_CALL(rl_write, RL_OK, db, &rl_data_type_btree_hash_sha1_hashkey, btree_page, hash);
+	RL_MALLOC(packed, sizeof(*packed));
+	packed->btree.db = db;
+	packed->btree.type = &rl_btree_type_hash_sha1_hashkey;
+	packed->btree.root = 0;
+	packed->btree.height = 0;
+	packed->btree.max_node_size = 0;
+	packed->btree.number_of_elements = 0;
+	packed->datalen = 0;
+	packed->data = NULL;
+	RL_CALL(rl_write, RL_OK, db, &rl_data_type_btree_hash_sha1_hashkey, btree_page, packed);
 
 	if (btree) {
-		*btree = hash;
+		*btree = &packed->btree;
 	}
 cleanup:
 	return retval;
@@ -35,6 +252,25 @@ cleanup:
 	return retval;
 }
 
+static int copy_bytes(unsigned char *src, long srclen, unsigned char **dst, long *dstlen)
+{
+	int retval = RL_OK;
+	if (dstlen) {
+		*dstlen = srclen;
+	}
+	if (dst) {
+		// like rl_multi_string_get: NULL when empty, nul terminated otherwise
+		*dst = NULL;
+		if (srclen > 0) {
+			RL_MALLOC(*dst, sizeof(unsigned char) * (srclen + 1));
+			memcpy(*dst, src, srclen);
+			(*dst)[srclen] = 0;
+		}
+	}
+cleanup:
+	return retval;
+}
+
 static int rl_hash_get_objects(rlite *db, const unsigned char *key, long keylen, long *_hash_page_number, rl_btree **btree, int update_version, int create)
 {
 	long hash_page_number = 0, version = 0;
@@ -75,119 +311,149 @@ cleanup:
 	return retval;
 }
 
-int rl_hset(struct rlite *db, const unsigned char *key, long keylen, unsigned char *field, long fieldlen, unsigned char *data, long datalen, long *added, int update)
+static int rl_hash_get_value(rlite *db, rl_btree *hash, unsigned char *field, long fieldlen, unsigned char **data, long *datalen)
 {
 	int retval;
-	long hash_page_number;
-	rl_btree *hash;
-	unsigned char *digest = NULL;
-	rl_hashkey *hashkey = NULL;
-	long add = 1;
 	void *tmp;
-	RL_CALL(rl_hash_get_objects, RL_OK, db, key, keylen, &hash_page_number, &hash, 1, 1);
+	unsigned char *digest = NULL, *value;
+	long valuelen;
+	rl_hashkey *hashkey;
+
+	if (IS_PACKED(hash)) {
+		retval = packed_find((rl_hash_packed *)hash, field, fieldlen, NULL, &value, &valuelen);
+		if (retval == RL_FOUND) {
+			RL_CALL(copy_bytes, RL_OK, value, valuelen, data, datalen);
+			retval = RL_FOUND;
+		}
+		goto cleanup;
+	}
 
 	RL_MALLOC(digest, sizeof(unsigned char) * 20);
 	RL_CALL(sha1, RL_OK, field, fieldlen, digest);
 
 	retval = rl_btree_find_score(db, hash, digest, &tmp, NULL, NULL);
-	if (retval == RL_FOUND) {
-		add = 0;
-		if (!update) {
-			goto cleanup;
-		}
+	if (retval == RL_FOUND && (data || datalen)) {
 		hashkey = tmp;
-		rl_multi_string_delete(db, hashkey->string_page);
-		rl_multi_string_delete(db, hashkey->value_page);
+		RL_CALL(rl_multi_string_get, RL_OK, db, hashkey->value_page, data, datalen);
+		retval = RL_FOUND;
 	}
+cleanup:
+	rl_free(digest);
+	return retval;
+}
 
-	RL_MALLOC(hashkey, sizeof(*hashkey));
-	RL_CALL(rl_multi_string_set, RL_OK, db, &hashkey->string_page, field, fieldlen);
-	RL_CALL(rl_multi_string_set, RL_OK, db, &hashkey->value_page, data, datalen);
-	if (update) {
-		retval = rl_btree_update_element(db, hash, digest, hashkey);
-		if (retval == RL_OK) {
+/**
+ * Sets `field` in `hash`, converting it to a btree when a packed hash
+ * would outgrow its page; `hash` is updated in that case.
+ */
+static int rl_hash_set(rlite *db, long hash_page_number, rl_btree **_hash, unsigned char *field, long fieldlen, unsigned char *data, long datalen, int update, long *added)
+{
+	int retval;
+	rl_btree *hash = *_hash;
+	rl_hash_packed *packed;
+	unsigned char *digest = NULL;
+	rl_hashkey *hashkey = NULL, *found;
+	long add = 1, offset = 0, valuelen = 0, packedlen;
+	void *tmp;
+
+	if (IS_PACKED(hash)) {
+		packed = (rl_hash_packed *)hash;
+		packedlen = packed->datalen + PACKED_ENTRY_SIZE(fieldlen, datalen);
+		retval = packed_find(packed, field, fieldlen, &offset, NULL, &valuelen);
+		if (retval == RL_FOUND) {
 			add = 0;
-			rl_free(digest);
-			digest = NULL;
+			if (!update) {
+				goto cleanup;
+			}
+			packedlen -= PACKED_ENTRY_SIZE(fieldlen, valuelen);
 		}
-		else if (retval != RL_NOT_FOUND) {
+		if (PACKED_HEADER_SIZE + packedlen <= db->page_size && hash->number_of_elements + add <= RL_HASH_PACKED_MAX_ENTRIES) {
+			if (!add) {
+				packed_remove(packed, offset);
+			}
+			RL_CALL(packed_append, RL_OK, packed, field, fieldlen, data, datalen);
+			RL_CALL(rl_write, RL_OK, db, &rl_data_type_btree_hash_sha1_hashkey, hash_page_number, packed);
+			retval = RL_OK;
 			goto cleanup;
 		}
+		RL_CALL(rl_hash_unpack, RL_OK, db, hash_page_number, _hash);
+		hash = *_hash;
 	}
-	if (add) {
-		retval = rl_btree_add_element(db, hash, hash_page_number, digest, hashkey);
-		if (retval == RL_FOUND) {
-			add = 0;
-		}
-		if (retval != RL_OK) {
+
+	RL_MALLOC(digest, sizeof(unsigned char) * 20);
+	RL_CALL(sha1, RL_OK, field, fieldlen, digest);
+
+	retval = rl_btree_find_score(db, hash, digest, &tmp, NULL, NULL);
+	if (retval == RL_FOUND) {
+		add = 0;
+		if (!update) {
 			goto cleanup;
 		}
+		found = tmp;
+		rl_multi_string_delete(db, found->value_page);
+		RL_CALL(rl_multi_string_set, RL_OK, db, &found->value_page, data, datalen);
+		RL_CALL(rl_btree_update_element, RL_OK, db, hash, digest, found);
+		retval = RL_OK;
+		goto cleanup;
+	}
+	else if (retval != RL_NOT_FOUND) {
+		goto cleanup;
 	}
+
+	RL_MALLOC(hashkey, sizeof(*hashkey));
+	RL_CALL(rl_multi_string_set, RL_OK, db, &hashkey->string_page, field, fieldlen);
+	RL_CALL(rl_multi_string_set, RL_OK, db, &hashkey->value_page, data, datalen);
+	RL_CALL(rl_btree_add_element, RL_OK, db, hash, hash_page_number, digest, hashkey);
+	digest = NULL;
+	hashkey = NULL;
 	retval = RL_OK;
 cleanup:
 	if (added) {
 		*added = add;
 	}
-	if (retval != RL_OK) {
-		rl_free(digest);
-		rl_free(hashkey);
-	}
+	rl_free(digest);
+	rl_free(hashkey);
 	return retval;
 }
 
-int rl_hget(struct rlite *db, const unsigned char *key, long keylen, unsigned char *field, long fieldlen, unsigned char **data, long *datalen)
+int rl_hset(struct rlite *db, const unsigned char *key, long keylen, unsigned char *field, long fieldlen, unsigned char *data, long datalen, long *added, int update)
 {
 	int retval;
 	long hash_page_number;
 	rl_btree *hash;
-	void *tmp;
-	unsigned char *digest = NULL;
-	rl_hashkey *hashkey;
-	RL_CALL(rl_hash_get_objects, RL_OK, db, key, keylen, &hash_page_number, &hash, 0, 0);
-
-	RL_MALLOC(digest, sizeof(unsigned char) * 20);
-	RL_CALL(sha1, RL_OK, field, fieldlen, digest);
+	RL_CALL(rl_hash_get_objects, RL_OK, db, key, keylen, &hash_page_number, &hash, 1, 1);
+	RL_CALL(rl_hash_set, RL_OK, db, hash_page_number, &hash, field, fieldlen, data, datalen, update, added);
+cleanup:
+	return retval;
+}
 
-	retval = rl_btree_find_score(db, hash, digest, &tmp, NULL, NULL);
-	if (retval == RL_FOUND) {
-		if (data || datalen) {
-			hashkey = tmp;
-			rl_multi_string_get(db, hashkey->value_page, data, datalen);
-		}
-	}
+int rl_hget(struct rlite *db, const unsigned char *key, long keylen, unsigned char *field, long fieldlen, unsigned char **data, long *datalen)
+{
+	int retval;
+	rl_btree *hash;
+	RL_CALL(rl_hash_get_objects, RL_OK, db, key, keylen, NULL, &hash, 0, 0);
+	retval = rl_hash_get_value(db, hash, field, fieldlen, data, datalen);
 cleanup:
-	rl_free(digest);
 	return retval;
 }
 
 int rl_hmget(struct rlite *db, const unsigned char *key, long keylen, int fieldc, unsigned char **fields, long *fieldslen, unsigned char ***_data, long **_datalen)
 {
 	int retval;
-	long hash_page_number;
 	rl_btree *hash;
-	void *tmp;
-	unsigned char *digest = NULL;
-	rl_hashkey *hashkey;
 
 	unsigned char **data = rl_malloc(sizeof(unsigned char *) * fieldc);
 	long *datalen = rl_malloc(sizeof(long) * fieldc);
-	RL_CALL(rl_hash_get_objects, RL_OK, db, key, keylen, &hash_page_number, &hash, 0, 0);
+	RL_CALL(rl_hash_get_objects, RL_OK, db, key, keylen, NULL, &hash, 0, 0);
 
-	RL_MALLOC(digest, sizeof(unsigned char) * 20);
 	int i;
 	for (i = 0; i < fieldc; i++) {
-		RL_CALL(sha1, RL_OK, fields[i], fieldslen[i], digest);
-
-		retval = rl_btree_find_score(db, hash, digest, &tmp, NULL, NULL);
-		if (retval == RL_FOUND) {
-			hashkey = tmp;
-			rl_multi_string_get(db, hashkey->value_page, &data[i], &datalen[i]);
-		}
-		else if (retval == RL_NOT_FOUND) {
+		retval = rl_hash_get_value(db, hash, fields[i], fieldslen[i], &data[i], &datalen[i]);
+		if (retval == RL_NOT_FOUND) {
 			data[i] = NULL;
 			datalen[i] = -1;
 		}
-		else {
+		else if (retval != RL_FOUND) {
 			goto cleanup;
 		}
 	}
@@ -199,7 +465,6 @@ cleanup:
 		rl_free(data);
 		rl_free(datalen);
 	}
-	rl_free(digest);
 	return retval;
 }
 
@@ -208,63 +473,45 @@ int rl_hmset(struct rlite *db, const unsigned char *key, long keylen, int fieldc
 	int i, retval;
 	long hash_page_number;
 	rl_btree *hash;
-	unsigned char *digest = NULL;
-	rl_hashkey *hashkey = NULL;
-	void *tmp;
 	RL_CALL(rl_hash_get_objects, RL_OK, db, key, keylen, &hash_page_number, &hash, 1, 1);
 
 	for (i = 0; i < fieldc; i++) {
-		RL_MALLOC(digest, sizeof(unsigned char) * 20);
-		RL_CALL(sha1, RL_OK, fields[i], fieldslen[i], digest);
-
-		retval = rl_btree_find_score(db, hash, digest, &tmp, NULL, NULL);
-		if (retval == RL_FOUND) {
-			hashkey = tmp;
-			rl_multi_string_delete(db, hashkey->value_page);
-			RL_CALL(rl_multi_string_set, RL_OK, db, &hashkey->value_page, datas[i], dataslen[i]);
-			retval = rl_btree_update_element(db, hash, digest, hashkey);
-			if (retval == RL_OK) {
-				rl_free(digest);
-				digest = NULL;
-			}
-			else {
-				goto cleanup;
-			}
-		}
-		else if (retval == RL_NOT_FOUND) {
-			RL_MALLOC(hashkey, sizeof(*hashkey));
-			RL_CALL(rl_multi_string_set, RL_OK, db, &hashkey->string_page, fields[i], fieldslen[i]);
-			RL_CALL(rl_multi_string_set, RL_OK, db, &hashkey->value_page, datas[i], dataslen[i]);
-
-			retval = rl_btree_add_element(db, hash, hash_page_number, digest, hashkey);
-			if (retval != RL_FOUND && retval != RL_OK) {
-				goto cleanup;
-			}
-		}
+		RL_CALL(rl_hash_set, RL_OK, db, hash_page_number, &hash, fields[i], fieldslen[i], datas[i], dataslen[i], 1, NULL);
 	}
 	retval = RL_OK;
 cleanup:
-	if (retval != RL_OK) {
-		rl_free(digest);
-		rl_free(hashkey);
-	}
 	return retval;
 }
 
 int rl_hexists(struct rlite *db, const unsigned char *key, long keylen, unsigned char *field, long fieldlen)
 {
 	int retval;
-	long hash_page_number;
 	rl_btree *hash;
-	unsigned char *digest = NULL;
-	RL_CALL(rl_hash_get_objects, RL_OK, db, key, keylen, &hash_page_number, &hash, 0, 0);
+	RL_CALL(rl_hash_get_objects, RL_OK, db, key, keylen, NULL, &hash, 0, 0);
+	retval = rl_hash_get_value(db, hash, field, fieldlen, NULL, NULL);
+cleanup:
+	return retval;
+}
 
-	RL_MALLOC(digest, sizeof(unsigned char) * 20);
-	RL_CALL(sha1, RL_OK, field, fieldlen, digest);
+static int rl_hdel_packed(rlite *db, long hash_page_number, rl_hash_packed *packed, long fieldsc, unsigned char **fields, long *fieldslen, long *deleted, int *keydeleted)
+{
+	int retval = RL_OK;
+	long i, offset;
 
-	retval = rl_btree_find_score(db, hash, digest, NULL, NULL, NULL);
+	for (i = 0; i < fieldsc; i++) {
+		if (packed_find(packed, fields[i], fieldslen[i], &offset, NULL, NULL) == RL_FOUND) {
+			packed_remove(packed, offset);
+			(*deleted)++;
+		}
+	}
+	if (packed->btree.number_of_elements == 0) {
+		*keydeleted = 1;
+		RL_CALL(rl_delete, RL_OK, db, hash_page_number);
+	}
+	else if (*deleted > 0) {
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_btree_hash_sha1_hashkey, hash_page_number, packed);
+	}
 cleanup:
-	rl_free(digest);
 	return retval;
 }
 
@@ -280,23 +527,28 @@ int rl_hdel(struct rlite *db, const unsigned char *key, long keylen, long fields
 	int keydeleted = 0;
 	unsigned char *digest = NULL;
 	RL_CALL(rl_hash_get_objects, RL_OK, db, key, keylen, &hash_page_number, &hash, 1, 0);
-	RL_MALLOC(digest, sizeof(unsigned char) * 20);
 
-	for (i = 0; i < fieldsc; i++) {
-		RL_CALL(sha1, RL_OK, fields[i], fieldslen[i], digest);
-		retval = rl_btree_find_score(db, hash, digest, &tmp, NULL, NULL);
-		if (retval == RL_FOUND) {
-			deleted++;
-			hashkey = tmp;
-			rl_multi_string_delete(db, hashkey->string_page);
-			rl_multi_string_delete(db, hashkey->value_page);
-			retval = rl_btree_remove_element(db, hash, hash_page_number, digest);
-			if (retval != RL_OK && retval != RL_DELETED) {
-				goto cleanup;
-			}
-			if (retval == RL_DELETED) {
-				keydeleted = 1;
-				break;
+	if (IS_PACKED(hash)) {
+		RL_CALL(rl_hdel_packed, RL_OK, db, hash_page_number, (rl_hash_packed *)hash, fieldsc, fields, fieldslen, &deleted, &keydeleted);
+	}
+	else {
+		RL_MALLOC(digest, sizeof(unsigned char) * 20);
+		for (i = 0; i < fieldsc; i++) {
+			RL_CALL(sha1, RL_OK, fields[i], fieldslen[i], digest);
+			retval = rl_btree_find_score(db, hash, digest, &tmp, NULL, NULL);
+			if (retval == RL_FOUND) {
+				deleted++;
+				hashkey = tmp;
+				rl_multi_string_delete(db, hashkey->string_page);
+				rl_multi_string_delete(db, hashkey->value_page);
+				retval = rl_btree_remove_element(db, hash, hash_page_number, digest);
+				if (retval != RL_OK && retval != RL_DELETED) {
+					goto cleanup;
+				}
+				if (retval == RL_DELETED) {
+					keydeleted = 1;
+					break;
+				}
 			}
 		}
 	}
@@ -312,13 +564,39 @@ cleanup:
 	return retval;
 }
 
-int rl_hgetall(struct rlite *db, rl_hash_iterator **iterator, const unsigned char *key, long keylen)
+int rl_hgetall(struct rlite *db, rl_hash_iterator **_iterator, const unsigned char *key, long keylen)
 {
 	int retval;
 	rl_btree *hash;
+	rl_hash_packed *packed;
+	rl_hash_iterator *iterator = NULL;
 	RL_CALL(rl_hash_get_objects, RL_OK, db, key, keylen, NULL, &hash, 0, 0);
-	RL_CALL(rl_btree_iterator_create, RL_OK, db, hash, iterator);
+	if (hash->number_of_elements == 0) {
+		retval = RL_NOT_FOUND;
+		goto cleanup;
+	}
+	RL_MALLOC(iterator, sizeof(*iterator));
+	iterator->db = db;
+	iterator->size = hash->number_of_elements;
+	iterator->btree_iterator = NULL;
+	iterator->data = NULL;
+	iterator->datalen = 0;
+	iterator->position = 0;
+	if (IS_PACKED(hash)) {
+		// the hash page may be modified or released while iterating
+		packed = (rl_hash_packed *)hash;
+		RL_CALL(packed_sorted_copy, RL_OK, packed, &iterator->data);
+		iterator->datalen = packed->datalen;
+	}
+	else {
+		RL_CALL(rl_btree_iterator_create, RL_OK, db, hash, &iterator->btree_iterator);
+	}
+	*_iterator = iterator;
+	retval = RL_OK;
 cleanup:
+	if (retval != RL_OK && iterator) {
+		rl_hash_iterator_destroy(iterator);
+	}
 	return retval;
 }
 
@@ -338,21 +616,15 @@ int rl_hincrby(struct rlite *db, const unsigned char *key, long keylen, unsigned
 	int retval;
 	rl_btree *hash;
 	void *tmp;
-	unsigned char *digest = NULL, *data = NULL;
+	unsigned char *data = NULL;
 	char *end;
 	long datalen, hash_page_number;
 	long long value;
-	rl_hashkey *hashkey;
 
 	RL_CALL(rl_hash_get_objects, RL_OK, db, key, keylen, &hash_page_number, &hash, 1, 1);
 
-	RL_MALLOC(digest, sizeof(unsigned char) * 20);
-	RL_CALL(sha1, RL_OK, field, fieldlen, digest);
-
-	retval = rl_btree_find_score(db, hash, digest, &tmp, NULL, NULL);
+	retval = rl_hash_get_value(db, hash, field, fieldlen, &data, &datalen);
 	if (retval == RL_FOUND) {
-		hashkey = tmp;
-		rl_multi_string_get(db, hashkey->value_page, &data, &datalen);
 		tmp = rl_realloc(data, sizeof(unsigned char) * (datalen + 1));
 		if (!tmp) {
 			retval = RL_OUT_OF_MEMORY;
@@ -362,7 +634,6 @@ int rl_hincrby(struct rlite *db, const unsigned char *key, long keylen, unsigned
 		data[datalen] = '\0';
 		value = strtoll((char *)data, &end, 10);
 		if (isspace(((char *)data)[0]) || end[0] != '\0' || errno == ERANGE) {
-			rl_free(digest);
 			retval = RL_NAN;
 			goto cleanup;
 		}
@@ -371,46 +642,25 @@ int rl_hincrby(struct rlite *db, const unsigned char *key, long keylen, unsigned
 
 		if ((increment < 0 && value < 0 && increment < (LLONG_MIN - value)) ||
 		        (increment > 0 && value > 0 && increment > (LLONG_MAX - value))) {
-			rl_free(digest);
 			retval = RL_OVERFLOW;
 			goto cleanup;
 		}
-
 		value += increment;
-		rl_multi_string_delete(db, hashkey->value_page);
-
-		RL_MALLOC(data, sizeof(unsigned char) * MAX_LLONG_DIGITS);
-		datalen = snprintf((char *)data, MAX_LLONG_DIGITS, "%lld", value);
-		RL_CALL(rl_multi_string_set, RL_OK, db, &hashkey->value_page, data, datalen);
-
-		retval = rl_btree_update_element(db, hash, digest, hashkey);
-		if (retval == RL_OK) {
-			rl_free(digest);
-			digest = NULL;
-			if (newvalue) {
-				*newvalue = value;
-			}
-		}
-		else if (retval != RL_NOT_FOUND) {
-			goto cleanup;
-		}
 	}
 	else if (retval == RL_NOT_FOUND) {
-		RL_MALLOC(data, sizeof(unsigned char) * MAX_LLONG_DIGITS);
-		datalen = snprintf((char *)data, MAX_LLONG_DIGITS, "%ld", increment);
-
-		RL_MALLOC(hashkey, sizeof(*hashkey));
-		RL_CALL(rl_multi_string_set, RL_OK, db, &hashkey->string_page, field, fieldlen);
-		RL_CALL(rl_multi_string_set, RL_OK, db, &hashkey->value_page, data, datalen);
-		RL_CALL(rl_btree_add_element, RL_OK, db, hash, hash_page_number, digest, hashkey);
-		if (newvalue) {
-			*newvalue = increment;
-		}
+		value = increment;
 	}
 	else {
 		goto cleanup;
 	}
 
+	RL_MALLOC(data, sizeof(unsigned char) * MAX_LLONG_DIGITS);
+	datalen = snprintf((char *)data, MAX_LLONG_DIGITS, "%lld", value);
+	RL_CALL(rl_hash_set, RL_OK, db, hash_page_number, &hash, field, fieldlen, data, datalen, 1, NULL);
+	if (newvalue) {
+		*newvalue = value;
+	}
+
 	retval = RL_OK;
 cleanup:
 	rl_free(data);
@@ -422,21 +672,15 @@ int rl_hincrbyfloat(struct rlite *db, const unsigned char *key, long keylen, uns
 	int retval;
 	rl_btree *hash;
 	void *tmp;
-	unsigned char *digest = NULL, *data = NULL;
+	unsigned char *data = NULL;
 	char *end;
 	long dataalloc, datalen, hash_page_number;
 	double value;
-	rl_hashkey *hashkey;
 
 	RL_CALL(rl_hash_get_objects, RL_OK, db, key, keylen, &hash_page_number, &hash, 1, 1);
 
-	RL_MALLOC(digest, sizeof(unsigned char) * 20);
-	RL_CALL(sha1, RL_OK, field, fieldlen, digest);
-
-	retval = rl_btree_find_score(db, hash, digest, &tmp, NULL, NULL);
+	retval = rl_hash_get_value(db, hash, field, fieldlen, &data, &datalen);
 	if (retval == RL_FOUND) {
-		hashkey = tmp;
-		rl_multi_string_get(db, hashkey->value_page, &data, &datalen);
 		dataalloc = (datalen / 8 + 1) * 8;
 		tmp = rl_realloc(data, sizeof(unsigned char) * dataalloc);
 		if (!tmp) {
@@ -450,47 +694,27 @@ int rl_hincrbyfloat(struct rlite *db, const unsigned char *key, long keylen, uns
 		if (isspace(((char *)data)[0]) || end[0] != '\0' ||
 		        (errno == ERANGE && (value == HUGE_VAL || value == -HUGE_VAL || value == 0)) ||
 		        errno == EINVAL || isnan(value)) {
-			rl_free(digest);
 			retval = RL_NAN;
 			goto cleanup;
 		}
 		rl_free(data);
 		data = NULL;
 		value += increment;
-		rl_multi_string_delete(db, hashkey->value_page);
-
-		RL_MALLOC(data, sizeof(unsigned char) * MAX_DOUBLE_DIGITS);
-		datalen = snprintf((char *)data, MAX_DOUBLE_DIGITS, "%lf", value);
-		RL_CALL(rl_multi_string_set, RL_OK, db, &hashkey->value_page, data, datalen);
-
-		retval = rl_btree_update_element(db, hash, digest, hashkey);
-		if (retval == RL_OK) {
-			rl_free(digest);
-			digest = NULL;
-			if (newvalue) {
-				*newvalue = value;
-			}
-		}
-		else if (retval != RL_NOT_FOUND) {
-			goto cleanup;
-		}
 	}
 	else if (retval == RL_NOT_FOUND) {
-		RL_MALLOC(data, sizeof(unsigned char) * MAX_DOUBLE_DIGITS);
-		datalen = snprintf((char *)data, MAX_DOUBLE_DIGITS, "%lf", increment);
-
-		RL_MALLOC(hashkey, sizeof(*hashkey));
-		RL_CALL(rl_multi_string_set, RL_OK, db, &hashkey->string_page, field, fieldlen);
-		RL_CALL(rl_multi_string_set, RL_OK, db, &hashkey->value_page, data, datalen);
-		RL_CALL(rl_btree_add_element, RL_OK, db, hash, hash_page_number, digest, hashkey);
-		if (newvalue) {
-			*newvalue = increment;
-		}
+		value = increment;
 	}
 	else {
 		goto cleanup;
 	}
 
+	RL_MALLOC(data, sizeof(unsigned char) * MAX_DOUBLE_DIGITS);
+	datalen = snprintf((char *)data, MAX_DOUBLE_DIGITS, "%lf", value);
+	RL_CALL(rl_hash_set, RL_OK, db, hash_page_number, &hash, field, fieldlen, data, datalen, 1, NULL);
+	if (newvalue) {
+		*newvalue = value;
+	}
+
 	retval = RL_OK;
 cleanup:
 	rl_free(data);
@@ -501,6 +725,7 @@ int rl_hash_iterator_next(rl_hash_iterator *iterator, long *fieldpage, unsigned
 {
 	void *tmp;
 	rl_hashkey *hashkey = NULL;
+	long flen, vlen;
 	int retval;
 	if (member && !memberlen) {
 		fprintf(stderr, "If member is provided, memberlen is required\n");
@@ -512,38 +737,68 @@ int rl_hash_iterator_next(rl_hash_iterator *iterator, long *fieldpage, unsigned
 		return RL_UNEXPECTED;
 	}
 
-	RL_CALL(rl_btree_iterator_next, RL_OK, iterator, NULL, &tmp);
+	if (!iterator->btree_iterator) {
+		if (iterator->position == iterator->datalen) {
+			retval = RL_END;
+			goto cleanup;
+		}
+		flen = get_4bytes(&iterator->data[iterator->position]);
+		vlen = get_4bytes(&iterator->data[iterator->position + 4 + flen]);
+		if (fieldpage) {
+			*fieldpage = 0;
+		}
+		if (fieldlen) {
+			RL_CALL(copy_bytes, RL_OK, &iterator->data[iterator->position + 4], flen, field, fieldlen);
+		}
+		if (memberpage) {
+			*memberpage = 0;
+		}
+		if (memberlen) {
+			RL_CALL(copy_bytes, RL_OK, &iterator->data[iterator->position + 8 + flen], vlen, member, memberlen);
+		}
+		iterator->position += PACKED_ENTRY_SIZE(flen, vlen);
+		retval = RL_OK;
+		goto cleanup;
+	}
+
+	retval = rl_btree_iterator_next(iterator->btree_iterator, NULL, &tmp);
+	if (retval != RL_OK) {
+		// the btree iterator releases itself once it is done
+		iterator->btree_iterator = NULL;
+		goto cleanup;
+	}
 	hashkey = tmp;
 
 	if (fieldpage) {
 		*fieldpage = hashkey->string_page;
 	}
 	if (fieldlen) {
-		retval = rl_multi_string_get(iterator->db, hashkey->string_page, field, fieldlen);
-		if (retval != RL_OK) {
-			rl_btree_iterator_destroy(iterator);
-			goto cleanup;
-		}
+		RL_CALL(rl_multi_string_get, RL_OK, iterator->db, hashkey->string_page, field, fieldlen);
 	}
 
 	if (memberpage) {
 		*memberpage = hashkey->value_page;
 	}
 	if (memberlen) {
-		retval = rl_multi_string_get(iterator->db, hashkey->value_page, member, memberlen);
-		if (retval != RL_OK) {
-			rl_btree_iterator_destroy(iterator);
-			goto cleanup;
-		}
+		RL_CALL(rl_multi_string_get, RL_OK, iterator->db, hashkey->value_page, member, memberlen);
 	}
 cleanup:
+	if (retval != RL_OK) {
+		rl_hash_iterator_destroy(iterator);
+	}
 	rl_free(hashkey);
 	return retval;
 }
 
 int rl_hash_iterator_destroy(rl_hash_iterator *iterator)
 {
-	return rl_btree_iterator_destroy(iterator);
+	int retval = RL_OK;
+	if (iterator->btree_iterator) {
+		retval = rl_btree_iterator_destroy(iterator->btree_iterator);
+	}
+	rl_free(iterator->data);
+	rl_free(iterator);
+	return retval;
 }
 
 int rl_hash_pages(struct rlite *db, long page, short *pages)
@@ -556,6 +811,10 @@ int rl_hash_pages(struct rlite *db, long page, short *pages)
 
 	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_btree_hash_sha1_hashkey, page, &rl_btree_type_hash_sha1_hashkey, &tmp, 1);
 	btree = tmp;
+	if (IS_PACKED(btree)) {
+		retval = RL_OK;
+		goto cleanup;
+	}
 
 	RL_CALL(rl_btree_pages, RL_OK, db, btree, pages);
 
@@ -592,6 +851,10 @@ int rl_hash_delete(rlite *db, long value_page)
 	void *tmp;
 	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_btree_hash_sha1_hashkey, value_page, &rl_btree_type_hash_sha1_hashkey, &tmp, 1);
 	hash = tmp;
+	if (IS_PACKED(hash)) {
+		RL_CALL(rl_delete, RL_OK, db, value_page);
+		goto cleanup;
+	}
 	RL_CALL(rl_btree_iterator_create, RL_OK, db, hash, &iterator);
 	while ((retval = rl_btree_iterator_next(iterator, NULL, &tmp)) == RL_OK) {
 		hashkey = tmp;
@@ -1,20 +1,256 @@
 #include <stdlib.h>
+#include <string.h>
 #include "rlite/rlite.h"
 #include "rlite/page_multi_string.h"
 #include "rlite/type_set.h"
 #include "rlite/page_btree.h"
 #include "rlite/util.h"
 
+/**
+ * Small sets are stored "packed" in their own page instead of in a btree,
+ * like small hashes. The page starts like a btree header with a zero root,
+ * followed by the number of members, the length of the members and the
+ * members themselves, each after its 4-byte length.
+ * Once a member does not fit in the page, or the set grows past
+ * RL_SET_PACKED_MAX_ENTRIES, it is converted to a btree.
+ */
+#define PACKED_HEADER_SIZE 12
+#define PACKED_ENTRY_SIZE(memberlen) (4 + (memberlen))
+// a btree resets its root to 0 when its last element is removed, so loaded
+// packed sets are told apart by their max_node_size instead
+#define IS_PACKED(set) ((set)->max_node_size == 0)
+
+typedef struct {
+	rl_btree btree;
+	long datalen;
+	unsigned char *data;
+} rl_set_packed;
+
+int rl_set_serialize(struct rlite *db, void *obj, unsigned char *data)
+{
+	rl_set_packed *packed = obj;
+	if (!IS_PACKED(&packed->btree)) {
+		return rl_btree_serialize(db, obj, data);
+	}
+	put_4bytes(data, 0);
+	put_4bytes(&data[4], packed->btree.number_of_elements);
+	put_4bytes(&data[8], packed->datalen);
+	if (packed->datalen) {
+		memcpy(&data[PACKED_HEADER_SIZE], packed->data, packed->datalen);
+	}
+	return RL_OK;
+}
+
+int rl_set_deserialize(struct rlite *db, void **obj, void *context, unsigned char *data)
+{
+	rl_set_packed *packed;
+	int retval = RL_OK;
+	if (get_4bytes(data) != 0) {
+		return rl_btree_deserialize(db, obj, context, data);
+	}
+	RL_MALLOC(packed, sizeof(*packed));
+	packed->btree.db = db;
+	packed->btree.type = context;
+	packed->btree.root = 0;
+	packed->btree.height = 0;
+	packed->btree.max_node_size = 0;
+	packed->btree.number_of_elements = get_4bytes(&data[4]);
+	packed->datalen = get_4bytes(&data[8]);
+	packed->data = NULL;
+	if (packed->datalen) {
+		packed->data = rl_malloc(sizeof(unsigned char) * packed->datalen);
+		if (!packed->data) {
+			rl_free(packed);
+			retval = RL_OUT_OF_MEMORY;
+			goto cleanup;
+		}
+		memcpy(packed->data, &data[PACKED_HEADER_SIZE], packed->datalen);
+	}
+	*obj = packed;
+cleanup:
+	return retval;
+}
+
+int rl_set_destroy(struct rlite *db, void *obj)
+{
+	rl_set_packed *packed = obj;
+	if (IS_PACKED(&packed->btree)) {
+		rl_free(packed->data);
+	}
+	return rl_btree_destroy(db, obj);
+}
+
+static int packed_find(rl_set_packed *packed, unsigned char *member, long memberlen, long *_offset)
+{
+	long offset = 0, len;
+	while (offset < packed->datalen) {
+		len = get_4bytes(&packed->data[offset]);
+		if (len == memberlen && memcmp(&packed->data[offset + 4], member, memberlen) == 0) {
+			if (_offset) {
+				*_offset = offset;
+			}
+			return RL_FOUND;
+		}
+		offset += PACKED_ENTRY_SIZE(len);
+	}
+	return RL_NOT_FOUND;
+}
+
+// offset of the member in position `index`
+static long packed_offset(rl_set_packed *packed, long index)
+{
+	long offset = 0;
+	while (index-- > 0) {
+		offset += PACKED_ENTRY_SIZE(get_4bytes(&packed->data[offset]));
+	}
+	return offset;
+}
+
+static void packed_remove(rl_set_packed *packed, long offset)
+{
+	long entrylen = PACKED_ENTRY_SIZE(get_4bytes(&packed->data[offset]));
+	memmove(&packed->data[offset], &packed->data[offset + entrylen], packed->datalen - offset - entrylen);
+	packed->datalen -= entrylen;
+	packed->btree.number_of_elements--;
+}
+
+static int packed_append(rl_set_packed *packed, unsigned char *member, long memberlen)
+{
+	int retval = RL_OK;
+	void *tmp;
+	long offset = packed->datalen;
+	RL_REALLOC(packed->data, sizeof(unsigned char) * (packed->datalen + PACKED_ENTRY_SIZE(memberlen)));
+	put_4bytes(&packed->data[offset], memberlen);
+	memcpy(&packed->data[offset + 4], member, memberlen);
+	packed->datalen += PACKED_ENTRY_SIZE(memberlen);
+	packed->btree.number_of_elements++;
+cleanup:
+	return retval;
+}
+
+struct packed_entry {
+	unsigned char digest[20];
+	long offset;
+};
+
+static int packed_entry_cmp(const void *a, const void *b)
+{
+	return sha1_cmp(((struct packed_entry *)a)->digest, ((struct packed_entry *)b)->digest);
+}
+
+/**
+ * Copies the members ordered by their sha1, the order a btree set iterates
+ * in, so converting a set does not change SMEMBERS' output.
+ */
+static int packed_sorted_copy(rl_set_packed *packed, unsigned char **_data)
+{
+	struct packed_entry *entries = NULL;
+	unsigned char *data = NULL;
+	long i, offset, memberlen, entrylen, datalen = 0;
+	int retval;
+
+	if (packed->datalen == 0) {
+		*_data = NULL;
+		return RL_OK;
+	}
+	RL_MALLOC(entries, sizeof(*entries) * packed->btree.number_of_elements);
+	RL_MALLOC(data, sizeof(unsigned char) * packed->datalen);
+	for (i = 0, offset = 0; offset < packed->datalen; i++) {
+		memberlen = get_4bytes(&packed->data[offset]);
+		RL_CALL(sha1, RL_OK, &packed->data[offset + 4], memberlen, entries[i].digest);
+		entries[i].offset = offset;
+		offset += PACKED_ENTRY_SIZE(memberlen);
+	}
+	qsort(entries, packed->btree.number_of_elements, sizeof(*entries), packed_entry_cmp);
+	for (i = 0; i < packed->btree.number_of_elements; i++) {
+		offset = entries[i].offset;
+		entrylen = PACKED_ENTRY_SIZE(get_4bytes(&packed->data[offset]));
+		memcpy(&data[datalen], &packed->data[offset], entrylen);
+		datalen += entrylen;
+	}
+	*_data = data;
+	data = NULL;
+	retval = RL_OK;
+cleanup:
+	rl_free(entries);
+	rl_free(data);
+	return retval;
+}
+
+static int copy_bytes(unsigned char *src, long srclen, unsigned char **dst, long *dstlen)
+{
+	int retval = RL_OK;
+	if (dstlen) {
+		*dstlen = srclen;
+	}
+	if (dst) {
+		// like rl_multi_string_get: NULL when empty, nul terminated otherwise
+		*dst = NULL;
+		if (srclen > 0) {
+			RL_MALLOC(*dst, sizeof(unsigned char) * (srclen + 1));
+			memcpy(*dst, src, srclen);
+			(*dst)[srclen] = 0;
+		}
+	}
+cleanup:
+	return retval;
+}
+
+/**
+ * Replaces the packed set in `set_page_number` with a btree holding the
+ * same members.
+ */
+static int rl_set_unpack(rlite *db, long set_page_number, rl_btree **set)
+{
+	rl_set_packed *packed = (rl_set_packed *)*set;
+	unsigned char *data = packed->data, *digest = NULL;
+	long datalen = packed->datalen, offset, memberlen;
+	long *member = NULL;
+	rl_btree *btree;
+	int retval;
+
+	RL_CALL(rl_btree_create, RL_OK, db, &btree, &rl_btree_type_hash_sha1_long);
+	// writing the btree destroys the packed object, its members are still needed
+	packed->data = NULL;
+	RL_CALL(rl_write, RL_OK, db, &rl_data_type_btree_hash_sha1_long, set_page_number, btree);
+	*set = btree;
+
+	for (offset = 0; offset < datalen; offset += PACKED_ENTRY_SIZE(memberlen)) {
+		memberlen = get_4bytes(&data[offset]);
+		RL_MALLOC(digest, sizeof(unsigned char) * 20);
+		RL_CALL(sha1, RL_OK, &data[offset + 4], memberlen, digest);
+		RL_MALLOC(member, sizeof(*member));
+		RL_CALL(rl_multi_string_set, RL_OK, db, member, &data[offset + 4], memberlen);
+		RL_CALL(rl_btree_add_element, RL_OK, db, btree, set_page_number, digest, member);
+		digest = NULL;
+		member = NULL;
+	}
+	retval = RL_OK;
+cleanup:
+	rl_free(data);
+	rl_free(digest);
+	rl_free(member);
+	return retval;
+}
+
 static int rl_set_create(rlite *db, long btree_page, rl_btree **btree)
 {
-	rl_btree *set = NULL;
+	rl_set_packed *packed = NULL;
 
 	int retval;
-	RL_CALL(rl_btree_create, RL_OK, db, &set, &rl_btree_type_hash_sha1_long);
-	RL_CALL(rl_write, RL_OK, db, &rl_data_type_btree_hash_sha1_long, btree_page, set);
+	RL_MALLOC(packed, sizeof(*packed));
+	packed->btree.db = db;
+	packed->btree.type = &rl_btree_type_hash_sha1_long;
+	packed->btree.root = 0;
+	packed->btree.height = 0;
+	packed->btree.max_node_size = 0;
+	packed->btree.number_of_elements = 0;
+	packed->datalen = 0;
+	packed->data = NULL;
+	RL_CALL(rl_write, RL_OK, db, &rl_data_type_btree_hash_sha1_long, btree_page, packed);
 
 	if (btree) {
-		*btree = set;
+		*btree = &packed->btree;
 	}
 cleanup:
 	return retval;
@@ -72,45 +308,152 @@ cleanup:
 	}
 	return retval;
 }
+/**
+ * Adds `member` to `set`, converting it to a btree when a packed set would
+ * outgrow its page; `set` is updated in that case. `digest` is the member's
+ * sha1 when the caller has it already, or NULL.
+ */
+static int rl_set_add(rlite *db, long set_page_number, rl_btree **_set, unsigned char *member, long memberlen, unsigned char *known_digest, long *added)
+{
+	int retval;
+	rl_btree *set = *_set;
+	rl_set_packed *packed;
+	unsigned char *digest = NULL;
+	long *member_page = NULL;
+
+	*added = 0;
+	if (IS_PACKED(set)) {
+		packed = (rl_set_packed *)set;
+		if (packed_find(packed, member, memberlen, NULL) == RL_FOUND) {
+			retval = RL_OK;
+			goto cleanup;
+		}
+		if (PACKED_HEADER_SIZE + packed->datalen + PACKED_ENTRY_SIZE(memberlen) <= db->page_size && set->number_of_elements < RL_SET_PACKED_MAX_ENTRIES) {
+			RL_CALL(packed_append, RL_OK, packed, member, memberlen);
+			RL_CALL(rl_write, RL_OK, db, &rl_data_type_btree_hash_sha1_long, set_page_number, packed);
+			*added = 1;
+			retval = RL_OK;
+			goto cleanup;
+		}
+		RL_CALL(rl_set_unpack, RL_OK, db, set_page_number, _set);
+		set = *_set;
+	}
+
+	RL_MALLOC(digest, sizeof(unsigned char) * 20);
+	if (known_digest) {
+		memcpy(digest, known_digest, 20);
+	}
+	else {
+		RL_CALL(sha1, RL_OK, member, memberlen, digest);
+	}
+
+	retval = rl_btree_find_score(db, set, digest, NULL, NULL, NULL);
+	if (retval == RL_NOT_FOUND) {
+		RL_MALLOC(member_page, sizeof(*member_page));
+		RL_CALL(rl_multi_string_set, RL_OK, db, member_page, member, memberlen);
+		RL_CALL(rl_btree_add_element, RL_OK, db, set, set_page_number, digest, member_page);
+		digest = NULL;
+		member_page = NULL;
+		*added = 1;
+	}
+	else if (retval != RL_FOUND) {
+		goto cleanup;
+	}
+	retval = RL_OK;
+cleanup:
+	rl_free(digest);
+	rl_free(member_page);
+	return retval;
+}
+
+/**
+ * Removes the packed member at `offset`, deleting the set page and returning
+ * RL_DELETED when it was the last one.
+ */
+static int packed_delete(rlite *db, long set_page_number, rl_set_packed *packed, long offset)
+{
+	int retval;
+	packed_remove(packed, offset);
+	if (packed->btree.number_of_elements == 0) {
+		RL_CALL(rl_delete, RL_OK, db, set_page_number);
+		retval = RL_DELETED;
+	}
+	else {
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_btree_hash_sha1_long, set_page_number, packed);
+	}
+cleanup:
+	return retval;
+}
+
+/**
+ * Removes `member` from `set`. Returns RL_DELETED when it was the last
+ * member, the set is gone then but its key is left to the caller.
+ */
+static int rl_set_remove(rlite *db, long set_page_number, rl_btree *set, unsigned char *member, long memberlen)
+{
+	unsigned char digest[20];
+	long offset;
+	void *tmp;
+	int retval;
+
+	if (IS_PACKED(set)) {
+		retval = packed_find((rl_set_packed *)set, member, memberlen, &offset);
+		if (retval == RL_FOUND) {
+			retval = packed_delete(db, set_page_number, (rl_set_packed *)set, offset);
+		}
+		goto cleanup;
+	}
+
+	RL_CALL(sha1, RL_OK, member, memberlen, digest);
+	retval = rl_btree_find_score(db, set, digest, &tmp, NULL, NULL);
+	if (retval != RL_FOUND) {
+		goto cleanup;
+	}
+	rl_multi_string_delete(db, *(long *)tmp);
+	retval = rl_btree_remove_element(db, set, set_page_number, digest);
+cleanup:
+	return retval;
+}
+
+// `digest` is the member's sha1, btree sets are searched by it
+static int set_find(rlite *db, rl_btree *set, unsigned char *digest, unsigned char *member, long memberlen)
+{
+	if (IS_PACKED(set)) {
+		return packed_find((rl_set_packed *)set, member, memberlen, NULL);
+	}
+	return rl_btree_find_score(db, set, digest, NULL, NULL, NULL);
+}
+
+int rl_set_ismember(struct rlite *db, rl_btree *set, unsigned char *member, long memberlen)
+{
+	unsigned char digest[20];
+	int retval;
+	if (IS_PACKED(set)) {
+		return packed_find((rl_set_packed *)set, member, memberlen, NULL);
+	}
+	RL_CALL(sha1, RL_OK, member, memberlen, digest);
+	retval = rl_btree_find_score(db, set, digest, NULL, NULL, NULL);
+cleanup:
+	return retval;
+}
+
 int rl_sadd(struct rlite *db, const unsigned char *key, long keylen, int memberc, unsigned char **members, long *memberslen, long *added)
 {
 	int i, retval;
 	long set_page_number;
 	rl_btree *set;
-	unsigned char *digest = NULL;
-	long *member = NULL;
-	long count = 0;
-	void *tmp;
+	long add, count = 0;
 	RL_CALL(rl_set_get_objects, RL_OK, db, key, keylen, &set_page_number, &set, 1, 1);
 
 	for (i = 0; i < memberc; i++) {
-		RL_MALLOC(digest, sizeof(unsigned char) * 20);
-		RL_CALL(sha1, RL_OK, members[i], memberslen[i], digest);
-
-		retval = rl_btree_find_score(db, set, digest, &tmp, NULL, NULL);
-		if (retval == RL_NOT_FOUND) {
-			RL_MALLOC(member, sizeof(*member));
-			RL_CALL(rl_multi_string_set, RL_OK, db, member, members[i], memberslen[i]);
-			RL_CALL(rl_btree_add_element, RL_OK, db, set, set_page_number, digest, member);
-			count++;
-		}
-		else if (retval == RL_FOUND) {
-			rl_free(digest);
-			digest = NULL;
-		}
-		else {
-			goto cleanup;
-		}
+		RL_CALL(rl_set_add, RL_OK, db, set_page_number, &set, members[i], memberslen[i], NULL, &add);
+		count += add;
 	}
 	if (added) {
 		*added = count;
 	}
 	retval = RL_OK;
 cleanup:
-	if (retval != RL_OK) {
-		rl_free(digest);
-		rl_free(member);
-	}
 	return retval;
 }
 
@@ -119,29 +462,23 @@ int rl_srem(struct rlite *db, const unsigned char *key, long keylen, int members
 	int retval;
 	long set_page_number;
 	rl_btree *set;
-	long member;
-	void *tmp;
 	long i;
 	long deleted = 0;
 	int keydeleted = 0;
-	unsigned char digest[20];
 	RL_CALL(rl_set_get_objects, RL_OK, db, key, keylen, &set_page_number, &set, 1, 0);
 
 	for (i = 0; i < membersc; i++) {
-		RL_CALL(sha1, RL_OK, members[i], memberslen[i], digest);
-		retval = rl_btree_find_score(db, set, digest, &tmp, NULL, NULL);
-		if (retval == RL_FOUND) {
+		retval = rl_set_remove(db, set_page_number, set, members[i], memberslen[i]);
+		if (retval == RL_OK) {
 			deleted++;
-			member = *(long *)tmp;
-			rl_multi_string_delete(db, member);
-			retval = rl_btree_remove_element(db, set, set_page_number, digest);
-			if (retval != RL_OK && retval != RL_DELETED) {
-				goto cleanup;
-			}
-			if (retval == RL_DELETED) {
-				keydeleted = 1;
-				break;
-			}
+		}
+		else if (retval == RL_DELETED) {
+			deleted++;
+			keydeleted = 1;
+			break;
+		}
+		else if (retval != RL_NOT_FOUND) {
+			goto cleanup;
 		}
 	}
 	if (delcount) {
@@ -160,12 +497,8 @@ int rl_sismember(struct rlite *db, const unsigned char *key, long keylen, unsign
 	int retval;
 	long set_page_number;
 	rl_btree *set;
-	unsigned char digest[20];
 	RL_CALL(rl_set_get_objects, RL_OK, db, key, keylen, &set_page_number, &set, 0, 0);
-
-	RL_CALL(sha1, RL_OK, member, memberlen, digest);
-
-	retval = rl_btree_find_score(db, set, digest, NULL, NULL, NULL);
+	retval = rl_set_ismember(db, set, member, memberlen);
 cleanup:
 	return retval;
 }
@@ -184,64 +517,120 @@ cleanup:
 
 int rl_smove(struct rlite *db, const unsigned char *source, long sourcelen, const unsigned char *destination, long destinationlen, unsigned char *member, long memberlen)
 {
-	rl_btree *source_hash, *target_hash;
-	void *tmp;
-	long target_page_number, source_page_number, *member_page_number;
+	rl_btree *source_set, *target_set;
+	long target_page_number, source_page_number, added;
 	int retval;
-	unsigned char *digest = NULL;
 	// make sure the target key is a set or does not exist
 	RL_CALL2(rl_set_get_objects, RL_OK, RL_NOT_FOUND, db, destination, destinationlen, NULL, NULL, 0, 0);
 
-	RL_MALLOC(digest, sizeof(unsigned char) * 20);
-	RL_CALL(sha1, RL_OK, member, memberlen, digest);
-	RL_CALL(rl_set_get_objects, RL_OK, db, source, sourcelen, &source_page_number, &source_hash, 1, 0);
-	retval = rl_btree_find_score(db, source_hash, digest, &tmp, NULL, NULL);
-	if (retval == RL_FOUND) {
-		rl_multi_string_delete(db, *(long *)tmp);
-		retval = rl_btree_remove_element(db, source_hash, source_page_number, digest);
-		if (retval == RL_DELETED) {
-			RL_CALL(rl_key_delete, RL_OK, db, source, sourcelen);
-		}
-		else if (retval != RL_OK) {
-			goto cleanup;
-		}
+	RL_CALL(rl_set_get_objects, RL_OK, db, source, sourcelen, &source_page_number, &source_set, 1, 0);
+	retval = rl_set_remove(db, source_page_number, source_set, member, memberlen);
+	if (retval == RL_DELETED) {
+		RL_CALL(rl_key_delete, RL_OK, db, source, sourcelen);
 	}
-	else {
+	else if (retval != RL_OK) {
 		goto cleanup;
 	}
-	RL_CALL(rl_set_get_objects, RL_OK, db, destination, destinationlen, &target_page_number, &target_hash, 1, 1);
-	RL_MALLOC(member_page_number, sizeof(*member_page_number))
-	RL_CALL(rl_multi_string_set, RL_OK, db, member_page_number, member, memberlen);
-	RL_CALL(rl_btree_add_element, RL_OK, db, target_hash, target_page_number, digest, member_page_number);
+	RL_CALL(rl_set_get_objects, RL_OK, db, destination, destinationlen, &target_page_number, &target_set, 1, 1);
+	RL_CALL(rl_set_add, RL_OK, db, target_page_number, &target_set, member, memberlen, NULL, &added);
 cleanup:
-	if (retval != RL_OK) {
-		rl_free(digest);
+	return retval;
+}
+
+static int rl_set_iterator_create(rlite *db, rl_btree *set, rl_set_iterator **_iterator)
+{
+	rl_set_iterator *iterator = NULL;
+	int retval;
+	RL_MALLOC(iterator, sizeof(*iterator));
+	iterator->db = db;
+	iterator->size = set->number_of_elements;
+	iterator->btree_iterator = NULL;
+	iterator->data = NULL;
+	iterator->datalen = 0;
+	iterator->position = 0;
+	if (IS_PACKED(set)) {
+		// the set page may be modified or released while iterating
+		RL_CALL(packed_sorted_copy, RL_OK, (rl_set_packed *)set, &iterator->data);
+		iterator->datalen = ((rl_set_packed *)set)->datalen;
+	}
+	else {
+		RL_CALL(rl_btree_iterator_create, RL_OK, db, set, &iterator->btree_iterator);
+	}
+	*_iterator = iterator;
+	retval = RL_OK;
+cleanup:
+	if (retval != RL_OK && iterator) {
+		rl_set_iterator_destroy(iterator);
 	}
 	return retval;
 }
 
-int rl_set_iterator_next(rl_set_iterator *iterator, long *_page, unsigned char **member, long *memberlen)
+// like rl_set_iterator_next, also allocating the member's sha1 in `digest`
+static int set_iterator_next(rl_set_iterator *iterator, unsigned char **digest, long *page, unsigned char **member, long *memberlen)
 {
 	void *tmp;
-	long page;
-	int retval = rl_btree_iterator_next(iterator, NULL, &tmp);
-	if (retval == RL_OK) {
-		page = *(long *)tmp;
-		if (_page) {
-			*_page = page;
+	long len;
+	int retval;
+
+	if (digest) {
+		*digest = NULL;
+	}
+	if (!iterator->btree_iterator) {
+		if (iterator->position == iterator->datalen) {
+			retval = RL_END;
+			goto cleanup;
 		}
-		rl_free(tmp);
-		retval = rl_multi_string_get(iterator->db, page, member, memberlen);
-		if (retval != RL_OK) {
-			rl_set_iterator_destroy(iterator);
+		len = get_4bytes(&iterator->data[iterator->position]);
+		if (digest) {
+			RL_MALLOC(*digest, sizeof(unsigned char) * 20);
+			RL_CALL(sha1, RL_OK, &iterator->data[iterator->position + 4], len, *digest);
+		}
+		if (page) {
+			*page = 0;
+		}
+		RL_CALL(copy_bytes, RL_OK, &iterator->data[iterator->position + 4], len, member, memberlen);
+		iterator->position += PACKED_ENTRY_SIZE(len);
+		retval = RL_OK;
+		goto cleanup;
+	}
+
+	retval = rl_btree_iterator_next(iterator->btree_iterator, (void **)digest, &tmp);
+	if (retval != RL_OK) {
+		// the btree iterator releases itself once it is done
+		iterator->btree_iterator = NULL;
+		goto cleanup;
+	}
+	len = *(long *)tmp;
+	rl_free(tmp);
+	if (page) {
+		*page = len;
+	}
+	RL_CALL(rl_multi_string_get, RL_OK, iterator->db, len, member, memberlen);
+cleanup:
+	if (retval != RL_OK) {
+		if (digest) {
+			rl_free(*digest);
+			*digest = NULL;
 		}
+		rl_set_iterator_destroy(iterator);
 	}
 	return retval;
 }
 
+int rl_set_iterator_next(rl_set_iterator *iterator, long *page, unsigned char **member, long *memberlen)
+{
+	return set_iterator_next(iterator, NULL, page, member, memberlen);
+}
+
 int rl_set_iterator_destroy(rl_set_iterator *iterator)
 {
-	return rl_btree_iterator_destroy(iterator);
+	int retval = RL_OK;
+	if (iterator->btree_iterator) {
+		retval = rl_btree_iterator_destroy(iterator->btree_iterator);
+	}
+	rl_free(iterator->data);
+	rl_free(iterator);
+	return retval;
 }
 
 int rl_smembers(struct rlite *db, rl_set_iterator **iterator, const unsigned char *key, long keylen)
@@ -249,7 +638,7 @@ int rl_smembers(struct rlite *db, rl_set_iterator **iterator, const unsigned cha
 	int retval;
 	rl_btree *set;
 	RL_CALL(rl_set_get_objects, RL_OK, db, key, keylen, NULL, &set, 0, 0);
-	RL_CALL(rl_btree_iterator_create, RL_OK, db, set, iterator);
+	RL_CALL(rl_set_iterator_create, RL_OK, db, set, iterator);
 cleanup:
 	return retval;
 }
@@ -267,14 +656,18 @@ static int contains(long size, long *elements, long element)
 
 int rl_srandmembers(struct rlite *db, const unsigned char *key, long keylen, int repeat, long *memberc, unsigned char ***_members, long **_memberslen)
 {
-	long i;
+	long i, offset = 0, member_id;
 	int retval;
 	long *member;
 	long *used_members = NULL;
 	rl_btree *set;
+	rl_set_packed *packed = NULL;
 	unsigned char **members = NULL;
 	long *memberslen = NULL;
 	RL_CALL(rl_set_get_objects, RL_OK, db, key, keylen, NULL, &set, 0, 0);
+	if (IS_PACKED(set)) {
+		packed = (rl_set_packed *)set;
+	}
 	if (!repeat) {
 		if (*memberc > set->number_of_elements) {
 			*memberc = set->number_of_elements;
@@ -286,17 +679,30 @@ int rl_srandmembers(struct rlite *db, const unsigned char *key, long keylen, int
 	RL_MALLOC(memberslen, sizeof(long) * *memberc);
 
 	for (i = 0; i < *memberc; i++) {
-		RL_CALL(rl_btree_random_element, RL_OK, db, set, NULL, (void **)&member);
+		if (packed) {
+			// packed members are told apart by their position
+			member_id = rand() % set->number_of_elements;
+		}
+		else {
+			RL_CALL(rl_btree_random_element, RL_OK, db, set, NULL, (void **)&member);
+			member_id = *member;
+		}
 		if (!repeat) {
-			if (contains(i, used_members, *member)) {
+			if (contains(i, used_members, member_id)) {
 				i--;
 				continue;
 			}
 			else {
-				used_members[i] = *member;
+				used_members[i] = member_id;
 			}
 		}
-		RL_CALL(rl_multi_string_get, RL_OK, db, *member, &members[i], &memberslen[i]);
+		if (packed) {
+			offset = packed_offset(packed, member_id);
+			RL_CALL(copy_bytes, RL_OK, &packed->data[offset + 4], get_4bytes(&packed->data[offset]), &members[i], &memberslen[i]);
+		}
+		else {
+			RL_CALL(rl_multi_string_get, RL_OK, db, member_id, &members[i], &memberslen[i]);
+		}
 	}
 	*_members = members;
 	*_memberslen = memberslen;
@@ -312,14 +718,23 @@ cleanup:
 int rl_spop(struct rlite *db, const unsigned char *key, long keylen, unsigned char **member, long *memberlen)
 {
 	int retval;
-	long set_page_number, *member_page;
+	long set_page_number, *member_page, offset;
 	unsigned char *digest;
 	rl_btree *set;
+	rl_set_packed *packed;
 	RL_CALL(rl_set_get_objects, RL_OK, db, key, keylen, &set_page_number, &set, 1, 0);
-	RL_CALL(rl_btree_random_element, RL_OK, db, set, (void **)&digest, (void **)&member_page);
-	RL_CALL(rl_multi_string_get, RL_OK, db, *member_page, member, memberlen);
-	rl_multi_string_delete(db, *member_page);
-	retval = rl_btree_remove_element(db, set, set_page_number, digest);
+	if (IS_PACKED(set)) {
+		packed = (rl_set_packed *)set;
+		offset = packed_offset(packed, rand() % set->number_of_elements);
+		RL_CALL(copy_bytes, RL_OK, &packed->data[offset + 4], get_4bytes(&packed->data[offset]), member, memberlen);
+		retval = packed_delete(db, set_page_number, packed, offset);
+	}
+	else {
+		RL_CALL(rl_btree_random_element, RL_OK, db, set, (void **)&digest, (void **)&member_page);
+		RL_CALL(rl_multi_string_get, RL_OK, db, *member_page, member, memberlen);
+		rl_multi_string_delete(db, *member_page);
+		retval = rl_btree_remove_element(db, set, set_page_number, digest);
+	}
 	if (retval == RL_DELETED) {
 		RL_CALL(rl_key_delete, RL_OK, db, key, keylen);
 	}
@@ -336,11 +751,10 @@ int rl_sdiff(struct rlite *db, int keyc, unsigned char **keys, long *keyslen, lo
 	int retval, found;
 	rl_btree *source = NULL;
 	rl_btree **sets = NULL;
-	rl_btree_iterator *iterator;
+	rl_set_iterator *iterator = NULL;
 	unsigned char **members = NULL, *digest;
-	long *memberslen = NULL, i, member_page, setsc = 0;
+	long *memberslen = NULL, i, setsc = 0;
 	long membersc = 0;
-	void *tmp;
 
 	if (keyc == 0) {
 		retval = RL_NOT_FOUND;
@@ -361,23 +775,23 @@ int rl_sdiff(struct rlite *db, int keyc, unsigned char **keys, long *keyslen, lo
 		}
 	}
 
-	RL_CALL(rl_btree_iterator_create, RL_OK, db, source, &iterator);
-	while ((retval = rl_btree_iterator_next(iterator, (void **)&digest, &tmp)) == RL_OK) {
+	RL_CALL(rl_set_iterator_create, RL_OK, db, source, &iterator);
+	while ((retval = set_iterator_next(iterator, &digest, NULL, &members[membersc], &memberslen[membersc])) == RL_OK) {
 		found = 0;
 		for (i = 0; i < setsc; i++) {
-			retval = rl_btree_find_score(db, sets[i], digest, NULL, NULL, NULL);
+			retval = set_find(db, sets[i], digest, members[membersc], memberslen[membersc]);
 			if (retval == RL_FOUND) {
 				found = 1;
 				break;
 			}
 		}
-		if (!found) {
-			member_page = *(long *)tmp;
-			RL_CALL(rl_multi_string_get, RL_OK, db, member_page, &members[membersc], &memberslen[membersc]);
+		if (found) {
+			rl_free(members[membersc]);
+		}
+		else {
 			membersc++;
 		}
 		rl_free(digest);
-		rl_free(tmp);
 	}
 	iterator = NULL;
 
@@ -416,7 +830,6 @@ cleanup:
 	rl_free(sets);
 	return retval;
 }
-
 int rl_sdiffstore(struct rlite *db, unsigned char *target, long targetlen, int keyc, unsigned char **keys, long *keyslen, long *added)
 {
 	int retval;
@@ -443,13 +856,14 @@ cleanup:
 	return retval;
 }
 
+
 int rl_sinter(struct rlite *db, int keyc, unsigned char **keys, long *keyslen, long *_membersc, unsigned char ***_members, long **_memberslen)
 {
 	int retval, found;
 	rl_btree **sets = NULL;
-	rl_btree_iterator *iterator;
+	rl_set_iterator *iterator;
 	unsigned char **members = NULL, *digest;
-	long *memberslen = NULL, i, member_page;
+	long *memberslen = NULL, i;
 	long membersc = 0, maxmemberc = 0;
 	void *tmp;
 
@@ -481,23 +895,23 @@ int rl_sinter(struct rlite *db, int keyc, unsigned char **keys, long *keyslen, l
 	RL_MALLOC(members, sizeof(unsigned char *) * maxmemberc);
 	RL_MALLOC(memberslen, sizeof(long) * maxmemberc);
 
-	RL_CALL(rl_btree_iterator_create, RL_OK, db, sets[0], &iterator);
-	while ((retval = rl_btree_iterator_next(iterator, (void **)&digest, &tmp)) == RL_OK) {
+	RL_CALL(rl_set_iterator_create, RL_OK, db, sets[0], &iterator);
+	while ((retval = set_iterator_next(iterator, &digest, NULL, &members[membersc], &memberslen[membersc])) == RL_OK) {
 		found = 1;
 		for (i = 1; i < keyc; i++) {
-			retval = rl_btree_find_score(db, sets[i], digest, NULL, NULL, NULL);
+			retval = set_find(db, sets[i], digest, members[membersc], memberslen[membersc]);
 			if (retval == RL_NOT_FOUND) {
 				found = 0;
 				break;
 			}
 		}
 		if (found) {
-			member_page = *(long *)tmp;
-			RL_CALL(rl_multi_string_get, RL_OK, db, member_page, &members[membersc], &memberslen[membersc]);
 			membersc++;
 		}
+		else {
+			rl_free(members[membersc]);
+		}
 		rl_free(digest);
-		rl_free(tmp);
 	}
 	iterator = NULL;
 
@@ -533,7 +947,6 @@ cleanup:
 	rl_free(sets);
 	return retval;
 }
-
 int rl_sinterstore(struct rlite *db, unsigned char *target, long targetlen, int keyc, unsigned char **keys, long *keyslen, long *added)
 {
 	int retval;
@@ -560,15 +973,15 @@ cleanup:
 	return retval;
 }
 
+
 int rl_sunion(struct rlite *db, int keyc, unsigned char **keys, long *keyslen, long *_membersc, unsigned char ***_members, long **_memberslen)
 {
 	int retval, found;
 	rl_btree **sets = NULL;
-	rl_btree_iterator *iterator;
+	rl_set_iterator *iterator;
 	unsigned char **members = NULL;
-	long *memberslen = NULL, i, j, member_page;
+	long *memberslen = NULL, i, j;
 	long membersc = 0, maxmemberc = 0;
-	void *tmp;
 
 	if (keyc == 0) {
 		retval = RL_NOT_FOUND;
@@ -601,12 +1014,9 @@ int rl_sunion(struct rlite *db, int keyc, unsigned char **keys, long *keyslen, l
 		if (!sets[i]) {
 			continue;
 		}
-		RL_CALL(rl_btree_iterator_create, RL_OK, db, sets[i], &iterator);
+		RL_CALL(rl_set_iterator_create, RL_OK, db, sets[i], &iterator);
 
-		while ((retval = rl_btree_iterator_next(iterator, NULL, &tmp)) == RL_OK) {
-			member_page = *(long *)tmp;
-			rl_free(tmp);
-			RL_CALL(rl_multi_string_get, RL_OK, db, member_page, &members[membersc], &memberslen[membersc]);
+		while ((retval = rl_set_iterator_next(iterator, NULL, &members[membersc], &memberslen[membersc])) == RL_OK) {
 			found = 0;
 			for (j = 0; j < membersc; j++) {
 				if (memberslen[membersc] == memberslen[j] && memcmp(members[membersc], members[j], memberslen[membersc]) == 0) {
@@ -656,19 +1066,18 @@ cleanup:
 	return retval;
 }
 
+
 int rl_sunionstore(struct rlite *db, unsigned char *target, long targetlen, int keyc, unsigned char **keys, long *keyslen, long *added)
 {
 	int retval;
 	rl_btree *target_set = NULL;
 	rl_btree *set = NULL;
-	rl_btree_iterator *iterator;
+	rl_set_iterator *iterator;
 	unsigned char *digest = NULL;
-	unsigned char *member;
-	long memberlen, i, member_page;
+	unsigned char *member = NULL;
+	long memberlen, i;
 	long target_page_number;
-	void *tmp;
-	long *member_object = NULL;
-	long count = 0;
+	long add, count = 0;
 
 	*added = 0;
 	retval = rl_key_delete_with_value(db, target, targetlen);
@@ -691,31 +1100,18 @@ int rl_sunionstore(struct rlite *db, unsigned char *target, long targetlen, int
 			goto cleanup;
 		}
 
-		RL_CALL(rl_btree_iterator_create, RL_OK, db, set, &iterator);
-		while ((retval = rl_btree_iterator_next(iterator, (void **)&digest, &tmp)) == RL_OK) {
-			member_page = *(long *)tmp;
-			rl_free(tmp);
-
-			retval = rl_btree_find_score(db, target_set, digest, &tmp, NULL, NULL);
-			if (retval == RL_NOT_FOUND) {
-				RL_CALL(rl_multi_string_get, RL_OK, db, member_page, &member, &memberlen);
-				RL_MALLOC(member_object, sizeof(*member_object));
-				RL_CALL(rl_multi_string_set, RL_OK, db, member_object, member, memberlen);
-
-				retval = rl_btree_add_element(db, target_set, target_page_number, digest, member_object);
-				if (retval != RL_OK) {
-					goto cleanup;
-				}
-				count++;
-				rl_free(member);
-			}
-			else if (retval == RL_FOUND) {
-				rl_free(digest);
-				digest = NULL;
-			}
-			else {
+		RL_CALL(rl_set_iterator_create, RL_OK, db, set, &iterator);
+		while ((retval = set_iterator_next(iterator, &digest, NULL, &member, &memberlen)) == RL_OK) {
+			retval = rl_set_add(db, target_page_number, &target_set, member, memberlen, digest, &add);
+			rl_free(digest);
+			digest = NULL;
+			rl_free(member);
+			member = NULL;
+			if (retval != RL_OK) {
+				rl_set_iterator_destroy(iterator);
 				goto cleanup;
 			}
+			count += add;
 		}
 		iterator = NULL;
 
@@ -743,6 +1139,10 @@ int rl_set_pages(struct rlite *db, long page, short *pages)
 
 	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_btree_hash_sha1_long, page, &rl_btree_type_hash_sha1_long, &tmp, 1);
 	btree = tmp;
+	if (IS_PACKED(btree)) {
+		retval = RL_OK;
+		goto cleanup;
+	}
 
 	RL_CALL(rl_btree_pages, RL_OK, db, btree, pages);
 
@@ -777,6 +1177,10 @@ int rl_set_delete(rlite *db, long value_page)
 	void *tmp;
 	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_btree_hash_sha1_long, value_page, &rl_btree_type_hash_sha1_long, &tmp, 1);
 	hash = tmp;
+	if (IS_PACKED(hash)) {
+		RL_CALL(rl_delete, RL_OK, db, value_page);
+		goto cleanup;
+	}
 	if (hash->number_of_elements) {
 		RL_CALL2(rl_btree_iterator_create, RL_OK, RL_NOT_FOUND, db, hash, &iterator);
 		if (retval == RL_OK) {
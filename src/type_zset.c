@@ -1,15 +1,299 @@
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include "rlite/rlite.h"
 #include "rlite/page_key.h"
 #include "rlite/page_multi_string.h"
 #include "rlite/type_zset.h"
+#include "rlite/type_set.h"
 #include "rlite/page_btree.h"
 #include "rlite/page_list.h"
 #include "rlite/page_skiplist.h"
 #include "rlite/util.h"
 
-static int rl_zset_create(rlite *db, long levels_page_number, rl_btree **btree, long *btree_page, rl_skiplist **_skiplist, long *skiplist_page)
+/**
+ * Small sorted sets are stored "packed" in their levels page instead of in a
+ * btree and a skiplist, like small hashes. The page starts like a list
+ * header with no nodes and a zero max_node_size, with the number of members
+ * as the list size, followed by the length of the entries and the entries
+ * themselves ordered by score and member: an 8-byte score, a 4-byte member
+ * length and the member.
+ * Once an entry does not fit in the page, or the sorted set grows past
+ * RL_ZSET_PACKED_MAX_ENTRIES, it is converted to a btree and a skiplist.
+ */
+#define PACKED_HEADER_SIZE 20
+#define PACKED_ENTRY_SIZE(memberlen) (12 + (memberlen))
+#define PACKED_SCORE(data, offset) get_double(&(data)[offset])
+#define PACKED_MEMBERLEN(data, offset) ((long)get_4bytes(&(data)[(offset) + 8]))
+#define PACKED_MEMBER(data, offset) (&(data)[(offset) + 12])
+// a levels list always has room for elements in its nodes
+#define IS_PACKED(levels) ((levels)->max_node_size == 0)
+
+typedef struct {
+	rl_list levels;
+	long datalen;
+	unsigned char *data;
+} rl_zset_packed;
+
+int rl_zset_serialize(struct rlite *db, void *obj, unsigned char *data)
+{
+	rl_zset_packed *packed = obj;
+	if (!IS_PACKED(&packed->levels)) {
+		return rl_list_serialize(db, obj, data);
+	}
+	put_4bytes(data, 0);
+	put_4bytes(&data[4], 0);
+	put_4bytes(&data[8], 0);
+	put_4bytes(&data[12], packed->levels.size);
+	put_4bytes(&data[16], packed->datalen);
+	if (packed->datalen) {
+		memcpy(&data[PACKED_HEADER_SIZE], packed->data, packed->datalen);
+	}
+	return RL_OK;
+}
+
+static void packed_init(rl_zset_packed *packed, long size, long datalen)
+{
+	packed->levels.type = &rl_list_type_zset;
+	packed->levels.left = 0;
+	packed->levels.right = 0;
+	packed->levels.max_node_size = 0;
+	packed->levels.size = size;
+	packed->levels.index = 0;
+	packed->levels.index_height = 0;
+	packed->datalen = datalen;
+	packed->data = NULL;
+}
+
+int rl_zset_deserialize(struct rlite *db, void **obj, void *context, unsigned char *data)
+{
+	rl_zset_packed *packed;
+	int retval = RL_OK;
+	if (get_4bytes(&data[8]) != 0) {
+		return rl_list_deserialize(db, obj, context, data);
+	}
+	RL_MALLOC(packed, sizeof(*packed));
+	packed_init(packed, get_4bytes(&data[12]), get_4bytes(&data[16]));
+	packed->levels.type = context;
+	if (packed->datalen) {
+		packed->data = rl_malloc(sizeof(unsigned char) * packed->datalen);
+		if (!packed->data) {
+			rl_free(packed);
+			retval = RL_OUT_OF_MEMORY;
+			goto cleanup;
+		}
+		memcpy(packed->data, &data[PACKED_HEADER_SIZE], packed->datalen);
+	}
+	*obj = packed;
+cleanup:
+	return retval;
+}
+
+int rl_zset_destroy(struct rlite *db, void *obj)
+{
+	rl_zset_packed *packed = obj;
+	if (IS_PACKED(&packed->levels)) {
+		rl_free(packed->data);
+	}
+	return rl_list_destroy(db, obj);
+}
+
+// orders members like rl_multi_string_cmp_str does in the skiplist
+static int member_cmp(unsigned char *member1, long member1len, unsigned char *member2, long member2len)
+{
+	long cmplen = member1len < member2len ? member1len : member2len;
+	int cmp = cmplen > 0 ? memcmp(member1, member2, cmplen) : 0;
+	if (cmp == 0) {
+		return member1len == member2len ? 0 : (member1len > member2len ? 1 : -1);
+	}
+	return cmp < 0 ? -1 : 1;
+}
+
+static int packed_find(rl_zset_packed *packed, unsigned char *member, long memberlen, long *_offset, double *score, long *rank)
+{
+	long offset = 0, i = 0, len;
+	while (offset < packed->datalen) {
+		len = PACKED_MEMBERLEN(packed->data, offset);
+		if (len == memberlen && (len == 0 || memcmp(PACKED_MEMBER(packed->data, offset), member, len) == 0)) {
+			if (_offset) {
+				*_offset = offset;
+			}
+			if (score) {
+				*score = PACKED_SCORE(packed->data, offset);
+			}
+			if (rank) {
+				*rank = i;
+			}
+			return RL_FOUND;
+		}
+		offset += PACKED_ENTRY_SIZE(len);
+		i++;
+	}
+	return RL_NOT_FOUND;
+}
+
+static long packed_offset(rl_zset_packed *packed, long rank)
+{
+	long offset = 0;
+	for (; rank > 0; rank--) {
+		offset += PACKED_ENTRY_SIZE(PACKED_MEMBERLEN(packed->data, offset));
+	}
+	return offset;
+}
+
+static void packed_remove(rl_zset_packed *packed, long offset)
+{
+	long entrylen = PACKED_ENTRY_SIZE(PACKED_MEMBERLEN(packed->data, offset));
+	memmove(&packed->data[offset], &packed->data[offset + entrylen], packed->datalen - offset - entrylen);
+	packed->datalen -= entrylen;
+	packed->levels.size--;
+}
+
+// inserts a member that is not in the sorted set yet where the skiplist would
+static int packed_insert(rl_zset_packed *packed, double score, unsigned char *member, long memberlen)
+{
+	int retval = RL_OK;
+	void *tmp;
+	double entry_score;
+	long offset = 0, len;
+	while (offset < packed->datalen) {
+		entry_score = PACKED_SCORE(packed->data, offset);
+		len = PACKED_MEMBERLEN(packed->data, offset);
+		if (entry_score > score || (entry_score == score && member_cmp(PACKED_MEMBER(packed->data, offset), len, member, memberlen) > 0)) {
+			break;
+		}
+		offset += PACKED_ENTRY_SIZE(len);
+	}
+	RL_REALLOC(packed->data, sizeof(unsigned char) * (packed->datalen + PACKED_ENTRY_SIZE(memberlen)));
+	memmove(&packed->data[offset + PACKED_ENTRY_SIZE(memberlen)], &packed->data[offset], packed->datalen - offset);
+	put_double(&packed->data[offset], score);
+	put_4bytes(&packed->data[offset + 8], memberlen);
+	if (memberlen) {
+		memcpy(PACKED_MEMBER(packed->data, offset), member, memberlen);
+	}
+	packed->datalen += PACKED_ENTRY_SIZE(memberlen);
+	packed->levels.size++;
+cleanup:
+	return retval;
+}
+
+/**
+ * Same as rl_skiplist_first_node on a packed sorted set, returning the
+ * matching entry's score instead of its node.
+ */
+static int packed_first_node(rl_zset_packed *packed, double score, int range_mode, unsigned char *value, long valuelen, double *retscore, long *_rank)
+{
+	int exclude = range_mode == RL_SKIPLIST_BEFORE_SCORE || range_mode == RL_SKIPLIST_UPTO_SCORE ? 1 : 0;
+	int cmp, return_retnode = exclude;
+	long rank = 0, offset = 0, prev_offset = -1, len;
+	double entry_score;
+
+	// find the last entry before the score, like rl_skiplist_get_update
+	while (offset < packed->datalen) {
+		entry_score = PACKED_SCORE(packed->data, offset);
+		len = PACKED_MEMBERLEN(packed->data, offset);
+		if (entry_score > score) {
+			break;
+		}
+		if (entry_score == score) {
+			if (value == NULL) {
+				if (exclude) {
+					break;
+				}
+			}
+			else {
+				cmp = member_cmp(PACKED_MEMBER(packed->data, offset), len, value, valuelen);
+				if (cmp > 0 || (cmp == 0 && exclude)) {
+					break;
+				}
+			}
+		}
+		prev_offset = offset;
+		offset += PACKED_ENTRY_SIZE(len);
+		rank++;
+	}
+
+	if (range_mode == RL_SKIPLIST_INCLUDE_SCORE && prev_offset >= 0) {
+		if (PACKED_SCORE(packed->data, prev_offset) >= score) {
+			if (!value || member_cmp(PACKED_MEMBER(packed->data, prev_offset), PACKED_MEMBERLEN(packed->data, prev_offset), value, valuelen) == 0) {
+				return_retnode = 1;
+			}
+		}
+	}
+
+	if (range_mode == RL_SKIPLIST_UPTO_SCORE && offset < packed->datalen) {
+		if (PACKED_SCORE(packed->data, offset) == score) {
+			if (!value || member_cmp(PACKED_MEMBER(packed->data, offset), PACKED_MEMBERLEN(packed->data, offset), value, valuelen) == 0) {
+				return_retnode = 0;
+			}
+		}
+	}
+
+	if (_rank) {
+		*_rank = rank - return_retnode;
+	}
+
+	if (return_retnode) {
+		if (retscore && prev_offset >= 0) {
+			*retscore = PACKED_SCORE(packed->data, prev_offset);
+		}
+		return RL_FOUND;
+	}
+	else if (offset < packed->datalen) {
+		if (retscore) {
+			*retscore = PACKED_SCORE(packed->data, offset);
+		}
+		return RL_FOUND;
+	}
+	return RL_NOT_FOUND;
+}
+
+// copies the entries from rank `start` to `end` in iteration order
+static int packed_range_copy(rl_zset_packed *packed, long start, long end, int direction, unsigned char **_data, long *_datalen)
+{
+	long *offsets = NULL, size = end - start + 1, i, start_offset, offset, entrylen, datalen = 0;
+	unsigned char *data = NULL;
+	int retval;
+
+	RL_MALLOC(offsets, sizeof(long) * size);
+	start_offset = offset = packed_offset(packed, start);
+	for (i = 0; i < size; i++) {
+		offsets[i] = offset;
+		offset += PACKED_ENTRY_SIZE(PACKED_MEMBERLEN(packed->data, offset));
+	}
+	RL_MALLOC(data, sizeof(unsigned char) * (offset - start_offset));
+	for (i = 0; i < size; i++) {
+		offset = offsets[direction > 0 ? i : size - i - 1];
+		entrylen = PACKED_ENTRY_SIZE(PACKED_MEMBERLEN(packed->data, offset));
+		memcpy(&data[datalen], &packed->data[offset], entrylen);
+		datalen += entrylen;
+	}
+	*_data = data;
+	*_datalen = datalen;
+	data = NULL;
+	retval = RL_OK;
+cleanup:
+	rl_free(offsets);
+	rl_free(data);
+	return retval;
+}
+
+static int rl_zset_create(rlite *db, long levels_page_number, rl_zset_packed **_packed)
+{
+	rl_zset_packed *packed;
+
+	int retval;
+	RL_MALLOC(packed, sizeof(*packed));
+	packed_init(packed, 0, 0);
+	RL_CALL(rl_write, RL_OK, db, &rl_data_type_zset, levels_page_number, packed);
+	if (_packed) {
+		*_packed = packed;
+	}
+cleanup:
+	return retval;
+}
+
+static int rl_zset_create_skiplist(rlite *db, long levels_page_number, rl_btree **btree, long *btree_page, rl_skiplist **_skiplist, long *skiplist_page)
 {
 	rl_list *levels;
 	rl_btree *scores = NULL;
@@ -24,8 +308,8 @@ static int rl_zset_create(rlite *db, long levels_page_number, rl_btree **btree,
 	RL_CALL(rl_skiplist_create, RL_OK, db, &skiplist);
 	skiplist_page_number = db->next_empty_page;
 	RL_CALL(rl_write, RL_OK, db, &rl_data_type_skiplist, skiplist_page_number, skiplist);
-	RL_CALL(rl_list_create, RL_OK, db, &levels, &rl_list_type_long);
-	RL_CALL(rl_write, RL_OK, db, &rl_data_type_list_long, levels_page_number, levels);
+	RL_CALL(rl_list_create, RL_OK, db, &levels, &rl_list_type_zset);
+	RL_CALL(rl_write, RL_OK, db, &rl_data_type_zset, levels_page_number, levels);
 
 	long *scores_element;
 	RL_MALLOC(scores_element, sizeof(long));
@@ -53,14 +337,20 @@ cleanup:
 	return retval;
 }
 
-static int rl_zset_read(rlite *db, long levels_page_number, rl_btree **btree, long *btree_page, rl_skiplist **skiplist, long *skiplist_page)
+static int rl_zset_read(rlite *db, long levels_page_number, rl_zset_packed **packed, rl_btree **btree, long *btree_page, rl_skiplist **skiplist, long *skiplist_page)
 {
 	void *tmp;
 	long scores_page_number, skiplist_page_number;
 	rl_list *levels;
 	int retval;
-	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, levels_page_number, &rl_list_type_long, &tmp, 1);
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_zset, levels_page_number, &rl_list_type_zset, &tmp, 1);
 	levels = tmp;
+	if (IS_PACKED(levels)) {
+		*packed = tmp;
+		retval = RL_OK;
+		goto cleanup;
+	}
+	*packed = NULL;
 	if (btree || btree_page) {
 		RL_CALL(rl_list_get_element, RL_FOUND, db, levels, &tmp, 0);
 		scores_page_number = *(long *)tmp;
@@ -91,7 +381,11 @@ cleanup:
 	return retval;
 }
 
-static int rl_zset_get_objects(rlite *db, const unsigned char *key, long keylen, long *_levels_page_number, rl_btree **btree, long *btree_page, rl_skiplist **skiplist, long *skiplist_page, int update_version, int create)
+/**
+ * Sets `packed` when the sorted set is packed, in which case the btree and
+ * skiplist are left untouched. Otherwise `packed` is set to NULL.
+ */
+static int rl_zset_get_objects(rlite *db, const unsigned char *key, long keylen, long *_levels_page_number, rl_zset_packed **packed, rl_btree **btree, long *btree_page, rl_skiplist **skiplist, long *skiplist_page, int update_version, int create)
 {
 	long levels_page_number = 0, version = 0;
 	int retval;
@@ -102,11 +396,11 @@ static int rl_zset_get_objects(rlite *db, const unsigned char *key, long keylen,
 			goto cleanup;
 		}
 		else if (retval == RL_NOT_FOUND) {
-			retval = rl_zset_create(db, levels_page_number, btree, btree_page, skiplist, skiplist_page);
+			retval = rl_zset_create(db, levels_page_number, packed);
 			goto cleanup;
 		}
 		else {
-			RL_CALL(rl_zset_read, RL_OK, db, levels_page_number, btree, btree_page, skiplist, skiplist_page);
+			RL_CALL(rl_zset_read, RL_OK, db, levels_page_number, packed, btree, btree_page, skiplist, skiplist_page);
 		}
 	}
 	else {
@@ -119,7 +413,7 @@ static int rl_zset_get_objects(rlite *db, const unsigned char *key, long keylen,
 			retval = RL_WRONG_TYPE;
 			goto cleanup;
 		}
-		RL_CALL(rl_zset_read, RL_OK, db, levels_page_number, btree, btree_page, skiplist, skiplist_page);
+		RL_CALL(rl_zset_read, RL_OK, db, levels_page_number, packed, btree, btree_page, skiplist, skiplist_page);
 	}
 	if (update_version) {
 		RL_CALL(rl_key_set, RL_OK, db, key, keylen, RL_TYPE_ZSET, levels_page_number, expires, version + 1);
@@ -131,6 +425,43 @@ cleanup:
 	return retval;
 }
 
+static long zset_card(rl_zset_packed *packed, rl_skiplist *skiplist)
+{
+	return packed ? packed->levels.size : skiplist->size;
+}
+
+static int zset_first_node(rlite *db, rl_zset_packed *packed, rl_skiplist *skiplist, double score, int range_mode, unsigned char *value, long valuelen, double *retscore, long *rank)
+{
+	rl_skiplist_node *node;
+	int retval;
+	if (packed) {
+		return packed_first_node(packed, score, range_mode, value, valuelen, retscore, rank);
+	}
+	retval = rl_skiplist_first_node(db, skiplist, score, range_mode, value, valuelen, &node, rank);
+	if (retval == RL_FOUND && retscore) {
+		*retscore = node->score;
+	}
+	return retval;
+}
+
+static int packed_delete(rlite *db, const unsigned char *key, long keylen, long levels_page_number, rl_zset_packed *packed, unsigned char *member, long member_len)
+{
+	long offset;
+	int retval;
+	RL_CALL(packed_find, RL_FOUND, packed, member, member_len, &offset, NULL, NULL);
+	packed_remove(packed, offset);
+	if (packed->levels.size == 0) {
+		RL_CALL(rl_delete, RL_OK, db, levels_page_number);
+		RL_CALL(rl_key_delete, RL_OK, db, key, keylen);
+		retval = RL_DELETED;
+	}
+	else {
+		RL_CALL(rl_write, RL_OK, db, &rl_data_type_zset, levels_page_number, packed);
+	}
+cleanup:
+	return retval;
+}
+
 static int remove_member_score_sha1(rlite *db, const unsigned char *key, long keylen, long levels_page_number, rl_btree *scores, long scores_page, rl_skiplist *skiplist, long skiplist_page, unsigned char *member, long member_len, double score, unsigned char digest[20])
 {
 	void *tmp;
@@ -144,7 +475,7 @@ static int remove_member_score_sha1(rlite *db, const unsigned char *key, long ke
 		goto cleanup;
 	}
 	if (retval == RL_DELETED) {
-		RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, levels_page_number, &rl_list_type_long, &tmp, 1);
+		RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_zset, levels_page_number, &rl_list_type_zset, &tmp, 1);
 		RL_CALL(rl_list_delete, RL_OK, db, tmp);
 		RL_CALL(rl_delete, RL_OK, db, levels_page_number);
 		RL_CALL(rl_key_delete, RL_OK, db, key, keylen);
@@ -154,22 +485,28 @@ cleanup:
 	return retval;
 }
 
-static int remove_member_score(rlite *db, const unsigned char *key, long keylen, long levels_page_number, rl_btree *scores, long scores_page, rl_skiplist *skiplist, long skiplist_page, unsigned char *member, long member_len, double score)
+static int remove_member_score(rlite *db, const unsigned char *key, long keylen, long levels_page_number, rl_zset_packed *packed, rl_btree *scores, long scores_page, rl_skiplist *skiplist, long skiplist_page, unsigned char *member, long member_len, double score)
 {
 	unsigned char digest[20];
 	int retval;
+	if (packed) {
+		return packed_delete(db, key, keylen, levels_page_number, packed, member, member_len);
+	}
 	RL_CALL(sha1, RL_OK, member, member_len, digest);
 	RL_CALL(remove_member_score_sha1, RL_OK, db, key, keylen, levels_page_number, scores, scores_page, skiplist, skiplist_page, member, member_len, score, digest);
 cleanup:
 	return retval;
 }
 
-static int remove_member(rlite *db, const unsigned char *key, long keylen, long levels_page_number, rl_btree *scores, long scores_page, rl_skiplist *skiplist, long skiplist_page, unsigned char *member, long member_len)
+static int remove_member(rlite *db, const unsigned char *key, long keylen, long levels_page_number, rl_zset_packed *packed, rl_btree *scores, long scores_page, rl_skiplist *skiplist, long skiplist_page, unsigned char *member, long member_len)
 {
 	double score;
 	void *tmp;
 	unsigned char digest[20];
 	int retval;
+	if (packed) {
+		return packed_delete(db, key, keylen, levels_page_number, packed, member, member_len);
+	}
 	RL_CALL(sha1, RL_OK, member, member_len, digest);
 	retval = rl_btree_find_score(db, scores, digest, &tmp, NULL, NULL);
 	if (retval != RL_FOUND && retval != RL_NOT_FOUND) {
@@ -215,23 +552,72 @@ cleanup:
 	return retval;
 }
 
+/**
+ * Replaces the packed sorted set in `levels_page_number` with a btree and a
+ * skiplist holding the same entries.
+ */
+static int rl_zset_unpack(rlite *db, long levels_page_number, rl_zset_packed *packed, rl_btree **btree, long *btree_page, rl_skiplist **skiplist, long *skiplist_page)
+{
+	unsigned char *data = packed->data;
+	long datalen = packed->datalen, offset, memberlen;
+	int retval;
+
+	// writing the levels list destroys the packed object, its entries are still needed
+	packed->data = NULL;
+	RL_CALL(rl_zset_create_skiplist, RL_OK, db, levels_page_number, btree, btree_page, skiplist, skiplist_page);
+	for (offset = 0; offset < datalen; offset += PACKED_ENTRY_SIZE(memberlen)) {
+		memberlen = PACKED_MEMBERLEN(data, offset);
+		RL_CALL(add_member, RL_OK, db, *btree, *btree_page, *skiplist, *skiplist_page, PACKED_SCORE(data, offset), PACKED_MEMBER(data, offset), memberlen);
+	}
+	retval = RL_OK;
+cleanup:
+	rl_free(data);
+	return retval;
+}
+
+// adds a member that is not in the sorted set, converting it if it no longer fits packed
+static int zset_add(rlite *db, long levels_page_number, rl_zset_packed *packed, rl_btree *scores, long scores_page, rl_skiplist *skiplist, long skiplist_page, double score, unsigned char *member, long memberlen)
+{
+	int retval;
+	if (packed) {
+		if (PACKED_HEADER_SIZE + packed->datalen + PACKED_ENTRY_SIZE(memberlen) <= db->page_size && packed->levels.size < RL_ZSET_PACKED_MAX_ENTRIES) {
+			RL_CALL(packed_insert, RL_OK, packed, score, member, memberlen);
+			RL_CALL(rl_write, RL_OK, db, &rl_data_type_zset, levels_page_number, packed);
+			goto cleanup;
+		}
+		RL_CALL(rl_zset_unpack, RL_OK, db, levels_page_number, packed, &scores, &scores_page, &skiplist, &skiplist_page);
+	}
+	RL_CALL(add_member, RL_OK, db, scores, scores_page, skiplist, skiplist_page, score, member, memberlen);
+cleanup:
+	return retval;
+}
+
 int rl_zadd(rlite *db, const unsigned char *key, long keylen, double score, unsigned char *member, long memberlen)
 {
 	int existed;
-	rl_btree *scores;
-	rl_skiplist *skiplist;
-	long scores_page, skiplist_page, levels_page_number;
+	rl_zset_packed *packed;
+	rl_btree *scores = NULL;
+	rl_skiplist *skiplist = NULL;
+	long scores_page = 0, skiplist_page = 0, levels_page_number, offset;
 	int retval;
-	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, &levels_page_number, &scores, &scores_page, &skiplist, &skiplist_page, 1, 1);
-	retval = remove_member(db, key, keylen, levels_page_number, scores, scores_page, skiplist, skiplist_page, member, memberlen);
-	if (retval != RL_OK && retval != RL_NOT_FOUND && retval != RL_DELETED) {
-		goto cleanup;
+	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, &levels_page_number, &packed, &scores, &scores_page, &skiplist, &skiplist_page, 1, 1);
+	if (packed) {
+		existed = packed_find(packed, member, memberlen, &offset, NULL, NULL) == RL_FOUND;
+		if (existed) {
+			packed_remove(packed, offset);
+		}
 	}
-	else if (retval == RL_DELETED) {
-		RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, &levels_page_number, &scores, &scores_page, &skiplist, &skiplist_page, 1, 1);
+	else {
+		retval = remove_member(db, key, keylen, levels_page_number, NULL, scores, scores_page, skiplist, skiplist_page, member, memberlen);
+		if (retval != RL_OK && retval != RL_NOT_FOUND && retval != RL_DELETED) {
+			goto cleanup;
+		}
+		else if (retval == RL_DELETED) {
+			RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, &levels_page_number, &packed, &scores, &scores_page, &skiplist, &skiplist_page, 1, 1);
+		}
+		existed = retval != RL_NOT_FOUND; // ok or deleted means there was a value
 	}
-	existed = retval != RL_NOT_FOUND; // ok or deleted means there was a value
-	RL_CALL(add_member, RL_OK, db, scores, scores_page, skiplist, skiplist_page, score, member, memberlen);
+	RL_CALL(zset_add, RL_OK, db, levels_page_number, packed, scores, scores_page, skiplist, skiplist_page, score, member, memberlen);
 	retval = existed ? RL_FOUND : RL_OK;
 cleanup:
 	return retval;
@@ -252,12 +638,21 @@ cleanup:
 	return retval;
 }
 
+static int zset_score(rlite *db, rl_zset_packed *packed, rl_btree *scores, unsigned char *member, long memberlen, double *score)
+{
+	if (packed) {
+		return packed_find(packed, member, memberlen, NULL, score, NULL);
+	}
+	return rl_get_zscore(db, scores, member, memberlen, score);
+}
+
 int rl_zscore(rlite *db, const unsigned char *key, long keylen, unsigned char *member, long memberlen, double *score)
 {
-	rl_btree *scores;
+	rl_zset_packed *packed;
+	rl_btree *scores = NULL;
 	int retval;
-	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, &scores, NULL, NULL, NULL, 0, 0);
-	RL_CALL(rl_get_zscore, RL_FOUND, db, scores, member, memberlen, score);
+	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, &packed, &scores, NULL, NULL, NULL, 0, 0);
+	RL_CALL(zset_score, RL_FOUND, db, packed, scores, member, memberlen, score);
 cleanup:
 	return retval;
 }
@@ -265,10 +660,15 @@ cleanup:
 int rl_zrank(rlite *db, const unsigned char *key, long keylen, unsigned char *member, long memberlen, long *rank)
 {
 	double score;
+	rl_zset_packed *packed;
 	rl_btree *scores;
 	rl_skiplist *skiplist;
 	int retval;
-	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, &scores, NULL, &skiplist, NULL, 0, 0);
+	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, &packed, &scores, NULL, &skiplist, NULL, 0, 0);
+	if (packed) {
+		RL_CALL(packed_find, RL_FOUND, packed, member, memberlen, NULL, NULL, rank);
+		goto cleanup;
+	}
 	RL_CALL(rl_get_zscore, RL_FOUND, db, scores, member, memberlen, &score);
 	RL_CALL(rl_skiplist_first_node, RL_FOUND, db, skiplist, score, RL_SKIPLIST_INCLUDE_SCORE, member, memberlen, NULL, rank);
 cleanup:
@@ -278,10 +678,16 @@ cleanup:
 int rl_zrevrank(rlite *db, const unsigned char *key, long keylen, unsigned char *member, long memberlen, long *revrank)
 {
 	double score;
+	rl_zset_packed *packed;
 	rl_btree *scores;
 	rl_skiplist *skiplist;
 	int retval;
-	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, &scores, NULL, &skiplist, NULL, 0, 0);
+	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, &packed, &scores, NULL, &skiplist, NULL, 0, 0);
+	if (packed) {
+		RL_CALL(packed_find, RL_FOUND, packed, member, memberlen, NULL, NULL, revrank);
+		*revrank = packed->levels.size - (*revrank) - 1;
+		goto cleanup;
+	}
 	RL_CALL(rl_get_zscore, RL_FOUND, db, scores, member, memberlen, &score);
 	RL_CALL(rl_skiplist_first_node, RL_FOUND, db, skiplist, score, RL_SKIPLIST_INCLUDE_SCORE, member, memberlen, NULL, revrank);
 	*revrank = skiplist->size - (*revrank) - 1;
@@ -291,10 +697,11 @@ cleanup:
 
 int rl_zcard(rlite *db, const unsigned char *key, long keylen, long *card)
 {
-	rl_skiplist *skiplist;
+	rl_zset_packed *packed;
+	rl_skiplist *skiplist = NULL;
 	int retval;
-	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, NULL, NULL, &skiplist, NULL, 0, 0);
-	*card = skiplist->size;
+	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, &packed, NULL, NULL, &skiplist, NULL, 0, 0);
+	*card = zset_card(packed, skiplist);
 	retval = RL_OK;
 cleanup:
 	return retval;
@@ -302,7 +709,8 @@ cleanup:
 
 int rl_zcount(rlite *db, const unsigned char *key, long keylen, rl_zrangespec *range, long *count)
 {
-	rl_skiplist *skiplist;
+	rl_zset_packed *packed;
+	rl_skiplist *skiplist = NULL;
 	long maxrank, minrank;
 	int retval;
 	if (range->max < range->min) {
@@ -311,34 +719,34 @@ int rl_zcount(rlite *db, const unsigned char *key, long keylen, rl_zrangespec *r
 		goto cleanup;
 	}
 
-	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, NULL, NULL, &skiplist, NULL, 0, 0);
+	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, &packed, NULL, NULL, &skiplist, NULL, 0, 0);
 
-	retval = rl_skiplist_first_node(db, skiplist, range->max, range->maxex ? RL_SKIPLIST_BEFORE_SCORE : RL_SKIPLIST_UPTO_SCORE, NULL, 0, NULL, &maxrank);
+	retval = zset_first_node(db, packed, skiplist, range->max, range->maxex ? RL_SKIPLIST_BEFORE_SCORE : RL_SKIPLIST_UPTO_SCORE, NULL, 0, NULL, &maxrank);
 	if (retval == RL_NOT_FOUND) {
-		maxrank = skiplist->size - 1;
+		maxrank = zset_card(packed, skiplist) - 1;
 	}
 	else if (retval != RL_FOUND) {
 		goto cleanup;
 	}
-	retval = rl_skiplist_first_node(db, skiplist, range->min, range->minex ? RL_SKIPLIST_EXCLUDE_SCORE : RL_SKIPLIST_INCLUDE_SCORE, NULL, 0, NULL, &minrank);
+	retval = zset_first_node(db, packed, skiplist, range->min, range->minex ? RL_SKIPLIST_EXCLUDE_SCORE : RL_SKIPLIST_INCLUDE_SCORE, NULL, 0, NULL, &minrank);
 	if (retval != RL_FOUND) {
 		goto cleanup;
 	}
 	else if (minrank < 0) {
 		minrank = 0;
 	}
-
 	*count = maxrank - minrank + 1;
 	retval = RL_OK;
 cleanup:
 	return retval;
 }
 
-static int _rl_zrange(rlite *db, rl_skiplist *skiplist, long start, long end, int direction, rl_zset_iterator **iterator)
+static int _rl_zrange(rlite *db, rl_zset_packed *packed, rl_skiplist *skiplist, long start, long end, int direction, rl_zset_iterator **_iterator)
 {
+	rl_zset_iterator *iterator = NULL;
 	int retval = RL_OK;
 	long size, node_page;
-	long card = skiplist->size;
+	long card = zset_card(packed, skiplist);
 
 	if (start < 0) {
 		start += card;
@@ -359,24 +767,42 @@ static int _rl_zrange(rlite *db, rl_skiplist *skiplist, long start, long end, in
 
 	size = end - start + 1;
 
-	RL_CALL(rl_skiplist_node_by_rank, RL_OK, db, skiplist, direction > 0 ? start : end, NULL, &node_page);
-	RL_CALL(rl_skiplist_iterator_create, RL_OK, db, iterator, skiplist, node_page, direction, size);
+	RL_MALLOC(iterator, sizeof(*iterator));
+	iterator->db = db;
+	iterator->size = size;
+	iterator->position = 0;
+	iterator->skiplist_iterator = NULL;
+	iterator->data = NULL;
+	iterator->datalen = 0;
+	iterator->offset = 0;
+	if (packed) {
+		RL_CALL(packed_range_copy, RL_OK, packed, start, end, direction, &iterator->data, &iterator->datalen);
+	}
+	else {
+		RL_CALL(rl_skiplist_node_by_rank, RL_OK, db, skiplist, direction > 0 ? start : end, NULL, &node_page);
+		RL_CALL(rl_skiplist_iterator_create, RL_OK, db, &iterator->skiplist_iterator, skiplist, node_page, direction, size);
+	}
+	*_iterator = iterator;
+	iterator = NULL;
 cleanup:
+	if (iterator) {
+		rl_zset_iterator_destroy(iterator);
+	}
 	return retval;
 }
 
-static int _rl_zrangebyscore(rlite *db, rl_skiplist *skiplist, rl_zrangespec *range, long *_start, long *_end)
+static int _rl_zrangebyscore(rlite *db, rl_zset_packed *packed, rl_skiplist *skiplist, rl_zrangespec *range, long *_start, long *_end)
 {
 	long start, end;
-	rl_skiplist_node *node;
+	double score = 0.0;
 	int retval;
-	RL_CALL(rl_skiplist_first_node, RL_FOUND, db, skiplist, range->min, range->minex ? RL_SKIPLIST_EXCLUDE_SCORE : RL_SKIPLIST_INCLUDE_SCORE, NULL, 0, NULL, &start);
-	retval = rl_skiplist_first_node(db, skiplist, range->max, range->maxex ? RL_SKIPLIST_BEFORE_SCORE : RL_SKIPLIST_UPTO_SCORE, NULL, 0, &node, &end);
+	RL_CALL(zset_first_node, RL_FOUND, db, packed, skiplist, range->min, range->minex ? RL_SKIPLIST_EXCLUDE_SCORE : RL_SKIPLIST_INCLUDE_SCORE, NULL, 0, NULL, &start);
+	retval = zset_first_node(db, packed, skiplist, range->max, range->maxex ? RL_SKIPLIST_BEFORE_SCORE : RL_SKIPLIST_UPTO_SCORE, NULL, 0, &score, &end);
 	if (retval != RL_FOUND && retval != RL_NOT_FOUND) {
 		goto cleanup;
 	}
 
-	if (retval == RL_FOUND && end == 0 && ((range->maxex && node->score == range->max) || node->score > range->max)) {
+	if (retval == RL_FOUND && end == 0 && ((range->maxex && score == range->max) || score > range->max)) {
 		retval = RL_NOT_FOUND;
 		goto cleanup;
 	}
@@ -394,14 +820,15 @@ cleanup:
 int rl_zrangebyscore(rlite *db, const unsigned char *key, long keylen, rl_zrangespec *range, long offset, long count, rl_zset_iterator **iterator)
 {
 	long start, end;
-	rl_skiplist *skiplist;
+	rl_zset_packed *packed;
+	rl_skiplist *skiplist = NULL;
 	int retval;
-	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, NULL, NULL, &skiplist, NULL, 0, 0);
-	RL_CALL(_rl_zrangebyscore, RL_OK, db, skiplist, range, &start, &end);
+	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, &packed, NULL, NULL, &skiplist, NULL, 0, 0);
+	RL_CALL(_rl_zrangebyscore, RL_OK, db, packed, skiplist, range, &start, &end);
 
 	start += offset;
 
-	RL_CALL(_rl_zrange, RL_OK, db, skiplist, start, end, 1, iterator);
+	RL_CALL(_rl_zrange, RL_OK, db, packed, skiplist, start, end, 1, iterator);
 	if (count >= 0 && (*iterator)->size > count) {
 		(*iterator)->size = count;
 	}
@@ -412,14 +839,15 @@ cleanup:
 int rl_zrevrangebyscore(rlite *db, const unsigned char *key, long keylen, rl_zrangespec *range, long offset, long count, rl_zset_iterator **iterator)
 {
 	long start, end;
-	rl_skiplist *skiplist;
+	rl_zset_packed *packed;
+	rl_skiplist *skiplist = NULL;
 	int retval;
-	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, NULL, NULL, &skiplist, NULL, 0, 0);
-	RL_CALL(_rl_zrangebyscore, RL_OK, db, skiplist, range, &start, &end);
+	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, &packed, NULL, NULL, &skiplist, NULL, 0, 0);
+	RL_CALL(_rl_zrangebyscore, RL_OK, db, packed, skiplist, range, &start, &end);
 
 	end -= offset;
 
-	RL_CALL(_rl_zrange, RL_OK, db, skiplist, start, end, -1, iterator);
+	RL_CALL(_rl_zrange, RL_OK, db, packed, skiplist, start, end, -1, iterator);
 	if (count >= 0 && (*iterator)->size > count) {
 		(*iterator)->size = count;
 	}
@@ -439,29 +867,27 @@ static int validate_lex_range(unsigned char *min, long minlen, unsigned char *ma
 	return RL_OK;
 }
 
-static int lex_get_range(rlite *db, unsigned char *min, long minlen, unsigned char *max, long maxlen, rl_skiplist *skiplist, long *_start, long *_end)
+static int lex_get_range(rlite *db, unsigned char *min, long minlen, unsigned char *max, long maxlen, rl_zset_packed *packed, rl_skiplist *skiplist, long *_start, long *_end)
 {
 	int retval;
 	RL_CALL(validate_lex_range, RL_OK, min, minlen, max, maxlen);
 
-	rl_skiplist_node *node;
-	double score;
-	RL_CALL(rl_skiplist_first_node, RL_FOUND, db, skiplist, -INFINITY, RL_SKIPLIST_EXCLUDE_SCORE, NULL, 0, &node, NULL);
-	score = node->score;
+	double score = 0.0;
+	RL_CALL(zset_first_node, RL_FOUND, db, packed, skiplist, -INFINITY, RL_SKIPLIST_EXCLUDE_SCORE, NULL, 0, &score, NULL);
 
 	long start, end;
 	if (min[0] == '-') {
 		start = 0;
 	}
 	else {
-		RL_CALL(rl_skiplist_first_node, RL_FOUND, db, skiplist, score, min[0] == '(' ? RL_SKIPLIST_EXCLUDE_SCORE : RL_SKIPLIST_INCLUDE_SCORE, &min[1], minlen - 1, &node, &start);
+		RL_CALL(zset_first_node, RL_FOUND, db, packed, skiplist, score, min[0] == '(' ? RL_SKIPLIST_EXCLUDE_SCORE : RL_SKIPLIST_INCLUDE_SCORE, &min[1], minlen - 1, NULL, &start);
 	}
 
 	if (max[0] == '+') {
 		end = -1;
 	}
 	else {
-		RL_CALL(rl_skiplist_first_node, RL_FOUND, db, skiplist, score, max[0] == '(' ? RL_SKIPLIST_BEFORE_SCORE : RL_SKIPLIST_UPTO_SCORE, &max[1], maxlen - 1, NULL, &end);
+		RL_CALL(zset_first_node, RL_FOUND, db, packed, skiplist, score, max[0] == '(' ? RL_SKIPLIST_BEFORE_SCORE : RL_SKIPLIST_UPTO_SCORE, &max[1], maxlen - 1, NULL, &end);
 		if (retval != RL_FOUND) {
 			goto cleanup;
 		}
@@ -485,13 +911,14 @@ cleanup:
 int rl_zlexcount(rlite *db, const unsigned char *key, long keylen, unsigned char *min, long minlen, unsigned char *max, long maxlen, long *lexcount)
 {
 	long start, end;
-	rl_skiplist *skiplist;
+	rl_zset_packed *packed;
+	rl_skiplist *skiplist = NULL;
 	int retval;
 	RL_CALL(validate_lex_range, RL_OK, min, minlen, max, maxlen);
-	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, NULL, NULL, &skiplist, NULL, 0, 0);
-	RL_CALL(lex_get_range, RL_OK, db, min, minlen, max, maxlen, skiplist, &start, &end);
+	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, &packed, NULL, NULL, &skiplist, NULL, 0, 0);
+	RL_CALL(lex_get_range, RL_OK, db, min, minlen, max, maxlen, packed, skiplist, &start, &end);
 	if (end < 0) {
-		end += skiplist->size;
+		end += zset_card(packed, skiplist);
 	}
 
 	if (end >= start) {
@@ -508,15 +935,16 @@ cleanup:
 int rl_zrevrangebylex(rlite *db, const unsigned char *key, long keylen, unsigned char *max, long maxlen, unsigned char *min, long minlen, long offset, long count, rl_zset_iterator **iterator)
 {
 	long start, end;
-	rl_skiplist *skiplist;
+	rl_zset_packed *packed;
+	rl_skiplist *skiplist = NULL;
 	int retval;
 	RL_CALL(validate_lex_range, RL_OK, min, minlen, max, maxlen);
-	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, NULL, NULL, &skiplist, NULL, 0, 0);
-	RL_CALL(lex_get_range, RL_OK, db, min, minlen, max, maxlen, skiplist, &start, &end);
+	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, &packed, NULL, NULL, &skiplist, NULL, 0, 0);
+	RL_CALL(lex_get_range, RL_OK, db, min, minlen, max, maxlen, packed, skiplist, &start, &end);
 
 	end -= offset;
 
-	RL_CALL(_rl_zrange, RL_OK, db, skiplist, start, end, -1, iterator);
+	RL_CALL(_rl_zrange, RL_OK, db, packed, skiplist, start, end, -1, iterator);
 	if (count >= 0 && (*iterator)->size > count) {
 		(*iterator)->size = count;
 	}
@@ -527,15 +955,16 @@ cleanup:
 int rl_zrangebylex(rlite *db, const unsigned char *key, long keylen, unsigned char *min, long minlen, unsigned char *max, long maxlen, long offset, long count, rl_zset_iterator **iterator)
 {
 	long start, end;
-	rl_skiplist *skiplist;
+	rl_zset_packed *packed;
+	rl_skiplist *skiplist = NULL;
 	int retval;
 	RL_CALL(validate_lex_range, RL_OK, min, minlen, max, maxlen);
-	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, NULL, NULL, &skiplist, NULL, 0, 0);
-	RL_CALL(lex_get_range, RL_OK, db, min, minlen, max, maxlen, skiplist, &start, &end);
+	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, &packed, NULL, NULL, &skiplist, NULL, 0, 0);
+	RL_CALL(lex_get_range, RL_OK, db, min, minlen, max, maxlen, packed, skiplist, &start, &end);
 
 	start += offset;
 
-	RL_CALL(_rl_zrange, RL_OK, db, skiplist, start, end, 1, iterator);
+	RL_CALL(_rl_zrange, RL_OK, db, packed, skiplist, start, end, 1, iterator);
 	if (count >= 0 && (*iterator)->size > count) {
 		(*iterator)->size = count;
 	}
@@ -545,22 +974,24 @@ cleanup:
 
 int rl_zrevrange(rlite *db, const unsigned char *key, long keylen, long start, long end, rl_zset_iterator **iterator)
 {
-	rl_skiplist *skiplist;
+	rl_zset_packed *packed;
+	rl_skiplist *skiplist = NULL;
 
 	int retval;
-	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, NULL, NULL, &skiplist, NULL, 0, 0);
-	RL_CALL(_rl_zrange, RL_OK, db, skiplist, - end - 1, - start - 1, -1, iterator);
+	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, &packed, NULL, NULL, &skiplist, NULL, 0, 0);
+	RL_CALL(_rl_zrange, RL_OK, db, packed, skiplist, - end - 1, - start - 1, -1, iterator);
 cleanup:
 	return retval;
 }
 
 int rl_zrange(rlite *db, const unsigned char *key, long keylen, long start, long end, rl_zset_iterator **iterator)
 {
-	rl_skiplist *skiplist;
+	rl_zset_packed *packed;
+	rl_skiplist *skiplist = NULL;
 
 	int retval;
-	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, NULL, NULL, &skiplist, NULL, 0, 0);
-	RL_CALL(_rl_zrange, RL_OK, db, skiplist, start, end, 1, iterator);
+	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, &packed, NULL, NULL, &skiplist, NULL, 0, 0);
+	RL_CALL(_rl_zrange, RL_OK, db, packed, skiplist, start, end, 1, iterator);
 cleanup:
 	return retval;
 }
@@ -573,43 +1004,94 @@ int rl_zset_iterator_next(rl_zset_iterator *iterator, long *page, double *score,
 	}
 
 	rl_skiplist_node *node;
+	long len;
 	int retval;
-	RL_CALL(rl_skiplist_iterator_next, RL_OK, iterator, &node);
+	if (iterator->position == iterator->size) {
+		retval = RL_END;
+		goto cleanup;
+	}
+	if (!iterator->skiplist_iterator) {
+		len = PACKED_MEMBERLEN(iterator->data, iterator->offset);
+		if (page) {
+			*page = 0;
+		}
+		if (score) {
+			*score = PACKED_SCORE(iterator->data, iterator->offset);
+		}
+		if (memberlen) {
+			*memberlen = len;
+		}
+		if (member) {
+			// like rl_multi_string_get: NULL when empty, nul terminated otherwise
+			*member = NULL;
+			if (len > 0) {
+				RL_MALLOC(*member, sizeof(unsigned char) * (len + 1));
+				memcpy(*member, PACKED_MEMBER(iterator->data, iterator->offset), len);
+				(*member)[len] = 0;
+			}
+		}
+		iterator->offset += PACKED_ENTRY_SIZE(len);
+		iterator->position++;
+		retval = RL_OK;
+		goto cleanup;
+	}
+
+	retval = rl_skiplist_iterator_next(iterator->skiplist_iterator, &node);
+	if (retval != RL_OK) {
+		// the skiplist iterator releases itself once it is done
+		iterator->skiplist_iterator = NULL;
+		goto cleanup;
+	}
 
 	if (page) {
 		*page = node->value;
 	}
 	if (memberlen) {
-		retval = rl_multi_string_get(iterator->db, node->value, member, memberlen);
-		if (retval != RL_OK) {
-			rl_skiplist_iterator_destroy(iterator->db, iterator);
-			goto cleanup;
-		}
+		RL_CALL(rl_multi_string_get, RL_OK, iterator->db, node->value, member, memberlen);
 	}
 
 	if (score) {
 		*score = node->score;
 	}
+	iterator->position++;
 cleanup:
+	if (retval != RL_OK) {
+		rl_zset_iterator_destroy(iterator);
+	}
 	return retval;
 }
 
 int rl_zset_iterator_destroy(rl_zset_iterator *iterator)
 {
-	return rl_skiplist_iterator_destroy(iterator->db, iterator);
+	int retval = RL_OK;
+	if (iterator->skiplist_iterator) {
+		retval = rl_skiplist_iterator_destroy(iterator->db, iterator->skiplist_iterator);
+	}
+	rl_free(iterator->data);
+	rl_free(iterator);
+	return retval;
 }
 
 int rl_zrem(rlite *db, const unsigned char *key, long keylen, long members_size, unsigned char **members, long *members_len, long *changed)
 {
-	rl_btree *scores;
-	rl_skiplist *skiplist;
-	long scores_page, skiplist_page, levels_page_number;
+	rl_zset_packed *packed;
+	rl_btree *scores = NULL;
+	rl_skiplist *skiplist = NULL;
+	long scores_page = 0, skiplist_page = 0, levels_page_number;
 	int retval;
-	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, &levels_page_number, &scores, &scores_page, &skiplist, &skiplist_page, 1, 1);
+	retval = rl_zset_get_objects(db, key, keylen, &levels_page_number, &packed, &scores, &scores_page, &skiplist, &skiplist_page, 1, 0);
+	if (retval == RL_NOT_FOUND) {
+		*changed = 0;
+		retval = RL_OK;
+		goto cleanup;
+	}
+	if (retval != RL_OK) {
+		goto cleanup;
+	}
 	long i;
 	long _changed = 0;
 	for (i = 0; i < members_size; i++) {
-		retval = remove_member(db, key, keylen, levels_page_number, scores, scores_page, skiplist, skiplist_page, members[i], members_len[i]);
+		retval = remove_member(db, key, keylen, levels_page_number, packed, scores, scores_page, skiplist, skiplist_page, members[i], members_len[i]);
 		if (retval != RL_OK && retval != RL_NOT_FOUND && retval != RL_DELETED) {
 			goto cleanup;
 		}
@@ -628,7 +1110,7 @@ cleanup:
 	return retval;
 }
 
-static int _zremiterator(rlite *db, const unsigned char *key, long keylen, long levels_page_number, rl_zset_iterator *iterator, rl_btree *scores, long scores_page, rl_skiplist *skiplist, long skiplist_page, long *changed)
+static int _zremiterator(rlite *db, const unsigned char *key, long keylen, long levels_page_number, rl_zset_iterator *iterator, rl_zset_packed *packed, rl_btree *scores, long scores_page, rl_skiplist *skiplist, long skiplist_page, long *changed)
 {
 	long _changed = 0;
 	double score;
@@ -636,7 +1118,7 @@ static int _zremiterator(rlite *db, const unsigned char *key, long keylen, long
 	long memberlen;
 	int retval;
 	while ((retval = rl_zset_iterator_next(iterator, NULL, &score, &member, &memberlen)) == RL_OK) {
-		retval = remove_member_score(db, key, keylen, levels_page_number, scores, scores_page, skiplist, skiplist_page, member, memberlen, score);
+		retval = remove_member_score(db, key, keylen, levels_page_number, packed, scores, scores_page, skiplist, skiplist_page, member, memberlen, score);
 		rl_free(member);
 		if (retval != RL_OK && retval != RL_DELETED) {
 			rl_zset_iterator_destroy(iterator);
@@ -658,13 +1140,22 @@ cleanup:
 int rl_zremrangebyrank(rlite *db, const unsigned char *key, long keylen, long start, long end, long *changed)
 {
 	rl_zset_iterator *iterator;
-	rl_btree *scores;
-	rl_skiplist *skiplist;
-	long scores_page, skiplist_page, levels_page_number;
+	rl_zset_packed *packed;
+	rl_btree *scores = NULL;
+	rl_skiplist *skiplist = NULL;
+	long scores_page = 0, skiplist_page = 0, levels_page_number;
 	int retval;
-	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, &levels_page_number, &scores, &scores_page, &skiplist, &skiplist_page, 1, 1);
-	RL_CALL(_rl_zrange, RL_OK, db, skiplist, start, end, 1, &iterator);
-	RL_CALL(_zremiterator, RL_OK, db, key, keylen, levels_page_number, iterator, scores, scores_page, skiplist, skiplist_page, changed);
+	retval = rl_zset_get_objects(db, key, keylen, &levels_page_number, &packed, &scores, &scores_page, &skiplist, &skiplist_page, 1, 0);
+	if (retval == RL_NOT_FOUND) {
+		*changed = 0;
+		retval = RL_OK;
+		goto cleanup;
+	}
+	if (retval != RL_OK) {
+		goto cleanup;
+	}
+	RL_CALL(_rl_zrange, RL_OK, db, packed, skiplist, start, end, 1, &iterator);
+	RL_CALL(_zremiterator, RL_OK, db, key, keylen, levels_page_number, iterator, packed, scores, scores_page, skiplist, skiplist_page, changed);
 	retval = RL_OK;
 cleanup:
 	if (retval != RL_OK && changed) {
@@ -676,16 +1167,25 @@ cleanup:
 int rl_zremrangebyscore(rlite *db, const unsigned char *key, long keylen, rl_zrangespec *range, long *changed)
 {
 	rl_zset_iterator *iterator;
-	rl_btree *scores;
-	rl_skiplist *skiplist;
-	long scores_page, skiplist_page, levels_page_number;
+	rl_zset_packed *packed;
+	rl_btree *scores = NULL;
+	rl_skiplist *skiplist = NULL;
+	long scores_page = 0, skiplist_page = 0, levels_page_number;
 	int retval;
-	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, &levels_page_number, &scores, &scores_page, &skiplist, &skiplist_page, 1, 1);
+	retval = rl_zset_get_objects(db, key, keylen, &levels_page_number, &packed, &scores, &scores_page, &skiplist, &skiplist_page, 1, 0);
+	if (retval == RL_NOT_FOUND) {
+		*changed = 0;
+		retval = RL_OK;
+		goto cleanup;
+	}
+	if (retval != RL_OK) {
+		goto cleanup;
+	}
 
 	long start, end;
-	RL_CALL(_rl_zrangebyscore, RL_OK, db, skiplist, range, &start, &end);
-	RL_CALL(_rl_zrange, RL_OK, db, skiplist, start, end, 1, &iterator);
-	RL_CALL(_zremiterator, RL_OK, db, key, keylen, levels_page_number, iterator, scores, scores_page, skiplist, skiplist_page, changed);
+	RL_CALL(_rl_zrangebyscore, RL_OK, db, packed, skiplist, range, &start, &end);
+	RL_CALL(_rl_zrange, RL_OK, db, packed, skiplist, start, end, 1, &iterator);
+	RL_CALL(_zremiterator, RL_OK, db, key, keylen, levels_page_number, iterator, packed, scores, scores_page, skiplist, skiplist_page, changed);
 	retval = RL_OK;
 cleanup:
 	if (retval != RL_OK && changed) {
@@ -697,13 +1197,22 @@ cleanup:
 int rl_zremrangebylex(rlite *db, const unsigned char *key, long keylen, unsigned char *min, long minlen, unsigned char *max, long maxlen, long *changed)
 {
 	rl_zset_iterator *iterator;
-	rl_btree *scores;
-	rl_skiplist *skiplist;
-	long scores_page, skiplist_page, start, end, levels_page_number;
+	rl_zset_packed *packed;
+	rl_btree *scores = NULL;
+	rl_skiplist *skiplist = NULL;
+	long scores_page = 0, skiplist_page = 0, start, end, levels_page_number;
 	int retval;
 	RL_CALL(validate_lex_range, RL_OK, min, minlen, max, maxlen);
-	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, &levels_page_number, &scores, &scores_page, &skiplist, &skiplist_page, 1, 1);
-	retval = lex_get_range(db, min, minlen, max, maxlen, skiplist, &start, &end);
+	retval = rl_zset_get_objects(db, key, keylen, &levels_page_number, &packed, &scores, &scores_page, &skiplist, &skiplist_page, 1, 0);
+	if (retval == RL_NOT_FOUND) {
+		*changed = 0;
+		retval = RL_OK;
+		goto cleanup;
+	}
+	if (retval != RL_OK) {
+		goto cleanup;
+	}
+	retval = lex_get_range(db, min, minlen, max, maxlen, packed, skiplist, &start, &end);
 	if (retval == RL_NOT_FOUND) {
 		*changed = 0;
 		retval = RL_OK;
@@ -713,8 +1222,8 @@ int rl_zremrangebylex(rlite *db, const unsigned char *key, long keylen, unsigned
 		goto cleanup;
 	}
 
-	RL_CALL(_rl_zrange, RL_OK, db, skiplist, start, end, 1, &iterator);
-	RL_CALL(_zremiterator, RL_OK, db, key, keylen, levels_page_number, iterator, scores, scores_page, skiplist, skiplist_page, changed);
+	RL_CALL(_rl_zrange, RL_OK, db, packed, skiplist, start, end, 1, &iterator);
+	RL_CALL(_zremiterator, RL_OK, db, key, keylen, levels_page_number, iterator, packed, scores, scores_page, skiplist, skiplist_page, changed);
 	retval = RL_OK;
 cleanup:
 	if (retval != RL_OK && changed) {
@@ -726,13 +1235,14 @@ cleanup:
 
 static int incrby(rlite *db, const unsigned char *key, long keylen, double score, unsigned char *member, long memberlen, double *newscore, int clearnan)
 {
-	rl_btree *scores;
-	rl_skiplist *skiplist;
-	long scores_page, skiplist_page, levels_page_number;
+	rl_zset_packed *packed;
+	rl_btree *scores = NULL;
+	rl_skiplist *skiplist = NULL;
+	long scores_page = 0, skiplist_page = 0, levels_page_number, offset;
 	double existing_score = 0.0;
 	int retval;
-	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, &levels_page_number, &scores, &scores_page, &skiplist, &skiplist_page, 1, 1);
-	retval = rl_get_zscore(db, scores, member, memberlen, &existing_score);
+	RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, &levels_page_number, &packed, &scores, &scores_page, &skiplist, &skiplist_page, 1, 1);
+	retval = zset_score(db, packed, scores, member, memberlen, &existing_score);
 	if (retval != RL_FOUND && retval != RL_NOT_FOUND) {
 		goto cleanup;
 	}
@@ -747,17 +1257,24 @@ static int incrby(rlite *db, const unsigned char *key, long keylen, double score
 				goto cleanup;
 			}
 		}
-		retval = remove_member(db, key, keylen, levels_page_number, scores, scores_page, skiplist, skiplist_page, member, memberlen);
-		if (retval == RL_DELETED) {
-			// it would be nice if we could update the score without destroying the btree, maybe remove_member should have an int destroy?
-			RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, NULL, &scores, &scores_page, &skiplist, &skiplist_page, 0, 1);
+		if (packed) {
+			// the member is added back right away, the page is written then
+			RL_CALL(packed_find, RL_FOUND, packed, member, memberlen, &offset, NULL, NULL);
+			packed_remove(packed, offset);
 		}
-		else if (retval != RL_OK) {
-			goto cleanup;
+		else {
+			retval = remove_member(db, key, keylen, levels_page_number, NULL, scores, scores_page, skiplist, skiplist_page, member, memberlen);
+			if (retval == RL_DELETED) {
+				// it would be nice if we could update the score without destroying the btree, maybe remove_member should have an int destroy?
+				RL_CALL(rl_zset_get_objects, RL_OK, db, key, keylen, &levels_page_number, &packed, &scores, &scores_page, &skiplist, &skiplist_page, 0, 1);
+			}
+			else if (retval != RL_OK) {
+				goto cleanup;
+			}
 		}
 	}
 
-	RL_CALL(add_member, RL_OK, db, scores, scores_page, skiplist, skiplist_page, score, member, memberlen);
+	RL_CALL(zset_add, RL_OK, db, levels_page_number, packed, scores, scores_page, skiplist, skiplist_page, score, member, memberlen);
 	if (newscore) {
 		*newscore = score;
 	}
@@ -770,32 +1287,42 @@ int rl_zincrby(rlite *db, const unsigned char *key, long keylen, double score, u
 	return incrby(db, key, keylen, score, member, memberlen, newscore, 0);
 }
 
-int rl_zinterstore(rlite *db, long keys_size, unsigned char **keys, long *keys_len, double *_weights, int aggregate)
+// a ZINTERSTORE source, either a sorted set or a set whose members score 1
+typedef struct {
+	unsigned char *key;
+	long keylen;
+	double weight;
+	long card;
+	rl_zset_packed *packed;
+	rl_btree *scores;
+	rl_skiplist *skiplist;
+	rl_btree *set;
+} zinter_source;
+
+static int zinter_source_score(rlite *db, zinter_source *source, unsigned char *member, long memberlen, double *score)
 {
-	unsigned char *member = NULL;
-	rl_btree **btrees = NULL;
-	rl_skiplist **skiplists = NULL;
-	double weight = 1.0, weight_tmp;
-	double *weights = NULL;
-	rl_skiplist_node *node;
-	rl_skiplist_iterator *skiplist_iterator = NULL;
-	rl_btree_iterator *btree_iterator = NULL;
 	int retval;
-	long target_btree_page, target_skiplist_page;
-	long multi_string_page;
-	rl_btree *target_btree;
-	rl_skiplist *target_skiplist;
-	int found;
-	void *tmp;
-	double skiplist_score, tmp_score;
-	long memberlen;
-	unsigned char digest[20];
-
-	if (keys_size > 1) {
-		RL_MALLOC(btrees, sizeof(rl_btree *) * (keys_size - 1));
-		RL_MALLOC(skiplists, sizeof(rl_skiplist *) * (keys_size - 1));
+	if (source->set) {
+		retval = rl_set_ismember(db, source->set, member, memberlen);
+		if (retval == RL_FOUND) {
+			*score = 1.0;
+		}
+		return retval;
 	}
-	else {
+	return zset_score(db, source->packed, source->scores, member, memberlen, score);
+}
+
+int rl_zinterstore(rlite *db, long keys_size, unsigned char **keys, long *keys_len, double *weights, int aggregate)
+{
+	zinter_source *sources = NULL, *pivot = NULL;
+	rl_zset_iterator *zset_iterator = NULL;
+	rl_set_iterator *set_iterator = NULL;
+	unsigned char *member = NULL;
+	long memberlen, i;
+	double score = 1.0, tmp_score;
+	int retval, found;
+
+	if (keys_size < 2) {
 		retval = RL_UNEXPECTED;
 		goto cleanup;
 	}
@@ -803,90 +1330,87 @@ int rl_zinterstore(rlite *db, long keys_size, unsigned char **keys, long *keys_l
 	if (retval != RL_OK && retval != RL_NOT_FOUND) {
 		goto cleanup;
 	}
-	rl_btree *btree, *btree_tmp;
-	rl_skiplist *skiplist = NULL, *skiplist_tmp;
-	long i;
 	// key in position 0 is the target key
-	// we'll store a pivot skiplist in btree/skiplist and the others in btrees/skiplists
-	// TODO: qsort instead
-	RL_MALLOC(weights, sizeof(double) * (keys_size - 2));
-	for (i = 1; i < keys_size; i++) {
-		weight_tmp = _weights ? _weights[i - 1] : 1.0;
-		RL_CALL2(rl_zset_get_objects, RL_OK, RL_WRONG_TYPE, db, keys[i], keys_len[i], NULL, &btree_tmp, NULL, &skiplist_tmp, NULL, 0, 0);
-		if (retval == RL_WRONG_TYPE) {
-			skiplist_tmp = NULL;
-			RL_CALL(rl_set_get_objects, RL_OK, db, keys[i], keys_len[i], NULL, &btree_tmp, 0, 0);
+	// the smallest source is iterated and its members are looked up in the others
+	RL_MALLOC(sources, sizeof(zinter_source) * (keys_size - 1));
+	for (i = 0; i < keys_size - 1; i++) {
+		sources[i].key = keys[i + 1];
+		sources[i].keylen = keys_len[i + 1];
+		sources[i].weight = weights ? weights[i] : 1.0;
+		sources[i].packed = NULL;
+		sources[i].scores = NULL;
+		sources[i].skiplist = NULL;
+		sources[i].set = NULL;
+		retval = rl_zset_get_objects(db, keys[i + 1], keys_len[i + 1], NULL, &sources[i].packed, &sources[i].scores, NULL, &sources[i].skiplist, NULL, 0, 0);
+		if (retval != RL_OK && retval != RL_WRONG_TYPE && retval != RL_NOT_FOUND) {
+			goto cleanup;
 		}
-		if (i == 1) {
-			btree = btree_tmp;
-			skiplist = skiplist_tmp;
-			weight = weight_tmp;
+		if (retval == RL_NOT_FOUND) {
+			sources[i].card = 0;
 		}
-		else if (btree_tmp->number_of_elements < btree->number_of_elements) {
-			weights[i - 2] = weight;
-			weight = weight_tmp;
-			btrees[i - 2] = btree;
-			btree = btree_tmp;
-			skiplists[i - 2] = skiplist;
-			skiplist = skiplist_tmp;
+		else if (retval == RL_WRONG_TYPE) {
+			RL_CALL(rl_set_get_objects, RL_OK, db, keys[i + 1], keys_len[i + 1], NULL, &sources[i].set, 0, 0);
+			sources[i].card = sources[i].set->number_of_elements;
 		}
 		else {
-			weights[i - 2] = weight_tmp;
-			btrees[i - 2] = btree_tmp;
-			skiplists[i - 2] = skiplist_tmp;
+			sources[i].card = zset_card(sources[i].packed, sources[i].skiplist);
+		}
+		if (!pivot || sources[i].card < pivot->card) {
+			pivot = &sources[i];
 		}
 	}
 
-	RL_CALL(rl_zset_get_objects, RL_OK, db, keys[0], keys_len[0], NULL, &target_btree, &target_btree_page, &target_skiplist, &target_skiplist_page, 1, 1);
-
-	if (skiplist) {
-		RL_CALL(rl_skiplist_iterator_create, RL_OK, db, &skiplist_iterator, skiplist, 0, 0, 0);
-	} else {
-		RL_CALL(rl_btree_iterator_create, RL_OK, db, btree, &btree_iterator);
+	if (pivot->card == 0) {
+		// an empty or missing source empties the intersection
+		retval = RL_OK;
+		goto cleanup;
+	}
+	if (pivot->set) {
+		RL_CALL(rl_smembers, RL_OK, db, &set_iterator, pivot->key, pivot->keylen);
 	}
-	while ((retval = skiplist ? rl_skiplist_iterator_next(skiplist_iterator, &node) : rl_btree_iterator_next(btree_iterator, NULL, &tmp)) == RL_OK) {
+	else {
+		RL_CALL(_rl_zrange, RL_OK, db, pivot->packed, pivot->skiplist, 0, -1, 1, &zset_iterator);
+	}
+	while ((retval = pivot->set ? rl_set_iterator_next(set_iterator, NULL, &member, &memberlen) : rl_zset_iterator_next(zset_iterator, NULL, &score, &member, &memberlen)) == RL_OK) {
 		found = 1;
-		if (skiplist) {
-			skiplist_score = node->score * weight;
-			multi_string_page = node->value;
-		} else {
-			skiplist_score = weight;
-			multi_string_page = *(long *)tmp;
-			rl_free(tmp);
+		if (pivot->set) {
+			score = 1.0;
 		}
-		for (i = 1; i < keys_size - 1; i++) {
-			RL_CALL(rl_multi_string_sha1, RL_OK, db, digest, multi_string_page);
-
-			retval = rl_btree_find_score(db, btrees[i - 1], digest, &tmp, NULL, NULL);
+		score *= pivot->weight;
+		for (i = 0; i < keys_size - 1; i++) {
+			if (&sources[i] == pivot) {
+				continue;
+			}
+			retval = zinter_source_score(db, &sources[i], member, memberlen, &tmp_score);
 			if (retval == RL_NOT_FOUND) {
 				found = 0;
 				break;
 			}
-			else if (retval == RL_FOUND) {
-				tmp_score = skiplist ? *(double *)tmp : 1.0;
-				if (aggregate == RL_ZSET_AGGREGATE_SUM) {
-					skiplist_score += tmp_score * weights[i - 1];
-				}
-				else if (
-				    (aggregate == RL_ZSET_AGGREGATE_MIN && tmp_score * weights[i - 1] < skiplist_score) ||
-				    (aggregate == RL_ZSET_AGGREGATE_MAX && tmp_score * weights[i - 1] > skiplist_score)
-				) {
-					skiplist_score = tmp_score * weights[i - 1];
-				}
-			}
-			else {
+			else if (retval != RL_FOUND) {
 				goto cleanup;
 			}
+			tmp_score *= sources[i].weight;
+			if (aggregate == RL_ZSET_AGGREGATE_SUM) {
+				score += tmp_score;
+			}
+			else if (
+			    (aggregate == RL_ZSET_AGGREGATE_MIN && tmp_score < score) ||
+			    (aggregate == RL_ZSET_AGGREGATE_MAX && tmp_score > score)
+			) {
+				score = tmp_score;
+			}
 		}
 		if (found) {
-			RL_CALL(rl_multi_string_get, RL_OK, db, multi_string_page, &member, &memberlen);
-			RL_CALL(add_member, RL_OK, db, target_btree, target_btree_page, target_skiplist, target_skiplist_page, isnan(skiplist_score) ? 0.0 : skiplist_score, member, memberlen);
-			rl_free(member);
-			member = NULL;
+			retval = rl_zadd(db, keys[0], keys_len[0], isnan(score) ? 0.0 : score, member, memberlen);
+			if (retval != RL_OK && retval != RL_FOUND) {
+				goto cleanup;
+			}
 		}
+		rl_free(member);
+		member = NULL;
 	}
-	skiplist_iterator = NULL;
-	btree_iterator = NULL;
+	set_iterator = NULL;
+	zset_iterator = NULL;
 
 	if (retval != RL_END) {
 		goto cleanup;
@@ -895,43 +1419,39 @@ int rl_zinterstore(rlite *db, long keys_size, unsigned char **keys, long *keys_l
 	retval = RL_OK;
 cleanup:
 	rl_free(member);
-	if (skiplist_iterator) {
-		rl_zset_iterator_destroy(skiplist_iterator);
+	if (set_iterator) {
+		rl_set_iterator_destroy(set_iterator);
 	}
-	if (btree_iterator) {
-		rl_btree_iterator_destroy(btree_iterator);
+	if (zset_iterator) {
+		rl_zset_iterator_destroy(zset_iterator);
 	}
-	rl_free(weights);
-	rl_free(btrees);
-	rl_free(skiplists);
+	rl_free(sources);
 	return retval;
 }
+
 static int zunionstore_minmax(rlite *db, long keys_size, unsigned char **keys, long *keys_len, double *weights, int aggregate)
 {
-	rl_btree *target_scores;
-	long target_scores_page, target_skiplist_page;
-	rl_skiplist *target_skiplist;
 	int retval;
-	rl_skiplist_iterator **iterators = NULL;;
-	rl_skiplist *skiplist;
-	double *scores = NULL, score;
+	rl_zset_iterator **iterators = NULL;;
+	rl_zset_packed *packed;
+	rl_skiplist *skiplist = NULL;
+	double *scores = NULL, score, existing_score;
 	unsigned char **members = NULL;
 	long *memberslen = NULL, i;
 	long position;
-	RL_CALL(rl_zset_get_objects, RL_OK, db, keys[0], keys_len[0], NULL, &target_scores, &target_scores_page, &target_skiplist, &target_skiplist_page, 1, 1);
 	RL_MALLOC(scores, sizeof(double) * keys_size);
 	RL_MALLOC(members, sizeof(unsigned char *) * keys_size);
 	for (i = 0; i < keys_size; i++) {
 		members[i] = NULL;
 	}
 	RL_MALLOC(memberslen, sizeof(long) * keys_size);
-	RL_MALLOC(iterators, sizeof(rl_skiplist_iterator *) * keys_size);
+	RL_MALLOC(iterators, sizeof(rl_zset_iterator *) * keys_size);
 	for (i = 0; i < keys_size; i++) {
 		iterators[i] = NULL;
 	}
 
 	for (i = 0; i < keys_size; i++) {
-		retval = rl_zset_get_objects(db, keys[i], keys_len[i], NULL, NULL, NULL, &skiplist, NULL, 0, 0);
+		retval = rl_zset_get_objects(db, keys[i], keys_len[i], NULL, &packed, NULL, NULL, &skiplist, NULL, 0, 0);
 		if (retval == RL_NOT_FOUND) {
 			iterators[i] = NULL;
 			continue;
@@ -939,7 +1459,10 @@ static int zunionstore_minmax(rlite *db, long keys_size, unsigned char **keys, l
 		if (retval != RL_OK) {
 			goto cleanup;
 		}
-		RL_CALL(rl_skiplist_iterator_create, RL_OK, db, &iterators[i], skiplist, 0, aggregate == RL_ZSET_AGGREGATE_MAX ? -1 : 1, 0);
+		if (zset_card(packed, skiplist) == 0) {
+			continue;
+		}
+		RL_CALL(_rl_zrange, RL_OK, db, packed, skiplist, 0, -1, aggregate == RL_ZSET_AGGREGATE_MAX ? -1 : 1, &iterators[i]);
 		retval = rl_zset_iterator_next(iterators[i], NULL, &scores[i], &members[i], &memberslen[i]);
 		if (retval != RL_OK) {
 			iterators[i] = NULL;
@@ -976,8 +1499,12 @@ static int zunionstore_minmax(rlite *db, long keys_size, unsigned char **keys, l
 		if (isnan(score)) {
 			score = 0.0;
 		}
-		retval = add_member(db, target_scores, target_scores_page, target_skiplist, target_skiplist_page, score, members[position], memberslen[position]);
-		if (retval != RL_FOUND && retval != RL_OK) {
+		// the first score seen for a member is the one kept
+		retval = rl_zscore(db, keys[0], keys_len[0], members[position], memberslen[position], &existing_score);
+		if (retval == RL_NOT_FOUND) {
+			RL_CALL(rl_zadd, RL_OK, db, keys[0], keys_len[0], score, members[position], memberslen[position]);
+		}
+		else if (retval != RL_FOUND) {
 			goto cleanup;
 		}
 		rl_free(members[position]);
@@ -991,9 +1518,6 @@ static int zunionstore_minmax(rlite *db, long keys_size, unsigned char **keys, l
 			}
 		}
 	}
-	if (target_scores->number_of_elements == 0) {
-		RL_CALL(rl_key_delete_with_value, RL_OK, db, keys[0], keys_len[0]);
-	}
 
 	retval = RL_OK;
 cleanup:
@@ -1014,22 +1538,23 @@ cleanup:
 
 static int zunionstore_sum(rlite *db, long keys_size, unsigned char **keys, long *keys_len, double *weights)
 {
-	rl_skiplist_iterator *iterator = NULL;
-	rl_skiplist *skiplist;
+	rl_zset_iterator *iterator = NULL;
+	rl_zset_packed *packed;
+	rl_skiplist *skiplist = NULL;
 	double score;
 	unsigned char *member;
 	long memberlen;
 	int retval;
 	long i;
 	for (i = 1; i < keys_size; i++) {
-		retval = rl_zset_get_objects(db, keys[i], keys_len[i], NULL, NULL, NULL, &skiplist, NULL, 0, 0);
-		if (retval == RL_NOT_FOUND) {
+		retval = rl_zset_get_objects(db, keys[i], keys_len[i], NULL, &packed, NULL, NULL, &skiplist, NULL, 0, 0);
+		if (retval == RL_NOT_FOUND || (retval == RL_OK && zset_card(packed, skiplist) == 0)) {
 			continue;
 		}
 		if (retval != RL_OK) {
 			goto cleanup;
 		}
-		RL_CALL(rl_skiplist_iterator_create, RL_OK, db, &iterator, skiplist, 0, 1, 0);
+		RL_CALL(_rl_zrange, RL_OK, db, packed, skiplist, 0, -1, 1, &iterator);
 		while ((retval = rl_zset_iterator_next(iterator, NULL, &score, &member, &memberlen)) == RL_OK) {
 			if (weights) {
 				score *= weights[i - 1];
@@ -1078,6 +1603,7 @@ cleanup:
 
 int rl_zset_pages(struct rlite *db, long page, short *pages)
 {
+	rl_zset_packed *packed;
 	rl_btree *scores;
 	rl_skiplist *skiplist;
 	rl_skiplist_iterator *iterator = NULL;
@@ -1087,11 +1613,16 @@ int rl_zset_pages(struct rlite *db, long page, short *pages)
 	void *tmp;
 	rl_list *levels;
 
-	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, page, &rl_list_type_long, &tmp, 1);
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_zset, page, &rl_list_type_zset, &tmp, 1);
 	levels = tmp;
+	if (IS_PACKED(levels)) {
+		// packed entries live in the levels page itself
+		retval = RL_OK;
+		goto cleanup;
+	}
 	rl_list_pages(db, levels, pages);
 
-	RL_CALL(rl_zset_read, RL_OK, db, page, &scores, &scores_page, &skiplist, &skiplist_page);
+	RL_CALL(rl_zset_read, RL_OK, db, page, &packed, &scores, &scores_page, &skiplist, &skiplist_page);
 	pages[scores_page] = 1;
 	pages[skiplist_page] = 1;
 
@@ -1128,8 +1659,12 @@ int rl_zset_delete(rlite *db, long value_page)
 	int retval;
 	void *tmp;
 	rl_list *levels;
-	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, value_page, &rl_list_type_long, &tmp, 1);
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_zset, value_page, &rl_list_type_zset, &tmp, 1);
 	levels = tmp;
+	if (IS_PACKED(levels)) {
+		RL_CALL(rl_delete, RL_OK, db, value_page);
+		goto cleanup;
+	}
 	RL_CALL(rl_list_get_element, RL_FOUND, db, levels, &tmp, 0);
 	scores_page = *(long *)tmp;
 	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_btree_hash_sha1_double, scores_page, &rl_btree_type_hash_sha1_double, &tmp, 1);
@@ -1142,7 +1677,7 @@ int rl_zset_delete(rlite *db, long value_page)
 	RL_CALL(rl_delete, RL_OK, db, skiplist_page);
 	RL_CALL(rl_btree_delete, RL_OK, db, scores);
 	RL_CALL(rl_delete, RL_OK, db, scores_page);
-	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_list_long, value_page, &rl_list_type_long, &tmp, 1);
+	RL_CALL(rl_read, RL_FOUND, db, &rl_data_type_zset, value_page, &rl_list_type_zset, &tmp, 1);
 	RL_CALL(rl_list_delete, RL_OK, db, tmp);
 	RL_CALL(rl_delete, RL_OK, db, value_page);
 cleanup:
@@ -288,6 +288,13 @@ unsigned long long rl_mstime()
 	return tp.tv_sec * 1000 + tp.tv_usec / 1000;
 }
 
+unsigned long long rl_ustime()
+{
+	struct timeval tp;
+	gettimeofday(&tp, NULL);
+	return ((unsigned long long)tp.tv_sec) * 1000000 + tp.tv_usec;
+}
+
 double rl_strtod(unsigned char *_str, long strlen, unsigned char **_eptr) {
 	double d;
 	char str[40];
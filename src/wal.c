@@ -1,21 +1,84 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
 
 #include "rlite/rlite.h"
 #include "rlite/flock.h"
 #include "rlite/sha1.h"
+#include "rlite/crc32c.h"
+#include "rlite/wal.h"
 
 #ifdef RL_DEBUG
-int rl_search_cache(rlite *db, rl_data_type *type, long page_number, void **obj, long *position, void *context, rl_page **pages, long page_len);
+int rl_search_cache(rlite *db, rl_data_type *type, long page_number, void **obj, long *position, void *context, rl_page **pages, rl_page_index *index);
 #endif
 
+// the last character tells the checksum used, see RL_CHECKSUM_*
 static const char *identifier = "rlwal0.0";
+#define IDENTIFIER_CHECKSUM_POSITION 7
+
+typedef struct {
+	int type;
+	SHA1_CTX sha;
+	uint32_t crc;
+} checksum_ctx;
+
+static void checksum_init(checksum_ctx *ctx, int type)
+{
+	ctx->type = type;
+	if (type == RL_CHECKSUM_CRC32C) {
+		ctx->crc = 0;
+	}
+	else {
+		SHA1Init(&ctx->sha);
+	}
+}
+
+static void checksum_update(checksum_ctx *ctx, const unsigned char *data, size_t len)
+{
+	if (ctx->type == RL_CHECKSUM_CRC32C) {
+		ctx->crc = rl_crc32c(ctx->crc, data, len);
+	}
+	else {
+		SHA1Update(&ctx->sha, data, len);
+	}
+}
+
+// digests take 20 bytes on disk, shorter checksums are padded with zeros
+static void checksum_final(checksum_ctx *ctx, unsigned char *digest)
+{
+	if (ctx->type == RL_CHECKSUM_CRC32C) {
+		memset(digest, 0, 20);
+		digest[0] = ctx->crc >> 24;
+		digest[1] = ctx->crc >> 16;
+		digest[2] = ctx->crc >> 8;
+		digest[3] = ctx->crc;
+	}
+	else {
+		SHA1Final(digest, &ctx->sha);
+	}
+}
+
+static int valid_checksum_type(int type)
+{
+	return type == RL_CHECKSUM_SHA1 || type == RL_CHECKSUM_CRC32C;
+}
 
 static char *get_wal_filename(const char *filename) {
 	return rl_get_filename_with_suffix(filename, ".wal");
 }
 
+static char *get_readers_filename(const char *filename) {
+	return rl_get_filename_with_suffix(filename, ".readers");
+}
+
 static int rl_delete_wal(const char *wal_path) {
 	unlink(wal_path);
 	return RL_OK;
@@ -46,21 +109,55 @@ cleanup:
 	return retval;
 }
 
+// upper bound of consecutive pages written with a single pwritev
+#define WAL_IOV_MAX 64
+
+/**
+ * Writes a run of consecutive pages starting at `page_number`.
+ */
+static int write_pages_fd(rlite *db, long page_number, struct iovec *iov, int iovcnt)
+{
+	rl_file_driver *driver = db->driver;
+	off_t offset = (off_t)page_number * db->page_size;
+	ssize_t written;
+	while (iovcnt > 0) {
+		written = pwritev(driver->fd, iov, iovcnt, offset);
+		if (written == -1 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			return RL_UNEXPECTED;
+		}
+		offset += written;
+		while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (unsigned char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return RL_OK;
+}
+
 static int rl_apply_wal_data(rlite *db, unsigned char *data, size_t datalen, int skip_check) {
 	if (skip_check == 0) {
 		if (datalen < 36 + (size_t)db->page_size) {
 			// too short to be a valid wal file
 			return RL_UNEXPECTED;
 		}
-		if (memcmp(data, identifier, strlen(identifier))) {
+		if (memcmp(data, identifier, IDENTIFIER_CHECKSUM_POSITION) ||
+				!valid_checksum_type(data[IDENTIFIER_CHECKSUM_POSITION] - '0')) {
 			// expected identifier
 			return RL_UNEXPECTED;
 		}
 		unsigned char digest[20];
-		SHA1_CTX sha;
-		SHA1Init(&sha);
-		SHA1Update(&sha, &data[32], datalen - 32);
-		SHA1Final(digest, &sha);
+		checksum_ctx checksum;
+		checksum_init(&checksum, data[IDENTIFIER_CHECKSUM_POSITION] - '0');
+		checksum_update(&checksum, &data[32], datalen - 32);
+		checksum_final(&checksum, digest);
 		if (memcmp(&data[8], digest, 20) != 0) {
 			// digest mismatch
 			return RL_UNEXPECTED;
@@ -74,10 +171,25 @@ static int rl_apply_wal_data(rlite *db, unsigned char *data, size_t datalen, int
 	position += 4;
 	int readwrite = (driver->mode & RLITE_OPEN_READWRITE) != 0;
 	rl_page *page_obj;
+	struct iovec iov[WAL_IOV_MAX];
+	int iovcnt = 0;
+	long iov_page_number = 0;
 	for (i = 0; i < write_pages_len; i++) {
 		page_number = get_4bytes(&data[position]);
 		position += 4;
-		if (readwrite) {
+		if (readwrite && db->driver_type != RL_FILE_DRIVER) {
+			// pages are sorted, runs of adjacent pages go out in one syscall
+			if (iovcnt > 0 && (iovcnt == WAL_IOV_MAX || iov_page_number + iovcnt != page_number)) {
+				RL_CALL(write_pages_fd, RL_OK, db, iov_page_number, iov, iovcnt);
+				iovcnt = 0;
+			}
+			if (iovcnt == 0) {
+				iov_page_number = page_number;
+			}
+			iov[iovcnt].iov_base = &data[position];
+			iov[iovcnt].iov_len = db->page_size;
+			iovcnt++;
+		} else if (readwrite) {
 			fseek(driver->fp, page_number * db->page_size, SEEK_SET);
 			written = fwrite(&data[position], sizeof(unsigned char), db->page_size, driver->fp);
 			if ((size_t)db->page_size != written) {
@@ -96,7 +208,6 @@ static int rl_apply_wal_data(rlite *db, unsigned char *data, size_t datalen, int
 			 */
 
 			// TODO: better cleanup on OOM
-			rl_ensure_pages(db);
 			RL_MALLOC(page_obj, sizeof(*page_obj));
 #ifdef RL_DEBUG
 			RL_MALLOC(page_obj->serialized_data, db->page_size * sizeof(unsigned char));
@@ -104,40 +215,42 @@ static int rl_apply_wal_data(rlite *db, unsigned char *data, size_t datalen, int
 #endif
 			page_obj->page_number = page_number;
 			page_obj->type = NULL;
+			page_obj->dirty_checksum_valid = 0;
 			page_obj->obj = rl_malloc(sizeof(unsigned char) * db->page_size);
 			if (page_obj->obj == NULL) {
 				rl_free(page_obj);
 				return RL_OUT_OF_MEMORY;
 			}
 			memcpy(page_obj->obj, &data[position], db->page_size);
-			db->read_pages[db->read_pages_len] = page_obj;
-			db->read_pages_len++;
+			RL_CALL(rl_add_read_page, RL_OK, db, page_obj);
 		}
 		if (page_number == 0) {
+			// the page size might change, the header cannot share a write
+			if (iovcnt > 0) {
+				RL_CALL(write_pages_fd, RL_OK, db, iov_page_number, iov, iovcnt);
+				iovcnt = 0;
+			}
 			// header has changed! need to parse it before using db->page_size
 			RL_CALL(rl_header_deserialize, RL_OK, db, NULL, NULL, &data[position]);
 		}
 		position += db->page_size;
 	}
+	if (iovcnt > 0) {
+		RL_CALL(write_pages_fd, RL_OK, db, iov_page_number, iov, iovcnt);
+	}
 	retval = RL_OK;
 cleanup:
 	return retval;
 }
 
-static int create_wal_data(rlite *db, unsigned char **_data, size_t *_datalen) {
-	// 20 (sha1) + 8 (header) + 4 (number of pages)
-	size_t datalen = db->write_pages_len * (db->page_size + 4) + 32;
-	unsigned char *data;
-	int i, retval = RL_OK;
+/**
+ * Writes every page in write_pages as its page number followed by its data.
+ */
+static int serialize_frames(rlite *db, unsigned char *data, checksum_ctx *checksum) {
+	int retval = RL_OK;
+	long i;
+	size_t position = 0;
 	rl_page *page;
-	SHA1_CTX sha;
-	SHA1Init(&sha);
-	RL_MALLOC(data, sizeof(char) * datalen);
-	size_t position = strlen(identifier);
-	memcpy(data, identifier, position);
-	position += 20; // leaving space blank for sha1
-	put_4bytes(&data[position], db->write_pages_len);
-	position += 4;
 	for (i = 0; i < db->write_pages_len; i++) {
 		page = db->write_pages[i];
 		put_4bytes(&data[position], page->page_number);
@@ -145,11 +258,31 @@ static int create_wal_data(rlite *db, unsigned char **_data, size_t *_datalen) {
 		memset(&data[position], 0, db->page_size);
 		if (page->type) {
 			retval = page->type->serialize(db, page->obj, &data[position]);
+			db->stats.bytes_serialized += db->page_size;
 		}
+		db->stats.pages_written++;
 		position += db->page_size;
-		SHA1Update(&sha, &data[position - db->page_size - 4], db->page_size + 4);
+		checksum_update(checksum, &data[position - db->page_size - 4], db->page_size + 4);
 	}
-	SHA1Final(&data[strlen(identifier)], &sha);
+	return retval;
+}
+
+static int create_wal_data(rlite *db, unsigned char **_data, size_t *_datalen) {
+	// 20 (sha1) + 8 (header) + 4 (number of pages)
+	size_t datalen = db->write_pages_len * (db->page_size + 4) + 32;
+	unsigned char *data;
+	int retval = RL_OK;
+	checksum_ctx checksum;
+	RL_MALLOC(data, sizeof(char) * datalen);
+	size_t position = strlen(identifier);
+	memcpy(data, identifier, position);
+	data[IDENTIFIER_CHECKSUM_POSITION] = '0' + db->wal_checksum;
+	position += 20; // leaving space blank for the digest
+	put_4bytes(&data[position], db->write_pages_len);
+	checksum_init(&checksum, db->wal_checksum);
+	position += 4;
+	retval = serialize_frames(db, &data[position], &checksum);
+	checksum_final(&checksum, &data[strlen(identifier)]);
 	*_data = data;
 	*_datalen = datalen;
 cleanup:
@@ -163,6 +296,7 @@ static int rl_write_wal_file(FILE *fp, rlite *db, unsigned char **_data, size_t
 	int retval;
 	unsigned char *data = NULL;
 	size_t datalen = 0;
+	RL_CALL(rl_sort_write_pages, RL_OK, db);
 	RL_CALL(create_wal_data, RL_OK, db, &data, &datalen);
 	fwrite(data, sizeof(char), datalen, fp);
 cleanup:
@@ -187,6 +321,827 @@ cleanup:
 	return retval;
 }
 
+#ifdef __APPLE__
+#define rl_fdatasync fsync
+#else
+#define rl_fdatasync fdatasync
+#endif
+
+// handles in this process writing to the same file share their sync state
+static pthread_mutex_t sync_groups_lock = PTHREAD_MUTEX_INITIALIZER;
+static rl_sync_group *sync_groups = NULL;
+
+static int sync_fd(int fd)
+{
+	while (rl_fdatasync(fd) != 0) {
+		if (errno != EINTR) {
+			return RL_UNEXPECTED;
+		}
+	}
+	return RL_OK;
+}
+
+static int sync_path(const char *path)
+{
+	int retval, fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return RL_UNEXPECTED;
+	}
+	retval = sync_fd(fd);
+	close(fd);
+	return retval;
+}
+
+/**
+ * The wal file is created on every commit, its directory entry needs to be
+ * durable too or a crash could leave a half applied database without a wal.
+ */
+static int sync_parent_directory(const char *path)
+{
+	int retval;
+	char *dir = NULL;
+	const char *slash = strrchr(path, '/');
+	if (slash == NULL) {
+		return sync_path(".");
+	}
+	if (slash == path) {
+		return sync_path("/");
+	}
+	RL_MALLOC(dir, sizeof(char) * (slash - path + 1));
+	memcpy(dir, path, slash - path);
+	dir[slash - path] = 0;
+	retval = sync_path(dir);
+cleanup:
+	rl_free(dir);
+	return retval;
+}
+
+static int sync_database(rlite *db)
+{
+	rl_file_driver *driver = db->driver;
+	if (driver->fp) {
+		fflush(driver->fp);
+		return sync_fd(fileno(driver->fp));
+	}
+	return sync_fd(driver->fd);
+}
+
+static long elapsed_ms(struct timeval *since)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_usec - since->tv_usec) / 1000;
+}
+
+/**
+ * Called after a commit was appended to the log. Syncs the log once enough
+ * commits or time have accumulated since the last sync by any handle on the
+ * file. Other committers do not wait for that sync, their commits are only
+ * durable once some later commit triggers it.
+ */
+static int sync_group_commit(rlite *db)
+{
+	int retval = RL_OK;
+	rl_sync_group *group = db->sync_group;
+	// this handle's reference keeps the group alive without sync_groups_lock
+	pthread_mutex_lock(&group->lock);
+	group->pending++;
+	if ((db->sync_group_commits > 0 && group->pending >= db->sync_group_commits) ||
+			(db->sync_group_ms > 0 && elapsed_ms(&group->last_sync) >= db->sync_group_ms)) {
+		retval = sync_fd(db->wal_log->fd);
+		if (retval == RL_OK) {
+			group->pending = 0;
+			gettimeofday(&group->last_sync, NULL);
+		}
+	}
+	pthread_mutex_unlock(&group->lock);
+	return retval;
+}
+
+static int sync_group_release(rlite *db)
+{
+	int retval = RL_OK, last;
+	rl_sync_group *group = db->sync_group, **link;
+	char *wal_path;
+	if (!group) {
+		return RL_OK;
+	}
+	pthread_mutex_lock(&sync_groups_lock);
+	last = --group->refs == 0;
+	if (last) {
+		for (link = &sync_groups; *link != group; link = &(*link)->next);
+		*link = group->next;
+	}
+	pthread_mutex_unlock(&sync_groups_lock);
+	db->sync_group = NULL;
+	if (!last) {
+		return RL_OK;
+	}
+
+	// unlinked and unreferenced, the group is only ours now
+	if (group->pending > 0) {
+		// nobody else will flush these commits
+		if (db->wal_log) {
+			retval = sync_fd(db->wal_log->fd);
+		}
+		else {
+			// appended by other handles; gone if they checkpointed it
+			wal_path = get_wal_filename(((rl_file_driver *)db->driver)->filename);
+			if (wal_path == NULL) {
+				retval = RL_OUT_OF_MEMORY;
+			}
+			else if (access(wal_path, F_OK) == 0) {
+				retval = sync_path(wal_path);
+			}
+			rl_free(wal_path);
+		}
+	}
+	pthread_mutex_destroy(&group->lock);
+	rl_free(group);
+	return retval;
+}
+
+static int sync_group_acquire(rlite *db)
+{
+	int retval = RL_OK;
+	rl_sync_group *group;
+	struct stat st;
+	if (stat(((rl_file_driver *)db->driver)->filename, &st) != 0) {
+		return RL_UNEXPECTED;
+	}
+	pthread_mutex_lock(&sync_groups_lock);
+	for (group = sync_groups; group; group = group->next) {
+		if (group->dev == st.st_dev && group->ino == st.st_ino) {
+			break;
+		}
+	}
+	if (!group) {
+		group = rl_malloc(sizeof(*group));
+		if (!group) {
+			retval = RL_OUT_OF_MEMORY;
+			goto cleanup;
+		}
+		group->dev = st.st_dev;
+		group->ino = st.st_ino;
+		group->refs = 0;
+		pthread_mutex_init(&group->lock, NULL);
+		group->pending = 0;
+		gettimeofday(&group->last_sync, NULL);
+		group->next = sync_groups;
+		sync_groups = group;
+	}
+	group->refs++;
+	db->sync_group = group;
+cleanup:
+	pthread_mutex_unlock(&sync_groups_lock);
+	return retval;
+}
+
+int rl_set_sync_mode(rlite *db, int mode, long group_ms, long group_commits)
+{
+	int retval = RL_OK;
+	if (mode != RLITE_SYNC_NONE && mode != RLITE_SYNC_FULL && mode != RLITE_SYNC_GROUP) {
+		return RL_INVALID_PARAMETERS;
+	}
+	if (mode == RLITE_SYNC_GROUP && group_ms <= 0 && group_commits <= 0) {
+		return RL_INVALID_PARAMETERS;
+	}
+	if (!RL_IS_FILE_DRIVER(db)) {
+		// nothing to sync
+		db->sync_mode = mode;
+		goto cleanup;
+	}
+	RL_CALL(sync_group_release, RL_OK, db);
+	if (mode == RLITE_SYNC_GROUP) {
+		RL_CALL(sync_group_acquire, RL_OK, db);
+	}
+	db->sync_mode = mode;
+	db->sync_group_ms = group_ms;
+	db->sync_group_commits = group_commits;
+cleanup:
+	return retval;
+}
+
+int rl_close_sync(rlite *db)
+{
+	return sync_group_release(db);
+}
+
+/**
+ * Append-only log, see doc/wal-format.md.
+ * Every commit appends its pages as a record, the index maps every page in
+ * the log to the offset of its newest version. Once the log is big enough,
+ * its pages are copied into the database and it starts over with a new
+ * generation, which tells other handles that their index is stale.
+ */
+static const char *log_identifier = "rlwal1.0";
+
+// magic, page size, checksum type, generation
+#define LOG_HEADER_SIZE 24
+// number of pages, digest
+#define LOG_RECORD_HEADER_SIZE 24
+#define LOG_INDEX_EMPTY -1
+
+static int write_all_fd(int fd, unsigned char *data, size_t len, off_t offset)
+{
+	ssize_t written;
+	while (len > 0) {
+		written = pwrite(fd, data, len, offset);
+		if (written == -1 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			return RL_UNEXPECTED;
+		}
+		data += written;
+		len -= written;
+		offset += written;
+	}
+	return RL_OK;
+}
+
+static int read_all_fd(int fd, unsigned char *data, size_t len, off_t offset)
+{
+	ssize_t read;
+	while (len > 0) {
+		read = pread(fd, data, len, offset);
+		if (read == -1 && errno == EINTR) {
+			continue;
+		}
+		if (read <= 0) {
+			return RL_NOT_FOUND;
+		}
+		data += read;
+		len -= read;
+		offset += read;
+	}
+	return RL_OK;
+}
+
+static void log_index_clear(rl_wal_log *log)
+{
+	long i;
+	for (i = 0; i < log->index_alloc; i++) {
+		log->index_pages[i] = LOG_INDEX_EMPTY;
+	}
+	log->index_len = 0;
+	log->frames = 0;
+	log->end = LOG_HEADER_SIZE;
+}
+
+static long log_index_slot(rl_wal_log *log, long page_number)
+{
+	long mask = log->index_alloc - 1;
+	long slot = (page_number * 2654435761UL) & mask;
+	while (log->index_pages[slot] != LOG_INDEX_EMPTY && log->index_pages[slot] != page_number) {
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+static int log_index_set(rl_wal_log *log, long page_number, off_t offset)
+{
+	long i, slot, old_alloc = log->index_alloc;
+	long *old_pages = log->index_pages;
+	off_t *old_offsets = log->index_offsets;
+	if ((log->index_len + 1) * 2 > log->index_alloc) {
+		// keep the load factor under a half so probes stay short
+		log->index_alloc *= 2;
+		log->index_pages = rl_malloc(sizeof(long) * log->index_alloc);
+		log->index_offsets = rl_malloc(sizeof(off_t) * log->index_alloc);
+		if (!log->index_pages || !log->index_offsets) {
+			rl_free(log->index_pages);
+			rl_free(log->index_offsets);
+			log->index_pages = old_pages;
+			log->index_offsets = old_offsets;
+			log->index_alloc = old_alloc;
+			return RL_OUT_OF_MEMORY;
+		}
+		for (i = 0; i < log->index_alloc; i++) {
+			log->index_pages[i] = LOG_INDEX_EMPTY;
+		}
+		for (i = 0; i < old_alloc; i++) {
+			if (old_pages[i] != LOG_INDEX_EMPTY) {
+				slot = log_index_slot(log, old_pages[i]);
+				log->index_pages[slot] = old_pages[i];
+				log->index_offsets[slot] = old_offsets[i];
+			}
+		}
+		rl_free(old_pages);
+		rl_free(old_offsets);
+	}
+	slot = log_index_slot(log, page_number);
+	if (log->index_pages[slot] == LOG_INDEX_EMPTY) {
+		log->index_pages[slot] = page_number;
+		log->index_len++;
+	}
+	log->index_offsets[slot] = offset;
+	return RL_OK;
+}
+
+static int log_index_get(rl_wal_log *log, long page_number, off_t *offset)
+{
+	long slot = log_index_slot(log, page_number);
+	if (log->index_pages[slot] == LOG_INDEX_EMPTY) {
+		return RL_NOT_FOUND;
+	}
+	*offset = log->index_offsets[slot];
+	return RL_FOUND;
+}
+
+static void log_destroy(rl_wal_log *log)
+{
+	if (!log) {
+		return;
+	}
+	if (log->fd != -1) {
+		close(log->fd);
+	}
+	rl_free(log->index_pages);
+	rl_free(log->index_offsets);
+	rl_free(log);
+}
+
+static int log_create(rl_wal_log **_log, int fd)
+{
+	int retval = RL_OK;
+	rl_wal_log *log;
+	RL_MALLOC(log, sizeof(*log));
+	log->fd = fd;
+	log->generation = 0;
+	log->page_size = 0;
+	log->checksum = RL_CHECKSUM_SHA1;
+	log->index_alloc = 64;
+	log->index_pages = rl_malloc(sizeof(long) * log->index_alloc);
+	log->index_offsets = rl_malloc(sizeof(off_t) * log->index_alloc);
+	if (!log->index_pages || !log->index_offsets) {
+		log->fd = -1;
+		log_destroy(log);
+		retval = RL_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+	log_index_clear(log);
+	*_log = log;
+cleanup:
+	return retval;
+}
+
+static int log_write_header(rl_wal_log *log)
+{
+	unsigned char header[LOG_HEADER_SIZE];
+	memcpy(header, log_identifier, 8);
+	put_4bytes(&header[8], log->page_size);
+	put_4bytes(&header[12], log->checksum);
+	put_8bytes(&header[16], log->generation);
+	return write_all_fd(log->fd, header, LOG_HEADER_SIZE, 0);
+}
+
+// the record digest covers the generation too, not just the frames
+static void log_record_checksum_init(rl_wal_log *log, checksum_ctx *checksum)
+{
+	unsigned char generation[8];
+	put_8bytes(generation, log->generation);
+	checksum_init(checksum, log->checksum);
+	checksum_update(checksum, generation, 8);
+}
+
+/**
+ * Indexes the records appended since the last time the log was read.
+ * A record that is incomplete or does not match its digest was being
+ * written when a process crashed; it and anything after it are ignored.
+ */
+static int log_read_records(rl_wal_log *log, off_t size)
+{
+	int retval = RL_OK;
+	unsigned char *data = NULL, digest[20];
+	size_t datalen = size - log->end, position = 0, frameslen;
+	checksum_ctx checksum;
+	long i, pages;
+	RL_MALLOC(data, sizeof(unsigned char) * datalen);
+	RL_CALL(read_all_fd, RL_OK, log->fd, data, datalen, log->end);
+	while (position + LOG_RECORD_HEADER_SIZE <= datalen) {
+		pages = get_4bytes(&data[position]);
+		frameslen = pages * (log->page_size + 4);
+		if (pages <= 0 || position + LOG_RECORD_HEADER_SIZE + frameslen > datalen) {
+			break;
+		}
+		log_record_checksum_init(log, &checksum);
+		checksum_update(&checksum, &data[position + LOG_RECORD_HEADER_SIZE], frameslen);
+		checksum_final(&checksum, digest);
+		if (memcmp(digest, &data[position + 4], 20) != 0) {
+			break;
+		}
+		position += LOG_RECORD_HEADER_SIZE;
+		for (i = 0; i < pages; i++) {
+			RL_CALL(log_index_set, RL_OK, log, get_4bytes(&data[position]), log->end + position + 4);
+			position += log->page_size + 4;
+		}
+		log->frames += pages;
+		log->end += LOG_RECORD_HEADER_SIZE + frameslen;
+		// from now on, offsets are relative to the new end
+		memmove(data, &data[position], datalen - position);
+		datalen -= position;
+		position = 0;
+	}
+cleanup:
+	rl_free(data);
+	return retval;
+}
+
+/**
+ * Whether `fd` is still the log at `wal_path`. The last handle to close the
+ * log deletes it; anyone who opened it before that and locked it after is
+ * left with a file nobody else will ever read.
+ */
+static int log_is_current(int fd, const char *wal_path)
+{
+	struct stat fd_st, path_st;
+	if (fstat(fd, &fd_st) != 0 || fd_st.st_nlink == 0 || stat(wal_path, &path_st) != 0) {
+		return 0;
+	}
+	return fd_st.st_dev == path_st.st_dev && fd_st.st_ino == path_st.st_ino;
+}
+
+int rl_wal_log_refresh(rlite *db)
+{
+	int retval = RL_OK, fd = -1;
+	rl_file_driver *driver = db->driver;
+	unsigned char header[LOG_HEADER_SIZE];
+	unsigned long long generation;
+	char *wal_path = NULL;
+	struct stat st;
+	rl_wal_log *log = db->wal_log;
+
+	wal_path = get_wal_filename(driver->filename);
+	if (wal_path == NULL) {
+		retval = RL_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+	if (log && !log_is_current(log->fd, wal_path)) {
+		// deleted, and checkpointed, by the last handle that closed it
+		log_destroy(log);
+		db->wal_log = log = NULL;
+	}
+reopen:
+	if (!log) {
+		fd = open(wal_path, (driver->mode & RLITE_OPEN_READWRITE) ? O_RDWR : O_RDONLY);
+		if (fd == -1) {
+			// no wal, or nothing we can use
+			goto cleanup;
+		}
+	}
+	else {
+		fd = log->fd;
+	}
+	if (fstat(fd, &st) != 0) {
+		retval = RL_UNEXPECTED;
+		goto cleanup;
+	}
+	if (st.st_size < LOG_HEADER_SIZE ||
+			read_all_fd(fd, header, LOG_HEADER_SIZE, 0) != RL_OK ||
+			memcmp(header, log_identifier, 8) != 0) {
+		// a wal from a crashed commit, rl_apply_wal takes care of it
+		goto cleanup;
+	}
+	generation = get_8bytes(&header[16]);
+	if (!log) {
+		// held while the log is in use, see rl_close_wal_log
+		RL_CALL(rl_flock_fd, RL_OK, fd, RLITE_FLOCK_SH);
+		if (!log_is_current(fd, wal_path)) {
+			// waited for a handle that was closing it
+			close(fd);
+			fd = -1;
+			goto reopen;
+		}
+		RL_CALL(log_create, RL_OK, &log, fd);
+		db->wal_log = log;
+		fd = -1;
+	}
+	else if (generation != log->generation) {
+		// checkpointed by someone else
+		log_index_clear(log);
+	}
+	log->generation = generation;
+	log->page_size = get_4bytes(&header[8]);
+	log->checksum = get_4bytes(&header[12]);
+	if (!valid_checksum_type(log->checksum)) {
+		retval = RL_UNEXPECTED;
+		goto cleanup;
+	}
+	if (st.st_size > log->end) {
+		RL_CALL(log_read_records, RL_OK, log, st.st_size);
+	}
+	log->size = st.st_size;
+cleanup:
+	if (fd != -1 && !db->wal_log) {
+		close(fd);
+	}
+	rl_free(wal_path);
+	return retval;
+}
+
+int rl_wal_log_read(rlite *db, long page_number, unsigned char *data, size_t len)
+{
+	off_t offset;
+	rl_wal_log *log = db->wal_log;
+	if (!log || log_index_get(log, page_number, &offset) != RL_FOUND) {
+		return RL_NOT_FOUND;
+	}
+	if (read_all_fd(log->fd, data, len, offset) != RL_OK) {
+		return RL_UNEXPECTED;
+	}
+	return RL_FOUND;
+}
+
+static int log_sync(rlite *db)
+{
+	if (db->sync_mode == RLITE_SYNC_FULL) {
+		return sync_fd(db->wal_log->fd);
+	}
+	if (db->sync_mode == RLITE_SYNC_GROUP) {
+		return sync_group_commit(db);
+	}
+	return RL_OK;
+}
+
+static int log_start(rlite *db)
+{
+	int retval = RL_OK, fd;
+	rl_file_driver *driver = db->driver;
+	char *wal_path = get_wal_filename(driver->filename);
+	if (wal_path == NULL) {
+		retval = RL_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+	fd = open(wal_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1) {
+		retval = RL_UNEXPECTED;
+		goto cleanup;
+	}
+	if (rl_flock_fd(fd, RLITE_FLOCK_SH) != RL_OK) {
+		close(fd);
+		retval = RL_UNEXPECTED;
+		goto cleanup;
+	}
+	RL_CALL(log_create, RL_OK, &db->wal_log, fd);
+	db->wal_log->generation = ((unsigned long long)time(NULL) << 32) ^ (unsigned long long)rand();
+	db->wal_log->page_size = db->page_size;
+	db->wal_log->checksum = db->wal_checksum;
+	RL_CALL(log_write_header, RL_OK, db->wal_log);
+	db->wal_log->size = LOG_HEADER_SIZE;
+	if (db->sync_mode != RLITE_SYNC_NONE) {
+		RL_CALL(sync_fd, RL_OK, fd);
+		RL_CALL(sync_parent_directory, RL_OK, wal_path);
+	}
+cleanup:
+	if (retval != RL_OK && db->wal_log) {
+		log_destroy(db->wal_log);
+		db->wal_log = NULL;
+	}
+	rl_free(wal_path);
+	return retval;
+}
+
+static int write_database_page(rlite *db, long page_number, unsigned char *data)
+{
+	rl_file_driver *driver = db->driver;
+	if (db->driver_type != RL_FILE_DRIVER) {
+		return write_all_fd(driver->fd, data, db->page_size, (off_t)page_number * db->page_size);
+	}
+	fseek(driver->fp, page_number * db->page_size, SEEK_SET);
+	if (fwrite(data, sizeof(unsigned char), db->page_size, driver->fp) != (size_t)db->page_size) {
+		return RL_UNEXPECTED;
+	}
+	return RL_OK;
+}
+
+/**
+ * Opens the file snapshot readers hold a shared lock on, created on first
+ * use. See rl_wal_log_snapshot.
+ */
+static int open_readers(rlite *db)
+{
+	rl_file_driver *driver = db->driver;
+	char *readers_path;
+	if (db->snapshot_fd != -1) {
+		return RL_OK;
+	}
+	readers_path = get_readers_filename(driver->filename);
+	if (readers_path == NULL) {
+		return RL_OUT_OF_MEMORY;
+	}
+	db->snapshot_fd = open(readers_path, O_RDWR | O_CREAT, 0666);
+	if (db->snapshot_fd == -1) {
+		// flock does not need write access
+		db->snapshot_fd = open(readers_path, O_RDONLY);
+	}
+	rl_free(readers_path);
+	return db->snapshot_fd == -1 ? RL_UNEXPECTED : RL_OK;
+}
+
+/**
+ * Starts a read transaction that does not lock the database file. It sees
+ * the database and the records of the wal log as they are now, writers keep
+ * appending to the log, and checkpoints wait until the last snapshot is
+ * released since they would overwrite pages it still reads.
+ * Returns RL_NOT_FOUND, holding nothing, when there is no log to pin; the
+ * caller then has to lock the file as usual.
+ */
+int rl_wal_log_snapshot(rlite *db)
+{
+	int retval;
+	rl_file_driver *driver = db->driver;
+	if (!db->wal_log && (driver->mode & RLITE_OPEN_WAL_LOG) == 0) {
+		return RL_NOT_FOUND;
+	}
+	RL_CALL(open_readers, RL_OK, db);
+	// waits for a checkpoint in progress
+	RL_CALL(rl_flock_fd, RL_OK, db->snapshot_fd, RLITE_FLOCK_SH);
+	retval = rl_wal_log_refresh(db);
+	if (retval == RL_OK && !db->wal_log) {
+		retval = RL_NOT_FOUND;
+	}
+	if (retval != RL_OK) {
+		rl_flock_fd(db->snapshot_fd, RLITE_FLOCK_UN);
+		goto cleanup;
+	}
+	db->snapshot = 1;
+cleanup:
+	return retval;
+}
+
+int rl_wal_log_release_snapshot(rlite *db)
+{
+	if (!db->snapshot) {
+		return RL_OK;
+	}
+	db->snapshot = 0;
+	return rl_flock_fd(db->snapshot_fd, RLITE_FLOCK_UN);
+}
+
+/**
+ * Copies the log into the database. Returns RL_NOT_FOUND without doing
+ * anything while a snapshot reader still needs the database as it is.
+ */
+int rl_wal_checkpoint(rlite *db)
+{
+	int retval = RL_OK, readers_locked = 0;
+	long i;
+	unsigned char *data = NULL;
+	rl_wal_log *log = db->wal_log;
+	rl_file_driver *driver;
+	if (!log || log->frames == 0) {
+		goto cleanup;
+	}
+	driver = db->driver;
+	if ((driver->mode & RLITE_OPEN_READWRITE) == 0) {
+		retval = RL_INVALID_STATE;
+		goto cleanup;
+	}
+	RL_CALL(open_readers, RL_OK, db);
+	RL_CALL(rl_flock_fd, RL_OK, db->snapshot_fd, RLITE_FLOCK_EX | RLITE_FLOCK_NB);
+	readers_locked = 1;
+	RL_CALL(rl_lock_exclusive, RL_OK, db);
+	if (db->sync_mode != RLITE_SYNC_NONE) {
+		// the log must be complete on disk before the database is touched
+		RL_CALL(sync_fd, RL_OK, log->fd);
+	}
+	RL_MALLOC(data, sizeof(unsigned char) * log->page_size);
+	for (i = 0; i < log->index_alloc; i++) {
+		if (log->index_pages[i] == LOG_INDEX_EMPTY) {
+			continue;
+		}
+		RL_CALL(read_all_fd, RL_OK, log->fd, data, log->page_size, log->index_offsets[i]);
+		RL_CALL(write_database_page, RL_OK, db, log->index_pages[i], data);
+	}
+	if (driver->fp) {
+		fflush(driver->fp);
+	}
+	if (db->sync_mode != RLITE_SYNC_NONE) {
+		RL_CALL(sync_database, RL_OK, db);
+	}
+	log->generation++;
+	log->page_size = db->page_size;
+	RL_CALL(log_write_header, RL_OK, log);
+	if (ftruncate(log->fd, LOG_HEADER_SIZE) != 0) {
+		retval = RL_UNEXPECTED;
+		goto cleanup;
+	}
+	log->size = LOG_HEADER_SIZE;
+	log_index_clear(log);
+cleanup:
+	if (readers_locked) {
+		rl_flock_fd(db->snapshot_fd, RLITE_FLOCK_UN);
+	}
+	rl_free(data);
+	return retval;
+}
+
+static int log_commit(rlite *db)
+{
+	int retval = RL_OK;
+	long i;
+	unsigned char *data = NULL;
+	size_t datalen, frameslen;
+	checksum_ctx checksum;
+	rl_wal_log *log;
+	unsigned long long start = rl_ustime();
+
+	if (db->write_pages_len == 0) {
+		goto cleanup;
+	}
+	if (!db->wal_log) {
+		RL_CALL(log_start, RL_OK, db);
+	}
+	log = db->wal_log;
+	if (log->page_size != db->page_size) {
+		retval = RL_UNEXPECTED;
+		goto cleanup;
+	}
+	frameslen = db->write_pages_len * (db->page_size + 4);
+	datalen = LOG_RECORD_HEADER_SIZE + frameslen;
+	RL_MALLOC(data, sizeof(unsigned char) * datalen);
+	put_4bytes(data, db->write_pages_len);
+	log_record_checksum_init(log, &checksum);
+	RL_CALL(serialize_frames, RL_OK, db, &data[LOG_RECORD_HEADER_SIZE], &checksum);
+	checksum_final(&checksum, &data[4]);
+
+	if (log->size != log->end) {
+		// leftovers of a crashed append
+		if (ftruncate(log->fd, log->end) != 0) {
+			retval = RL_UNEXPECTED;
+			goto cleanup;
+		}
+	}
+	RL_CALL(write_all_fd, RL_OK, log->fd, data, datalen, log->end);
+	for (i = 0; i < db->write_pages_len; i++) {
+		RL_CALL(log_index_set, RL_OK, log, db->write_pages[i]->page_number, log->end + LOG_RECORD_HEADER_SIZE + i * (db->page_size + 4) + 4);
+	}
+	log->end += datalen;
+	log->size = log->end;
+	log->frames += db->write_pages_len;
+	RL_CALL(log_sync, RL_OK, db);
+	db->stats.wal_write_us += rl_ustime() - start;
+
+	if (log->frames >= db->wal_checkpoint_pages) {
+		start = rl_ustime();
+		retval = rl_wal_checkpoint(db);
+		db->stats.wal_apply_us += rl_ustime() - start;
+		if (retval == RL_NOT_FOUND) {
+			// snapshot readers, a later commit tries again
+			retval = RL_OK;
+		}
+		else if (retval != RL_OK) {
+			goto cleanup;
+		}
+	}
+cleanup:
+	rl_free(data);
+	return retval;
+}
+
+/**
+ * Every handle holds a shared lock on the log while using it. The last one
+ * to close it, if it is allowed to write, moves the log into the database
+ * and removes it. When `checkpoint` is set, the caller must hold the writer
+ * lock.
+ * The readers file is never removed: a snapshot reader may have it open
+ * already, and would lock a file the next checkpoint does not look at.
+ */
+int rl_close_wal_log(rlite *db, int checkpoint)
+{
+	int retval = RL_OK;
+	rl_file_driver *driver = db->driver;
+	rl_wal_log *log = db->wal_log;
+	char *wal_path = NULL;
+	if (!log) {
+		goto cleanup;
+	}
+	// locking the database first keeps out readers that would otherwise
+	// hold it while waiting for the log
+	if (!checkpoint || (driver->mode & RLITE_OPEN_READWRITE) == 0 ||
+			rl_lock_exclusive(db) != RL_OK ||
+			rl_flock_fd(log->fd, RLITE_FLOCK_EX | RLITE_FLOCK_NB) != RL_OK) {
+		goto cleanup;
+	}
+	wal_path = get_wal_filename(driver->filename);
+	if (wal_path == NULL) {
+		retval = RL_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+	RL_CALL(rl_wal_checkpoint, RL_OK, db);
+	RL_CALL(rl_delete_wal, RL_OK, wal_path);
+cleanup:
+	log_destroy(log);
+	db->wal_log = NULL;
+	if (db->snapshot_fd != -1) {
+		close(db->snapshot_fd);
+		db->snapshot_fd = -1;
+	}
+	rl_free(wal_path);
+	return retval;
+}
+
 int rl_write_apply_wal(rlite *db) {
 	FILE *fp = NULL;
 	int retval = RL_OK;
@@ -195,6 +1150,7 @@ int rl_write_apply_wal(rlite *db) {
 	char *wal_path = NULL;
 	unsigned char *data = NULL;
 	size_t datalen;
+	unsigned long long start;
 #ifdef RL_DEBUG
 	for (i = 0; i < db->read_pages_len; i++) {
 		RL_MALLOC(data, db->page_size * sizeof(unsigned char));
@@ -211,7 +1167,7 @@ int rl_write_apply_wal(rlite *db) {
 					fprintf(stderr, "Different data in position %ld (expected %d, got %d)\n", i, page->serialized_data[i], data[i]);
 				}
 			}
-			retval = rl_search_cache(db, page->type, page->page_number, NULL, NULL, NULL, db->write_pages, db->write_pages_len);
+			retval = rl_search_cache(db, page->type, page->page_number, NULL, NULL, NULL, db->write_pages, &db->write_pages_index);
 			if (retval == RL_FOUND) {
 				fprintf(stderr, "Page found in write_pages\n");
 			}
@@ -224,13 +1180,21 @@ int rl_write_apply_wal(rlite *db) {
 		data = NULL;
 	}
 #endif
-	if (db->driver_type == RL_FILE_DRIVER) {
+	if (RL_IS_FILE_DRIVER(db) && (db->wal_log || db->sync_mode == RLITE_SYNC_GROUP ||
+				(((rl_file_driver *)db->driver)->mode & RLITE_OPEN_WAL_LOG))) {
+		// once a log exists, every writer has to append to it
+		// group syncs need it too: records that did not reach the disk are
+		// dropped as a whole, while pages written in place would be torn
+		RL_CALL(log_commit, RL_OK, db);
+	}
+	else if (RL_IS_FILE_DRIVER(db) && db->write_pages_len > 0) {
 		rl_file_driver *driver = db->driver;
 		wal_path = get_wal_filename(driver->filename);
 		if (wal_path == NULL) {
 			retval = RL_OUT_OF_MEMORY;
 			goto cleanup;
 		}
+		start = rl_ustime();
 		fp = fopen(wal_path, "wb");
 		if (fp == NULL) {
 			retval = RL_UNEXPECTED;
@@ -238,19 +1202,33 @@ int rl_write_apply_wal(rlite *db) {
 		}
 		RL_CALL(rl_flock, RL_OK, fp, RLITE_FLOCK_EX);
 		RL_CALL(rl_write_wal_file, RL_OK, fp, db, &data, &datalen);
+		if (db->sync_mode == RLITE_SYNC_FULL) {
+			// the wal must be on disk before the database is touched
+			fflush(fp);
+			RL_CALL(sync_fd, RL_OK, fileno(fp));
+			RL_CALL(sync_parent_directory, RL_OK, wal_path);
+		}
+		db->stats.wal_write_us += rl_ustime() - start;
+		start = rl_ustime();
 		RL_CALL(rl_apply_wal_data, RL_OK, db, data, datalen, 1);
+		if (db->sync_mode == RLITE_SYNC_FULL) {
+			// and the database before the wal goes away
+			RL_CALL(sync_database, RL_OK, db);
+		}
 		ftruncate(fileno(fp), 0);
 		fclose(fp);
 		fp = NULL;
 		RL_CALL(rl_delete_wal, RL_OK, wal_path);
-		if (db->write_pages_len > 0) {
+		if (db->write_pages_len > 0 && driver->fp) {
 			fflush(driver->fp);
 		}
+		db->stats.wal_apply_us += rl_ustime() - start;
 		rl_free(data);
 		data = NULL;
 	}
 	else if (db->driver_type == RL_MEMORY_DRIVER) {
 		rl_memory_driver *driver = db->driver;
+		start = rl_ustime();
 		if (db->write_pages_len > 0) {
 			page = db->write_pages[db->write_pages_len - 1];
 			if ((page->page_number + 1) * db->page_size > driver->datalen) {
@@ -269,8 +1247,11 @@ int rl_write_apply_wal(rlite *db) {
 			memset(&driver->data[page_number * db->page_size], 0, db->page_size);
 			if (page->type) {
 				retval = page->type->serialize(db, page->obj, (unsigned char *)&driver->data[page_number * db->page_size]);
+				db->stats.bytes_serialized += db->page_size;
 			}
+			db->stats.pages_written++;
 		}
+		db->stats.wal_apply_us += rl_ustime() - start;
 	}
 cleanup:
 	if (fp) {
@@ -286,7 +1267,12 @@ int rl_apply_wal(rlite *db) {
 	int retval;
 	unsigned char *data = NULL;
 	size_t datalen;
-	char *wal_path = get_wal_filename(driver->filename);
+	char *wal_path = NULL;
+	if (db->wal_log) {
+		// not a crashed commit, rl_wal_log_refresh already indexed it
+		return RL_OK;
+	}
+	wal_path = get_wal_filename(driver->filename);
 	if (wal_path == NULL) {
 		retval = RL_OUT_OF_MEMORY;
 		goto cleanup;
@@ -295,7 +1281,15 @@ int rl_apply_wal(rlite *db) {
 		retval = RL_OK;
 		goto cleanup;
 	}
+	if (db->read_transaction && (driver->mode & RLITE_OPEN_READWRITE) != 0) {
+		// recovering writes to the database, a shared lock is not enough
+		retval = RL_INVALID_STATE;
+		goto cleanup;
+	}
 
+	if ((driver->mode & RLITE_OPEN_READWRITE) != 0) {
+		RL_CALL(rl_lock_exclusive, RL_OK, db);
+	}
 	RL_CALL(rl_read_wal, RL_OK, wal_path, &data, &datalen);
 	if (data != NULL) {
 		// regardless the data applies or not, the wal file needs to go away
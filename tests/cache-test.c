@@ -0,0 +1,295 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "util.h"
+#include "../src/rlite/rlite.h"
+#include "../src/rlite/cache.h"
+#include "../src/rlite/flock.h"
+
+static const char *db_path = "rlite-test.rld";
+
+TEST test_cache_survives_commit(int file)
+{
+	int retval;
+	rlite *db = NULL;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, file, 1);
+
+	unsigned char *key = UNSIGN("my key"), *testvalue;
+	long keylen = strlen((char *)key), testvaluelen;
+	unsigned char *value = UNSIGN("my value");
+	long valuelen = strlen((char *)value);
+
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, value, valuelen, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	ASSERT(db->page_cache->len > 0);
+	ASSERT_EQ(db->read_pages_len, 0);
+
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, key, keylen, &testvalue, &testvaluelen);
+	EXPECT_BYTES(value, valuelen, testvalue, testvaluelen);
+	rl_free(testvalue);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+
+	rl_close(db);
+	PASS();
+}
+
+TEST test_cache_invalidated_by_other_handle()
+{
+	int retval;
+	rlite *db = NULL, *db2 = NULL;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(rl_open, RL_OK, db_path, &db2, RLITE_OPEN_READWRITE);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+
+	unsigned char *key = UNSIGN("my key"), *testvalue;
+	long keylen = strlen((char *)key), testvaluelen;
+	unsigned char *value = UNSIGN("my value");
+	long valuelen = strlen((char *)value);
+	unsigned char *value2 = UNSIGN("my other value");
+	long value2len = strlen((char *)value2);
+
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, value, valuelen, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db2);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db2, key, keylen, &testvalue, &testvaluelen);
+	EXPECT_BYTES(value, valuelen, testvalue, testvaluelen);
+	rl_free(testvalue);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+	ASSERT(db2->page_cache->len > 0);
+
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, value2, value2len, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db2);
+	ASSERT_EQ(db2->page_cache->len, 0);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db2, key, keylen, &testvalue, &testvaluelen);
+	EXPECT_BYTES(value2, value2len, testvalue, testvaluelen);
+	rl_free(testvalue);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+
+	rl_close(db);
+	rl_close(db2);
+	PASS();
+}
+
+TEST test_cache_bounded()
+{
+	int retval;
+	rlite *db = NULL;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	RL_CALL_VERBOSE(rl_set_page_cache_size, RL_OK, db, 4);
+
+	char key[20];
+	long i;
+	for (i = 0; i < 20; i++) {
+		snprintf(key, 20, "key%ld", i);
+		RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN(key), strlen(key), UNSIGN(key), strlen(key), 0, 0);
+	}
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	ASSERT_EQ(db->page_cache->len, 4);
+
+	RL_CALL_VERBOSE(rl_set_page_cache_size, RL_OK, db, 0);
+	ASSERT_EQ(db->page_cache, NULL);
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, UNSIGN("key3"), 4, NULL, NULL);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+
+	rl_close(db);
+	PASS();
+}
+
+TEST test_read_transaction()
+{
+	int retval;
+	rlite *db = NULL, *db2 = NULL;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+
+	unsigned char *key = UNSIGN("my key"), *testvalue;
+	long keylen = strlen((char *)key), testvaluelen;
+	unsigned char *value = UNSIGN("my value");
+	long valuelen = strlen((char *)value);
+	unsigned char *key2 = UNSIGN("expired key");
+	long key2len = strlen((char *)key2);
+
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, value, valuelen, 0, 0);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key2, key2len, value, valuelen, 0, 1);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(rl_open, RL_OK, db_path, &db2, RLITE_OPEN_READWRITE);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+
+	// both handles read at the same time
+	RL_CALL_VERBOSE(rl_begin_read, RL_OK, db);
+	RL_CALL_VERBOSE(rl_begin_read, RL_OK, db2);
+	ASSERT_EQ(rl_is_flocked(db_path, RLITE_FLOCK_SH), RL_FOUND);
+	ASSERT_EQ(rl_is_flocked(db_path, RLITE_FLOCK_EX), RL_NOT_FOUND);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, key, keylen, &testvalue, &testvaluelen);
+	EXPECT_BYTES(value, valuelen, testvalue, testvaluelen);
+	rl_free(testvalue);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db2, key, keylen, &testvalue, &testvaluelen);
+	EXPECT_BYTES(value, valuelen, testvalue, testvaluelen);
+	rl_free(testvalue);
+	RL_CALL_VERBOSE(rl_end_read, RL_OK, db);
+	RL_CALL_VERBOSE(rl_end_read, RL_OK, db2);
+	ASSERT_EQ(rl_is_flocked(db_path, RLITE_FLOCK_SH), RL_NOT_FOUND);
+	ASSERT(db->page_cache->len > 0);
+
+	// deleting the expired key is a write, it has to be done again
+	RL_CALL_VERBOSE(rl_begin_read, RL_OK, db);
+	RL_CALL_VERBOSE(rl_get, RL_NOT_FOUND, db, key2, key2len, NULL, NULL);
+	RL_CALL_VERBOSE(rl_end_read, RL_INVALID_STATE, db);
+	ASSERT_EQ(db->write_pages_len, 0);
+	ASSERT_EQ(db->read_transaction, 0);
+
+	// the key is still there for a regular transaction to delete
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	RL_CALL_VERBOSE(rl_key_get, RL_NOT_FOUND, db, key2, key2len, NULL, NULL, NULL, NULL, NULL);
+	ASSERT(db->write_pages_len > 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+
+	rl_close(db);
+	rl_close(db2);
+	PASS();
+}
+
+TEST test_page_stats()
+{
+	int retval;
+	rlite *db = NULL;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	RL_CALL_VERBOSE(rl_set_page_cache_size, RL_OK, db, 0);
+
+	unsigned char *key = UNSIGN("my key");
+	long keylen = strlen((char *)key);
+	unsigned char *value = UNSIGN("my value");
+	long valuelen = strlen((char *)value);
+
+	rl_page_stats before = db->stats;
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, value, valuelen, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	ASSERT(db->stats.pages_written > before.pages_written);
+	ASSERT_EQ(db->stats.bytes_serialized - before.bytes_serialized, (db->stats.pages_written - before.pages_written) * db->page_size);
+
+	before = db->stats;
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, key, keylen, NULL, NULL);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	ASSERT(db->stats.pages_read > before.pages_read);
+	ASSERT(db->stats.bytes_deserialized >= (db->stats.pages_read - before.pages_read) * db->page_size);
+	ASSERT_EQ(db->stats.pages_written, before.pages_written);
+
+	rl_close(db);
+	PASS();
+}
+
+TEST test_shared_cache()
+{
+	int retval;
+	rlite *db = NULL, *db2 = NULL;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	rl_close(db);
+	RL_CALL_VERBOSE(rl_open, RL_OK, db_path, &db, RLITE_OPEN_READWRITE | RLITE_OPEN_SHARED);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(rl_open, RL_OK, db_path, &db2, RLITE_OPEN_READWRITE | RLITE_OPEN_SHARED);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+	ASSERT(db->shared_cache != NULL);
+	ASSERT_EQ(db->page_cache, db2->page_cache);
+
+	unsigned char *key = UNSIGN("my key"), *testvalue;
+	long keylen = strlen((char *)key), testvaluelen;
+	unsigned char *value = UNSIGN("my value");
+	long valuelen = strlen((char *)value);
+
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, value, valuelen, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+
+	rl_page_stats before = db->stats;
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, key, keylen, NULL, NULL);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	unsigned long long warm_reads = db->stats.pages_read - before.pages_read;
+
+	// db2 finds the same pages in the cache as db does
+	before = db2->stats;
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db2);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db2, key, keylen, &testvalue, &testvaluelen);
+	EXPECT_BYTES(value, valuelen, testvalue, testvaluelen);
+	rl_free(testvalue);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+	ASSERT_EQ(db2->stats.pages_read - before.pages_read, warm_reads);
+
+	// the cache outlives the handle that created it
+	rl_close(db);
+	RL_CALL_VERBOSE(rl_set_page_cache_size, RL_OK, db2, 1);
+	ASSERT(db2->page_cache->len <= 1);
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db2);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db2, key, keylen, &testvalue, &testvaluelen);
+	EXPECT_BYTES(value, valuelen, testvalue, testvaluelen);
+	rl_free(testvalue);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+
+	rl_close(db2);
+	PASS();
+}
+
+TEST test_shared_cache_concurrent_readers()
+{
+	int retval;
+	rlite *db = NULL, *db2 = NULL;
+	unsigned char *key = UNSIGN("my key"), *testvalue;
+	long keylen = strlen((char *)key), testvaluelen, len;
+	rl_page_stats before, before2;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	rl_close(db);
+	RL_CALL_VERBOSE(rl_open, RL_OK, db_path, &db, RLITE_OPEN_READWRITE | RLITE_OPEN_SHARED);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(rl_open, RL_OK, db_path, &db2, RLITE_OPEN_READWRITE | RLITE_OPEN_SHARED);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, UNSIGN("my value"), 8, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	len = db->page_cache->len;
+
+	// both read transactions are open at the same time, and both get their
+	// pages from the cache without taking them away from the other
+	before = db->stats;
+	before2 = db2->stats;
+	RL_CALL_VERBOSE(rl_begin_read, RL_OK, db);
+	RL_CALL_VERBOSE(rl_begin_read, RL_OK, db2);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, key, keylen, &testvalue, &testvaluelen);
+	EXPECT_BYTES(UNSIGN("my value"), 8, testvalue, testvaluelen);
+	rl_free(testvalue);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db2, key, keylen, &testvalue, &testvaluelen);
+	EXPECT_BYTES(UNSIGN("my value"), 8, testvalue, testvaluelen);
+	rl_free(testvalue);
+	ASSERT_EQ(db->page_cache->len, len);
+	ASSERT(db->stats.cache_hits > before.cache_hits);
+	ASSERT_EQ(db2->stats.cache_hits - before2.cache_hits, db->stats.cache_hits - before.cache_hits);
+	ASSERT_EQ(db2->stats.pages_read - before2.pages_read, db->stats.pages_read - before.pages_read);
+	RL_CALL_VERBOSE(rl_end_read, RL_OK, db);
+	RL_CALL_VERBOSE(rl_end_read, RL_OK, db2);
+	ASSERT_EQ(db->page_cache->len, len);
+
+	rl_close(db2);
+	rl_close(db);
+	PASS();
+}
+
+SUITE(cache_test)
+{
+	RUN_TEST1(test_cache_survives_commit, 0);
+	RUN_TEST1(test_cache_survives_commit, 1);
+	RUN_TEST(test_cache_invalidated_by_other_handle);
+	RUN_TEST(test_cache_bounded);
+	RUN_TEST(test_read_transaction);
+	RUN_TEST(test_page_stats);
+	RUN_TEST(test_shared_cache);
+	RUN_TEST(test_shared_cache_concurrent_readers);
+}
@@ -8,8 +8,9 @@
 #define FILEPATH "rlite-test.rld"
 #define INCREMENT_LIMIT 1000
 
-static void *increment(void *UNUSED(arg)) {
-	rliteContext *context = rliteConnect(FILEPATH, 0);
+// a non-NULL arg joins the shared page cache of the file
+static void *increment(void *arg) {
+	rliteContext *context = arg ? rliteConnectShared(FILEPATH) : rliteConnect(FILEPATH, 0);
 	rliteReply* reply;
 	size_t argvlen[100];
 	char* argv[100] = {"INCR", "key", NULL};
@@ -29,6 +30,28 @@ static void *increment(void *UNUSED(arg)) {
 	return NULL;
 }
 
+#define SHARED_CONTEXT_THREADS 4
+
+// every thread increments the same context INCREMENT_LIMIT / SHARED_CONTEXT_THREADS times
+static void *increment_context(void *arg) {
+	rliteContext *context = arg;
+	rliteReply* reply;
+	size_t argvlen[100];
+	char* argv[100] = {"INCR", "key", NULL};
+	int argc = populateArgvlen(argv, argvlen);
+	int i;
+	for (i = 0; i < INCREMENT_LIMIT / SHARED_CONTEXT_THREADS; i++) {
+		reply = rliteCommandArgv(context, argc, argv, argvlen);
+		if (reply->type != RLITE_REPLY_INTEGER) {
+			fprintf(stderr, "Expected incremented value to be an integer, got %d instead\n", reply->type);
+			rliteFreeReplyObject(reply);
+			break;
+		}
+		rliteFreeReplyObject(reply);
+	}
+	return NULL;
+}
+
 static void delete_file() {
 	if (access(FILEPATH, F_OK) == 0) {
 		unlink(FILEPATH);
@@ -142,8 +165,116 @@ TEST multiple_writing_threads_concurrency() {
 	PASS();
 }
 
+TEST shared_threads_concurrency() {
+	delete_file();
+	rliteContext *context = rliteConnectShared(FILEPATH);
+
+	pthread_t thread1;
+	pthread_t thread2;
+	pthread_create(&thread1, NULL, increment, context);
+	pthread_create(&thread2, NULL, increment, context);
+
+	rliteReply* reply;
+	size_t argvlen[100];
+	char* argv[100] = {"GET", "key", NULL};
+	int argc = populateArgvlen(argv, argvlen);
+	long long val;
+	char tmp[40];
+
+	do {
+		reply = rliteCommandArgv(context, argc, argv, argvlen);
+		if (reply->type == RLITE_REPLY_NIL) {
+			val = 0;
+		} else  if (reply->type != RLITE_REPLY_STRING) {
+			fprintf(stderr, "Expected incremented value to be a string, got %d instead on line %d\n", reply->type, __LINE__);
+			rliteFreeReplyObject(reply);
+			break;
+		} else {
+			memcpy(tmp, reply->str, reply->len);
+			tmp[reply->len] = 0;
+			val = strtoll(tmp, NULL, 10);
+		}
+		rliteFreeReplyObject(reply);
+	} while (val < INCREMENT_LIMIT);
+
+	pthread_join(thread1, NULL);
+	pthread_join(thread2, NULL);
+	rliteFree(context);
+	PASS();
+}
+
+TEST one_context_threads_concurrency() {
+	delete_file();
+	rliteContext *context = rliteConnectShared(FILEPATH);
+
+	pthread_t threads[SHARED_CONTEXT_THREADS];
+	int i;
+	for (i = 0; i < SHARED_CONTEXT_THREADS; i++) {
+		pthread_create(&threads[i], NULL, increment_context, context);
+	}
+	for (i = 0; i < SHARED_CONTEXT_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	rliteReply* reply;
+	size_t argvlen[100];
+	char* argv[100] = {"GET", "key", NULL};
+	int argc = populateArgvlen(argv, argvlen);
+	reply = rliteCommandArgv(context, argc, argv, argvlen);
+	EXPECT_REPLY_STR(reply, "1000", 4);
+	rliteFreeReplyObject(reply);
+	rliteFree(context);
+	PASS();
+}
+
+TEST busy_timeout_concurrency() {
+	delete_file();
+	rliteContext *context1 = rliteConnect(FILEPATH, 0);
+	rliteContext *context2 = rliteConnect(FILEPATH, 0);
+	struct timeval timeout = {0, 10000};
+	ASSERT_EQ(rliteSetTimeout(context2, timeout), RLITE_OK);
+
+	rliteReply* reply;
+	size_t argvlen[100];
+
+	// context1 is stuck in the middle of a write
+	ASSERT_EQ(rl_set(context1->db, UNSIGN("key"), 3, UNSIGN("value"), 5, 0, 0), RL_OK);
+
+	{
+		char* argv[100] = {"set", "key", "other", NULL};
+		reply = rliteCommandArgv(context2, populateArgvlen(argv, argvlen), argv, argvlen);
+		ASSERT_EQ(reply->type, RLITE_REPLY_ERROR);
+		ASSERT(strncmp(reply->str, "BUSY", 4) == 0);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		// readers are not held up by it
+		char* argv[100] = {"GET", "key", NULL};
+		reply = rliteCommandArgv(context2, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_NIL(reply);
+		rliteFreeReplyObject(reply);
+	}
+
+	ASSERT_EQ(rl_commit(context1->db), RL_OK);
+	{
+		char* argv[100] = {"set", "key", "other", NULL};
+		reply = rliteCommandArgv(context2, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+
+	rliteFree(context1);
+	rliteFree(context2);
+	unlink(FILEPATH);
+	PASS();
+}
+
 SUITE(concurrency_test) {
 	RUN_TEST(simple_concurrency);
 	RUN_TEST(threads_concurrency);
 	RUN_TEST(multiple_writing_threads_concurrency);
+	RUN_TEST(shared_threads_concurrency);
+	RUN_TEST(one_context_threads_concurrency);
+	RUN_TEST(busy_timeout_concurrency);
 }
@@ -89,6 +89,58 @@ TEST dbsize() {
 	PASS();
 }
 
+TEST read_only_expired() {
+	unlink("user.db");
+	rliteContext *context = rliteConnect("user.db", 0);
+
+	rliteReply* reply;
+	size_t argvlen[100];
+
+	{
+		char* argv[100] = {"set", "key1", "mydata", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+
+	ASSERT_EQ(rl_refresh(context->db), RL_OK);
+	ASSERT_EQ(rl_set(context->db, UNSIGN("key2"), 4, UNSIGN("old"), 3, 0, 1), RL_OK);
+	ASSERT_EQ(rl_commit(context->db), RL_OK);
+
+	{
+		char* argv[100] = {"get", "key1", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STR(reply, "mydata", 6);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"dbsize", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_INTEGER(reply, 2);
+		rliteFreeReplyObject(reply);
+	}
+
+	// reading the expired key deletes it
+	{
+		char* argv[100] = {"get", "key2", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_NIL(reply);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"dbsize", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_INTEGER(reply, 1);
+		rliteFreeReplyObject(reply);
+	}
+
+	rliteFree(context);
+	unlink("user.db");
+	PASS();
+}
+
 TEST expire(char *command, char *time) {
 	rliteContext *context = rliteConnect(":memory:", 0);
 
@@ -610,6 +662,7 @@ SUITE(db_test) {
 	RUN_TEST(test_rlite_connect);
 	RUN_TEST(keys);
 	RUN_TEST(dbsize);
+	RUN_TEST(read_only_expired);
 	RUN_TESTp(expire, "expire", "-1");
 	RUN_TESTp(expire, "pexpire", "-1");
 	RUN_TESTp(expire, "expireat", "1000");
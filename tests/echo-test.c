@@ -162,6 +162,36 @@ TEST test_echo_wrong_arity() {
 	PASS();
 }
 
+TEST test_command_lookup() {
+	size_t argvlen[2];
+	char* argv[2];
+	rliteReply* reply;
+	rliteContext *context = rliteConnect(":memory:", 0);
+	argvlen[0] = 4;
+	argv[0] = "EcHo";
+	argvlen[1] = 11;
+	argv[1] = "hello world";
+	reply = rliteCommandArgv(context, 2, argv, argvlen);
+	EXPECT_REPLY_STR(reply, argv[1], argvlen[1]);
+	rliteFreeReplyObject(reply);
+
+	const char *unknown[3] = {"ech", "echoo", "echo\0x"};
+	size_t unknownlen[3] = {3, 5, 6};
+	int i;
+	for (i = 0; i < 3; i++) {
+		argv[0] = (char *)unknown[i];
+		argvlen[0] = unknownlen[i];
+		reply = rliteCommandArgv(context, 2, argv, argvlen);
+		EXPECT_REPLY_ERROR(reply);
+		const char *err = "unknown command";
+		ASSERT_EQ(memcmp(reply->str, err, strlen(err)), 0);
+		rliteFreeReplyObject(reply);
+	}
+
+	rliteFree(context);
+	PASS();
+}
+
 TEST test_not_null_terminated_long() {
 	size_t argvlen[4];
 	char* argv[4];
@@ -198,6 +228,7 @@ SUITE(echo_test)
 	RUN_TEST(test_ping);
 	RUN_TEST(test_ping_str);
 	RUN_TEST(test_echo);
+	RUN_TEST(test_command_lookup);
 	RUN_TEST(test_echo_wrong_arity);
 	RUN_TEST(test_not_null_terminated_long);
 }
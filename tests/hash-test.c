@@ -321,6 +321,37 @@ TEST test_hgetall() {
 	PASS();
 }
 
+TEST test_hgetall_stream() {
+	rliteContext *context = rliteConnect(":memory:", 0);
+
+	char buffer[STREAM_BUFFER_SIZE];
+	rliteReply* reply;
+	size_t argvlen[100];
+
+	char* argv[100] = {"hmset", "mykey", "myfield", "mydata", "myfield2", "mydata2", NULL};
+	reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+	ASSERT_EQ(reply->type, RLITE_REPLY_STATUS);
+	rliteFreeReplyObject(reply);
+
+	char *argv2[100] = {"hgetall", "mykey", NULL};
+	memset(buffer, 0, sizeof(buffer));
+	reply = rliteCommandArgvStream(context, populateArgvlen(argv2, argvlen), argv2, argvlen, stream_join, buffer);
+	EXPECT_REPLY_LEN(reply, 4);
+	ASSERT_EQ(reply->element, NULL);
+	ASSERT_STR_EQ(buffer, "myfield2 mydata2 myfield mydata");
+	rliteFreeReplyObject(reply);
+
+	char *argv3[100] = {"hvals", "mykey", NULL};
+	memset(buffer, 0, sizeof(buffer));
+	reply = rliteCommandArgvStream(context, populateArgvlen(argv3, argvlen), argv3, argvlen, stream_join, buffer);
+	EXPECT_REPLY_LEN(reply, 2);
+	ASSERT_STR_EQ(buffer, "mydata2 mydata");
+	rliteFreeReplyObject(reply);
+
+	rliteFree(context);
+	PASS();
+}
+
 TEST test_hkeys() {
 	rliteContext *context = rliteConnect(":memory:", 0);
 
@@ -438,6 +469,7 @@ SUITE(hash_test)
 	RUN_TEST(test_hincrby);
 	RUN_TEST(test_hincrbyfloat);
 	RUN_TEST(test_hgetall);
+	RUN_TEST(test_hgetall_stream);
 	RUN_TEST(test_hkeys);
 	RUN_TEST(test_hvals);
 	RUN_TEST(test_hmget);
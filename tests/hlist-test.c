@@ -346,6 +346,59 @@ TEST test_lrange() {
 	PASS();
 }
 
+TEST test_lrange_stream() {
+	rliteContext *context = rliteConnect(":memory:", 0);
+
+	char buffer[STREAM_BUFFER_SIZE];
+	char *key = "mylist";
+
+	rliteReply* reply;
+	size_t argvlen[100];
+
+	lpush(context, key, "othervalue");
+	lpush(context, key, "value2");
+	lpush(context, key, "value1");
+
+	{
+		char* argv[100] = {"lrange", key, "0", "-1", NULL};
+		memset(buffer, 0, sizeof(buffer));
+		reply = rliteCommandArgvStream(context, populateArgvlen(argv, argvlen), argv, argvlen, stream_join, buffer);
+		EXPECT_REPLY_LEN(reply, 3);
+		ASSERT_EQ(reply->element, NULL);
+		ASSERT_STR_EQ(buffer, "value1 value2 othervalue");
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"lrange", key, "-2", "5", NULL};
+		memset(buffer, 0, sizeof(buffer));
+		reply = rliteCommandArgvStream(context, populateArgvlen(argv, argvlen), argv, argvlen, stream_join, buffer);
+		EXPECT_REPLY_LEN(reply, 2);
+		ASSERT_STR_EQ(buffer, "value2 othervalue");
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"lrange", "nolist", "0", "-1", NULL};
+		memset(buffer, 0, sizeof(buffer));
+		reply = rliteCommandArgvStream(context, populateArgvlen(argv, argvlen), argv, argvlen, stream_join, buffer);
+		EXPECT_REPLY_LEN(reply, 0);
+		ASSERT_STR_EQ(buffer, "");
+		rliteFreeReplyObject(reply);
+	}
+
+	// replies that are not arrays come back as usual
+	{
+		char* argv[100] = {"llen", key, NULL};
+		reply = rliteCommandArgvStream(context, populateArgvlen(argv, argvlen), argv, argvlen, stream_join, buffer);
+		EXPECT_REPLY_INTEGER(reply, 3);
+		rliteFreeReplyObject(reply);
+	}
+
+	rliteFree(context);
+	PASS();
+}
+
 TEST test_lrem() {
 	rliteContext *context = rliteConnect(":memory:", 0);
 
@@ -526,6 +579,7 @@ SUITE(hlist_test)
 	RUN_TEST(test_lindex);
 	RUN_TEST(test_linsert);
 	RUN_TEST(test_lrange);
+	RUN_TEST(test_lrange_stream);
 	RUN_TEST(test_lrem);
 	RUN_TEST(test_lset);
 	RUN_TEST(test_ltrim);
@@ -299,6 +299,295 @@ TEST test_multi_discard() {
 	PASS();
 }
 
+TEST test_multi_watch_change_counter() {
+	unlink("rlite-test.rld");
+	rliteContext *context = rliteConnect("rlite-test.rld", 0);
+	rliteContext *context2 = rliteConnect("rlite-test.rld", 0);
+
+	rliteReply* reply;
+	size_t argvlen[100];
+	unsigned long long skipped;
+
+	{
+		char* argv[100] = {"select", "1", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+	{
+		char* argv[100] = {"watch", "key", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+	{
+		char* argv[100] = {"select", "0", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+	{
+		char* argv[100] = {"watch", "key", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+
+	// nothing was committed since watch, no key is looked up
+	skipped = context->db->stats.watch_skipped;
+	{
+		char* argv[100] = {"multi", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+	{
+		char* argv[100] = {"set", "key", "value", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "QUEUED", 6);
+		rliteFreeReplyObject(reply);
+	}
+	{
+		char* argv[100] = {"exec", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_LEN(reply, 1);
+		rliteFreeReplyObject(reply);
+	}
+	ASSERT_EQ(context->db->stats.watch_skipped, skipped + 1);
+
+	{
+		char* argv[100] = {"select", "1", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+	{
+		char* argv[100] = {"watch", "key", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+	{
+		char* argv[100] = {"select", "0", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+
+	// an unrelated commit forces the lookups, which still pass
+	{
+		char* argv[100] = {"set", "other", "value", NULL};
+		reply = rliteCommandArgv(context2, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+	{
+		char* argv[100] = {"multi", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+	{
+		char* argv[100] = {"set", "key", "value2", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "QUEUED", 6);
+		rliteFreeReplyObject(reply);
+	}
+	{
+		char* argv[100] = {"exec", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_LEN(reply, 1);
+		rliteFreeReplyObject(reply);
+	}
+	ASSERT_EQ(context->db->stats.watch_skipped, skipped + 1);
+
+	{
+		char* argv[100] = {"select", "1", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+	{
+		char* argv[100] = {"watch", "key", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+	{
+		char* argv[100] = {"select", "0", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+
+	// the key is checked in the database it was watched in
+	{
+		char* argv[100] = {"select", "1", NULL};
+		reply = rliteCommandArgv(context2, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+	{
+		char* argv[100] = {"set", "key", "value", NULL};
+		reply = rliteCommandArgv(context2, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+	{
+		char* argv[100] = {"multi", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+	{
+		char* argv[100] = {"set", "key", "value3", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "QUEUED", 6);
+		rliteFreeReplyObject(reply);
+	}
+	{
+		char* argv[100] = {"exec", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_NIL(reply);
+		rliteFreeReplyObject(reply);
+	}
+
+	rliteFree(context);
+	rliteFree(context2);
+	unlink("rlite-test.rld");
+	PASS();
+}
+
+TEST test_batch() {
+	unlink("rlite-test.rld");
+	rliteContext *context = rliteConnect("rlite-test.rld", 0);
+
+	rliteReply* reply;
+	char *set[] = {"set", "key", "1"};
+	char *incr[] = {"incr", "key"};
+	char *get[] = {"get", "key"};
+	char *publish[] = {"publish", "channel", "message"};
+	char **argv[] = {set, incr, get, publish};
+	size_t setlen[] = {3, 3, 1}, incrlen[] = {4, 3}, getlen[] = {3, 3}, publishlen[] = {7, 7, 7};
+	size_t *argvlen[] = {setlen, incrlen, getlen, publishlen};
+	int argc[] = {3, 2, 2, 3};
+	unsigned long long change_counter = context->db->initial_change_counter;
+
+	ASSERT_EQ(rliteAppendCommandArgvBatch(context, 4, argc, argv, argvlen), RLITE_OK);
+	// one commit for the whole batch
+	ASSERT_EQ(context->db->initial_change_counter, change_counter + 1);
+
+	rliteGetReply(context, (void **)&reply);
+	EXPECT_REPLY_STATUS(reply, "OK", 2);
+	rliteFreeReplyObject(reply);
+	rliteGetReply(context, (void **)&reply);
+	EXPECT_REPLY_INTEGER(reply, 2);
+	rliteFreeReplyObject(reply);
+	rliteGetReply(context, (void **)&reply);
+	EXPECT_REPLY_STR(reply, "2", 1);
+	rliteFreeReplyObject(reply);
+	rliteGetReply(context, (void **)&reply);
+	ASSERT_EQ(reply->type, RLITE_REPLY_ERROR);
+	rliteFreeReplyObject(reply);
+
+	rliteFree(context);
+	unlink("rlite-test.rld");
+	PASS();
+}
+
+TEST test_batch_failed() {
+	rliteContext *context = rliteConnect(":memory:", 0);
+
+	rliteReply* reply;
+	size_t argvlen[100];
+	char *set[] = {"set", "key", "value"};
+	char **argv[] = {set, NULL};
+	size_t setlen[] = {3, 3, 5};
+	size_t *batchlen[] = {setlen, NULL};
+	int argc[] = {3, 0};
+
+	ASSERT_EQ(rliteAppendCommandArgvBatch(context, 2, argc, argv, batchlen), RLITE_ERR);
+
+	{
+		char* argv[100] = {"exists", "key", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_INTEGER(reply, 0);
+		rliteFreeReplyObject(reply);
+	}
+
+	rliteFree(context);
+	PASS();
+}
+
+#ifdef RL_DEBUG
+TEST test_batch_oom() {
+	unlink("rlite-test.rld");
+	rliteContext *context = rliteConnect("rlite-test.rld", 0);
+
+	rliteReply* reply;
+	size_t argvlen[100];
+	char *set1[] = {"set", "key1", "1"};
+	char *set2[] = {"set", "key2", "2"};
+	char **argv[] = {set1, set2};
+	size_t set1len[] = {3, 4, 1}, set2len[] = {3, 4, 1};
+	size_t *batchlen[] = {set1len, set2len};
+	int argc[] = {3, 3};
+	char* del[100] = {"del", "key1", "key2", NULL};
+	long long exists[2];
+	int i, j, retval, written[2], done = 0;
+
+	for (i = 1; !done; i++) {
+		test_mode = 1;
+		test_mode_counter = i;
+		retval = rliteAppendCommandArgvBatch(context, 2, argc, argv, batchlen);
+		// still armed when nothing failed
+		done = test_mode;
+		test_mode = 0;
+		if (retval == RLITE_OK) {
+			ASSERT_EQ(context->replyLength, 2);
+		}
+		else {
+			// a failed batch leaves no replies behind
+			ASSERT_EQ(context->replyLength, 0);
+		}
+		for (j = 0; j < 2; j++) {
+			written[j] = 0;
+			if (retval == RLITE_OK) {
+				rliteGetReply(context, (void **)&reply);
+				written[j] = reply->type == RLITE_REPLY_STATUS;
+				rliteFreeReplyObject(reply);
+			}
+		}
+		for (j = 0; j < 2; j++) {
+			char* existsargv[100] = {"exists", argv[j][1], NULL};
+			reply = rliteCommandArgv(context, populateArgvlen(existsargv, argvlen), existsargv, argvlen);
+			ASSERT_EQ(reply->type, RLITE_REPLY_INTEGER);
+			exists[j] = reply->integer;
+			rliteFreeReplyObject(reply);
+			if (retval == RLITE_OK) {
+				// a command may fail on its own, but an OK reply means it was written
+				ASSERT_EQ(exists[j], written[j]);
+			}
+		}
+		if (retval != RLITE_OK) {
+			// the commit itself may fail after the log was written, but
+			// never with only part of the batch
+			ASSERT_EQ(exists[0], exists[1]);
+		}
+		if (done) {
+			ASSERT_EQ(retval, RLITE_OK);
+			ASSERT_EQ(exists[0] + exists[1], 2);
+		}
+		reply = rliteCommandArgv(context, populateArgvlen(del, argvlen), del, argvlen);
+		rliteFreeReplyObject(reply);
+	}
+
+	rliteFree(context);
+	unlink("rlite-test.rld");
+	PASS();
+}
+#endif
+
 SUITE(hmulti_test)
 {
 	RUN_TEST(test_multi_nowatch);
@@ -307,4 +596,10 @@ SUITE(hmulti_test)
 	RUN_TEST(test_multi_watch_changed);
 	RUN_TEST(test_multi_unwatch_changed);
 	RUN_TEST(test_multi_discard);
+	RUN_TEST(test_multi_watch_change_counter);
+	RUN_TEST(test_batch);
+	RUN_TEST(test_batch_failed);
+#ifdef RL_DEBUG
+	RUN_TEST(test_batch_oom);
+#endif
 }
@@ -0,0 +1,212 @@
+#include <string.h>
+#include <unistd.h>
+#include "rlite/hirlite.h"
+#include "util.h"
+
+TEST test_slowlog() {
+	rliteContext *context = rliteConnect(":memory:", 0);
+	context->slowlogLogSlowerThan = 0;
+
+	rliteReply* reply;
+	size_t argvlen[100];
+
+	{
+		char* argv[100] = {"set", "key", "value", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"get", "key", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STR(reply, "value", 5);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"slowlog", "len", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_INTEGER(reply, 2);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"slowlog", "get", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		// slowlog len ran too
+		EXPECT_REPLY_LEN(reply, 3);
+		EXPECT_REPLY_LEN(reply->element[1], 5);
+		EXPECT_REPLY_INTEGER(reply->element[1]->element[0], 1);
+		EXPECT_REPLY_LEN(reply->element[1]->element[3], 2);
+		EXPECT_REPLY_STR(reply->element[1]->element[3]->element[0], "get", 3);
+		EXPECT_REPLY_STR(reply->element[1]->element[3]->element[1], "key", 3);
+		EXPECT_REPLY_LEN(reply->element[1]->element[4], 8);
+		EXPECT_REPLY_STR(reply->element[1]->element[4]->element[0], "lock_usec", 9);
+		EXPECT_REPLY_STR(reply->element[2]->element[3]->element[0], "set", 3);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"slowlog", "get", "1", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_LEN(reply, 1);
+		EXPECT_REPLY_INTEGER(reply->element[0]->element[0], 3);
+		rliteFreeReplyObject(reply);
+	}
+
+	context->slowlogLogSlowerThan = -1;
+	{
+		char* argv[100] = {"slowlog", "reset", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"slowlog", "len", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_INTEGER(reply, 0);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"slowlog", "nope", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_ERROR(reply);
+		rliteFreeReplyObject(reply);
+	}
+
+	rliteFree(context);
+	PASS();
+}
+
+TEST test_slowlog_truncates() {
+	rliteContext *context = rliteConnect(":memory:", 0);
+	context->slowlogLogSlowerThan = 0;
+	context->slowlogMaxLen = 2;
+
+	rliteReply* reply;
+	char *argv[40];
+	size_t argvlen[40];
+	char value[200];
+	int i;
+
+	memset(value, 'a', 200);
+	argv[0] = "sadd";
+	argvlen[0] = 4;
+	argv[1] = "key";
+	argvlen[1] = 3;
+	argv[2] = value;
+	argvlen[2] = 200;
+	for (i = 3; i < 40; i++) {
+		argv[i] = "b";
+		argvlen[i] = 1;
+	}
+	reply = rliteCommandArgv(context, 40, argv, argvlen);
+	EXPECT_REPLY_INTEGER(reply, 2);
+	rliteFreeReplyObject(reply);
+
+	{
+		char* argv[100] = {"slowlog", "get", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_LEN(reply, 1);
+		EXPECT_REPLY_LEN(reply->element[0]->element[3], 32);
+		ASSERT_EQ(reply->element[0]->element[3]->element[2]->len, 128 + 19);
+		ASSERT(memcmp(&reply->element[0]->element[3]->element[2]->str[128], "... (72 more bytes)", 19) == 0);
+		EXPECT_REPLY_STR(reply->element[0]->element[3]->element[31], "... (9 more arguments)", 22);
+		rliteFreeReplyObject(reply);
+	}
+
+	// only the newest two are kept
+	{
+		char* argv[100] = {"slowlog", "len", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_INTEGER(reply, 2);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"slowlog", "get", "-1", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_LEN(reply, 2);
+		EXPECT_REPLY_STR(reply->element[0]->element[3]->element[0], "slowlog", 7);
+		EXPECT_REPLY_STR(reply->element[1]->element[3]->element[0], "slowlog", 7);
+		rliteFreeReplyObject(reply);
+	}
+
+	rliteFree(context);
+	PASS();
+}
+
+TEST test_latency_histogram() {
+	rliteContext *context = rliteConnect(":memory:", 0);
+
+	rliteReply* reply;
+	size_t argvlen[100];
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		char* argv[100] = {"set", "key", "value", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STATUS(reply, "OK", 2);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"get", "key", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_STR(reply, "value", 5);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"latency", "histogram", "SET", "unknown", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_LEN(reply, 2);
+		EXPECT_REPLY_STR(reply->element[0], "set", 3);
+		EXPECT_REPLY_LEN(reply->element[1], 12);
+		EXPECT_REPLY_STR(reply->element[1]->element[0], "calls", 5);
+		EXPECT_REPLY_INTEGER(reply->element[1]->element[1], 3);
+		EXPECT_REPLY_STR(reply->element[1]->element[2], "histogram_usec", 14);
+		rliteReply *histogram = reply->element[1]->element[3];
+		ASSERT(histogram->elements >= 2);
+		// cumulative, the last bucket holds every call
+		EXPECT_REPLY_INTEGER(histogram->element[histogram->elements - 1], 3);
+		EXPECT_REPLY_STR(reply->element[1]->element[4], "lock_usec", 9);
+		EXPECT_REPLY_STR(reply->element[1]->element[10], "wal_apply_usec", 14);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"latency", "histogram", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		// set, get and the previous latency
+		EXPECT_REPLY_LEN(reply, 6);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"latency", "reset", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_INTEGER(reply, 3);
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"latency", "histogram", "set", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_LEN(reply, 0);
+		rliteFreeReplyObject(reply);
+	}
+
+	rliteFree(context);
+	PASS();
+}
+
+SUITE(hslowlog_test)
+{
+	RUN_TEST(test_slowlog);
+	RUN_TEST(test_slowlog_truncates);
+	RUN_TEST(test_latency_histogram);
+}
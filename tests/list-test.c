@@ -6,6 +6,7 @@
 #include "../src/rlite/rlite.h"
 #include "../src/rlite/status.h"
 #include "../src/rlite/page_list.h"
+#include "../src/rlite/page_long.h"
 
 TEST basic_insert_list_test(int options)
 {
@@ -294,6 +295,132 @@ TEST fuzzy_list_delete_test(long size, long list_node_size, int _commit)
 	PASS();
 }
 
+static int count_used_pages(rlite *db, long *used)
+{
+	int retval = RL_OK;
+	long page_number = db->next_empty_page;
+	*used = db->number_of_pages - 1;
+	while (page_number != db->number_of_pages) {
+		(*used)--;
+		RL_CALL(rl_long_get, RL_OK, db, &page_number, page_number);
+	}
+cleanup:
+	return retval;
+}
+
+TEST index_list_test(long size, int _commit)
+{
+	rlite *db = NULL;
+	rl_list *list = NULL;
+	long *elements = malloc(sizeof(long) * size);
+	short *pages = NULL;
+	long i, j, position, used, marked, *element;
+	int retval;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, _commit, 1);
+	db->number_of_databases = 1;
+	db->page_size = sizeof(long) * 2 + 12;
+	RL_CALL_VERBOSE(rl_list_create, RL_OK, db, &list, &rl_list_type_long);
+	long list_page = db->next_empty_page;
+	RL_CALL_VERBOSE(rl_write, RL_OK, db, list->type->list_type, list_page, list);
+
+	for (i = 0; i < size; i++) {
+		position = rand() % (i + 1);
+		memmove(&elements[position + 1], &elements[position], sizeof(long) * (i - position));
+		elements[position] = i;
+		element = malloc(sizeof(long));
+		*element = i;
+		RL_CALL_VERBOSE(rl_list_add_element, RL_OK, db, list, list_page, element, position);
+		if (_commit) {
+			RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+			RL_CALL_VERBOSE(rl_read, RL_FOUND, db, &rl_data_type_list_long, list_page, &rl_list_type_long, (void **)&list, 1);
+		}
+	}
+	RL_CALL_VERBOSE(rl_list_is_balanced, RL_OK, db, list);
+	// with three entries per index page, the index has several levels
+	ASSERT(list->index_height > 2);
+
+	for (i = 0; i < size; i++) {
+		RL_CALL_VERBOSE(rl_list_get_element, RL_FOUND, db, list, (void **)&element, i);
+		EXPECT_LONG(*element, elements[i]);
+		RL_CALL_VERBOSE(rl_list_get_element, RL_FOUND, db, list, (void **)&element, i - size);
+		EXPECT_LONG(*element, elements[i]);
+	}
+
+	void **range = malloc(sizeof(void *) * size);
+	RL_CALL_VERBOSE(rl_list_get_elements, RL_FOUND, db, list, range, 1, size - 1);
+	for (i = 1; i < size; i++) {
+		EXPECT_LONG(*(long *)range[i - 1], elements[i]);
+	}
+	RL_CALL_VERBOSE(rl_list_get_elements, RL_INVALID_PARAMETERS, db, list, range, 1, size);
+	free(range);
+
+	for (j = size; j > 1; j--) {
+		position = rand() % j;
+		RL_CALL_VERBOSE(rl_list_remove_element, RL_OK, db, list, list_page, rand() % 2 ? position : position - j);
+		memmove(&elements[position], &elements[position + 1], sizeof(long) * (j - position - 1));
+		RL_CALL_VERBOSE(rl_list_is_balanced, RL_OK, db, list);
+		if (j % 50 == 0) {
+			RL_CALL_VERBOSE(rl_list_get_element, RL_FOUND, db, list, (void **)&element, j / 3);
+			EXPECT_LONG(*element, elements[j / 3]);
+		}
+	}
+	ASSERT_EQ(list->index, 0);
+	ASSERT_EQ(list->index_height, 0);
+
+	// the list page and its node are the only pages left
+	pages = calloc(db->number_of_pages, sizeof(short));
+	RL_CALL_VERBOSE(rl_list_pages, RL_OK, db, list, pages);
+	for (marked = 1, i = 0; i < db->number_of_pages; i++) {
+		marked += pages[i];
+	}
+	RL_CALL_VERBOSE(count_used_pages, RL_OK, db, &used);
+	EXPECT_LONG(used, marked);
+
+	free(pages);
+	free(elements);
+	rl_close(db);
+	PASS();
+}
+
+TEST index_upgrade_list_test()
+{
+	rlite *db = NULL;
+	rl_list *list = NULL;
+	long i, *element;
+	int retval;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 0, 1);
+	db->number_of_databases = 1;
+	db->page_size = sizeof(long) * 2 + 12;
+	RL_CALL_VERBOSE(rl_list_create, RL_OK, db, &list, &rl_list_type_long);
+	long list_page = db->next_empty_page;
+	RL_CALL_VERBOSE(rl_write, RL_OK, db, list->type->list_type, list_page, list);
+	for (i = 0; i < 20; i++) {
+		element = malloc(sizeof(long));
+		*element = i;
+		RL_CALL_VERBOSE(rl_list_add_element, RL_OK, db, list, list_page, element, -1);
+	}
+
+	// lists written before the index existed are walked node by node
+	list->index = 0;
+	list->index_height = 0;
+	for (i = 0; i < 20; i++) {
+		RL_CALL_VERBOSE(rl_list_get_element, RL_FOUND, db, list, (void **)&element, i);
+		EXPECT_LONG(*element, i);
+	}
+
+	// and get an index the first time they change
+	RL_CALL_VERBOSE(rl_list_remove_element, RL_OK, db, list, list_page, 0);
+	ASSERT(list->index != 0);
+	RL_CALL_VERBOSE(rl_list_is_balanced, RL_OK, db, list);
+	for (i = 0; i < 19; i++) {
+		RL_CALL_VERBOSE(rl_list_get_element, RL_FOUND, db, list, (void **)&element, i);
+		EXPECT_LONG(*element, i + 1);
+	}
+
+	rl_close(db);
+	PASS();
+}
+
 #define DELETE_TESTS_COUNT 5
 SUITE(list_test)
 {
@@ -350,4 +477,10 @@ SUITE(list_test)
 			}
 		}
 	}
+
+	for (i = 0; i < 3; i++) {
+		srand(1);
+		RUN_TESTp(index_list_test, 300, i);
+	}
+	RUN_TEST(index_upgrade_list_test);
 }
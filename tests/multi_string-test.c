@@ -285,6 +285,95 @@ TEST test_setrange(long initialsize, long index, long updatesize)
 	PASS();
 }
 
+TEST test_range_many_pages()
+{
+	int retval;
+	long i, j, size = 300 * 1024, number, start, stop, testsize;
+	unsigned char *data = malloc(sizeof(unsigned char) * size), *testdata, byte;
+	unsigned char localdata[3000];
+
+	rlite *db = NULL;
+	RL_CALL_VERBOSE(rl_open, RL_OK, ":memory:", &db, RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE);
+	srand(1);
+	for (i = 0; i < size; i++) {
+		data[i] = (unsigned char)(rand() / CHAR_MAX);
+	}
+	RL_CALL_VERBOSE(rl_multi_string_set, RL_OK, db, &number, data, size);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+
+	// a single byte only needs the pages on the way to it, not the whole string
+	RL_CALL_VERBOSE(rl_multi_string_getrange, RL_OK, db, number, &testdata, &testsize, size / 2, size / 2);
+	EXPECT_BYTES(&data[size / 2], 1, testdata, testsize);
+	rl_free(testdata);
+	ASSERT(db->read_pages_len < 10);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+
+	for (i = 0; i < 100; i++) {
+		start = rand() % size;
+		stop = start + rand() % 3000;
+		if (stop >= size) {
+			stop = size - 1;
+		}
+		RL_CALL_VERBOSE(rl_multi_string_getrange, RL_OK, db, number, &testdata, &testsize, start, stop);
+		EXPECT_BYTES(&data[start], stop - start + 1, testdata, testsize);
+		rl_free(testdata);
+		RL_CALL_VERBOSE(rl_multi_string_cpyrange, RL_OK, db, number, localdata, &testsize, start, stop);
+		EXPECT_BYTES(&data[start], stop - start + 1, localdata, testsize);
+
+		byte = (unsigned char)i;
+		RL_CALL_VERBOSE(rl_multi_string_setrange, RL_OK, db, number, &byte, 1, stop, NULL);
+		data[stop] = byte;
+		for (j = 0; j < 2000; j++) {
+			localdata[j] = (unsigned char)(i + j);
+		}
+		start = rand() % (size - 2000);
+		RL_CALL_VERBOSE(rl_multi_string_setrange, RL_OK, db, number, localdata, 2000, start, NULL);
+		memcpy(&data[start], localdata, 2000);
+	}
+
+	RL_CALL_VERBOSE(rl_multi_string_get, RL_OK, db, number, &testdata, &testsize);
+	EXPECT_BYTES(data, size, testdata, testsize);
+	rl_free(testdata);
+
+	free(data);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_inline()
+{
+	int retval, cmp;
+	long page, page2, next_empty_page, size;
+	unsigned char data[2000], *testdata;
+	rlite *db = NULL;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	for (size = 0; size < 2000; size++) {
+		data[size] = size % 123;
+	}
+
+	next_empty_page = db->next_empty_page;
+	RL_CALL_VERBOSE(rl_multi_string_set, RL_OK, db, &page, data, 10);
+	// the whole string is in its own page
+	EXPECT_LONG(db->next_empty_page, next_empty_page + 1);
+	RL_CALL_VERBOSE(rl_multi_string_set, RL_OK, db, &page2, data, 2000);
+	RL_CALL_VERBOSE(rl_multi_string_cmp, RL_OK, db, page, page2, &cmp);
+	EXPECT_INT(cmp, -1);
+	RL_CALL_VERBOSE(rl_multi_string_cmp, RL_OK, db, page2, page, &cmp);
+	EXPECT_INT(cmp, 1);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	rl_close(db);
+
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 0);
+	RL_CALL_VERBOSE(rl_multi_string_get, RL_OK, db, page, &testdata, &size);
+	EXPECT_BYTES(data, 10, testdata, size);
+	rl_free(testdata);
+	RL_CALL_VERBOSE(rl_multi_string_delete, RL_OK, db, page);
+	RL_CALL_VERBOSE(rl_multi_string_delete, RL_OK, db, page2);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	rl_close(db);
+	PASS();
+}
+
 SUITE(multi_string_test)
 {
 	RUN_TEST(basic_set_get);
@@ -313,4 +402,7 @@ SUITE(multi_string_test)
 	RUN_TESTp(test_setrange, 1024, 1024, 1024);
 	RUN_TESTp(test_setrange, 1024, 100, 1024);
 	RUN_TESTp(test_setrange, 1024, 1024, 100);
+	RUN_TESTp(test_setrange, 10, 1000, 100);
+	RUN_TEST(test_range_many_pages);
+	RUN_TEST(test_inline);
 }
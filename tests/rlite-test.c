@@ -5,6 +5,7 @@
 #include "util.h"
 #include "../src/rlite/rlite.h"
 #include "rlite/util.h"
+#include "rlite/flock.h"
 
 TEST test_rlite_page_cache()
 {
@@ -12,32 +13,76 @@ TEST test_rlite_page_cache()
 	db->driver_type = RL_MEMORY_DRIVER;
 	int retval;
 	void *obj;
+	rl_page *page;
 
 	int size = 15;
 	db->write_pages_len = 0;
-	db->read_pages = malloc(sizeof(rl_page *) * size);
-	db->read_pages_len = size;
-	db->read_pages_alloc = size;
+	db->write_pages_alloc = 0;
+	db->write_pages_index.alloc = 0;
+	db->read_pages = NULL;
+	db->read_pages_len = 0;
+	db->read_pages_alloc = 0;
+	db->read_pages_index.alloc = 0;
+	db->read_pages_index.slots = NULL;
 	long i;
 	for (i = 0; i < size; i++) {
-		db->read_pages[i] = malloc(sizeof(rl_page));
-		db->read_pages[i]->page_number = i;
-		db->read_pages[i]->type = &rl_data_type_header;
+		page = malloc(sizeof(rl_page));
+		// out of order, the index does not care
+		page->page_number = (i * 7) % size;
+		page->type = &rl_data_type_header;
 		// not a real life scenario, we just need any pointer
-		db->read_pages[i]->obj = db->read_pages[i];
+		page->obj = page;
+		RL_CALL_VERBOSE(rl_add_read_page, RL_OK, db, page);
 	}
 	for (i = 0; i < size; i++) {
-		RL_CALL_VERBOSE(rl_read, RL_FOUND, db, &rl_data_type_header, i, NULL, &obj, 1);
+		RL_CALL_VERBOSE(rl_read, RL_FOUND, db, &rl_data_type_header, db->read_pages[i]->page_number, NULL, &obj, 1);
 		EXPECT_PTR(obj, db->read_pages[i])
 	}
 	for (i = 0; i < size; i++) {
 		rl_free(db->read_pages[i]);
 	}
 	rl_free(db->read_pages);
+	rl_free(db->read_pages_index.slots);
 	rl_free(db);
 	PASS();
 }
 
+TEST test_rlite_many_pages()
+{
+	int retval;
+	rlite *db = NULL;
+	char key[20];
+	unsigned char *value;
+	long i, valuelen;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 0, 1);
+
+	// enough pages to grow the transaction's page arrays many times
+	for (i = 0; i < 2000; i++) {
+		snprintf(key, 20, "key%ld", (i * 7919) % 2000);
+		RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN(key), strlen(key), UNSIGN(key), strlen(key), 0, 0);
+	}
+	ASSERT(db->write_pages_len > 100);
+	for (i = 0; i < 2000; i++) {
+		snprintf(key, 20, "key%ld", i);
+		RL_CALL_VERBOSE(rl_get, RL_OK, db, UNSIGN(key), strlen(key), &value, &valuelen);
+		EXPECT_BYTES(UNSIGN(key), (long)strlen(key), value, valuelen);
+		rl_free(value);
+	}
+	RL_CALL_VERBOSE(rl_sort_write_pages, RL_OK, db);
+	for (i = 1; i < db->write_pages_len; i++) {
+		ASSERT(db->write_pages[i - 1]->page_number < db->write_pages[i]->page_number);
+	}
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	for (i = 0; i < 2000; i += 99) {
+		snprintf(key, 20, "key%ld", i);
+		RL_CALL_VERBOSE(rl_get, RL_OK, db, UNSIGN(key), strlen(key), &value, &valuelen);
+		EXPECT_BYTES(UNSIGN(key), (long)strlen(key), value, valuelen);
+		rl_free(value);
+	}
+	rl_close(db);
+	PASS();
+}
+
 TEST test_has_key()
 {
 	rlite *db = NULL;
@@ -60,6 +105,173 @@ TEST test_has_key()
 	PASS();
 }
 
+TEST test_keep_fd()
+{
+	rlite *db = NULL, *db2 = NULL;
+	int retval;
+	const char *filepath = "rlite-test.rld";
+	if (access(filepath, F_OK) == 0) {
+		unlink(filepath);
+	}
+	RL_CALL_VERBOSE(rl_open, RL_OK, filepath, &db, RLITE_OPEN_CREATE | RLITE_OPEN_READWRITE | RLITE_OPEN_KEEP_FD);
+	const unsigned char *key = (unsigned char *)"random key";
+	long keylen = strlen((char *) key);
+	RL_CALL_VERBOSE(rl_key_set, RL_OK, db, key, keylen, 'C', 529, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+
+	rl_file_driver *driver = db->driver;
+	ASSERT(driver->fp != NULL);
+	ASSERT_EQ(driver->locked, 0);
+	ASSERT_EQ(rl_is_flocked(filepath, RLITE_FLOCK_EX), RL_NOT_FOUND);
+
+	RL_CALL_VERBOSE(rl_open, RL_OK, filepath, &db2, RLITE_OPEN_READWRITE);
+	RL_CALL_VERBOSE(rl_key_get, RL_FOUND, db2, key, keylen, NULL, NULL, NULL, NULL, NULL);
+	RL_CALL_VERBOSE(rl_key_delete, RL_OK, db2, key, keylen);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+	rl_close(db2);
+
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	// a writer locks the database itself only to commit
+	ASSERT_EQ(driver->reserved, 1);
+	ASSERT_EQ(driver->locked, 0);
+	RL_CALL_VERBOSE(rl_key_get, RL_NOT_FOUND, db, key, keylen, NULL, NULL, NULL, NULL, NULL);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_read_during_write()
+{
+	rlite *db = NULL, *db2 = NULL;
+	int retval;
+	unsigned char *testvalue;
+	long testvaluelen;
+	const char *filepath = "rlite-test.rld";
+	if (access(filepath, F_OK) == 0) {
+		unlink(filepath);
+	}
+	RL_CALL_VERBOSE(rl_open, RL_OK, filepath, &db, RLITE_OPEN_CREATE | RLITE_OPEN_READWRITE);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key"), 3, UNSIGN("value"), 5, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(rl_open, RL_OK, filepath, &db2, RLITE_OPEN_READWRITE);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+
+	// an open write transaction does not keep readers out
+	RL_CALL_VERBOSE(rl_select, RL_OK, db, 3);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key"), 3, UNSIGN("value3"), 6, 0, 0);
+	ASSERT_EQ(rl_is_flocked(filepath, RLITE_FLOCK_EX), RL_NOT_FOUND);
+	RL_CALL_VERBOSE(rl_begin_read, RL_OK, db2);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db2, UNSIGN("key"), 3, &testvalue, &testvaluelen);
+	EXPECT_BYTES(UNSIGN("value"), 5, testvalue, testvaluelen);
+	rl_free(testvalue);
+	RL_CALL_VERBOSE(rl_end_read, RL_OK, db2);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+
+	RL_CALL_VERBOSE(rl_begin_read, RL_OK, db2);
+	RL_CALL_VERBOSE(rl_select, RL_OK, db2, 3);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db2, UNSIGN("key"), 3, &testvalue, &testvaluelen);
+	EXPECT_BYTES(UNSIGN("value3"), 6, testvalue, testvaluelen);
+	rl_free(testvalue);
+	RL_CALL_VERBOSE(rl_end_read, RL_OK, db2);
+
+	rl_close(db);
+	rl_close(db2);
+	PASS();
+}
+
+static int give_up_after_three(void *arg, int count)
+{
+	*(int *)arg = count + 1;
+	return count < 3;
+}
+
+TEST test_busy_timeout()
+{
+	rlite *db = NULL, *db2 = NULL;
+	int retval, calls = 0;
+	unsigned long long start;
+	const char *filepath = "rlite-test.rld";
+	if (access(filepath, F_OK) == 0) {
+		unlink(filepath);
+	}
+	RL_CALL_VERBOSE(rl_open, RL_OK, filepath, &db, RLITE_OPEN_CREATE | RLITE_OPEN_READWRITE);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(rl_open_busy_timeout, RL_OK, filepath, &db2, RLITE_OPEN_READWRITE, 30);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+
+	// db is in the middle of a write transaction
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key"), 3, UNSIGN("value"), 5, 0, 0);
+
+	start = rl_ustime();
+	RL_CALL_VERBOSE(rl_set, RL_TIMEOUT, db2, UNSIGN("key"), 3, UNSIGN("other"), 5, 0, 0);
+	ASSERT(rl_ustime() - start >= 30000);
+	ASSERT_EQ(db2->stats.lock_timeouts, 1);
+	ASSERT(db2->stats.lock_wait_us >= 30000);
+	RL_CALL_VERBOSE(rl_discard, RL_OK, db2);
+
+	RL_CALL_VERBOSE(rl_set_busy_handler, RL_OK, db2, give_up_after_three, &calls);
+	RL_CALL_VERBOSE(rl_set, RL_TIMEOUT, db2, UNSIGN("key"), 3, UNSIGN("other"), 5, 0, 0);
+	ASSERT_EQ(calls, 4);
+	ASSERT_EQ(db2->stats.lock_timeouts, 2);
+	RL_CALL_VERBOSE(rl_discard, RL_OK, db2);
+
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db2, UNSIGN("key"), 3, UNSIGN("other"), 5, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+
+	rl_close(db);
+	rl_close(db2);
+	PASS();
+}
+
+TEST test_fd_driver(int flag, int driver_type)
+{
+	rlite *db = NULL, *db2 = NULL;
+	int retval;
+	long i;
+	char key[20];
+	unsigned char *testvalue;
+	long testvaluelen;
+	const char *filepath = "rlite-test.rld";
+	if (access(filepath, F_OK) == 0) {
+		unlink(filepath);
+	}
+	RL_CALL_VERBOSE(rl_open, RL_OK, filepath, &db, RLITE_OPEN_CREATE | RLITE_OPEN_READWRITE | RLITE_OPEN_KEEP_FD | flag);
+	ASSERT_EQ(db->driver_type, driver_type);
+	for (i = 0; i < 200; i++) {
+		snprintf(key, 20, "key%ld", i);
+		RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN(key), strlen(key), UNSIGN(key), strlen(key), 0, 0);
+	}
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+
+	rl_file_driver *driver = db->driver;
+	ASSERT(driver->fd != -1);
+	ASSERT_EQ(driver->fp, NULL);
+	ASSERT_EQ(rl_is_flocked(filepath, RLITE_FLOCK_EX), RL_NOT_FOUND);
+
+	RL_CALL_VERBOSE(rl_open, RL_OK, filepath, &db2, RLITE_OPEN_READWRITE);
+	for (i = 0; i < 200; i++) {
+		snprintf(key, 20, "key%ld", i);
+		RL_CALL_VERBOSE(rl_get, RL_OK, db2, UNSIGN(key), strlen(key), &testvalue, &testvaluelen);
+		EXPECT_BYTES(UNSIGN(key), (long)strlen(key), testvalue, testvaluelen);
+		rl_free(testvalue);
+	}
+	RL_CALL_VERBOSE(rl_set, RL_OK, db2, UNSIGN("key0"), 4, UNSIGN("other"), 5, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+	rl_close(db2);
+
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, UNSIGN("key0"), 4, &testvalue, &testvaluelen);
+	EXPECT_BYTES(UNSIGN("other"), 5, testvalue, testvaluelen);
+	rl_free(testvalue);
+#ifndef RL_DEBUG
+	if (driver_type == RL_MMAP_DRIVER) {
+		ASSERT(driver->map != NULL);
+	}
+#endif
+	rl_close(db);
+	PASS();
+}
+
 #ifdef RL_DEBUG
 TEST rl_open_oom()
 {
@@ -90,7 +302,13 @@ TEST rl_open_oom()
 SUITE(rlite_test)
 {
 	RUN_TEST(test_rlite_page_cache);
+	RUN_TEST(test_rlite_many_pages);
 	RUN_TEST(test_has_key);
+	RUN_TEST(test_keep_fd);
+	RUN_TEST(test_read_during_write);
+	RUN_TEST(test_busy_timeout);
+	RUN_TESTp(test_fd_driver, RLITE_OPEN_PFILE, RL_PFILE_DRIVER);
+	RUN_TESTp(test_fd_driver, RLITE_OPEN_MMAP, RL_MMAP_DRIVER);
 #ifdef RL_DEBUG
 	RUN_TEST(rl_open_oom);
 #endif
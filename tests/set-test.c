@@ -355,6 +355,35 @@ TEST test_smembers() {
 	return 0;
 }
 
+TEST test_smembers_stream() {
+	rliteContext *context = rliteConnect(":memory:", 0);
+
+	char buffer[STREAM_BUFFER_SIZE];
+	rliteReply* reply;
+	size_t argvlen[100];
+
+	{
+		char* argv[100] = {"sadd", "myset", "member", NULL};
+		reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+		EXPECT_REPLY_INTEGER(reply, 1);
+		rliteFreeReplyObject(reply);
+	}
+
+	// built as a whole and handed out afterwards
+	{
+		char* argv[100] = {"smembers", "myset", NULL};
+		memset(buffer, 0, sizeof(buffer));
+		reply = rliteCommandArgvStream(context, populateArgvlen(argv, argvlen), argv, argvlen, stream_join, buffer);
+		EXPECT_REPLY_LEN(reply, 1);
+		ASSERT_EQ(reply->element, NULL);
+		ASSERT_STR_EQ(buffer, "member");
+		rliteFreeReplyObject(reply);
+	}
+
+	rliteFree(context);
+	PASS();
+}
+
 TEST test_sinter() {
 	rliteContext *context = rliteConnect(":memory:", 0);
 	size_t argvlen[100];
@@ -529,6 +558,7 @@ SUITE(set_test)
 	RUN_TEST(test_srandmember_10_non_unique);
 	RUN_TEST(test_srem);
 	RUN_TEST(test_smembers);
+	RUN_TEST(test_smembers_stream);
 	RUN_TEST(test_sinter);
 	RUN_TEST(test_sinterstore);
 	RUN_TEST(test_sunion);
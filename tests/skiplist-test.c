@@ -236,6 +236,169 @@ TEST basic_skiplist_iterator_test(int commit)
 	PASS();
 }
 
+TEST skiplist_packed_nodes_test(int commit)
+{
+	rlite *db;
+	void *tmp;
+	int retval;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, commit, 1);
+	rl_skiplist *skiplist;
+	rl_skiplist_node *node;
+	rl_skiplist_iterator *iterator;
+	RL_CALL_VERBOSE(rl_skiplist_create, RL_OK, db, &skiplist);
+	long skiplist_page = db->next_empty_page;
+	RL_CALL_VERBOSE(rl_write, RL_OK, db, &rl_data_type_skiplist, skiplist_page, skiplist);
+
+	long i, pages = 0, last_page = 0;
+	unsigned char data[1];
+	for (i = 0; i < TEST_SIZE; i++) {
+		data[0] = i;
+		RL_CALL_VERBOSE(rl_skiplist_add, RL_OK, db, skiplist, skiplist_page, i, data, 1);
+	}
+	if (commit) {
+		RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+		RL_CALL_VERBOSE(rl_read, RL_FOUND, db, &rl_data_type_skiplist, skiplist_page, NULL, &tmp, 1);
+		skiplist = tmp;
+	}
+	RL_CALL_VERBOSE(rl_skiplist_is_balanced, RL_OK, db, skiplist);
+
+	// neighbours share pages
+	RL_CALL_VERBOSE(rl_skiplist_iterator_create, RL_OK, db, &iterator, skiplist, 0, 1, 0);
+	i = 0;
+	while (1) {
+		if (iterator->node_page && RL_SKIPLIST_NODE_PAGE(iterator->node_page) != last_page) {
+			last_page = RL_SKIPLIST_NODE_PAGE(iterator->node_page);
+			pages++;
+		}
+		if ((retval = rl_skiplist_iterator_next(iterator, &node)) != RL_OK) {
+			break;
+		}
+		EXPECT_DOUBLE(node->score, i);
+		i++;
+	}
+	EXPECT_INT(retval, RL_END);
+	EXPECT_LONG(i, TEST_SIZE);
+	ASSERT(pages * 10 <= TEST_SIZE);
+
+	for (i = 0; i < TEST_SIZE; i++) {
+		data[0] = i;
+		RL_CALL2_VERBOSE(rl_skiplist_delete, RL_OK, RL_DELETED, db, skiplist, skiplist_page, i, data, 1);
+		if (retval == RL_OK) {
+			RL_CALL_VERBOSE(rl_skiplist_is_balanced, RL_OK, db, skiplist);
+		}
+	}
+	EXPECT_INT(retval, RL_DELETED);
+	rl_close(db);
+	PASS();
+}
+
+static int raw_page_serialize(rlite *db, void *obj, unsigned char *data)
+{
+	memcpy(data, obj, db->page_size);
+	return RL_OK;
+}
+
+static int raw_page_destroy(rlite *UNUSED(db), void *obj)
+{
+	free(obj);
+	return RL_OK;
+}
+
+static rl_data_type raw_page_type = {
+	"raw_page_type",
+	raw_page_serialize,
+	NULL,
+	raw_page_destroy,
+};
+
+// a node page as written before nodes were packed, one node per page
+static unsigned char *single_node_page(rlite *db, long value, double score, long left, long num_levels, long right)
+{
+	unsigned char *data = calloc(db->page_size, 1);
+	put_4bytes(data, value);
+	put_double(&data[4], score);
+	put_4bytes(&data[12], left);
+	put_4bytes(&data[16], num_levels);
+	put_4bytes(&data[20], right);
+	put_4bytes(&data[24], right ? 1 : 0);
+	return data;
+}
+
+TEST skiplist_single_node_pages_test()
+{
+	rlite *db;
+	void *tmp;
+	int retval;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	rl_skiplist *skiplist;
+	rl_skiplist_node *node;
+	rl_skiplist_iterator *iterator;
+	unsigned char data[1], *page_data;
+	long i, values[3];
+	for (i = 0; i < 3; i++) {
+		data[0] = i;
+		RL_CALL_VERBOSE(rl_multi_string_set, RL_OK, db, &values[i], data, 1);
+	}
+
+	// header page followed by the index node and a page for each element
+	long skiplist_page = db->next_empty_page;
+	page_data = calloc(db->page_size, 1);
+	put_4bytes(&page_data[0], skiplist_page + 1);
+	put_4bytes(&page_data[4], skiplist_page + 4);
+	put_4bytes(&page_data[8], 3);
+	put_4bytes(&page_data[12], 1);
+	RL_CALL_VERBOSE(rl_write, RL_OK, db, &raw_page_type, skiplist_page, page_data);
+	page_data = single_node_page(db, 0, 0.0, 0, RL_SKIPLIST_MAXLEVEL, skiplist_page + 2);
+	RL_CALL_VERBOSE(rl_write, RL_OK, db, &raw_page_type, skiplist_page + 1, page_data);
+	for (i = 0; i < 3; i++) {
+		page_data = single_node_page(db, values[i], i, i ? skiplist_page + 1 + i : 0, 1, i < 2 ? skiplist_page + 3 + i : 0);
+		RL_CALL_VERBOSE(rl_write, RL_OK, db, &raw_page_type, skiplist_page + 2 + i, page_data);
+	}
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	rl_close(db);
+
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 0);
+	RL_CALL_VERBOSE(rl_read, RL_FOUND, db, &rl_data_type_skiplist, skiplist_page, NULL, &tmp, 1);
+	skiplist = tmp;
+	EXPECT_LONG(skiplist->packed, 0);
+	RL_CALL_VERBOSE(rl_skiplist_is_balanced, RL_OK, db, skiplist);
+
+	RL_CALL_VERBOSE(rl_skiplist_iterator_create, RL_OK, db, &iterator, skiplist, 0, 1, 0);
+	i = 0;
+	while ((retval = rl_skiplist_iterator_next(iterator, &node)) == RL_OK) {
+		EXPECT_DOUBLE(node->score, i);
+		EXPECT_LONG(node->value, values[i]);
+		i++;
+	}
+	EXPECT_INT(retval, RL_END);
+	EXPECT_LONG(i, 3);
+
+	RL_CALL_VERBOSE(rl_skiplist_node_by_rank, RL_OK, db, skiplist, 1, &node, NULL);
+	EXPECT_DOUBLE(node->score, 1.0);
+
+	// changes keep the layout the skiplist was written with
+	for (i = 3; i < TEST_SIZE; i++) {
+		data[0] = i;
+		RL_CALL_VERBOSE(rl_skiplist_add, RL_OK, db, skiplist, skiplist_page, i, data, 1);
+	}
+	data[0] = 1;
+	RL_CALL_VERBOSE(rl_skiplist_delete, RL_OK, db, skiplist, skiplist_page, 1, data, 1);
+	RL_CALL_VERBOSE(rl_skiplist_is_balanced, RL_OK, db, skiplist);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	rl_close(db);
+
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 0);
+	RL_CALL_VERBOSE(rl_read, RL_FOUND, db, &rl_data_type_skiplist, skiplist_page, NULL, &tmp, 1);
+	skiplist = tmp;
+	EXPECT_LONG(skiplist->packed, 0);
+	EXPECT_LONG(skiplist->size, TEST_SIZE - 1);
+	RL_CALL_VERBOSE(rl_skiplist_is_balanced, RL_OK, db, skiplist);
+	RL_CALL_VERBOSE(rl_skiplist_node_by_rank, RL_OK, db, skiplist, 1, &node, NULL);
+	EXPECT_DOUBLE(node->score, 2.0);
+	rl_close(db);
+	PASS();
+}
+
 SUITE(skiplist_test)
 {
 	int i, j;
@@ -248,6 +411,8 @@ SUITE(skiplist_test)
 	for (i = 0; i < 3; i++) {
 		RUN_TEST1(basic_skiplist_delete_node_test, i);
 		RUN_TEST1(basic_skiplist_iterator_test, i);
+		RUN_TEST1(skiplist_packed_nodes_test, i);
 	}
 	RUN_TEST(basic_skiplist_node_by_rank);
+	RUN_TEST(skiplist_single_node_pages_test);
 }
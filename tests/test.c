@@ -3,6 +3,7 @@
 #include "greatest.h"
 
 extern SUITE(btree_test);
+extern SUITE(cache_test);
 extern SUITE(concurrency_test);
 extern SUITE(db_test);
 extern SUITE(rlite_test);
@@ -25,6 +26,7 @@ extern SUITE(sort_test);
 extern SUITE(wal_test);
 extern SUITE(zset_test);
 extern SUITE(hmulti_test);
+extern SUITE(hslowlog_test);
 extern SUITE(hsort_test);
 extern SUITE(scripting_test);
 extern SUITE(echo_test);
@@ -43,6 +45,7 @@ GREATEST_MAIN_DEFS();
 int main(int argc, char **argv) {
 	GREATEST_MAIN_BEGIN();
 	RUN_SUITE(btree_test);
+	RUN_SUITE(cache_test);
 	RUN_SUITE(concurrency_test);
 	RUN_SUITE(db_test);
 	RUN_SUITE(rlite_test);
@@ -65,6 +68,7 @@ int main(int argc, char **argv) {
 	RUN_SUITE(wal_test);
 	RUN_SUITE(zset_test);
 	RUN_SUITE(hmulti_test);
+	RUN_SUITE(hslowlog_test);
 	RUN_SUITE(hsort_test);
 	RUN_SUITE(scripting_test);
 	RUN_SUITE(echo_test);
@@ -546,6 +546,135 @@ TEST hiterator_destroy()
 	PASS();
 }
 
+TEST test_hash_packed(int _commit)
+{
+	int retval;
+	rlite *db = NULL;
+	unsigned char *key = UNSIGN("my key");
+	long keylen = strlen((char *)key);
+	char field[20], value[20];
+	unsigned char *data;
+	long i, datalen, len, next_empty_page;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, _commit, 1);
+
+	RL_CALL_VERBOSE(rl_hset, RL_OK, db, key, keylen, UNSIGN("f"), 1, UNSIGN("v"), 1, NULL, 1);
+	next_empty_page = db->next_empty_page;
+	for (i = 0; i < 200; i++) {
+		snprintf(field, 20, "field%ld", i);
+		snprintf(value, 20, "value%ld", i);
+		RL_CALL_VERBOSE(rl_hset, RL_OK, db, key, keylen, UNSIGN(field), strlen(field), UNSIGN(value), strlen(value), NULL, 1);
+		if (i == 10) {
+			// small hashes live in a single page
+			EXPECT_LONG(db->next_empty_page, next_empty_page);
+			RL_BALANCED();
+		}
+	}
+	RL_BALANCED();
+
+	RL_CALL_VERBOSE(rl_hlen, RL_OK, db, key, keylen, &len);
+	EXPECT_LONG(len, 201);
+	for (i = 0; i < 200; i++) {
+		snprintf(field, 20, "field%ld", i);
+		snprintf(value, 20, "value%ld", i);
+		RL_CALL_VERBOSE(rl_hget, RL_FOUND, db, key, keylen, UNSIGN(field), strlen(field), &data, &datalen);
+		EXPECT_BYTES(UNSIGN(value), (long)strlen(value), data, datalen);
+		rl_free(data);
+	}
+
+	for (i = 0; i < 200; i++) {
+		snprintf(field, 20, "field%ld", i);
+		unsigned char *fields[1] = {UNSIGN(field)};
+		long fieldslen[1] = {strlen(field)};
+		RL_CALL_VERBOSE(rl_hdel, RL_OK, db, key, keylen, 1, fields, fieldslen, NULL);
+	}
+	RL_BALANCED();
+	RL_CALL_VERBOSE(rl_hget, RL_FOUND, db, key, keylen, UNSIGN("f"), 1, &data, &datalen);
+	EXPECT_BYTES(UNSIGN("v"), 1, data, datalen);
+	rl_free(data);
+
+	rl_close(db);
+	PASS();
+}
+
+TEST test_hash_packed_order(int _commit)
+{
+	int retval;
+	rlite *db = NULL;
+	unsigned char *key = UNSIGN("my key");
+	long keylen = strlen((char *)key);
+	unsigned char *fields[3] = {UNSIGN("a"), UNSIGN("b"), UNSIGN("c")};
+	long fieldslen[3] = {1, 1, 1};
+	unsigned char *datas[3] = {UNSIGN("1"), UNSIGN("2"), UNSIGN("3")};
+	long dataslen[3] = {1, 1, 1};
+	unsigned char *order[3], *f, bigvalue[2000];
+	long i, fl;
+	rl_hash_iterator *iterator;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, _commit, 1);
+
+	RL_CALL_VERBOSE(rl_hmset, RL_OK, db, key, keylen, 3, fields, fieldslen, datas, dataslen);
+	RL_BALANCED();
+	RL_CALL_VERBOSE(rl_hgetall, RL_OK, db, &iterator, key, keylen);
+	i = 0;
+	while ((retval = rl_hash_iterator_next(iterator, NULL, &f, &fl, NULL, NULL, NULL)) == RL_OK) {
+		order[i++] = f;
+	}
+	EXPECT_INT(retval, RL_END);
+	EXPECT_LONG(i, 3);
+
+	// a value larger than a page turns the hash into a btree
+	memset(bigvalue, 'x', sizeof(bigvalue));
+	RL_CALL_VERBOSE(rl_hset, RL_OK, db, key, keylen, UNSIGN("big"), 3, bigvalue, sizeof(bigvalue), NULL, 1);
+	RL_BALANCED();
+	unsigned char *big[1] = {UNSIGN("big")};
+	long biglen[1] = {3};
+	RL_CALL_VERBOSE(rl_hdel, RL_OK, db, key, keylen, 1, big, biglen, NULL);
+
+	RL_CALL_VERBOSE(rl_hgetall, RL_OK, db, &iterator, key, keylen);
+	i = 0;
+	while ((retval = rl_hash_iterator_next(iterator, NULL, &f, &fl, NULL, NULL, NULL)) == RL_OK) {
+		EXPECT_BYTES(order[i], 1, f, fl);
+		rl_free(order[i]);
+		rl_free(f);
+		i++;
+	}
+	EXPECT_INT(retval, RL_END);
+	EXPECT_LONG(i, 3);
+
+	RL_CALL_VERBOSE(rl_hdel, RL_OK, db, key, keylen, 3, fields, fieldslen, NULL);
+	RL_CALL_VERBOSE(rl_key_get, RL_NOT_FOUND, db, key, keylen, NULL, NULL, NULL, NULL, NULL);
+	RL_BALANCED();
+
+	rl_close(db);
+	PASS();
+}
+
+TEST test_hash_packed_delete(int _commit)
+{
+	int retval;
+	rlite *db = NULL;
+	unsigned char *key = UNSIGN("my key");
+	long keylen = strlen((char *)key);
+	unsigned char *fields[2] = {UNSIGN("a"), UNSIGN("b")};
+	long fieldslen[2] = {1, 1};
+	long delcount;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, _commit, 1);
+
+	RL_CALL_VERBOSE(rl_hset, RL_OK, db, key, keylen, fields[0], 1, UNSIGN("1"), 1, NULL, 1);
+	RL_CALL_VERBOSE(rl_hset, RL_OK, db, key, keylen, fields[1], 1, UNSIGN("2"), 1, NULL, 1);
+	RL_BALANCED();
+	RL_CALL_VERBOSE(rl_hdel, RL_OK, db, key, keylen, 2, fields, fieldslen, &delcount);
+	EXPECT_LONG(delcount, 2);
+	RL_CALL_VERBOSE(rl_key_get, RL_NOT_FOUND, db, key, keylen, NULL, NULL, NULL, NULL, NULL);
+	RL_BALANCED();
+
+	RL_CALL_VERBOSE(rl_hset, RL_OK, db, key, keylen, fields[0], 1, UNSIGN("1"), 1, NULL, 1);
+	RL_CALL_VERBOSE(rl_key_delete_with_value, RL_OK, db, key, keylen);
+	RL_BALANCED();
+
+	rl_close(db);
+	PASS();
+}
+
 SUITE(type_hash_test)
 {
 	int i;
@@ -564,6 +693,9 @@ SUITE(type_hash_test)
 		RUN_TEST1(basic_test_hincrbyfloat_hget, i);
 		RUN_TEST1(basic_test_hincrbyfloat_invalid, i);
 		RUN_TEST1(basic_test_hset_del, i);
+		RUN_TEST1(test_hash_packed, i);
+		RUN_TEST1(test_hash_packed_order, i);
+		RUN_TEST1(test_hash_packed_delete, i);
 	}
 	RUN_TEST(hiterator_destroy);
 }
@@ -668,6 +668,130 @@ TEST fuzzy_test_srandmembers_unique(long size, int _commit)
 	PASS();
 }
 
+TEST test_set_packed(int _commit)
+{
+	int retval;
+	rlite *db = NULL;
+	unsigned char *key = UNSIGN("my key");
+	long keylen = strlen((char *)key);
+	char member[20];
+	unsigned char *members[1] = {UNSIGN(member)};
+	long memberslen[1], i, card, next_empty_page;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, _commit, 1);
+
+	unsigned char *m[1] = {UNSIGN("m")};
+	long mlen[1] = {1};
+	RL_CALL_VERBOSE(rl_sadd, RL_OK, db, key, keylen, 1, m, mlen, NULL);
+	next_empty_page = db->next_empty_page;
+	for (i = 0; i < 200; i++) {
+		snprintf(member, 20, "member%ld", i);
+		memberslen[0] = strlen(member);
+		RL_CALL_VERBOSE(rl_sadd, RL_OK, db, key, keylen, 1, members, memberslen, NULL);
+		if (i == 10) {
+			// small sets live in a single page
+			EXPECT_LONG(db->next_empty_page, next_empty_page);
+			RL_BALANCED();
+		}
+	}
+	RL_BALANCED();
+
+	RL_CALL_VERBOSE(rl_scard, RL_OK, db, key, keylen, &card);
+	EXPECT_LONG(card, 201);
+	for (i = 0; i < 200; i++) {
+		snprintf(member, 20, "member%ld", i);
+		RL_CALL_VERBOSE(rl_sismember, RL_FOUND, db, key, keylen, UNSIGN(member), strlen(member));
+	}
+
+	for (i = 0; i < 200; i++) {
+		snprintf(member, 20, "member%ld", i);
+		memberslen[0] = strlen(member);
+		RL_CALL_VERBOSE(rl_srem, RL_OK, db, key, keylen, 1, members, memberslen, NULL);
+	}
+	RL_BALANCED();
+	RL_CALL_VERBOSE(rl_scard, RL_OK, db, key, keylen, &card);
+	EXPECT_LONG(card, 1);
+	RL_CALL_VERBOSE(rl_sismember, RL_FOUND, db, key, keylen, UNSIGN("m"), 1);
+
+	rl_close(db);
+	PASS();
+}
+
+TEST test_set_packed_order(int _commit)
+{
+	int retval;
+	rlite *db = NULL;
+	unsigned char *key = UNSIGN("my key");
+	long keylen = strlen((char *)key);
+	unsigned char *members[3] = {UNSIGN("a"), UNSIGN("b"), UNSIGN("c")};
+	long memberslen[3] = {1, 1, 1};
+	unsigned char *order[3], *member, bigmember[2000];
+	unsigned char *big[1] = {bigmember};
+	long biglen[1] = {sizeof(bigmember)};
+	long i, memberlen;
+	rl_set_iterator *iterator;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, _commit, 1);
+
+	RL_CALL_VERBOSE(rl_sadd, RL_OK, db, key, keylen, 3, members, memberslen, NULL);
+	RL_BALANCED();
+	RL_CALL_VERBOSE(rl_smembers, RL_OK, db, &iterator, key, keylen);
+	i = 0;
+	while ((retval = rl_set_iterator_next(iterator, NULL, &member, &memberlen)) == RL_OK) {
+		order[i++] = member;
+	}
+	EXPECT_INT(retval, RL_END);
+	EXPECT_LONG(i, 3);
+
+	// a member larger than a page turns the set into a btree
+	memset(bigmember, 'x', sizeof(bigmember));
+	RL_CALL_VERBOSE(rl_sadd, RL_OK, db, key, keylen, 1, big, biglen, NULL);
+	RL_BALANCED();
+	RL_CALL_VERBOSE(rl_srem, RL_OK, db, key, keylen, 1, big, biglen, NULL);
+
+	RL_CALL_VERBOSE(rl_smembers, RL_OK, db, &iterator, key, keylen);
+	i = 0;
+	while ((retval = rl_set_iterator_next(iterator, NULL, &member, &memberlen)) == RL_OK) {
+		EXPECT_BYTES(order[i], 1, member, memberlen);
+		rl_free(order[i]);
+		rl_free(member);
+		i++;
+	}
+	EXPECT_INT(retval, RL_END);
+	EXPECT_LONG(i, 3);
+
+	RL_CALL_VERBOSE(rl_srem, RL_OK, db, key, keylen, 3, members, memberslen, NULL);
+	RL_CALL_VERBOSE(rl_key_get, RL_NOT_FOUND, db, key, keylen, NULL, NULL, NULL, NULL, NULL);
+	RL_BALANCED();
+
+	rl_close(db);
+	PASS();
+}
+
+TEST test_set_packed_delete(int _commit)
+{
+	int retval;
+	rlite *db = NULL;
+	unsigned char *key = UNSIGN("my key");
+	long keylen = strlen((char *)key);
+	unsigned char *members[2] = {UNSIGN("a"), UNSIGN("b")};
+	long memberslen[2] = {1, 1};
+	long delcount;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, _commit, 1);
+
+	RL_CALL_VERBOSE(rl_sadd, RL_OK, db, key, keylen, 2, members, memberslen, NULL);
+	RL_BALANCED();
+	RL_CALL_VERBOSE(rl_srem, RL_OK, db, key, keylen, 2, members, memberslen, &delcount);
+	EXPECT_LONG(delcount, 2);
+	RL_CALL_VERBOSE(rl_key_get, RL_NOT_FOUND, db, key, keylen, NULL, NULL, NULL, NULL, NULL);
+	RL_BALANCED();
+
+	RL_CALL_VERBOSE(rl_sadd, RL_OK, db, key, keylen, 1, members, memberslen, NULL);
+	RL_CALL_VERBOSE(rl_key_delete_with_value, RL_OK, db, key, keylen);
+	RL_BALANCED();
+
+	rl_close(db);
+	PASS();
+}
+
 SUITE(type_set_test)
 {
 	int i;
@@ -686,6 +810,9 @@ SUITE(type_set_test)
 		RUN_TEST1(basic_test_sadd_sunion, i);
 		RUN_TEST1(basic_test_sadd_sunionstore, i);
 		RUN_TEST1(basic_test_sadd_sunionstore_empty, i);
+		RUN_TEST1(test_set_packed, i);
+		RUN_TEST1(test_set_packed_order, i);
+		RUN_TEST1(test_set_packed_delete, i);
 		RUN_TESTp(fuzzy_test_srandmembers_unique, 10, i);
 		RUN_TESTp(fuzzy_test_srandmembers_unique, 1000, i);
 	}
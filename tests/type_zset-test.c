@@ -983,6 +983,248 @@ TEST regression_zrangebyscore(int _commit)
 
 #define SADD_ZINTERSTORE_TESTS 4
 #define ZINTERSTORE_TESTS 7
+TEST test_zset_packed(int _commit)
+{
+	int retval;
+	rlite *db = NULL;
+	unsigned char *key = UNSIGN("my key");
+	long keylen = strlen((char *)key);
+	char member[20];
+	unsigned char bigmember[2000];
+	double score;
+	long i, card, rank, next_empty_page;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, _commit, 1);
+
+	RL_CALL_VERBOSE(rl_zadd, RL_OK, db, key, keylen, -1.0, UNSIGN("m"), 1);
+	next_empty_page = db->next_empty_page;
+	for (i = 0; i < 200; i++) {
+		snprintf(member, 20, "member%ld", i);
+		RL_CALL_VERBOSE(rl_zadd, RL_OK, db, key, keylen, (double)(200 - i), UNSIGN(member), strlen(member));
+		if (i == 10) {
+			// small sorted sets live in a single page
+			EXPECT_LONG(db->next_empty_page, next_empty_page);
+			RL_BALANCED();
+		}
+	}
+	RL_BALANCED();
+
+	RL_CALL_VERBOSE(rl_zcard, RL_OK, db, key, keylen, &card);
+	EXPECT_LONG(card, 201);
+	for (i = 0; i < 200; i++) {
+		snprintf(member, 20, "member%ld", i);
+		RL_CALL_VERBOSE(rl_zscore, RL_FOUND, db, key, keylen, UNSIGN(member), strlen(member), &score);
+		EXPECT_DOUBLE(score, (double)(200 - i));
+		RL_CALL_VERBOSE(rl_zrank, RL_FOUND, db, key, keylen, UNSIGN(member), strlen(member), &rank);
+		EXPECT_LONG(rank, 200 - i);
+	}
+
+	for (i = 0; i < 200; i++) {
+		snprintf(member, 20, "member%ld", i);
+		unsigned char *members[1] = {UNSIGN(member)};
+		long memberslen[1] = {strlen(member)};
+		RL_CALL_VERBOSE(rl_zrem, RL_OK, db, key, keylen, 1, members, memberslen, &card);
+		EXPECT_LONG(card, 1);
+	}
+	RL_BALANCED();
+	RL_CALL_VERBOSE(rl_zscore, RL_FOUND, db, key, keylen, UNSIGN("m"), 1, &score);
+	EXPECT_DOUBLE(score, -1.0);
+
+	// a member larger than a page turns the sorted set into a skiplist
+	memset(bigmember, 'x', sizeof(bigmember));
+	RL_CALL_VERBOSE(rl_zincrby, RL_OK, db, key, keylen, 2.5, bigmember, sizeof(bigmember), &score);
+	EXPECT_DOUBLE(score, 2.5);
+	RL_BALANCED();
+	RL_CALL_VERBOSE(rl_zrank, RL_FOUND, db, key, keylen, bigmember, sizeof(bigmember), &rank);
+	EXPECT_LONG(rank, 1);
+	RL_CALL_VERBOSE(rl_zscore, RL_FOUND, db, key, keylen, UNSIGN("m"), 1, &score);
+	EXPECT_DOUBLE(score, -1.0);
+
+	rl_close(db);
+	PASS();
+}
+
+TEST expect_same_zset_iterators(int retval1, rl_zset_iterator *iterator1, int retval2, rl_zset_iterator *iterator2)
+{
+	int retval;
+	unsigned char *member1, *member2;
+	long member1len, member2len;
+	double score1, score2;
+
+	EXPECT_INT(retval1, retval2);
+	if (retval1 != RL_OK) {
+		PASS();
+	}
+	EXPECT_LONG(iterator1->size, iterator2->size);
+	while ((retval = rl_zset_iterator_next(iterator1, NULL, &score1, &member1, &member1len)) == RL_OK) {
+		RL_CALL_VERBOSE(rl_zset_iterator_next, RL_OK, iterator2, NULL, &score2, &member2, &member2len);
+		EXPECT_DOUBLE(score1, score2);
+		EXPECT_BYTES(member1, member1len, member2, member2len);
+		rl_free(member1);
+		rl_free(member2);
+	}
+	EXPECT_INT(retval, RL_END);
+	RL_CALL_VERBOSE(rl_zset_iterator_next, RL_END, iterator2, NULL, NULL, NULL, NULL);
+	PASS();
+}
+
+TEST test_zset_packed_ranges(int _commit)
+{
+	int retval, retval2;
+	rlite *db = NULL;
+	unsigned char *keys[2] = {UNSIGN("packed"), UNSIGN("converted")};
+	long keyslen[2] = {6, 9};
+	unsigned char *lexkeys[2] = {UNSIGN("lexpacked"), UNSIGN("lexconverted")};
+	long lexkeyslen[2] = {9, 12};
+	unsigned char bigmember[2000], member[3];
+	unsigned char *big[1] = {bigmember};
+	long biglen[1] = {sizeof(bigmember)};
+	rl_zset_iterator *iterator, *iterator2;
+	rl_zrangespec range;
+	long i, j, k, value, value2;
+	double scores[] = {-INFINITY, -1, 0, 1, 1.5, 2, 4, 5, INFINITY};
+	unsigned char *lexbounds[] = {UNSIGN("-"), UNSIGN("+"), UNSIGN("[a"), UNSIGN("(a"), UNSIGN("[c"), UNSIGN("(cC"), UNSIGN("[cC"), UNSIGN("[z")};
+	long lexboundslen[] = {1, 1, 2, 2, 2, 3, 3, 2};
+	long nscores = sizeof(scores) / sizeof(scores[0]), nlexbounds = sizeof(lexbounds) / sizeof(lexbounds[0]);
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, _commit, 1);
+
+	// the same members in a packed sorted set and in one turned into a skiplist
+	memset(bigmember, 'x', sizeof(bigmember));
+	for (k = 0; k < 2; k++) {
+		if (k == 1) {
+			RL_CALL_VERBOSE(rl_zadd, RL_OK, db, keys[k], keyslen[k], 0, bigmember, sizeof(bigmember));
+			RL_CALL_VERBOSE(rl_zadd, RL_OK, db, lexkeys[k], lexkeyslen[k], 0, bigmember, sizeof(bigmember));
+		}
+		for (i = 0; i < 30; i++) {
+			member[0] = 'a' + (i / 2);
+			member[1] = 'A' + i;
+			RL_CALL_VERBOSE(rl_zadd, RL_OK, db, keys[k], keyslen[k], (double)(i % 5), member, ((i & 1) == 0) ? 1 : 2);
+			RL_CALL_VERBOSE(rl_zadd, RL_OK, db, lexkeys[k], lexkeyslen[k], 0, member, ((i & 1) == 0) ? 1 : 2);
+		}
+		if (k == 1) {
+			RL_CALL_VERBOSE(rl_zrem, RL_OK, db, keys[k], keyslen[k], 1, big, biglen, &value);
+			RL_CALL_VERBOSE(rl_zrem, RL_OK, db, lexkeys[k], lexkeyslen[k], 1, big, biglen, &value);
+		}
+	}
+	RL_BALANCED();
+
+	for (i = -32; i < 32; i += 3) {
+		for (j = -32; j < 32; j += 5) {
+			retval = rl_zrange(db, keys[0], keyslen[0], i, j, &iterator);
+			retval2 = rl_zrange(db, keys[1], keyslen[1], i, j, &iterator2);
+			RL_CALL_VERBOSE(expect_same_zset_iterators, 0, retval, iterator, retval2, iterator2);
+			retval = rl_zrevrange(db, keys[0], keyslen[0], i, j, &iterator);
+			retval2 = rl_zrevrange(db, keys[1], keyslen[1], i, j, &iterator2);
+			RL_CALL_VERBOSE(expect_same_zset_iterators, 0, retval, iterator, retval2, iterator2);
+		}
+	}
+
+	for (i = 0; i < nscores; i++) {
+		for (j = 0; j < nscores; j++) {
+			for (k = 0; k < 4; k++) {
+				range.min = scores[i];
+				range.minex = k & 1;
+				range.max = scores[j];
+				range.maxex = k & 2;
+				retval = rl_zcount(db, keys[0], keyslen[0], &range, &value);
+				retval2 = rl_zcount(db, keys[1], keyslen[1], &range, &value2);
+				EXPECT_INT(retval, retval2);
+				if (retval == RL_OK) {
+					EXPECT_LONG(value, value2);
+				}
+				retval = rl_zrangebyscore(db, keys[0], keyslen[0], &range, k, k == 3 ? 2 : -1, &iterator);
+				retval2 = rl_zrangebyscore(db, keys[1], keyslen[1], &range, k, k == 3 ? 2 : -1, &iterator2);
+				RL_CALL_VERBOSE(expect_same_zset_iterators, 0, retval, iterator, retval2, iterator2);
+				retval = rl_zrevrangebyscore(db, keys[0], keyslen[0], &range, k, k == 3 ? 2 : -1, &iterator);
+				retval2 = rl_zrevrangebyscore(db, keys[1], keyslen[1], &range, k, k == 3 ? 2 : -1, &iterator2);
+				RL_CALL_VERBOSE(expect_same_zset_iterators, 0, retval, iterator, retval2, iterator2);
+			}
+		}
+	}
+
+	for (i = 0; i < nlexbounds; i++) {
+		for (j = 0; j < nlexbounds; j++) {
+			retval = rl_zlexcount(db, lexkeys[0], lexkeyslen[0], lexbounds[i], lexboundslen[i], lexbounds[j], lexboundslen[j], &value);
+			retval2 = rl_zlexcount(db, lexkeys[1], lexkeyslen[1], lexbounds[i], lexboundslen[i], lexbounds[j], lexboundslen[j], &value2);
+			EXPECT_INT(retval, retval2);
+			if (retval == RL_OK) {
+				EXPECT_LONG(value, value2);
+			}
+			retval = rl_zrangebylex(db, lexkeys[0], lexkeyslen[0], lexbounds[i], lexboundslen[i], lexbounds[j], lexboundslen[j], 1, -1, &iterator);
+			retval2 = rl_zrangebylex(db, lexkeys[1], lexkeyslen[1], lexbounds[i], lexboundslen[i], lexbounds[j], lexboundslen[j], 1, -1, &iterator2);
+			RL_CALL_VERBOSE(expect_same_zset_iterators, 0, retval, iterator, retval2, iterator2);
+			retval = rl_zrevrangebylex(db, lexkeys[0], lexkeyslen[0], lexbounds[j], lexboundslen[j], lexbounds[i], lexboundslen[i], 0, 3, &iterator);
+			retval2 = rl_zrevrangebylex(db, lexkeys[1], lexkeyslen[1], lexbounds[j], lexboundslen[j], lexbounds[i], lexboundslen[i], 0, 3, &iterator2);
+			RL_CALL_VERBOSE(expect_same_zset_iterators, 0, retval, iterator, retval2, iterator2);
+		}
+	}
+
+	for (i = 0; i < 30; i++) {
+		member[0] = 'a' + (i / 2);
+		member[1] = 'A' + i;
+		RL_CALL_VERBOSE(rl_zrank, RL_FOUND, db, keys[0], keyslen[0], member, ((i & 1) == 0) ? 1 : 2, &value);
+		RL_CALL_VERBOSE(rl_zrank, RL_FOUND, db, keys[1], keyslen[1], member, ((i & 1) == 0) ? 1 : 2, &value2);
+		EXPECT_LONG(value, value2);
+		RL_CALL_VERBOSE(rl_zrevrank, RL_FOUND, db, keys[0], keyslen[0], member, ((i & 1) == 0) ? 1 : 2, &value);
+		RL_CALL_VERBOSE(rl_zrevrank, RL_FOUND, db, keys[1], keyslen[1], member, ((i & 1) == 0) ? 1 : 2, &value2);
+		EXPECT_LONG(value, value2);
+	}
+
+	for (k = 0; k < 2; k++) {
+		range.min = 1.5;
+		range.minex = 0;
+		range.max = 2.5;
+		range.maxex = 0;
+		RL_CALL_VERBOSE(rl_zremrangebyscore, RL_OK, db, keys[k], keyslen[k], &range, &value);
+		EXPECT_LONG(value, 6);
+		RL_CALL_VERBOSE(rl_zremrangebyrank, RL_OK, db, keys[k], keyslen[k], 0, 2, &value);
+		EXPECT_LONG(value, 3);
+		RL_CALL_VERBOSE(rl_zremrangebylex, RL_OK, db, lexkeys[k], lexkeyslen[k], UNSIGN("(cC"), 3, UNSIGN("[k"), 2, &value);
+		EXPECT_LONG(value, 16);
+	}
+	RL_BALANCED();
+	retval = rl_zrange(db, keys[0], keyslen[0], 0, -1, &iterator);
+	retval2 = rl_zrange(db, keys[1], keyslen[1], 0, -1, &iterator2);
+	RL_CALL_VERBOSE(expect_same_zset_iterators, 0, retval, iterator, retval2, iterator2);
+	retval = rl_zrange(db, lexkeys[0], lexkeyslen[0], 0, -1, &iterator);
+	retval2 = rl_zrange(db, lexkeys[1], lexkeyslen[1], 0, -1, &iterator2);
+	RL_CALL_VERBOSE(expect_same_zset_iterators, 0, retval, iterator, retval2, iterator2);
+
+	rl_close(db);
+	PASS();
+}
+
+TEST test_zset_packed_delete(int _commit)
+{
+	int retval;
+	rlite *db = NULL;
+	unsigned char *key = UNSIGN("my key");
+	long keylen = strlen((char *)key);
+	unsigned char *members[2] = {UNSIGN("a"), UNSIGN("b")};
+	long memberslen[2] = {1, 1};
+	long changed;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, _commit, 1);
+
+	RL_CALL_VERBOSE(rl_zadd, RL_OK, db, key, keylen, 1.0, members[0], 1);
+	RL_CALL_VERBOSE(rl_zadd, RL_OK, db, key, keylen, 2.0, members[1], 1);
+	RL_BALANCED();
+	RL_CALL_VERBOSE(rl_zrem, RL_OK, db, key, keylen, 2, members, memberslen, &changed);
+	EXPECT_LONG(changed, 2);
+	RL_CALL_VERBOSE(rl_key_get, RL_NOT_FOUND, db, key, keylen, NULL, NULL, NULL, NULL, NULL);
+	RL_BALANCED();
+
+	RL_CALL_VERBOSE(rl_zadd, RL_OK, db, key, keylen, 1.0, members[0], 1);
+	RL_CALL_VERBOSE(rl_zremrangebyrank, RL_OK, db, key, keylen, 0, -1, &changed);
+	EXPECT_LONG(changed, 1);
+	RL_CALL_VERBOSE(rl_key_get, RL_NOT_FOUND, db, key, keylen, NULL, NULL, NULL, NULL, NULL);
+
+	RL_CALL_VERBOSE(rl_zadd, RL_OK, db, key, keylen, 1.0, members[0], 1);
+	RL_CALL_VERBOSE(rl_key_delete_with_value, RL_OK, db, key, keylen);
+	RL_BALANCED();
+
+	rl_close(db);
+	PASS();
+}
+
 SUITE(type_zset_test)
 {
 	long sadd_zinterunionstore_tests[SADD_ZINTERSTORE_TESTS][5] = {
@@ -1018,6 +1260,9 @@ SUITE(type_zset_test)
 		RUN_TESTp(basic_test_zadd_dupe, i);
 		RUN_TESTp(basic_test_zincrnan, i);
 		RUN_TESTp(regression_zrangebyscore, i);
+		RUN_TESTp(test_zset_packed, i);
+		RUN_TESTp(test_zset_packed_ranges, i);
+		RUN_TESTp(test_zset_packed_delete, i);
 		for (j = 0; j < ZINTERSTORE_TESTS; j++) {
 			RUN_TESTp(basic_test_zadd_zinterstore, i, zinterunionstore_tests[j]);
 			RUN_TESTp(basic_test_zadd_zunionstore, i, zinterunionstore_tests[j]);
@@ -1,5 +1,9 @@
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include "../src/rlite/rlite.h"
+#include "../src/rlite/hirlite.h"
+#include "util.h"
 
 int setup_db(rlite **_db, int file, int del)
 {
@@ -22,3 +26,13 @@ int setup_db(rlite **_db, int file, int del)
 	}
 	return retval;
 }
+
+void stream_join(void *privdata, const rliteReply *element)
+{
+	char *buffer = privdata;
+	size_t len = strlen(buffer);
+	if (len > 0 && len < STREAM_BUFFER_SIZE - 1) {
+		buffer[len++] = ' ';
+	}
+	snprintf(&buffer[len], STREAM_BUFFER_SIZE - len, "%.*s", element->len, element->str);
+}
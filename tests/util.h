@@ -7,6 +7,12 @@ struct rlite;
 
 int setup_db(struct rlite **db, int file, int del);
 
+#define STREAM_BUFFER_SIZE 1024
+struct rliteReply;
+// a stream callback appending the string elements, separated by spaces, to
+// `privdata`, a zeroed buffer of STREAM_BUFFER_SIZE bytes
+void stream_join(void *privdata, const struct rliteReply *element);
+
 static inline int populateArgvlen(char *argv[], size_t argvlen[]) {
 	int i;
 	for (i = 0; argv[i] != NULL; i++) {
@@ -1,9 +1,14 @@
+#define _DEFAULT_SOURCE
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "rlite/rlite.h"
 #include "util.h"
 #include "rlite/wal.h"
+#include "rlite/crc32c.h"
+#include "rlite/flock.h"
 
 static const char *db_path = "rlite-test.rld";
 static const char *wal_path = ".rlite-test.rld.wal";
@@ -120,10 +125,370 @@ TEST test_partial_wal_readonly(int _commit) {
 	PASS();
 }
 
+TEST test_sync_full() {
+	int retval;
+	rlite *db;
+	unsigned char *testvalue;
+	long testvaluelen;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	RL_CALL_VERBOSE(rl_set_sync_mode, RL_OK, db, RLITE_SYNC_FULL, 0, 0);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key"), 3, UNSIGN("value"), 5, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	ASSERT_EQm("Expected wal path not to exist", access(wal_path, F_OK), -1);
+	rl_close(db);
+
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 0);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, UNSIGN("key"), 3, &testvalue, &testvaluelen);
+	EXPECT_BYTES(UNSIGN("value"), 5, testvalue, testvaluelen);
+	rl_free(testvalue);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_sync_group() {
+	int retval;
+	rlite *db, *db2;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(rl_set_sync_mode, RL_INVALID_PARAMETERS, db, RLITE_SYNC_GROUP, 0, 0);
+	RL_CALL_VERBOSE(rl_set_sync_mode, RL_OK, db, RLITE_SYNC_GROUP, 0, 3);
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db2, 1, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+	RL_CALL_VERBOSE(rl_set_sync_mode, RL_OK, db2, RLITE_SYNC_GROUP, 0, 3);
+	ASSERT_EQ(db->sync_group, db2->sync_group);
+	ASSERT_EQ(db->sync_group->refs, 2);
+
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key"), 3, UNSIGN("value"), 5, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	// nothing is written in place until a checkpoint syncs the log
+	ASSERT(db->wal_log != NULL);
+	ASSERT(db->wal_log->frames > 0);
+	ASSERT_EQ(db->sync_group->pending, 1);
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db2);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db2, UNSIGN("key2"), 4, UNSIGN("value"), 5, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+	ASSERT_EQ(db->sync_group->pending, 2);
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key3"), 4, UNSIGN("value"), 5, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	ASSERT_EQ(db->sync_group->pending, 0);
+
+	rl_close(db2);
+	ASSERT_EQ(db->sync_group->refs, 1);
+	RL_CALL_VERBOSE(rl_set_sync_mode, RL_OK, db, RLITE_SYNC_NONE, 0, 0);
+	ASSERT_EQ(db->sync_group, NULL);
+	rl_close(db);
+	PASS();
+}
+
+static int open_wal_log(rlite **db, int flags) {
+	return rl_open(db_path, db, RLITE_OPEN_READWRITE | RLITE_OPEN_CREATE | flags);
+}
+
+static void copy_file(const char *src, const char *dst) {
+	char buffer[4096];
+	size_t read;
+	FILE *in = fopen(src, "rb"), *out = fopen(dst, "wb");
+	while ((read = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+		fwrite(buffer, 1, read, out);
+	}
+	fclose(in);
+	fclose(out);
+}
+
+TEST test_wal_log() {
+	int retval;
+	rlite *db, *db2;
+	unsigned char *testvalue;
+	long testvaluelen;
+	unlink(db_path);
+	unlink(wal_path);
+
+	RL_CALL_VERBOSE(open_wal_log, RL_OK, &db, RLITE_OPEN_WAL_LOG);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key"), 3, UNSIGN("value"), 5, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	ASSERT(db->wal_log != NULL);
+	ASSERT(db->wal_log->frames > 0);
+	ASSERT_EQm("Expected wal path to exist", access(wal_path, F_OK), 0);
+
+	// writers without the flag use the log too once it exists
+	RL_CALL_VERBOSE(open_wal_log, RL_OK, &db2, 0);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db2, UNSIGN("key"), 3, &testvalue, &testvaluelen);
+	EXPECT_BYTES(UNSIGN("value"), 5, testvalue, testvaluelen);
+	rl_free(testvalue);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db2, UNSIGN("key2"), 4, UNSIGN("value2"), 6, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+	ASSERT(db2->wal_log != NULL);
+
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, UNSIGN("key2"), 4, &testvalue, &testvaluelen);
+	EXPECT_BYTES(UNSIGN("value2"), 6, testvalue, testvaluelen);
+	rl_free(testvalue);
+	RL_CALL_VERBOSE(rl_wal_checkpoint, RL_OK, db);
+	ASSERT_EQ(db->wal_log->frames, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db2);
+	ASSERT_EQ(db2->wal_log->frames, 0);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db2, UNSIGN("key"), 3, &testvalue, &testvaluelen);
+	EXPECT_BYTES(UNSIGN("value"), 5, testvalue, testvaluelen);
+	rl_free(testvalue);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+
+	rl_close(db2);
+	ASSERT_EQm("Expected wal path to exist", access(wal_path, F_OK), 0);
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key3"), 4, UNSIGN("value3"), 6, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	rl_close(db);
+	ASSERT_EQm("Expected wal path not to exist", access(wal_path, F_OK), -1);
+
+	RL_CALL_VERBOSE(open_wal_log, RL_OK, &db, 0);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, UNSIGN("key3"), 4, &testvalue, &testvaluelen);
+	EXPECT_BYTES(UNSIGN("value3"), 6, testvalue, testvaluelen);
+	rl_free(testvalue);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_wal_log_checkpoint() {
+	int retval;
+	rlite *db;
+	char key[20];
+	long i;
+	unlink(db_path);
+	unlink(wal_path);
+
+	RL_CALL_VERBOSE(open_wal_log, RL_OK, &db, RLITE_OPEN_WAL_LOG);
+	db->wal_checkpoint_pages = 20;
+	for (i = 0; i < 50; i++) {
+		snprintf(key, 20, "key%ld", i);
+		RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN(key), strlen(key), UNSIGN(key), strlen(key), 0, 0);
+		RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+		ASSERT(db->wal_log->frames < 20);
+		RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	}
+	for (i = 0; i < 50; i++) {
+		snprintf(key, 20, "key%ld", i);
+		RL_CALL_VERBOSE(rl_get, RL_OK, db, UNSIGN(key), strlen(key), NULL, NULL);
+	}
+	rl_close(db);
+	PASS();
+}
+
+TEST test_wal_log_snapshot() {
+	int retval;
+	rlite *db, *db2;
+	unsigned char *testvalue;
+	long testvaluelen;
+	unlink(db_path);
+	unlink(wal_path);
+
+	RL_CALL_VERBOSE(open_wal_log, RL_OK, &db, RLITE_OPEN_WAL_LOG);
+	db->wal_checkpoint_pages = 1;
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key"), 3, UNSIGN("value"), 5, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(open_wal_log, RL_OK, &db2, RLITE_OPEN_WAL_LOG);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db2);
+
+	// the writer holds the database lock, the reader does not wait for it
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key"), 3, UNSIGN("value2"), 6, 0, 0);
+	RL_CALL_VERBOSE(rl_begin_read, RL_OK, db2);
+	ASSERT(db2->snapshot);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db2, UNSIGN("key"), 3, &testvalue, &testvaluelen);
+	EXPECT_BYTES(UNSIGN("value"), 5, testvalue, testvaluelen);
+	rl_free(testvalue);
+
+	// the commit cannot checkpoint under the reader
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	ASSERT(db->wal_log->frames > 0);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db2, UNSIGN("key"), 3, &testvalue, &testvaluelen);
+	EXPECT_BYTES(UNSIGN("value"), 5, testvalue, testvaluelen);
+	rl_free(testvalue);
+	RL_CALL_VERBOSE(rl_end_read, RL_OK, db2);
+	ASSERT(!db2->snapshot);
+
+	RL_CALL_VERBOSE(rl_begin_read, RL_OK, db2);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db2, UNSIGN("key"), 3, &testvalue, &testvaluelen);
+	EXPECT_BYTES(UNSIGN("value2"), 6, testvalue, testvaluelen);
+	rl_free(testvalue);
+	RL_CALL_VERBOSE(rl_end_read, RL_OK, db2);
+
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key2"), 4, UNSIGN("value"), 5, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	ASSERT_EQ(db->wal_log->frames, 0);
+
+	rl_close(db2);
+	rl_close(db);
+	// a reader may be about to lock it
+	ASSERT_EQm("Expected readers path to exist", access(".rlite-test.rld.readers", F_OK), 0);
+	PASS();
+}
+
+static int write_after_close(void) {
+	int retval;
+	rlite *db, *db2;
+	// blocks on the log until the parent is done closing it
+	RL_CALL(open_wal_log, RL_OK, &db, RLITE_OPEN_WAL_LOG);
+	RL_CALL(rl_set, RL_OK, db, UNSIGN("key2"), 4, UNSIGN("value2"), 6, 0, 0);
+	RL_CALL(rl_commit, RL_OK, db);
+	RL_CALL(open_wal_log, RL_OK, &db2, 0);
+	retval = rl_get(db2, UNSIGN("key2"), 4, NULL, NULL);
+	rl_close(db2);
+	rl_close(db);
+cleanup:
+	return retval;
+}
+
+TEST test_wal_log_open_while_closing() {
+	int retval, status;
+	rlite *db;
+	pid_t pid;
+	unlink(db_path);
+	unlink(wal_path);
+
+	RL_CALL_VERBOSE(open_wal_log, RL_OK, &db, RLITE_OPEN_WAL_LOG);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key"), 3, UNSIGN("value"), 5, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(rl_wal_checkpoint, RL_OK, db);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+
+	// what the last handle does when closing, with another process opening
+	// the log in between
+	RL_CALL_VERBOSE(rl_flock_fd, RL_OK, db->wal_log->fd, RLITE_FLOCK_EX);
+	fflush(stdout);
+	pid = fork();
+	ASSERT(pid != -1);
+	if (pid == 0) {
+		_exit(write_after_close() == RL_OK ? 0 : 1);
+	}
+	usleep(200 * 1000);
+	unlink(wal_path);
+	RL_CALL_VERBOSE(rl_flock_fd, RL_OK, db->wal_log->fd, RLITE_FLOCK_SH);
+	ASSERT_EQ(waitpid(pid, &status, 0), pid);
+	ASSERTm("Expected the write to be seen by a new handle", WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	rl_close(db);
+
+	RL_CALL_VERBOSE(open_wal_log, RL_OK, &db, 0);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, UNSIGN("key2"), 4, NULL, NULL);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_wal_log_torn_record() {
+	int retval;
+	rlite *db;
+	struct stat st;
+	unlink(db_path);
+	unlink(wal_path);
+
+	RL_CALL_VERBOSE(open_wal_log, RL_OK, &db, RLITE_OPEN_WAL_LOG);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key"), 3, UNSIGN("value"), 5, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key2"), 4, UNSIGN("value2"), 6, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+
+	// what a crash in the middle of the second append leaves behind
+	copy_file(db_path, "rlite-test.rld.bak");
+	copy_file(wal_path, "rlite-test.rld.wal.bak");
+	rl_close(db);
+	rename("rlite-test.rld.bak", db_path);
+	rename("rlite-test.rld.wal.bak", wal_path);
+	stat(wal_path, &st);
+	truncate(wal_path, st.st_size - 10);
+
+	RL_CALL_VERBOSE(open_wal_log, RL_OK, &db, 0);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, UNSIGN("key"), 3, NULL, NULL);
+	RL_CALL_VERBOSE(rl_get, RL_NOT_FOUND, db, UNSIGN("key2"), 4, NULL, NULL);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key3"), 4, UNSIGN("value3"), 6, 0, 0);
+	RL_CALL_VERBOSE(rl_commit, RL_OK, db);
+	RL_CALL_VERBOSE(rl_refresh, RL_OK, db);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, UNSIGN("key3"), 4, NULL, NULL);
+	rl_close(db);
+	PASS();
+}
+
+TEST test_crc32c() {
+	unsigned char data[1000];
+	long i;
+	ASSERT_EQ(rl_crc32c(0, UNSIGN("123456789"), 9), 0xe3069283);
+	ASSERT_EQ(rl_crc32c_sw(0, UNSIGN("123456789"), 9), 0xe3069283);
+	for (i = 0; i < 1000; i++) {
+		data[i] = (unsigned char)(i * 7);
+	}
+	// unaligned starts and odd lengths go through the byte at a time tails
+	for (i = 0; i < 16; i++) {
+		ASSERT_EQ(rl_crc32c(0, &data[i], 1000 - i * 3), rl_crc32c_sw(0, &data[i], 1000 - i * 3));
+	}
+	ASSERT_EQ(rl_crc32c(rl_crc32c(0, data, 300), &data[300], 700), rl_crc32c(0, data, 1000));
+	PASS();
+}
+
+TEST test_wal_checksum(int checksum) {
+	int retval;
+	rlite *db;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+	db->wal_checksum = checksum;
+
+	unsigned char *key = UNSIGN("my key");
+	long keylen = strlen((char *)key);
+	unsigned char *value = UNSIGN("my value"), *testvalue;
+	long valuelen = strlen((char *)value), testvaluelen;
+
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, key, keylen, value, valuelen, 0, 0);
+	RL_CALL_VERBOSE(rl_write_wal, RL_OK, wal_path, db, NULL, NULL);
+
+	rl_close(db);
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 0);
+
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, key, keylen, &testvalue, &testvaluelen);
+	EXPECT_BYTES(value, valuelen, testvalue, testvaluelen);
+	rl_free(testvalue);
+
+	rl_close(db);
+	PASS();
+}
+
+TEST test_dirty_hash() {
+	int retval;
+	rlite *db;
+	unsigned char *hash1, *hash2, *hash3;
+	RL_CALL_VERBOSE(setup_db, RL_OK, &db, 1, 1);
+
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key"), 3, UNSIGN("value"), 5, 0, 0);
+	RL_CALL_VERBOSE(rl_dirty_hash, RL_OK, db, &hash1);
+	RL_CALL_VERBOSE(rl_get, RL_OK, db, UNSIGN("key"), 3, NULL, NULL);
+	RL_CALL_VERBOSE(rl_dirty_hash, RL_OK, db, &hash2);
+	ASSERT_EQ(memcmp(hash1, hash2, 20), 0);
+	RL_CALL_VERBOSE(rl_set, RL_OK, db, UNSIGN("key"), 3, UNSIGN("other"), 5, 0, 0);
+	RL_CALL_VERBOSE(rl_dirty_hash, RL_OK, db, &hash3);
+	ASSERT(memcmp(hash1, hash3, 20) != 0);
+	rl_free(hash1);
+	rl_free(hash2);
+	rl_free(hash3);
+
+	rl_close(db);
+	PASS();
+}
+
 SUITE(wal_test)
 {
 	RUN_TEST1(test_full_wal, 1);
 	RUN_TEST1(test_full_wal_readonly, 1);
 	RUN_TEST1(test_partial_wal, 1);
 	RUN_TEST1(test_partial_wal_readonly, 1);
+	RUN_TEST(test_sync_full);
+	RUN_TEST(test_sync_group);
+	RUN_TEST(test_wal_log);
+	RUN_TEST(test_wal_log_checkpoint);
+	RUN_TEST(test_wal_log_snapshot);
+	RUN_TEST(test_wal_log_open_while_closing);
+	RUN_TEST(test_wal_log_torn_record);
+	RUN_TEST(test_crc32c);
+	RUN_TEST1(test_wal_checksum, RL_CHECKSUM_SHA1);
+	RUN_TEST1(test_wal_checksum, RL_CHECKSUM_CRC32C);
+	RUN_TEST(test_dirty_hash);
 }
@@ -53,6 +53,39 @@ TEST test_zrange() {
 	PASS();
 }
 
+TEST test_zrange_stream() {
+	rliteContext *context = rliteConnect(":memory:", 0);
+	if (_zadd(context) != 0) {
+		return 1;
+	}
+
+	char buffer[STREAM_BUFFER_SIZE];
+	size_t argvlen[100];
+	rliteReply* reply;
+
+	{
+		char* argv[100] = {"ZRANGE", "mykey", "0", "-1", "WITHSCORES", NULL};
+		memset(buffer, 0, sizeof(buffer));
+		reply = rliteCommandArgvStream(context, populateArgvlen(argv, argvlen), argv, argvlen, stream_join, buffer);
+		EXPECT_REPLY_LEN(reply, 4);
+		ASSERT_EQ(reply->element, NULL);
+		ASSERT_STR_EQ(buffer, "one 1 two 2");
+		rliteFreeReplyObject(reply);
+	}
+
+	{
+		char* argv[100] = {"ZREVRANGEBYSCORE", "mykey", "+inf", "-inf", NULL};
+		memset(buffer, 0, sizeof(buffer));
+		reply = rliteCommandArgvStream(context, populateArgvlen(argv, argvlen), argv, argvlen, stream_join, buffer);
+		EXPECT_REPLY_LEN(reply, 2);
+		ASSERT_STR_EQ(buffer, "two one");
+		rliteFreeReplyObject(reply);
+	}
+
+	rliteFree(context);
+	PASS();
+}
+
 TEST test_zrevrange() {
 	rliteContext *context = rliteConnect(":memory:", 0);
 	if (_zadd(context) != 0) {
@@ -232,6 +265,74 @@ TEST test_zinterstore() {
 	PASS();
 }
 
+TEST test_zinterstore_empty() {
+	rliteContext *context = rliteConnect(":memory:", 0);
+
+	rliteReply* reply;
+	char* argv[100] = {"ZADD", "key1", "1", "one", NULL};
+	size_t argvlen[100];
+
+	reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+	rliteFreeReplyObject(reply);
+
+	char *argv2[100] = {"ZADD", "key2", "1", "two", NULL};
+	reply = rliteCommandArgv(context, populateArgvlen(argv2, argvlen), argv2, argvlen);
+	rliteFreeReplyObject(reply);
+
+	char *argv3[100] = {"ZINTERSTORE", "out", "2", "key1", "key2", NULL};
+	reply = rliteCommandArgv(context, populateArgvlen(argv3, argvlen), argv3, argvlen);
+	EXPECT_REPLY_INTEGER(reply, 0);
+	rliteFreeReplyObject(reply);
+
+	char *argv4[100] = {"EXISTS", "out", NULL};
+	reply = rliteCommandArgv(context, populateArgvlen(argv4, argvlen), argv4, argvlen);
+	EXPECT_REPLY_INTEGER(reply, 0);
+	rliteFreeReplyObject(reply);
+
+	rliteFree(context);
+	PASS();
+}
+
+TEST test_zstore_empty_source() {
+	rliteContext *context = rliteConnect(":memory:", 0);
+
+	rliteReply* reply;
+	char* argv[100] = {"ZADD", "key1", "1", "one", NULL};
+	size_t argvlen[100];
+
+	reply = rliteCommandArgv(context, populateArgvlen(argv, argvlen), argv, argvlen);
+	rliteFreeReplyObject(reply);
+
+	// removing from a missing key does not create it
+	char *argv2[100] = {"ZREM", "nokey", "one", NULL};
+	reply = rliteCommandArgv(context, populateArgvlen(argv2, argvlen), argv2, argvlen);
+	EXPECT_REPLY_INTEGER(reply, 0);
+	rliteFreeReplyObject(reply);
+
+	char *argv3[100] = {"ZREMRANGEBYRANK", "nokey", "0", "-1", NULL};
+	reply = rliteCommandArgv(context, populateArgvlen(argv3, argvlen), argv3, argvlen);
+	EXPECT_REPLY_INTEGER(reply, 0);
+	rliteFreeReplyObject(reply);
+
+	char *argv4[100] = {"EXISTS", "nokey", NULL};
+	reply = rliteCommandArgv(context, populateArgvlen(argv4, argvlen), argv4, argvlen);
+	EXPECT_REPLY_INTEGER(reply, 0);
+	rliteFreeReplyObject(reply);
+
+	char *argv5[100] = {"ZUNIONSTORE", "out", "2", "nokey", "key1", NULL};
+	reply = rliteCommandArgv(context, populateArgvlen(argv5, argvlen), argv5, argvlen);
+	EXPECT_REPLY_INTEGER(reply, 1);
+	rliteFreeReplyObject(reply);
+
+	char *argv6[100] = {"ZINTERSTORE", "out", "2", "key1", "nokey", NULL};
+	reply = rliteCommandArgv(context, populateArgvlen(argv6, argvlen), argv6, argvlen);
+	EXPECT_REPLY_INTEGER(reply, 0);
+	rliteFreeReplyObject(reply);
+
+	rliteFree(context);
+	PASS();
+}
+
 TEST test_zunionstore() {
 	rliteContext *context = rliteConnect(":memory:", 0);
 
@@ -509,12 +610,15 @@ TEST test_debug() {
 SUITE(zset_test) {
 	RUN_TEST(test_zadd);
 	RUN_TEST(test_zrange);
+	RUN_TEST(test_zrange_stream);
 	RUN_TEST(test_zrevrange);
 	RUN_TEST(test_zrem);
 	RUN_TEST(test_zremrangebyrank);
 	RUN_TEST(test_zremrangebyscore);
 	RUN_TEST(test_zcard);
 	RUN_TEST(test_zinterstore);
+	RUN_TEST(test_zinterstore_empty);
+	RUN_TEST(test_zstore_empty_source);
 	RUN_TEST(test_zunionstore);
 	RUN_TEST(test_zrangebyscore);
 	RUN_TEST(test_zrevrangebyscore);